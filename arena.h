@@ -0,0 +1,208 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <type_traits>
+#include <vector>
+
+// Offsets of ranges handed out front to back from a block of capacity bytes, released all together.
+// Doesn't know where the block lives: Arena uses it for host memory, the D3D12 frontend for its
+// upload buffer.
+class LinearSuballocator
+{
+public:
+    LinearSuballocator() = default;
+    explicit LinearSuballocator(size_t capacity) : capacity(capacity) {}
+
+    // False if the range doesn't fit. Alignment has to be a power of two.
+    bool Allocate(size_t size, size_t alignment, size_t& offset)
+    {
+        const size_t aligned = (head + alignment - 1) & ~(alignment - 1);
+        if (aligned > capacity || size > capacity - aligned)
+            return false;
+        offset = aligned;
+        head = aligned + size;
+        return true;
+    }
+
+    // Releases everything after position.
+    void Reset(size_t position = 0) { head = position; }
+
+    size_t Used() const { return head; }
+    size_t Capacity() const { return capacity; }
+
+private:
+    size_t capacity = 0;
+    size_t head = 0;
+};
+
+// Bump allocator for memory that is dropped all at once, scene data when the next scene replaces it,
+// scratch data at the end of an ArenaScope. Released memory is kept for the next time, and once the
+// arena is back to empty its chunks merge into one. So after it has seen the biggest scene or frame,
+// an arena doesn't go to the heap anymore. Not thread safe, every thread has its own ScratchArena.
+class Arena
+{
+public:
+    struct Marker
+    {
+        size_t chunk;
+        size_t offset;
+    };
+
+    Arena() = default;
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+
+    ~Arena()
+    {
+        for (Chunk& chunk : chunks)
+        {
+            ::operator delete(chunk.memory);
+        }
+    }
+
+    // Up to the alignment operator new gives, which is all that anything here needs.
+    void* Allocate(size_t size, size_t alignment = alignof(std::max_align_t))
+    {
+        if (alignment > alignof(std::max_align_t))
+            throw std::invalid_argument("Arena alignment above max_align_t");
+
+        size_t offset;
+        for (; current < chunks.size(); ++current)
+        {
+            if (chunks[current].ranges.Allocate(size, alignment, offset))
+                return chunks[current].memory + offset;
+        }
+
+        // Chunks double, so a growing arena needs few of them before it settles.
+        addChunk(std::max({ size, reserved, FIRST_CHUNK_SIZE }));
+        if (!chunks[current].ranges.Allocate(size, alignment, offset))
+            throw std::bad_alloc();
+        return chunks[current].memory + offset;
+    }
+
+    Marker Mark() const
+    {
+        return { current, current < chunks.size() ? chunks[current].ranges.Used() : 0 };
+    }
+
+    // Releases everything allocated since marker was taken.
+    void Rewind(Marker marker)
+    {
+        for (size_t i = marker.chunk + 1; i <= current && i < chunks.size(); ++i)
+        {
+            chunks[i].ranges.Reset();
+        }
+        if (marker.chunk < chunks.size())
+            chunks[marker.chunk].ranges.Reset(marker.offset);
+        current = marker.chunk;
+
+        if (marker.chunk == 0 && marker.offset == 0 && chunks.size() > 1)
+        {
+            for (Chunk& chunk : chunks)
+            {
+                ::operator delete(chunk.memory);
+            }
+            chunks.clear();
+            const size_t merged = reserved;
+            reserved = 0;
+            addChunk(merged);
+            current = 0;
+        }
+    }
+
+    void Reset() { Rewind({ 0, 0 }); }
+
+    size_t BytesReserved() const { return reserved; }
+    // Times the arena went to the heap for a chunk, merges included.
+    size_t ChunkAllocations() const { return chunkAllocations; }
+
+private:
+    static constexpr size_t FIRST_CHUNK_SIZE = 64 * 1024;
+
+    struct Chunk
+    {
+        std::byte* memory;
+        LinearSuballocator ranges;
+    };
+
+    void addChunk(size_t size)
+    {
+        chunks.push_back({ static_cast<std::byte*>(::operator new(size)), LinearSuballocator(size) });
+        current = chunks.size() - 1;
+        reserved += size;
+        ++chunkAllocations;
+    }
+
+    std::vector<Chunk> chunks;
+    size_t current = 0;
+    size_t reserved = 0;
+    size_t chunkAllocations = 0;
+};
+
+// Scratch memory of the calling thread, for temporaries that don't outlive an ArenaScope.
+inline Arena& ScratchArena()
+{
+    thread_local Arena arena;
+    return arena;
+}
+
+// Releases everything allocated from the arena during the scope when it ends. Containers using the
+// arena have to be declared after the scope, so they are gone by then.
+class ArenaScope
+{
+public:
+    explicit ArenaScope(Arena& arena) : arena(arena), marker(arena.Mark()) {}
+    ~ArenaScope() { arena.Rewind(marker); }
+    ArenaScope(const ArenaScope&) = delete;
+    ArenaScope& operator=(const ArenaScope&) = delete;
+
+private:
+    Arena& arena;
+    Arena::Marker marker;
+};
+
+// Standard allocator on top of an arena, freeing does nothing. Without an arena it's the heap.
+template <typename T>
+class ArenaAllocator
+{
+public:
+    using value_type = T;
+    // Containers moved, swapped or assigned take their arena along.
+    using propagate_on_container_copy_assignment = std::true_type;
+    using propagate_on_container_move_assignment = std::true_type;
+    using propagate_on_container_swap = std::true_type;
+
+    ArenaAllocator() = default;
+    ArenaAllocator(Arena& arena) : arena(&arena) {}
+    template <typename U>
+    ArenaAllocator(const ArenaAllocator<U>& other) : arena(other.arena) {}
+
+    T* allocate(size_t count)
+    {
+        if (!arena)
+            return std::allocator<T>().allocate(count);
+        return static_cast<T*>(arena->Allocate(count * sizeof(T), alignof(T)));
+    }
+
+    void deallocate(T* pointer, size_t count)
+    {
+        if (!arena)
+            std::allocator<T>().deallocate(pointer, count);
+    }
+
+    template <typename U>
+    bool operator==(const ArenaAllocator<U>& other) const { return arena == other.arena; }
+
+private:
+    template <typename U>
+    friend class ArenaAllocator;
+
+    Arena* arena = nullptr;
+};
+
+template <typename T>
+using ArenaVector = std::vector<T, ArenaAllocator<T>>;
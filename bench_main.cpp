@@ -0,0 +1,34 @@
+#include "core.h"
+
+// Entry point of raytracer_bench, which runs the --bench suite with a counting operator new so the
+// benchmarks can report heap allocations. Replacing it in raytracer_core would put every other build
+// on it too.
+
+namespace
+{
+    std::atomic<UINT64> heapAllocations = 0;
+}
+
+void* operator new(size_t size)
+{
+    heapAllocations.fetch_add(1, std::memory_order_relaxed);
+    if (void* memory = std::malloc(size ? size : 1))
+        return memory;
+    throw std::bad_alloc();
+}
+
+void operator delete(void* memory) noexcept
+{
+    std::free(memory);
+}
+
+void operator delete(void* memory, size_t) noexcept
+{
+    std::free(memory);
+}
+
+int main()
+{
+    heapAllocationCounter = &heapAllocations;
+    return RunBenchmarks();
+}
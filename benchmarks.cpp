@@ -0,0 +1,1399 @@
+#include "core.h"
+#include "frame_ring.h"
+#include "scene_switcher.h"
+#include "shader_table.h"
+#include <bit>
+#include <filesystem>
+
+// CPU side benchmarks, run with --bench. They don't touch the GPU, so they run anywhere.
+
+namespace
+{
+    template <typename Func>
+    double averageMilliseconds(UINT iterations, Func&& func)
+    {
+        auto t0 = std::chrono::high_resolution_clock::now();
+        for (UINT i = 0; i < iterations; ++i)
+        {
+            func(i);
+        }
+        auto t1 = std::chrono::high_resolution_clock::now();
+        return std::chrono::duration<double, std::milli>(t1 - t0).count() / iterations;
+    }
+
+    float randomRange(float min, float max)
+    {
+        return min + (max - min) * (std::rand() / (RAND_MAX + 1.0f));
+    }
+
+    void benchmarkSceneUpdates()
+    {
+        using namespace DirectX;
+
+        constexpr UINT INSTANCE_COUNT = 100000;
+        constexpr UINT FRAME_COUNT = 100;
+
+        std::srand(1);
+        proceduralInstances.clear();
+        dirtyInstances.clear();
+        for (UINT i = 0; i < INSTANCE_COUNT; ++i)
+        {
+            float r = randomRange(0.5f, 2.0f);
+            proceduralInstances.push_back({ .transform = XMMatrixScaling(r, r, r) *
+                                                         XMMatrixTranslation(randomRange(-1000, 1000), randomRange(-1000, 1000), randomRange(-1000, 1000)),
+                                            .instanceID = i,
+                                            .type = OBJECT_TYPE_SPHERE });
+        }
+
+        printf("Scene BVH, %u instances, average per frame over %u frames:\n", INSTANCE_COUNT, FRAME_COUNT);
+
+        // What every frame used to cost, a rebuild regardless of whether anything moved.
+        double rebuildMs = averageMilliseconds(FRAME_COUNT / 10, [](UINT) { UpdateSceneBVH(true); });
+        printf("  full rebuild:          %8.3f ms\n", rebuildMs);
+
+        for (UINT moved : { 0u, INSTANCE_COUNT / 1000, INSTANCE_COUNT / 100, INSTANCE_COUNT / 10, INSTANCE_COUNT / 2 })
+        {
+            double frameMs = averageMilliseconds(FRAME_COUNT, [&](UINT frame) {
+                for (UINT i = 0; i < moved; ++i)
+                {
+                    // Spread the moved instances around, so they don't all end up in one subtree.
+                    UINT id = (UINT)(((UINT64)frame * 7919 + (UINT64)i * 104729) % INSTANCE_COUNT);
+                    MoveInstance(id, proceduralInstances[id].transform * XMMatrixTranslation(0, 0.01f, 0));
+                }
+                UpdateSceneBVH(false);
+                ClearDirtyInstances();
+            });
+            printf("  %6u moved (%4.1f%%): %8.3f ms\n", moved, 100.0f * moved / INSTANCE_COUNT, frameMs);
+        }
+
+        proceduralInstances.clear();
+        sceneBVH = {};
+    }
+
+    // What a hit fetches from the scene tables, the object and its material, against the single 108 byte
+    // record per object they were split from. Bounce counts come from a render of the scene, the fetches are
+    // timed over random instances of it as the CPU renderer doesn't keep the hit sequence around.
+    void benchmarkSceneData()
+    {
+        constexpr UINT WIDTH = 96;
+        constexpr UINT HEIGHT = 54;
+        constexpr UINT SAMPLES = 16;
+        constexpr UINT FETCHES = 1 << 22;
+
+        struct UnsplitObjectData
+        {
+            MaterialData material;
+            UINT geometry[16]; // Quad, sphere, mesh and group fields.
+        };
+        static_assert(sizeof(UnsplitObjectData) == 108);
+
+        ThreadPool pool;
+        printf("Scene data per hit, %ux%u at %u spp, %u random fetches:\n", WIDTH, HEIGHT, SAMPLES, FETCHES);
+        printf("                  objects materials   bounces   split: B/hit     ms    unsplit: B/hit     ms\n");
+        for (UINT scene : { 0u, 8u, 15u })
+        {
+            SetupScene(scene);
+            AnimateInstances(cameraData.shutterOpen, cameraData.shutterClose);
+            ClearDirtyInstances();
+            MotionBVH bvh;
+            BuildMotionBVH(bvh);
+            ReferenceFrame referenceFrame;
+            CaptureReferenceFrame(referenceFrame, bvh);
+            referenceFrame.camera.samplesPerPixel = SAMPLES;
+
+            PathStats stats = {};
+            std::vector<DirectX::XMFLOAT3> image;
+            RenderReference(referenceFrame, WIDTH, HEIGHT, image, &pool, &stats);
+            UINT64 bounces = 0;
+            for (UINT64 typeBounces : stats.bounces)
+            {
+                bounces += typeBounces;
+            }
+
+            std::vector<UnsplitObjectData> unsplit(objectList.size());
+            for (size_t i = 0; i < objectList.size(); ++i)
+            {
+                unsplit[i].material = materialList[objectList[i].materialIndex];
+            }
+            std::srand(1);
+            std::vector<UINT> instances(FETCHES);
+            for (UINT& instance : instances)
+            {
+                instance = (UINT)(std::rand() % objectList.size());
+            }
+
+            // Sums what a hit reads first, so the fetches can't be dropped and both layouts have to agree.
+            float sums[2] = {};
+            double splitMs = averageMilliseconds(4, [&](UINT) {
+                float sum = 0;
+                for (UINT instance : instances)
+                {
+                    const MaterialData& material = materialList[objectList[instance].materialIndex];
+                    sum += material.albedo.x + material.fuzz + (float)material.type;
+                }
+                sums[0] = sum;
+            });
+            double unsplitMs = averageMilliseconds(4, [&](UINT) {
+                float sum = 0;
+                for (UINT instance : instances)
+                {
+                    const MaterialData& material = unsplit[instance].material;
+                    sum += material.albedo.x + material.fuzz + (float)material.type;
+                }
+                sums[1] = sum;
+            });
+            if (sums[0] != sums[1])
+            {
+                throw std::runtime_error("Split and unsplit object data read different materials in scene " + std::to_string(scene));
+            }
+
+            // A bounce is a hit, so that's what the object and material fetches add up to over the render.
+            size_t splitBytes = sizeof(ObjectData) + sizeof(MaterialData);
+            printf("  scene %2u: %8u %9u %9.2fM   %8zu %8.2f %10zu %8.2f    %.1f MB vs %.1f MB per frame\n", scene, (UINT)objectList.size(),
+                (UINT)materialList.size(), bounces / 1e6, splitBytes, splitMs, sizeof(UnsplitObjectData), unsplitMs,
+                bounces * splitBytes / 1e6, bounces * sizeof(UnsplitObjectData) / 1e6);
+        }
+    }
+
+    // Transforms the way addQuad and addBox build them, which is most of the math scene setup does.
+    void benchmarkTransforms()
+    {
+        using namespace DirectX;
+
+        constexpr UINT TRANSFORM_COUNT = 1000000;
+
+        std::srand(1);
+        std::vector<XMFLOAT3> points(TRANSFORM_COUNT + 2);
+        for (XMFLOAT3& point : points)
+        {
+            point = XMFLOAT3(randomRange(-100, 100), randomRange(-100, 100), randomRange(-100, 100));
+        }
+
+        printf("Transform building with %s, average per transform over %u:\n", MATH_LIBRARY, TRANSFORM_COUNT);
+
+        XMVECTOR checksum = XMVectorZero();
+        double quadMs = averageMilliseconds(1, [&](UINT) {
+            for (UINT i = 0; i < TRANSFORM_COUNT; ++i)
+            {
+                XMVECTOR pos = XMLoadFloat3(&points[i]);
+                XMVECTOR u = XMLoadFloat3(&points[i + 1]);
+                XMVECTOR v = XMLoadFloat3(&points[i + 2]);
+                XMVECTOR xBasis = XMVectorScale(v, 0.5f);
+                XMVECTOR yBasis = XMVectorScale(u, 0.5f);
+                XMVECTOR zBasis = XMVector3Normalize(XMVector3Cross(u, v));
+                XMMATRIX transform(XMVectorSetW(xBasis, 0.0f), XMVectorSetW(yBasis, 0.0f), XMVectorSetW(zBasis, 0.0f),
+                                   XMVectorSetW(pos + xBasis + yBasis, 1.0f));
+                checksum += transform.r[2] + transform.r[3];
+            }
+        });
+        printf("  quad: %8.2f ns\n", quadMs * 1e6 / TRANSFORM_COUNT);
+
+        double boxMs = averageMilliseconds(1, [&](UINT) {
+            for (UINT i = 0; i < TRANSFORM_COUNT; ++i)
+            {
+                const XMFLOAT3& a = points[i];
+                const XMFLOAT3& b = points[i + 1];
+                const XMFLOAT3& rotation = points[i + 2];
+                XMMATRIX transform = XMMatrixTranslation(a.x < b.x ? 1.0f : -1.0f, a.y < b.y ? 1.0f : -1.0f, a.z < b.z ? 1.0f : -1.0f) *
+                    XMMatrixRotationRollPitchYaw(XMConvertToRadians(rotation.x), XMConvertToRadians(rotation.y), XMConvertToRadians(rotation.z)) *
+                    XMMatrixScaling(std::abs(b.x - a.x) / 2, std::abs(b.y - a.y) / 2, std::abs(b.z - a.z) / 2) *
+                    XMMatrixTranslation(a.x, a.y, a.z);
+                checksum += transform.r[0] + transform.r[3];
+            }
+        });
+        printf("  box:  %8.2f ns\n", boxMs * 1e6 / TRANSFORM_COUNT);
+
+        // Keeps the loops from being optimized away.
+        XMFLOAT3 sum;
+        XMStoreFloat3(&sum, checksum);
+        printf("  (checksum %g)\n", sum.x + sum.y + sum.z);
+    }
+
+    void benchmarkAnimation()
+    {
+        constexpr UINT FRAME_COUNT = 120;
+        constexpr float FRAME_TIME = 1.0f / 30.0f;
+        constexpr UINT WIDTH = 96;
+        constexpr UINT HEIGHT = 54;
+
+        SetupScene(17); // Bouncing spheres.
+        cameraData.samplesPerPixel = 4;
+
+        // Half a frame of exposure, so every frame is blurred by the motion within it. Geometry is never
+        // duplicated per time step, the same instances just get their per frame motion.
+        auto setFrame = [](UINT frame) {
+            cameraData.frameIndex = frame;
+            cameraData.shutterOpen = frame * FRAME_TIME;
+            cameraData.shutterClose = cameraData.shutterOpen + 0.5f * FRAME_TIME;
+            AnimateInstances(cameraData.shutterOpen, cameraData.shutterClose);
+            ClearDirtyInstances();
+        };
+
+        printf("Animation, %u instances (%u animated), %u frames at %ux%u, %u spp:\n",
+            getNumInstances(), (UINT)animatedInstances.size(), FRAME_COUNT, WIDTH, HEIGHT, cameraData.samplesPerPixel);
+
+        ThreadPool pool;
+        ReferenceFrame referenceFrame;
+        std::vector<DirectX::XMFLOAT3> image;
+        for (bool reuse : { false, true })
+        {
+            MotionBVH bvh;
+            double bvhMs = 0;
+            double renderMs = 0;
+            for (UINT frame = 0; frame < FRAME_COUNT; ++frame)
+            {
+                setFrame(frame);
+
+                bvhMs += averageMilliseconds(1, [&](UINT) {
+                    if (reuse && frame > 0)
+                        RefitMotionBVH(bvh);
+                    else
+                        BuildMotionBVH(bvh);
+                });
+                renderMs += averageMilliseconds(1, [&](UINT) {
+                    CaptureReferenceFrame(referenceFrame, bvh);
+                    RenderReference(referenceFrame, WIDTH, HEIGHT, image, &pool);
+                });
+            }
+            printf("  %s: BVH %8.3f ms, render %9.1f ms per frame\n", reuse ? "refit per frame  " : "rebuild per frame",
+                bvhMs / FRAME_COUNT, renderMs / FRAME_COUNT);
+        }
+    }
+
+    void benchmarkPrimaryRays()
+    {
+        constexpr UINT WIDTH = 1280;
+        constexpr UINT HEIGHT = 720;
+        constexpr UINT ITERATIONS = 4;
+
+        SetupScene(4); // Final scene of the first book, the big random sphere field.
+        sceneSpatialIndex = SPATIAL_INDEX_BVH; // Packets only traverse the BVH.
+        MotionBVH bvh;
+        BuildMotionBVH(bvh);
+        ReferenceFrame referenceFrame;
+        CaptureReferenceFrame(referenceFrame, bvh);
+
+        printf("Primary rays, %u instances at %ux%u, single threaded:\n", getNumInstances(), WIDTH, HEIGHT);
+        UINT hits[2] = {};
+        for (bool packets : { false, true })
+        {
+            double ms = averageMilliseconds(ITERATIONS, [&](UINT) {
+                hits[packets] = TraceReferencePrimaryHits(referenceFrame, WIDTH, HEIGHT, packets);
+            });
+            printf("  %s: %8.3f ms, %6.2f Mrays/s\n", packets ? "8x8 packets" : "single rays", ms, WIDTH * HEIGHT / ms / 1000);
+        }
+        if (hits[0] != hits[1])
+        {
+            throw std::runtime_error("Packets hit " + std::to_string(hits[1]) + " times, single rays " + std::to_string(hits[0]));
+        }
+    }
+
+    void benchmarkSpatialIndex()
+    {
+        constexpr UINT WIDTH = 320;
+        constexpr UINT HEIGHT = 180;
+        constexpr UINT SAMPLES = 4;
+        constexpr UINT ITERATIONS = 8;
+
+        // The first book's sphere field and the second book's final scene, boxes, spheres and fog around them.
+        ThreadPool pool;
+        for (UINT scene : { 4u, 15u })
+        {
+            SetupScene(scene);
+            AnimateInstances(cameraData.shutterOpen, cameraData.shutterClose);
+            ClearDirtyInstances();
+
+            // The grid only needs the instance bounds, which the BVH build computes as well.
+            MotionBVH bvh;
+            MotionBVH boundsOnly;
+            UniformGrid grid;
+            double boundsMs = averageMilliseconds(ITERATIONS, [&](UINT) { RefitMotionBVH(boundsOnly); });
+            double bvhMs = averageMilliseconds(ITERATIONS, [&](UINT) { BuildMotionBVH(bvh); });
+            double gridMs = averageMilliseconds(ITERATIONS, [&](UINT) { BuildUniformGrid(grid, bvh); });
+
+            printf("Spatial index, scene %u, %u instances at %ux%u, %u spp:\n", scene, getNumInstances(), WIDTH, HEIGHT, SAMPLES);
+            printf("  grid %ux%ux%u, %u instances binned, %zu not, %.2f per occupied cell, %u at most, auto picks the %s\n",
+                grid.resolution[0], grid.resolution[1], grid.resolution[2], grid.binnedInstances, grid.unbinned.size(),
+                grid.occupiedCells ? (double)grid.cellInstances.size() / grid.occupiedCells : 0.0, grid.maxCellInstances,
+                ChooseSpatialIndex(grid) == SPATIAL_INDEX_GRID ? "grid" : "BVH");
+
+            UINT hits[2] = {};
+            for (SPATIAL_INDEX index : { SPATIAL_INDEX_BVH, SPATIAL_INDEX_GRID })
+            {
+                const bool isGrid = index == SPATIAL_INDEX_GRID;
+                sceneSpatialIndex = index;
+                ReferenceFrame referenceFrame;
+                CaptureReferenceFrame(referenceFrame, bvh);
+                referenceFrame.camera.samplesPerPixel = SAMPLES;
+
+                double primaryMs = averageMilliseconds(ITERATIONS, [&](UINT) {
+                    hits[isGrid] = TraceReferencePrimaryHits(referenceFrame, WIDTH, HEIGHT, false);
+                });
+
+                std::vector<DirectX::XMFLOAT3> image;
+                PathStats stats = {};
+                double renderMs = averageMilliseconds(1, [&](UINT) { RenderReference(referenceFrame, WIDTH, HEIGHT, image, &pool, &stats); });
+                UINT64 rays = stats.paths;
+                for (UINT64 typeBounces : stats.bounces)
+                {
+                    rays += typeBounces;
+                }
+
+                printf("  %s: build %8.3f ms, primary %6.2f Mrays/s, paths %6.2f Mrays/s\n", isGrid ? "grid" : "BVH ",
+                    isGrid ? boundsMs + gridMs : bvhMs, WIDTH * HEIGHT / primaryMs / 1000, rays / renderMs / 1000);
+            }
+            if (hits[0] != hits[1])
+            {
+                throw std::runtime_error("Grid hits " + std::to_string(hits[1]) + " primary rays, BVH " + std::to_string(hits[0]));
+            }
+        }
+    }
+
+    void benchmarkSpectral()
+    {
+        constexpr UINT WIDTH = 160;
+        constexpr UINT HEIGHT = 90;
+        constexpr UINT SAMPLES = 16;
+
+        // The Cornell box with the dispersive glass sphere and the sphere field, most of it diffuse.
+        ThreadPool pool;
+        for (UINT scene : { 12u, 4u })
+        {
+            SetupScene(scene);
+            AnimateInstances(cameraData.shutterOpen, cameraData.shutterClose);
+            ClearDirtyInstances();
+            MotionBVH bvh;
+            BuildMotionBVH(bvh);
+            ReferenceFrame referenceFrame;
+            CaptureReferenceFrame(referenceFrame, bvh);
+            referenceFrame.camera.samplesPerPixel = SAMPLES;
+
+            printf("Spectral rendering, scene %u at %ux%u, %u spp:\n", scene, WIDTH, HEIGHT, SAMPLES);
+            for (UINT spectral : { 0u, 1u })
+            {
+                referenceFrame.camera.spectral = spectral;
+                std::vector<DirectX::XMFLOAT3> image;
+                PathStats stats = {};
+                double ms = averageMilliseconds(1, [&](UINT) { RenderReference(referenceFrame, WIDTH, HEIGHT, image, &pool, &stats); });
+                UINT64 rays = stats.paths;
+                for (UINT64 typeBounces : stats.bounces)
+                {
+                    rays += typeBounces;
+                }
+
+                double mean[3] = {};
+                for (const DirectX::XMFLOAT3& pixel : image)
+                {
+                    mean[0] += pixel.x;
+                    mean[1] += pixel.y;
+                    mean[2] += pixel.z;
+                }
+                printf("  %s: %8.1f ms, %6.2f Mrays/s, mean color %.4f %.4f %.4f\n", spectral ? "hero wavelengths" : "RGB             ",
+                    ms, rays / ms / 1000, mean[0] / image.size(), mean[1] / image.size(), mean[2] / image.size());
+            }
+        }
+    }
+
+    void benchmarkKernelSpecialization()
+    {
+        constexpr UINT WIDTH = 160;
+        constexpr UINT HEIGHT = 90;
+        constexpr UINT SAMPLES = 8;
+        constexpr UINT ITERATIONS = 5;
+
+        // Sphere fields with and without motion blur, a Cornell box and the marble spheres, each rendered
+        // by the generic kernel and by the one picked for it. Both have to give the exact same image.
+        printf("Kernel specialization, %ux%u at %u spp:\n", WIDTH, HEIGHT, SAMPLES);
+        ThreadPool pool;
+        const bool specializedBefore = specializedReferenceKernels;
+        for (UINT scene : { 0u, 6u, 8u, 19u })
+        {
+            SetupScene(scene);
+            AnimateInstances(cameraData.shutterOpen, cameraData.shutterClose);
+            ClearDirtyInstances();
+            MotionBVH bvh;
+            BuildMotionBVH(bvh);
+            ReferenceFrame referenceFrame;
+            CaptureReferenceFrame(referenceFrame, bvh);
+            referenceFrame.camera.samplesPerPixel = SAMPLES;
+
+            // Taking turns and keeping the best of each, so both see the same machine.
+            std::vector<DirectX::XMFLOAT3> images[2];
+            double ms[2] = { DBL_MAX, DBL_MAX };
+            for (UINT i = 0; i < ITERATIONS; ++i)
+            {
+                for (bool specialized : { false, true })
+                {
+                    specializedReferenceKernels = specialized;
+                    ms[specialized] = std::min(ms[specialized], averageMilliseconds(1, [&](UINT) {
+                        RenderReference(referenceFrame, WIDTH, HEIGHT, images[specialized], &pool);
+                    }));
+                }
+            }
+            if (memcmp(images[0].data(), images[1].data(), images[0].size() * sizeof(DirectX::XMFLOAT3)) != 0)
+            {
+                throw std::runtime_error("Specialized kernel rendered scene " + std::to_string(scene) + " differently");
+            }
+
+            const UINT features = ReferenceKernelFeatures(referenceFrame.camera);
+            printf("  scene %2u: generic %7.1f ms, specialized %7.1f ms (%+5.1f%%), features%s%s%s%s\n", scene, ms[0], ms[1],
+                100 * (ms[1] / ms[0] - 1), features & REFERENCE_KERNEL_DEFOCUS ? " defocus" : "",
+                features & REFERENCE_KERNEL_MOTION ? " motion" : "", features & REFERENCE_KERNEL_SPECTRAL ? " spectral" : "",
+                features & REFERENCE_KERNEL_TEXTURES ? " textures" : "");
+        }
+        specializedReferenceKernels = specializedBefore;
+    }
+
+    void benchmarkBounceLimits()
+    {
+        constexpr UINT WIDTH = 96;
+        constexpr UINT HEIGHT = 54;
+        constexpr UINT SAMPLES = 16;
+
+        // Dense smoke in the Cornell box, and the final scene with its fog sphere around everything.
+        ThreadPool pool;
+        for (UINT scene : { 9u, 15u })
+        {
+            SetupScene(scene);
+            AnimateInstances(cameraData.shutterOpen, cameraData.shutterClose);
+            ClearDirtyInstances();
+            MotionBVH bvh;
+            BuildMotionBVH(bvh);
+            ReferenceFrame referenceFrame;
+            CaptureReferenceFrame(referenceFrame, bvh);
+            referenceFrame.camera.samplesPerPixel = SAMPLES;
+
+            printf("Bounce limits, scene %u at %ux%u, %u spp, limits are diffuse/specular/transmission/volume:\n", scene, WIDTH, HEIGHT, SAMPLES);
+            printf("                      time    bounces/path   cut off by limit d/s/t/v      paths with 0, 1, 2-3, 4-7, ... 1024+ bounces\n");
+            const UINT limitSets[][BOUNCE_TYPE_COUNT] = { { 256, 256, 256, 256 }, { 256, 256, 256, 64 }, { 256, 256, 256, 16 },
+                                                          { 256, 256, 256, 4 }, { 16, 16, 16, 16 }, { 4, 4, 4, 4 } };
+            std::vector<DirectX::XMFLOAT3> image;
+            for (const auto& limits : limitSets)
+            {
+                std::copy(std::begin(limits), std::end(limits), referenceFrame.camera.maxBounces);
+                PathStats stats = {};
+                double ms = averageMilliseconds(1, [&](UINT) { RenderReference(referenceFrame, WIDTH, HEIGHT, image, &pool, &stats); });
+
+                UINT64 bounces = 0;
+                for (UINT64 typeBounces : stats.bounces)
+                {
+                    bounces += typeBounces;
+                }
+                printf("  %3u/%3u/%3u/%3u: %8.1f ms %8.2f       ", limits[0], limits[1], limits[2], limits[3], ms, (double)bounces / stats.paths);
+                for (UINT64 truncated : stats.truncated)
+                {
+                    printf(" %5.2f%%", 100.0 * truncated / stats.paths);
+                }
+                printf("    ");
+                for (UINT64 paths : stats.lengths)
+                {
+                    printf(" %4.1f", 100.0 * paths / stats.paths);
+                }
+                printf("\n");
+            }
+        }
+    }
+
+    void benchmarkReprojection()
+    {
+        using namespace DirectX;
+
+        constexpr UINT WIDTH = 320;
+        constexpr UINT HEIGHT = 180;
+        constexpr UINT FRAME_COUNT = 60;
+        constexpr UINT SAMPLES_PER_FRAME = 4;
+
+        SetupScene(8); // Cornell box, mostly diffuse.
+        MotionBVH bvh;
+        BuildMotionBVH(bvh);
+        ReferenceFrame referenceFrame;
+        CaptureReferenceFrame(referenceFrame, bvh);
+        const CameraData start = referenceFrame.camera;
+
+        std::vector<XMFLOAT3> positions, normals, previousPositions, previousNormals;
+        printf("Reprojection, %ux%u, %u frames at %u spp, share of view independent first hits reusing history and their average history length:\n",
+            WIDTH, HEIGHT, FRAME_COUNT, SAMPLES_PER_FRAME);
+        const float distance = XMVectorGetX(XMVector3Length(XMLoadFloat3(&start.lookat) - XMLoadFloat3(&start.lookfrom)));
+        for (float step : { 0.0f, 0.0005f, 0.002f, 0.005f })
+        {
+            // Camera strafes sideways by step of the distance to what it looks at every frame.
+            std::vector<XMFLOAT4> history, previousHistory;
+            UINT64 reused = 0;
+            UINT64 reusable = 0;
+            for (UINT frame = 0; frame < FRAME_COUNT; ++frame)
+            {
+                CameraData& camera = referenceFrame.camera;
+                const CameraData previous = camera;
+                camera.lookfrom.x = start.lookfrom.x + frame * step * distance;
+                camera.lookat.x = start.lookat.x + frame * step * distance;
+
+                std::swap(positions, previousPositions);
+                std::swap(normals, previousNormals);
+                std::swap(history, previousHistory);
+                TraceReferenceFirstHits(referenceFrame, WIDTH, HEIGHT, positions, normals);
+
+                history.assign((size_t)WIDTH * HEIGHT, { 0, 0, 0, 0 });
+                for (UINT i = 0; frame > 0 && i < WIDTH * HEIGHT; ++i)
+                {
+                    if (normals[i].x == 0 && normals[i].y == 0 && normals[i].z == 0)
+                        continue;
+                    ++reusable;
+                    XMINT2 pixel;
+                    if (!ReprojectToPixel(previous.lookfrom, previous.lookat, previous.vfov, WIDTH, HEIGHT, positions[i], pixel))
+                        continue;
+                    const size_t previousPixel = (size_t)pixel.y * WIDTH + pixel.x;
+                    if (IsHistoryValid(positions[i], normals[i], previousPositions[previousPixel], previousNormals[previousPixel], camera.lookfrom))
+                    {
+                        history[i] = previousHistory[previousPixel];
+                        ++reused;
+                    }
+                }
+                for (auto& pixel : history)
+                {
+                    pixel = AccumulateHistory(pixel, { 0, 0, 0 }, SAMPLES_PER_FRAME);
+                }
+            }
+
+            double historyLength = 0;
+            UINT hitPixels = 0;
+            for (UINT i = 0; i < WIDTH * HEIGHT; ++i)
+            {
+                if (normals[i].x == 0 && normals[i].y == 0 && normals[i].z == 0)
+                    continue;
+                historyLength += history[i].w;
+                ++hitPixels;
+            }
+            printf("  %4.2f%% of the distance per frame: %5.1f%% reused, %6.1f samples per pixel\n", step * 100,
+                100.0 * reused / std::max<UINT64>(reusable, 1), historyLength / std::max(hitPixels, 1u));
+        }
+    }
+
+    void benchmarkAnimationPipeline()
+    {
+        // Same sequence rendered with the stages one after another, then overlapped.
+        ThreadPool pool;
+        AnimationSettings settings = { .scene = 17, .frameCount = 120, .frameTime = 1.0f / 30.0f,
+                                       .width = 160, .height = 90, .samplesPerPixel = 4 };
+        AnimationStats serial = RenderAnimation(settings, pool);
+        settings.pipelined = true;
+        AnimationStats pipelined = RenderAnimation(settings, pool);
+        printf("Pipelining speedup: %.2fx\n", serial.totalMilliseconds / pipelined.totalMilliseconds);
+    }
+
+    struct SimulatedFrame {}; // Nothing to keep per frame, only the pacing matters here.
+
+    template <size_t FrameCount>
+    void simulateFramePacing(double cpuMilliseconds, double gpuMilliseconds, UINT frameCount)
+    {
+        FrameRing<SimulatedFrameQueue, SimulatedFrame, FrameCount> ring;
+        SimulatedFrameQueue& queue = ring.GetQueue();
+        for (UINT i = 0; i < frameCount; ++i)
+        {
+            ring.BeginFrame();
+            queue.now += cpuMilliseconds;
+            queue.Submit(gpuMilliseconds);
+            ring.EndFrame();
+        }
+        ring.WaitIdle();
+
+        printf("  %zu in flight: %5.2f ms per frame, %llu of %llu frames waited for the GPU\n", FrameCount,
+            queue.now / frameCount, (unsigned long long)ring.Stalls(), (unsigned long long)ring.FramesSubmitted());
+    }
+
+    // CPU copy of the exact test in HittablePDFValue (shaders_helpers.hlsli), the light's share of the PDF
+    // of direction from origin.
+    float lightPDFValue(const LightData& light, DirectX::FXMVECTOR origin, DirectX::FXMVECTOR direction)
+    {
+        using namespace DirectX;
+
+        const XMVECTOR Q = XMLoadFloat3(&light.Q);
+        if (light.type == OBJECT_TYPE_QUAD)
+        {
+            const XMVECTOR normal = XMLoadFloat3(&light.normal);
+            const float denom = XMVectorGetX(XMVector3Dot(normal, direction));
+            if (std::abs(denom) <= 1e-8f)
+                return 0;
+            const float t = XMVectorGetX(XMVector3Dot(normal, Q - origin)) / denom;
+            const XMVECTOR planar = origin + t * direction - Q;
+            const XMVECTOR W = normal / light.area;
+            const float alpha = XMVectorGetX(XMVector3Dot(W, XMVector3Cross(planar, XMLoadFloat3(&light.V))));
+            const float beta = XMVectorGetX(XMVector3Dot(W, XMVector3Cross(XMLoadFloat3(&light.U), planar)));
+            if (t <= 0 || alpha < 0 || alpha > 1 || beta < 0 || beta > 1)
+                return 0;
+            const float lengthSquared = XMVectorGetX(XMVector3LengthSq(direction));
+            const float cosine = std::abs(denom) / std::sqrt(lengthSquared);
+            return t * t * lengthSquared / (cosine * light.area);
+        }
+
+        const XMVECTOR oc = Q - origin;
+        const float a = XMVectorGetX(XMVector3LengthSq(direction));
+        const float h = XMVectorGetX(XMVector3Dot(direction, oc));
+        const float distanceSquared = XMVectorGetX(XMVector3LengthSq(oc));
+        const float discriminant = h * h - a * (distanceSquared - light.radius * light.radius);
+        if (discriminant < 0 || h + std::sqrt(discriminant) <= 0)
+            return 0;
+        const float cosThetaMax = std::sqrt(1 - light.radius * light.radius / distanceSquared);
+        return 1 / (XM_2PI * (1 - cosThetaMax));
+    }
+
+    void benchmarkLightCulling()
+    {
+        using namespace DirectX;
+
+        constexpr UINT WIDTH = 160;
+        constexpr UINT HEIGHT = 90;
+        constexpr UINT SURFACE_SAMPLES = 8;
+        constexpr UINT DIRECTIONS = 16;
+        constexpr UINT ITERATIONS = 4;
+
+        // Without culling, a diffuse bounce runs the exact test of every light for the PDF value. With it, it
+        // runs a pass of bounds tests over every light, then the exact test of the ones left. Counted at the
+        // diffuse first hits of the lit scenes, and timed with a CPU copy of both loops over cosine directions.
+        // Culling has to keep every light some part of which the point can see. The shaders only cull scenes
+        // with MIN_CULLED_LIGHTS to MAX_CULLED_LIGHTS lights, the last column is the loop they run.
+        printf("Light culling, %ux%u diffuse first hits, light work per bounce:\n", WIDTH, HEIGHT);
+        printf("            lights   all: exact     ns    culled: bounds exact     ns   shaders run\n");
+        for (UINT scene : { 0u, 7u, 8u, 10u, 11u, 13u, 14u })
+        {
+            SetupScene(scene);
+            AnimateInstances(cameraData.shutterOpen, cameraData.shutterClose);
+            ClearDirtyInstances();
+            MotionBVH bvh;
+            BuildMotionBVH(bvh);
+            ReferenceFrame referenceFrame;
+            CaptureReferenceFrame(referenceFrame, bvh);
+
+            std::vector<XMFLOAT3> positions, normals;
+            TraceReferenceFirstHits(referenceFrame, WIDTH, HEIGHT, positions, normals);
+            std::vector<UINT> hits;
+            UINT64 reachable = 0;
+            for (UINT i = 0; i < WIDTH * HEIGHT; ++i)
+            {
+                const XMVECTOR n = XMLoadFloat3(&normals[i]);
+                if (XMVector3Equal(n, XMVectorZero()))
+                    continue;
+                hits.push_back(i);
+                const XMVECTOR p = XMLoadFloat3(&positions[i]);
+                for (const LightData& light : lightsList)
+                {
+                    if (LightMayReach(light, positions[i], normals[i]))
+                    {
+                        ++reachable;
+                        continue;
+                    }
+
+                    // Facing away from the point, the normal cone test culled it.
+                    const XMVECTOR Q = XMLoadFloat3(&light.Q);
+                    const float side = XMVectorGetX(XMVector3Dot(p - Q, XMLoadFloat3(&light.normal)));
+                    if (((light.flags & LIGHT_FLAG_ONE_SIDED) && side >= 0) || ((light.flags & LIGHT_FLAG_BOX_FACE) && side <= 0))
+                        continue;
+
+                    // Otherwise the bounds test did, so no point of the light may be above the tangent plane.
+                    for (UINT s = 0; s < SURFACE_SAMPLES; ++s)
+                    {
+                        const float a = (s + 0.5f) / SURFACE_SAMPLES, b = (s * 5 % SURFACE_SAMPLES + 0.5f) / SURFACE_SAMPLES;
+                        XMVECTOR point;
+                        if (light.type == OBJECT_TYPE_SPHERE)
+                        {
+                            const float z = 2 * a - 1, phi = XM_2PI * b, r = std::sqrt(1 - z * z);
+                            point = Q + light.radius * XMVectorSet(r * std::cos(phi), r * std::sin(phi), z, 0);
+                        }
+                        else
+                        {
+                            point = Q + a * XMLoadFloat3(&light.U) + b * XMLoadFloat3(&light.V);
+                        }
+                        if (XMVectorGetX(XMVector3Dot(point - p, n)) > 1e-3f)
+                        {
+                            throw std::runtime_error("Scene " + std::to_string(scene) + " culls a light a first hit can see");
+                        }
+                    }
+                }
+            }
+
+            // Same directions for both, around the normal like the cosine half of the mixture.
+            std::vector<XMFLOAT3> directions(hits.size() * DIRECTIONS);
+            UINT seed = 1;
+            for (size_t i = 0; i < directions.size(); ++i)
+            {
+                XMVECTOR random;
+                do
+                {
+                    random = XMVectorSet(RandomFloat(seed, -1, 1), RandomFloat(seed, -1, 1), RandomFloat(seed, -1, 1), 0);
+                } while (XMVectorGetX(XMVector3LengthSq(random)) > 1);
+                XMStoreFloat3(&directions[i], XMLoadFloat3(&normals[hits[i / DIRECTIONS]]) + XMVector3Normalize(random));
+            }
+
+            float sum = 0;
+            const double allMs = averageMilliseconds(ITERATIONS, [&](UINT) {
+                for (size_t i = 0; i < directions.size(); ++i)
+                {
+                    const XMVECTOR p = XMLoadFloat3(&positions[hits[i / DIRECTIONS]]);
+                    float pdf = 0;
+                    for (const LightData& light : lightsList)
+                    {
+                        pdf += lightPDFValue(light, p, XMLoadFloat3(&directions[i]));
+                    }
+                    sum += pdf / lightsList.size();
+                }
+            });
+            if (lightsList.size() > MAX_CULLED_LIGHTS)
+            {
+                printf("  scene %2u: %5zu %12zu %8.1f %15s %5s %8s   all\n", scene, lightsList.size(), lightsList.size(),
+                    allMs * 1e6 / directions.size(), "-", "-", "-");
+                continue;
+            }
+            const double culledMs = averageMilliseconds(ITERATIONS, [&](UINT) {
+                for (size_t i = 0; i < directions.size(); ++i)
+                {
+                    const UINT hit = hits[i / DIRECTIONS];
+                    const XMVECTOR p = XMLoadFloat3(&positions[hit]);
+                    UINT lights = 0;
+                    for (UINT light = 0; light < lightsList.size(); ++light)
+                    {
+                        if (LightMayReach(lightsList[light], positions[hit], normals[hit]))
+                            lights |= 1u << light;
+                    }
+                    float pdf = 0;
+                    for (UINT rest = lights; rest != 0; rest &= rest - 1)
+                    {
+                        pdf += lightPDFValue(lightsList[std::countr_zero(rest)], p, XMLoadFloat3(&directions[i]));
+                    }
+                    sum += lights ? pdf / std::popcount(lights) : 0;
+                }
+            });
+            if (!std::isfinite(sum))
+            {
+                throw std::runtime_error("Light PDF of scene " + std::to_string(scene) + " isn't finite");
+            }
+
+            const double bounces = (double)directions.size();
+            const bool culls = lightsList.size() >= MIN_CULLED_LIGHTS;
+            printf("  scene %2u: %5zu %12zu %8.1f %15zu %5.2f %8.1f   %s\n", scene, lightsList.size(), lightsList.size(),
+                allMs * 1e6 / bounces, lightsList.size(), hits.empty() ? 0.0 : (double)reachable / hits.size(), culledMs * 1e6 / bounces,
+                culls ? "culled" : "all");
+        }
+    }
+
+    void benchmarkGridVolumes()
+    {
+        using namespace DirectX;
+
+        constexpr UINT RESOLUTION = 128;
+        constexpr UINT RAY_COUNT = 50000;
+        constexpr float DENSITY = 1.5f; // Mean extinction per object space unit, the cube is 2 across.
+        constexpr float MARCH_STEP = 0.5f; // In voxels.
+
+        DensityGrid grid = MakeCloudGrid(RESOLUTION, 6, 7);
+
+        // The grid file round trip, and how much the zero runs save on a mostly empty grid.
+        const auto path = std::filesystem::temp_directory_path() / "benchmark.vgrid";
+        WriteDensityGrid(path.string(), grid, false);
+        const auto rawSize = std::filesystem::file_size(path);
+        WriteDensityGrid(path.string(), grid, true);
+        const auto compressedSize = std::filesystem::file_size(path);
+        const bool same = LoadDensityGrid(path.string()).density == grid.density;
+        std::filesystem::remove(path);
+        UINT64 emptyCells = std::count(grid.majorants.begin(), grid.majorants.end(), 0.0f);
+        printf("Grid volumes, %u^3 voxels, %.1f%% of %u^3 voxel blocks empty, file %.1f MB raw, %.1f MB compressed, round trip %s\n",
+            RESOLUTION, 100.0 * emptyCells / grid.majorants.size(), MAJORANT_BLOCK, rawSize / 1e6, compressedSize / 1e6, same ? "exact" : "DIFFERS");
+
+        // Rays from all around aimed at the middle of the cube.
+        std::srand(1);
+        std::vector<std::pair<XMVECTOR, XMVECTOR>> rays;
+        std::vector<std::pair<float, float>> spans;
+        while (rays.size() < RAY_COUNT)
+        {
+            XMVECTOR origin = XMVector3Normalize(XMVectorSet(randomRange(-1, 1), randomRange(-1, 1), randomRange(-1, 1), 0)) * 3;
+            XMVECTOR target = XMVectorSet(randomRange(-0.6f, 0.6f), randomRange(-0.6f, 0.6f), randomRange(-0.6f, 0.6f), 0);
+            XMVECTOR direction = XMVector3Normalize(target - origin);
+            XMFLOAT3 o, d;
+            XMStoreFloat3(&o, origin);
+            XMStoreFloat3(&d, direction);
+            float tEnter = 0, tExit = FLT_MAX;
+            for (auto [p, v] : { std::pair{ o.x, d.x }, std::pair{ o.y, d.y }, std::pair{ o.z, d.z } })
+            {
+                float t0 = (-1 - p) / v, t1 = (1 - p) / v;
+                tEnter = std::max(tEnter, std::min(t0, t1));
+                tExit = std::min(tExit, std::max(t0, t1));
+            }
+            if (tEnter < tExit)
+            {
+                rays.push_back({ origin, direction });
+                spans.push_back({ tEnter, tExit });
+            }
+        }
+
+        DensityGrid single = grid;
+        BuildMajorantGrid(single, RESOLUTION);
+
+        // Scattering (free flight sampling) and transmittance of the same rays with each method.
+        printf("                                    scattering                          transmittance\n");
+        printf("                                  time   cells/ray lookups/ray scattered   time   cells/ray lookups/ray  mean\n");
+        for (UINT method = 0; method < 3; ++method)
+        {
+            const DensityGrid& tracked = (method == 1) ? single : grid;
+            VolumeTrackingStats scatterStats = {}, transmittanceStats = {};
+            UINT scattered = 0;
+            double scatterMs = averageMilliseconds(1, [&](UINT) {
+                for (UINT i = 0; i < RAY_COUNT; ++i)
+                {
+                    UINT seed = SetupSeed(i, 0);
+                    float t;
+                    scattered += (method == 2)
+                        ? MarchGridScattering(tracked, DENSITY, rays[i].first, rays[i].second, spans[i].first, spans[i].second, MARCH_STEP, seed, t, &scatterStats)
+                        : SampleGridScattering(tracked, DENSITY, rays[i].first, rays[i].second, spans[i].first, spans[i].second, seed, t, &scatterStats);
+                }
+            });
+            double transmittance = 0;
+            double transmittanceMs = averageMilliseconds(1, [&](UINT) {
+                for (UINT i = 0; i < RAY_COUNT; ++i)
+                {
+                    UINT seed = SetupSeed(i, 1);
+                    transmittance += (method == 2)
+                        ? MarchGridTransmittance(tracked, DENSITY, rays[i].first, rays[i].second, spans[i].first, spans[i].second, MARCH_STEP, &transmittanceStats)
+                        : EstimateGridTransmittance(tracked, DENSITY, rays[i].first, rays[i].second, spans[i].first, spans[i].second, seed, &transmittanceStats);
+                }
+            });
+
+            const char* names[] = { "delta tracking, majorant grid", "delta tracking, one majorant", "ray march, half voxel steps" };
+            printf("  %-30s %6.1f ms %8.2f %10.2f %9.2f%% %6.1f ms %8.2f %10.2f %7.4f\n", names[method],
+                scatterMs, (double)scatterStats.majorantCells / RAY_COUNT, (double)scatterStats.densityLookups / RAY_COUNT, 100.0 * scattered / RAY_COUNT,
+                transmittanceMs, (double)transmittanceStats.majorantCells / RAY_COUNT, (double)transmittanceStats.densityLookups / RAY_COUNT,
+                transmittance / RAY_COUNT);
+        }
+    }
+
+    void benchmarkTextureCache()
+    {
+        using namespace DirectX;
+
+        constexpr UINT TEXTURE_COUNT = 16;
+        constexpr UINT TEXTURE_SIZE = 1024;
+        constexpr UINT WIDTH = 640;
+        constexpr UINT HEIGHT = 360;
+        constexpr UINT SAMPLES = 4;
+
+        // Marble spheres with a wall of image textured spheres in front, every one its own texture.
+        SetupScene(19);
+        const auto directory = std::filesystem::temp_directory_path() / "benchmark_textures";
+        std::filesystem::create_directories(directory);
+        std::vector<UINT8> texels((size_t)TEXTURE_SIZE * TEXTURE_SIZE * 3);
+        for (UINT i = 0; i < TEXTURE_COUNT; ++i)
+        {
+            for (UINT y = 0; y < TEXTURE_SIZE; ++y)
+            {
+                for (UINT x = 0; x < TEXTURE_SIZE; ++x)
+                {
+                    UINT8* texel = &texels[3 * ((size_t)y * TEXTURE_SIZE + x)];
+                    const bool checker = ((x >> (3 + i % 4)) ^ (y >> (3 + i % 4))) & 1;
+                    texel[0] = (UINT8)(checker ? 255 - x / 4 : 40 + i * 10);
+                    texel[1] = (UINT8)(checker ? y / 4 : 200);
+                    texel[2] = (UINT8)(checker ? (x ^ y) & 255 : 255 - i * 12);
+                }
+            }
+            const std::string path = (directory / ("texture" + std::to_string(i) + ".ppm")).string();
+            FILE* file = fopen(path.c_str(), "wb");
+            fprintf(file, "P6\n%u %u\n255\n", TEXTURE_SIZE, TEXTURE_SIZE);
+            fwrite(texels.data(), 1, texels.size(), file);
+            fclose(file);
+
+            const UINT texture = LoadTexture(path);
+            const UINT id = (UINT)proceduralInstances.size();
+            const float r = 0.45f;
+            proceduralInstances.push_back({ .transform = XMMatrixScaling(r, r, r) * XMMatrixTranslation(2.0f, 0.5f + (i / 4) * 0.95f, -1.5f + (i % 4) * 0.95f),
+                                            .instanceID = id,
+                                            .type = OBJECT_TYPE_SPHERE });
+            objectList.push_back({ .materialIndex = (UINT16)materialList.size(), .type = OBJECT_TYPE_SPHERE });
+            materialList.push_back({ .albedo = textureList[texture].average, .type = MATERIAL_TYPE_LAMBERTIAN,
+                                     .textureType = TEXTURE_TYPE_IMAGE, .textureIndex = texture });
+        }
+
+        MotionBVH bvh;
+        BuildMotionBVH(bvh);
+        ReferenceFrame referenceFrame;
+        CaptureReferenceFrame(referenceFrame, bvh);
+        referenceFrame.camera.samplesPerPixel = SAMPLES;
+
+        // Every texture with all its mip levels, as the cache would hold it with no budget at all.
+        const double allLevelsMB = TEXTURE_COUNT * (double)TEXTURE_SIZE * TEXTURE_SIZE * 4 * 4 / 3 / (1 << 20);
+        printf("Texture cache, %u textures of %ux%u (%.1f MB with mip levels), %ux%u at %u spp:\n",
+            TEXTURE_COUNT, TEXTURE_SIZE, TEXTURE_SIZE, allLevelsMB, WIDTH, HEIGHT, SAMPLES);
+        printf("        budget      time     lookups   hit rate   tile loads  evictions   peak memory\n");
+        ThreadPool pool;
+        std::vector<XMFLOAT3> image;
+        for (size_t budget : { 256ull << 20, 16ull << 20, 4ull << 20, 1ull << 20, 256ull << 10 })
+        {
+            SetTextureCacheBudget(budget);
+            ClearTextureCache();
+            double ms = averageMilliseconds(1, [&](UINT) { RenderReference(referenceFrame, WIDTH, HEIGHT, image, &pool); });
+            TextureCacheStats stats = GetTextureCacheStats();
+            printf("  %9.2f MB %8.1f ms %10llu %9.2f%% %11llu %10llu %10.2f MB\n", budget / 1048576.0, ms,
+                (unsigned long long)stats.lookups, 100.0 * stats.hits / std::max<UINT64>(stats.lookups, 1),
+                (unsigned long long)stats.misses, (unsigned long long)stats.evictions, stats.peakBytes / 1048576.0);
+        }
+
+        SetTextureCacheBudget(TEXTURE_CACHE_DEFAULT_BUDGET);
+        ClearTextures();
+        std::filesystem::remove_all(directory);
+    }
+
+    void benchmarkMeshPaging()
+    {
+        using namespace DirectX;
+
+        constexpr UINT RINGS = 256;
+        constexpr UINT SEGMENTS = 512;
+        constexpr UINT WIDTH = 320;
+        constexpr UINT HEIGHT = 180;
+        constexpr UINT SAMPLES = 4;
+        constexpr UINT RAY_COUNT = 1 << 16;
+
+        // Bumpy sphere of about a quarter million triangles in the Cornell box, first whole, then paged
+        // out under smaller and smaller budgets. Every budget has to give the exact same image.
+        const auto path = std::filesystem::temp_directory_path() / "benchmark_mesh.obj";
+        {
+            FILE* file = fopen(path.string().c_str(), "w");
+            for (UINT ring = 0; ring <= RINGS; ++ring)
+            {
+                for (UINT segment = 0; segment < SEGMENTS; ++segment)
+                {
+                    const float theta = XM_PI * ring / RINGS, phi = XM_2PI * segment / SEGMENTS;
+                    const float r = 1 + 0.05f * std::sin(12 * theta) * std::sin(17 * phi);
+                    fprintf(file, "v %f %f %f\n", r * std::sin(theta) * std::cos(phi), r * std::cos(theta), r * std::sin(theta) * std::sin(phi));
+                }
+            }
+            for (UINT ring = 0; ring < RINGS; ++ring)
+            {
+                for (UINT segment = 0; segment < SEGMENTS; ++segment)
+                {
+                    const UINT a = ring * SEGMENTS + segment + 1, b = ring * SEGMENTS + (segment + 1) % SEGMENTS + 1;
+                    fprintf(file, "f %u %u %u %u\n", a, b, b + SEGMENTS, a + SEGMENTS);
+                }
+            }
+            fclose(file);
+        }
+
+        SetupScene(8);
+        auto loadMesh = [&](bool paged) {
+            pageMeshes = paged;
+            SceneState loaded;
+            LoadMesh(path.string(), loaded);
+            std::swap(meshList, loaded.meshList);
+            std::swap(meshVertices, loaded.meshVertices);
+            std::swap(meshIndices, loaded.meshIndices);
+            ClearMeshPageCache();
+            pageMeshes = false;
+        };
+        loadMesh(false);
+        const UINT id = (UINT)proceduralInstances.size();
+        proceduralInstances.push_back({ .transform = XMMatrixScaling(150, 150, 150) * XMMatrixTranslation(278, 200, 278),
+                                        .instanceID = id,
+                                        .type = OBJECT_TYPE_TRIANGLE_MESH,
+                                        .prototypeIndex = 0 });
+        objectList.push_back({ .materialIndex = (UINT16)materialList.size(), .type = OBJECT_TYPE_TRIANGLE_MESH });
+        materialList.push_back({ .albedo = { 0.73f, 0.73f, 0.73f }, .type = MATERIAL_TYPE_LAMBERTIAN });
+        MotionBVH bvh;
+        BuildMotionBVH(bvh);
+        ReferenceFrame referenceFrame;
+        CaptureReferenceFrame(referenceFrame, bvh);
+        referenceFrame.camera.samplesPerPixel = SAMPLES;
+
+        ThreadPool pool;
+        std::vector<XMFLOAT3> wholeImage, image;
+        const double wholeMs = averageMilliseconds(1, [&](UINT) { RenderReference(referenceFrame, WIDTH, HEIGHT, wholeImage, &pool); });
+
+        // Rays from all around the mesh to points inside it, in no particular order.
+        std::vector<MeshRay> rays(RAY_COUNT);
+        std::vector<MeshRayHit> wholeHits(RAY_COUNT), hits(RAY_COUNT);
+        std::srand(49);
+        for (MeshRay& ray : rays)
+        {
+            const XMVECTOR origin = 3 * XMVector3Normalize(XMVectorSet(randomRange(-1, 1), randomRange(-1, 1), randomRange(-1, 1), 0));
+            const XMVECTOR target = XMVectorSet(randomRange(-0.5f, 0.5f), randomRange(-0.5f, 0.5f), randomRange(-0.5f, 0.5f), 0);
+            XMStoreFloat3(&ray.origin, origin);
+            XMStoreFloat3(&ray.direction, target - origin);
+        }
+        TraceMeshRays(0, rays, wholeHits, &pool);
+
+        loadMesh(true);
+        const size_t pagedBytes = std::filesystem::file_size(meshList[0].pagePath);
+        printf("Mesh paging, %u triangles in %zu treelets (%.1f MB paged), %ux%u at %u spp, whole mesh in memory %.1f ms:\n",
+            meshList[0].indexCount / 3, meshList[0].treelets.size(), pagedBytes / 1048576.0, WIDTH, HEIGHT, SAMPLES, wholeMs);
+        printf("        budget                 time    page faults    MB read  evictions   peak memory   queued rays  queues  longest\n");
+        for (size_t budget : { 256ull << 20, 8ull << 20, 2ull << 20 })
+        {
+            SetMeshPageBudget(budget);
+            auto report = [&](const char* what, double ms, UINT64 rayCount) {
+                const MeshPagingStats stats = GetMeshPagingStats();
+                printf("  %9.2f MB %-7s %8.1f ms %9llu %12.1f %10llu %10.2f MB %12llu %7llu %8llu", budget / 1048576.0, what, ms,
+                    (unsigned long long)stats.faults, stats.bytesRead / 1048576.0, (unsigned long long)stats.evictions,
+                    stats.peakBytes / 1048576.0, (unsigned long long)stats.queuedRays, (unsigned long long)stats.queues,
+                    (unsigned long long)stats.maxQueueLength);
+                if (rayCount)
+                    printf("  %6.2f Mrays/s", rayCount / ms / 1000);
+                printf("\n");
+            };
+
+            ClearMeshPageCache();
+            double ms = averageMilliseconds(1, [&](UINT) { RenderReference(referenceFrame, WIDTH, HEIGHT, image, &pool); });
+            if (memcmp(image.data(), wholeImage.data(), image.size() * sizeof(XMFLOAT3)) != 0)
+            {
+                throw std::runtime_error("Paged mesh renders differently with a " + std::to_string(budget) + " byte budget");
+            }
+            report("render", ms, 0);
+
+            // The same rays, first each reading what it misses right away, then queued by treelet.
+            for (bool queue : { false, true })
+            {
+                ClearMeshPageCache();
+                ms = averageMilliseconds(1, [&](UINT) { TraceMeshRays(0, rays, hits, &pool, queue); });
+                for (UINT i = 0; i < RAY_COUNT; ++i)
+                {
+                    if (hits[i].t != wholeHits[i].t)
+                    {
+                        throw std::runtime_error("Paged mesh ray " + std::to_string(i) + " hits somewhere else");
+                    }
+                }
+                report(queue ? "queued" : "rays", ms, RAY_COUNT);
+            }
+        }
+
+        SetMeshPageBudget(MESH_PAGE_CACHE_DEFAULT_BUDGET);
+        SetupScene(0); // Drops the paged mesh, and its page file with it.
+        std::filesystem::remove(path);
+    }
+
+    void benchmarkNumaScaling()
+    {
+        constexpr UINT WIDTH = 160;
+        constexpr UINT HEIGHT = 90;
+        constexpr UINT SAMPLES = 8;
+
+        // The final scene on pools pinned per NUMA node, from one thread up to every CPU, once with all
+        // nodes reading the same frame and once with a copy per node. Every run has to give the image a
+        // single thread renders on its own. With just one node there's nothing to copy, so that path
+        // also runs with the CPUs split into two pretend nodes.
+        const std::vector<std::vector<UINT>> nodes = NumaNodeCpus();
+        std::vector<UINT> allCpus;
+        for (const auto& cpus : nodes)
+        {
+            allCpus.insert(allCpus.end(), cpus.begin(), cpus.end());
+        }
+        const UINT cpuCount = (UINT)allCpus.size();
+
+        SetupScene(15);
+        AnimateInstances(cameraData.shutterOpen, cameraData.shutterClose);
+        ClearDirtyInstances();
+        MotionBVH bvh;
+        BuildMotionBVH(bvh);
+        ReferenceFrame referenceFrame;
+        CaptureReferenceFrame(referenceFrame, bvh);
+        referenceFrame.camera.samplesPerPixel = SAMPLES;
+
+        std::vector<DirectX::XMFLOAT3> expected;
+        RenderReference(referenceFrame, WIDTH, HEIGHT, expected, nullptr);
+
+        // Mrays/s of one render.
+        auto run = [&](UINT threads, const std::vector<std::vector<UINT>>& nodeCpus, bool replicate) {
+            ThreadPool pool(threads, nodeCpus);
+            replicateFramePerNode = replicate;
+            std::vector<DirectX::XMFLOAT3> image;
+            PathStats stats = {};
+            double ms = averageMilliseconds(1, [&](UINT) { RenderReference(referenceFrame, WIDTH, HEIGHT, image, &pool, &stats); });
+            replicateFramePerNode = true;
+            if (memcmp(image.data(), expected.data(), expected.size() * sizeof(DirectX::XMFLOAT3)) != 0)
+            {
+                throw std::runtime_error("Render on " + std::to_string(threads) + " threads over " + std::to_string(pool.NodeCount()) +
+                    " nodes differs from the single threaded one");
+            }
+
+            UINT64 rays = stats.paths;
+            for (UINT64 typeBounces : stats.bounces)
+            {
+                rays += typeBounces;
+            }
+            return rays / ms / 1000;
+        };
+
+        printf("NUMA scaling, scene 15 at %ux%u, %u spp, %zu node(s) with %u CPUs:\n", WIDTH, HEIGHT, SAMPLES, nodes.size(), cpuCount);
+        std::vector<UINT> threadCounts;
+        for (UINT threads = 1; threads < cpuCount; threads *= 2)
+        {
+            threadCounts.push_back(threads);
+        }
+        threadCounts.push_back(cpuCount);
+
+        double base = 0;
+        for (UINT threads : threadCounts)
+        {
+            const double shared = run(threads, nodes, false);
+            if (threads == 1)
+                base = shared;
+            if (nodes.size() == 1)
+            {
+                printf("  %3u threads: shared frame %7.2f Mrays/s (%5.2fx)\n", threads, shared, shared / base);
+                continue;
+            }
+            const double copies = run(threads, nodes, true);
+            printf("  %3u threads: shared frame %7.2f Mrays/s (%5.2fx), frame per node %7.2f Mrays/s (%5.2fx)\n",
+                threads, shared, shared / base, copies, copies / base);
+        }
+
+        const size_t half = std::max<size_t>(allCpus.size() / 2, 1);
+        std::vector<std::vector<UINT>> pretend = { { allCpus.begin(), allCpus.begin() + half }, { allCpus.begin() + half, allCpus.end() } };
+        if (pretend[1].empty())
+            pretend[1] = pretend[0];
+        if (nodes.size() == 1)
+        {
+            // Pretend nodes share the same memory, so this checks the copies and what making them costs,
+            // not what they gain.
+            const UINT threads = std::max(cpuCount, 2u);
+            printf("  multi-node scaling not measured, this machine has a single NUMA node\n");
+            printf("  %3u threads over two pretend nodes, frame per node %7.2f Mrays/s\n", threads, run(threads, pretend, true));
+        }
+
+        // A render worker gets a frame tile by tile, see RunRenderWorker. Its nodes copy the frame once
+        // for all of them, instead of once per tile like a RenderReferenceRegion without replicas does.
+        constexpr UINT TILE_SIZE = 32;
+        ThreadPool pool(std::max(cpuCount, 2u), nodes.size() > 1 ? nodes : pretend);
+        std::vector<DirectX::XMFLOAT3> image((size_t)WIDTH * HEIGHT), tile;
+        for (bool once : { false, true })
+        {
+            double ms = averageMilliseconds(1, [&](UINT) {
+                const std::vector<ReferenceFrame> replicas = once ? ReplicateReferenceFrame(referenceFrame, pool) : std::vector<ReferenceFrame>();
+                for (UINT y = 0; y < HEIGHT; y += TILE_SIZE)
+                {
+                    for (UINT x = 0; x < WIDTH; x += TILE_SIZE)
+                    {
+                        const ImageRect rect = { x, y, std::min(TILE_SIZE, WIDTH - x), std::min(TILE_SIZE, HEIGHT - y) };
+                        RenderReferenceRegion(referenceFrame, WIDTH, HEIGHT, rect, tile, &pool, nullptr, replicas);
+                        for (UINT row = 0; row < rect.height; ++row)
+                        {
+                            std::copy_n(tile.begin() + (size_t)row * rect.width, rect.width, image.begin() + (size_t)(y + row) * WIDTH + x);
+                        }
+                    }
+                }
+            });
+            if (memcmp(image.data(), expected.data(), expected.size() * sizeof(DirectX::XMFLOAT3)) != 0)
+            {
+                throw std::runtime_error("Tiled render over " + std::to_string(pool.NodeCount()) + " nodes differs from the single threaded one");
+            }
+            printf("  %ux%u tiles over %u nodes, frame copied %s: %8.1f ms\n", TILE_SIZE, TILE_SIZE, pool.NodeCount(),
+                once ? "once          " : "for every tile", ms);
+        }
+    }
+
+    void benchmarkSceneSwitch()
+    {
+        // Scenes the CPU side rebuilds everything for. The procedural ones must switch without a heap
+        // allocation once each was seen once. The mesh, the cloud and the textures of the others come
+        // from files, which still go through the heap, so those are only timed.
+        constexpr UINT PROCEDURAL_SCENES[] = { 4, 17, 19 };
+        constexpr UINT FILE_SCENES[] = { 15, 16, 18 };
+        constexpr UINT ROUNDS = 2;
+
+        printf("Scene switch, host side rebuild (SetupScene, animation, scene and motion BVH):\n");
+        MotionBVH bvh;
+        for (UINT round = 0; round < ROUNDS; ++round)
+        {
+            for (bool fromFiles : { false, true })
+            {
+                for (UINT scene : fromFiles ? std::span<const UINT>(FILE_SCENES) : std::span<const UINT>(PROCEDURAL_SCENES))
+                {
+                    const UINT64 allocationsBefore = heapAllocationCounter ? heapAllocationCounter->load(std::memory_order_relaxed) : 0;
+                    double ms = averageMilliseconds(1, [&](UINT) {
+                        SetupScene(scene);
+                        AnimateInstances(cameraData.shutterOpen, cameraData.shutterClose);
+                        UpdateSceneBVH(true);
+                        ClearDirtyInstances();
+                        BuildMotionBVH(bvh);
+                    });
+                    if (round < ROUNDS - 1)
+                        continue;
+
+                    const char* kind = fromFiles ? "from files" : "procedural";
+                    if (!heapAllocationCounter)
+                    {
+                        printf("  scene %2u: %8.3f ms, %s, heap allocations only counted by raytracer_bench\n", scene, ms, kind);
+                        continue;
+                    }
+                    const UINT64 allocations = heapAllocationCounter->load(std::memory_order_relaxed) - allocationsBefore;
+                    printf("  scene %2u: %8.3f ms, %s, %6llu heap allocations\n", scene, ms, kind, (unsigned long long)allocations);
+                    if (!fromFiles && allocations != 0)
+                    {
+                        throw std::runtime_error("Switching to procedural scene " + std::to_string(scene) + " allocated from the heap");
+                    }
+                }
+            }
+        }
+        printf("  scene arena %.2f MB in %zu chunk allocations, scratch arena %.2f MB\n", sceneArena->BytesReserved() / 1048576.0,
+            sceneArena->ChunkAllocations(), ScratchArena().BytesReserved() / 1048576.0);
+    }
+
+    void benchmarkBackgroundSceneLoad()
+    {
+        using namespace DirectX;
+
+        // A render loop going through scenes that take a while to set up, once building them in the frame
+        // like SetupScene, once on the switcher's worker with the old scene rendering meanwhile. Frames are
+        // small CPU renders, and either way the render thread rebuilds the scene and motion BVH on a change.
+        constexpr UINT SCENES[] = { 18, 15, 4, 18, 15 };
+        constexpr UINT FRAMES_PER_SCENE = 20;
+        constexpr UINT WIDTH = 32;
+        constexpr UINT HEIGHT = 18;
+
+        ThreadPool pool;
+        MotionBVH bvh;
+        ReferenceFrame referenceFrame;
+        std::vector<XMFLOAT3> image;
+        auto sceneChanged = [&]() {
+            UpdateSceneBVH(true);
+            ClearDirtyInstances();
+            BuildMotionBVH(bvh);
+        };
+        auto renderFrame = [&]() {
+            CaptureReferenceFrame(referenceFrame, bvh);
+            referenceFrame.camera.samplesPerPixel = 1;
+            RenderReference(referenceFrame, WIDTH, HEIGHT, image, &pool);
+        };
+        auto printFrames = [](const char* name, const std::vector<double>& frameMs) {
+            double total = 0;
+            double worst = 0;
+            for (double ms : frameMs)
+            {
+                total += ms;
+                worst = std::max(worst, ms);
+            }
+            printf("  %s: %6.2f ms per frame, %7.2f ms worst frame", name, total / frameMs.size(), worst);
+        };
+
+        std::vector<double> inFrameMs;
+        for (UINT i = 0; i < std::size(SCENES) * FRAMES_PER_SCENE; ++i)
+        {
+            inFrameMs.push_back(averageMilliseconds(1, [&](UINT) {
+                if (i % FRAMES_PER_SCENE == 0)
+                {
+                    SetupScene(SCENES[i / FRAMES_PER_SCENE]);
+                    sceneChanged();
+                }
+                renderFrame();
+            }));
+        }
+
+        // The front scene is the globals, just like for the D3D12 frontend.
+        SceneSwitcher<SceneState> switcher([](UINT scene, SceneState& back) { BuildScene(scene, back); });
+        std::vector<double> backgroundMs;
+        UINT framesWhileLoading = 0;
+        for (UINT i = 0; i < std::size(SCENES) * FRAMES_PER_SCENE; ++i)
+        {
+            backgroundMs.push_back(averageMilliseconds(1, [&](UINT) {
+                if (i % FRAMES_PER_SCENE == 0)
+                {
+                    switcher.Request(SCENES[i / FRAMES_PER_SCENE]);
+                }
+                if (switcher.TrySwap([](SceneState& back) { SwapSceneState(back); }))
+                {
+                    sceneChanged();
+                }
+                framesWhileLoading += switcher.Loading() ? 1 : 0;
+                renderFrame();
+            }));
+        }
+
+        printf("Scene loading in a render loop, %ux%u at 1 spp, %u scene changes:\n", WIDTH, HEIGHT, (UINT)std::size(SCENES));
+        printFrames("in the frame", inFrameMs);
+        printf("\n");
+        printFrames("background  ", backgroundMs);
+        printf(", %u frames rendered the old scene while loading, %llu swaps, %llu loads superseded\n", framesWhileLoading,
+            (unsigned long long)switcher.Swaps(), (unsigned long long)switcher.Superseded());
+    }
+
+    void benchmarkShaderTable()
+    {
+        // Same as InstanceRecordData in program.h, which needs d3d12.h. Identifiers are fake, one byte
+        // pattern per hit group. What the records hold is checked by the shader_table tests.
+        struct InstanceRecord
+        {
+            ObjectData object;
+            UINT inlined;
+            MaterialData material;
+        };
+        constexpr UINT HIT_GROUPS = 23;
+        constexpr UINT RECORDS_PER_CHUNK = 4096;
+
+        printf("Shader table, one hit record per instance:\n");
+        SceneState scene;
+        ThreadPool pool;
+        std::vector<std::byte> table;
+        for (UINT index : { 0u, 4u, 15u })
+        {
+            BuildScene(index, scene);
+            const UINT count = (UINT)scene.proceduralInstances.size();
+            const ShaderTableLayout layout = MakeShaderTableLayout(1, count, sizeof(InstanceRecord));
+            table.assign(layout.size, std::byte{ 0xCD });
+            ShaderTableWriter writer(table.data(), layout);
+
+            std::byte identifiers[HIT_GROUPS][SHADER_IDENTIFIER_BYTES];
+            for (UINT i = 0; i < HIT_GROUPS; ++i)
+            {
+                memset(identifiers[i], (int)i + 1, SHADER_IDENTIFIER_BYTES);
+            }
+
+            auto writeRecords = [&](UINT first, UINT end) {
+                for (UINT id = first; id < end; ++id)
+                {
+                    const ProceduralInstance& instance = scene.proceduralInstances[id];
+                    InstanceRecord record = { .object = scene.objectList[instance.instanceID], .inlined = 1 };
+                    record.material = scene.materialList[record.object.materialIndex];
+                    writer.HitGroup(id, identifiers[instance.hitGroupIndex], &record, sizeof(record));
+                }
+            };
+            const double serialMs = averageMilliseconds(20, [&](UINT) { writeRecords(0, count); });
+            const double parallelMs = averageMilliseconds(20, [&](UINT) {
+                pool.ParallelFor((count + RECORDS_PER_CHUNK - 1) / RECORDS_PER_CHUNK, [&](UINT chunk) {
+                    writeRecords(chunk * RECORDS_PER_CHUNK, std::min(count, (chunk + 1) * RECORDS_PER_CHUNK));
+                });
+            });
+            printf("  scene %2u: %5u records of %llu bytes, %.3f ms serial, %.3f ms on the pool\n", index, count,
+                (unsigned long long)layout.hitGroups.stride, serialMs, parallelMs);
+        }
+    }
+
+    void benchmarkFramePacing()
+    {
+        // One in flight is what waiting for the GPU after every frame amounts to.
+        constexpr UINT FRAME_COUNT = 1000;
+        for (auto [cpu, gpu] : { std::pair{ 6.0, 10.0 }, std::pair{ 10.0, 6.0 }, std::pair{ 8.0, 8.0 } })
+        {
+            printf("Frame pacing, %.0f ms CPU and %.0f ms GPU per frame:\n", cpu, gpu);
+            simulateFramePacing<1>(cpu, gpu, FRAME_COUNT);
+            simulateFramePacing<2>(cpu, gpu, FRAME_COUNT);
+            simulateFramePacing<3>(cpu, gpu, FRAME_COUNT);
+        }
+    }
+}
+
+int RunBenchmarks()
+{
+    benchmarkSceneUpdates();
+    benchmarkSceneData();
+    benchmarkSceneSwitch();
+    benchmarkBackgroundSceneLoad();
+    benchmarkShaderTable();
+    benchmarkTransforms();
+    benchmarkAnimation();
+    benchmarkPrimaryRays();
+    benchmarkSpatialIndex();
+    benchmarkReprojection();
+    benchmarkBounceLimits();
+    benchmarkSpectral();
+    benchmarkKernelSpecialization();
+    benchmarkLightCulling();
+    benchmarkGridVolumes();
+    benchmarkTextureCache();
+    benchmarkMeshPaging();
+    benchmarkNumaScaling();
+    benchmarkAnimationPipeline();
+    benchmarkFramePacing();
+    return 0;
+}
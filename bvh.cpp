@@ -0,0 +1,475 @@
+#include "core.h"
+#include <bit>
+
+// Binned SAH builder. We don't need anything fancy here, the GPU builds its own
+// structures, so this one just has to be good enough for CPU side queries and for
+// sorting the primitives into a spatially coherent order.
+
+namespace
+{
+    constexpr UINT BVH_BIN_COUNT = 16;
+    constexpr UINT BVH_MAX_LEAF_SIZE = 4;
+
+    struct BVHBuildTask
+    {
+        UINT node;
+        UINT first;
+        UINT count;
+        UINT depth;
+    };
+
+    struct BVHBin
+    {
+        AABB bounds;
+        UINT count;
+    };
+
+    AABB emptyBounds()
+    {
+        return { { FLT_MAX, FLT_MAX, FLT_MAX }, { -FLT_MAX, -FLT_MAX, -FLT_MAX } };
+    }
+
+    void growBounds(AABB& bounds, const AABB& other)
+    {
+        bounds.min = { std::min(bounds.min.x, other.min.x), std::min(bounds.min.y, other.min.y), std::min(bounds.min.z, other.min.z) };
+        bounds.max = { std::max(bounds.max.x, other.max.x), std::max(bounds.max.y, other.max.y), std::max(bounds.max.z, other.max.z) };
+    }
+
+    void growBounds(AABB& bounds, const DirectX::XMFLOAT3& point)
+    {
+        growBounds(bounds, AABB{ point, point });
+    }
+
+    float surfaceArea(const AABB& bounds)
+    {
+        float dx = bounds.max.x - bounds.min.x;
+        float dy = bounds.max.y - bounds.min.y;
+        float dz = bounds.max.z - bounds.min.z;
+        return (dx < 0) ? 0.0f : 2.0f * (dx * dy + dy * dz + dz * dx);
+    }
+
+    float axisValue(const DirectX::XMFLOAT3& v, UINT axis)
+    {
+        return (axis == 0) ? v.x : (axis == 1) ? v.y : v.z;
+    }
+
+    DirectX::XMFLOAT3 centroid(const AABB& bounds)
+    {
+        return { 0.5f * (bounds.min.x + bounds.max.x), 0.5f * (bounds.min.y + bounds.max.y), 0.5f * (bounds.min.z + bounds.max.z) };
+    }
+
+    // Levels a node of count primitives needs below it when every split halves it.
+    UINT balancedLevels(UINT count)
+    {
+        const UINT leaves = (count + BVH_MAX_LEAF_SIZE - 1) / BVH_MAX_LEAF_SIZE;
+        return leaves > 1 ? (UINT)std::bit_width(leaves - 1) : 0;
+    }
+}
+
+UINT BuildBVH(std::span<const AABB> primitiveBounds, std::span<BVHNode> nodes, std::span<UINT> primitiveOrder)
+{
+    const UINT primitiveCount = (UINT)primitiveBounds.size();
+
+    for (UINT i = 0; i < primitiveCount; ++i)
+    {
+        primitiveOrder[i] = i;
+    }
+
+    if (primitiveCount == 0)
+    {
+        return 0;
+    }
+
+    // Binary tree with at least one primitive per leaf can't have more nodes than that.
+    if (nodes.size() < 2 * (size_t)primitiveCount - 1 || primitiveOrder.size() < primitiveCount)
+        throw std::invalid_argument("BuildBVH output too small");
+    nodes[0] = {};
+    UINT nodeCount = 1;
+
+    ArenaScope scratch(ScratchArena());
+    ArenaVector<BVHBuildTask> stack(ScratchArena());
+    stack.push_back({ 0, 0, primitiveCount, 0 });
+    while (!stack.empty())
+    {
+        BVHBuildTask task = stack.back();
+        stack.pop_back();
+
+        AABB bounds = emptyBounds();
+        AABB centroidBounds = emptyBounds();
+        for (UINT i = task.first; i < task.first + task.count; ++i)
+        {
+            const AABB& primitive = primitiveBounds[primitiveOrder[i]];
+            growBounds(bounds, primitive);
+            growBounds(centroidBounds, centroid(primitive));
+        }
+
+        BVHNode& node = nodes[task.node];
+        node.boundsMin = bounds.min;
+        node.boundsMax = bounds.max;
+        node.leftOrFirst = task.first;
+        node.primitiveCount = task.count;
+
+        if (task.count <= BVH_MAX_LEAF_SIZE)
+        {
+            continue;
+        }
+
+        // Split along the axis where centroids are spread the most.
+        DirectX::XMFLOAT3 extent = { centroidBounds.max.x - centroidBounds.min.x,
+                                     centroidBounds.max.y - centroidBounds.min.y,
+                                     centroidBounds.max.z - centroidBounds.min.z };
+        UINT axis = (extent.x > extent.y && extent.x > extent.z) ? 0 : (extent.y > extent.z) ? 1 : 2;
+        float axisMin = axisValue(centroidBounds.min, axis);
+        float axisExtent = axisValue(extent, axis);
+
+        // SAH can peel a few primitives off at a time and go arbitrarily deep on unbalanced inputs. Nodes
+        // that would get too close to BVH_MAX_DEPTH that way are split at the median instead, which keeps
+        // all of their leaves within it.
+        const bool medianSplit = task.depth + balancedLevels(task.count) >= BVH_MAX_DEPTH;
+
+        UINT splitCount = 0;
+        if (axisExtent > 0.0f && !medianSplit)
+        {
+            BVHBin bins[BVH_BIN_COUNT];
+            for (auto& bin : bins)
+            {
+                bin = { emptyBounds(), 0 };
+            }
+
+            const float binScale = BVH_BIN_COUNT / axisExtent;
+            auto binIndex = [&](UINT primitive) {
+                float c = axisValue(centroid(primitiveBounds[primitive]), axis);
+                return std::min(BVH_BIN_COUNT - 1, (UINT)((c - axisMin) * binScale));
+            };
+
+            for (UINT i = task.first; i < task.first + task.count; ++i)
+            {
+                BVHBin& bin = bins[binIndex(primitiveOrder[i])];
+                growBounds(bin.bounds, primitiveBounds[primitiveOrder[i]]);
+                bin.count++;
+            }
+
+            // Sweep from the right to get the cost of every right side, then from the left.
+            float rightCost[BVH_BIN_COUNT];
+            AABB rightBounds = emptyBounds();
+            UINT rightCount = 0;
+            for (UINT i = BVH_BIN_COUNT - 1; i > 0; --i)
+            {
+                growBounds(rightBounds, bins[i].bounds);
+                rightCount += bins[i].count;
+                rightCost[i] = rightCount * surfaceArea(rightBounds);
+            }
+
+            float bestCost = FLT_MAX;
+            UINT bestSplit = 0;
+            AABB leftBounds = emptyBounds();
+            UINT leftCount = 0;
+            for (UINT i = 0; i < BVH_BIN_COUNT - 1; ++i)
+            {
+                growBounds(leftBounds, bins[i].bounds);
+                leftCount += bins[i].count;
+                float cost = leftCount * surfaceArea(leftBounds) + rightCost[i + 1];
+                if (leftCount > 0 && leftCount < task.count && cost < bestCost)
+                {
+                    bestCost = cost;
+                    bestSplit = i;
+                }
+            }
+
+            // Keep small nodes as leaves if splitting them doesn't pay off.
+            float leafCost = task.count * surfaceArea(bounds);
+            if (bestCost >= leafCost && task.count <= 4 * BVH_MAX_LEAF_SIZE)
+            {
+                continue;
+            }
+
+            if (bestCost < FLT_MAX)
+            {
+                auto middle = std::partition(primitiveOrder.begin() + task.first, primitiveOrder.begin() + task.first + task.count,
+                    [&](UINT primitive) { return binIndex(primitive) <= bestSplit; });
+                splitCount = (UINT)(middle - (primitiveOrder.begin() + task.first));
+            }
+        }
+
+        if (splitCount == 0 || splitCount == task.count)
+        {
+            // All centroids ended up in one bin (or are the same point), or the node is too deep, fall
+            // back to a median split.
+            splitCount = task.count / 2;
+            std::nth_element(primitiveOrder.begin() + task.first,
+                             primitiveOrder.begin() + task.first + splitCount,
+                             primitiveOrder.begin() + task.first + task.count,
+                             [&](UINT a, UINT b) {
+                                 return axisValue(centroid(primitiveBounds[a]), axis) < axisValue(centroid(primitiveBounds[b]), axis);
+                             });
+        }
+
+        UINT left = nodeCount;
+        nodes[left] = {};
+        nodes[left + 1] = {};
+        nodeCount += 2;
+
+        nodes[task.node].leftOrFirst = left;
+        nodes[task.node].primitiveCount = 0;
+
+        stack.push_back({ left, task.first, splitCount, task.depth + 1 });
+        stack.push_back({ left + 1, task.first + splitCount, task.count - splitCount, task.depth + 1 });
+    }
+    return nodeCount;
+}
+
+UINT BVHDepth(std::span<const BVHNode> nodes)
+{
+    if (nodes.empty())
+        return 0;
+
+    UINT depth = 0;
+    std::vector<std::pair<UINT, UINT>> stack = { { 0, 0 } };
+    while (!stack.empty())
+    {
+        const auto [index, nodeDepth] = stack.back();
+        stack.pop_back();
+        depth = std::max(depth, nodeDepth);
+        const BVHNode& node = nodes[index];
+        if (node.primitiveCount == 0)
+        {
+            if ((size_t)node.leftOrFirst + 1 >= nodes.size() || node.leftOrFirst <= index)
+                throw std::runtime_error("BVH child index out of range");
+            stack.push_back({ node.leftOrFirst, nodeDepth + 1 });
+            stack.push_back({ node.leftOrFirst + 1, nodeDepth + 1 });
+        }
+    }
+    return depth;
+}
+
+namespace
+{
+    AABB instanceOpenBounds(const ProceduralInstance& instance)
+    {
+        using namespace DirectX;
+
+        // Object space bounds, matching the AABBs the BLASes are built from.
+        AABB local = { { -1, -1, -1 }, { 1, 1, 1 } };
+        switch (instance.type)
+        {
+        case OBJECT_TYPE_QUAD:
+            local = { { -1, -1, -0.00001f }, { 1, 1, 0.00001f } };
+            break;
+        case OBJECT_TYPE_TRIANGLE_MESH:
+            local = meshList[instance.prototypeIndex].bounds;
+            break;
+        case OBJECT_TYPE_QUAD_GROUP:
+            {
+                const QuadGroupData& group = groupList[instance.prototypeIndex];
+                local = emptyBounds();
+                for (UINT i = group.quadOffset; i < group.quadOffset + group.quadCount; ++i)
+                {
+                    const GroupQuad& quad = groupQuads[i];
+                    growBounds(local, quad.Q);
+                    growBounds(local, { quad.Q.x + quad.U.x, quad.Q.y + quad.U.y, quad.Q.z + quad.U.z });
+                    growBounds(local, { quad.Q.x + quad.V.x, quad.Q.y + quad.V.y, quad.Q.z + quad.V.z });
+                    growBounds(local, { quad.Q.x + quad.U.x + quad.V.x, quad.Q.y + quad.U.y + quad.V.y, quad.Q.z + quad.U.z + quad.V.z });
+                }
+            }
+            break;
+        default: // Spheres and volumes fill the unit cube.
+            break;
+        }
+
+        AABB world = emptyBounds();
+        for (UINT corner = 0; corner < 8; ++corner)
+        {
+            XMFLOAT3 p = { (corner & 1) ? local.max.x : local.min.x,
+                           (corner & 2) ? local.max.y : local.min.y,
+                           (corner & 4) ? local.max.z : local.min.z };
+            XMStoreFloat3(&p, XMVector3Transform(XMLoadFloat3(&p), instance.transform));
+            growBounds(world, p);
+        }
+        return world;
+    }
+
+    // Blur is translation only (see AnimateInstances), so the open bounds moved by the motion are the
+    // close bounds, and the two cover every time in between.
+    AABB instanceCloseBounds(const ProceduralInstance& instance, const AABB& openBounds)
+    {
+        const DirectX::XMFLOAT3& m = instance.motion;
+        return { { openBounds.min.x + m.x, openBounds.min.y + m.y, openBounds.min.z + m.z },
+                 { openBounds.max.x + m.x, openBounds.max.y + m.y, openBounds.max.z + m.z } };
+    }
+}
+
+AABB InstanceWorldBounds(const ProceduralInstance& instance)
+{
+    // Animated instances get bounds covering everything they pass through while the shutter is open.
+    AABB world = instanceOpenBounds(instance);
+    if (!instance.keyframes.empty())
+    {
+        growBounds(world, instanceCloseBounds(instance, world));
+    }
+    return world;
+}
+
+void BuildSceneBVH(SceneBVH& bvh)
+{
+    // Sized for the worst case, then trimmed. Shrinking keeps the capacity, so the next build of a
+    // scene this big doesn't allocate.
+    const size_t instanceCount = bvh.instanceBounds.size();
+    bvh.nodes.resize(instanceCount ? 2 * instanceCount - 1 : 0);
+    bvh.primitiveOrder.resize(instanceCount);
+    bvh.nodes.resize(BuildBVH(bvh.instanceBounds, bvh.nodes, bvh.primitiveOrder));
+
+    bvh.parents.assign(bvh.nodes.size(), 0);
+    bvh.instanceLeaves.assign(bvh.instanceBounds.size(), 0);
+    for (UINT i = 0; i < (UINT)bvh.nodes.size(); ++i)
+    {
+        const BVHNode& node = bvh.nodes[i];
+        if (node.primitiveCount == 0)
+        {
+            bvh.parents[node.leftOrFirst] = i;
+            bvh.parents[node.leftOrFirst + 1] = i;
+        }
+        else
+        {
+            for (UINT p = node.leftOrFirst; p < node.leftOrFirst + node.primitiveCount; ++p)
+            {
+                bvh.instanceLeaves[bvh.primitiveOrder[p]] = i;
+            }
+        }
+    }
+}
+
+void RefitSceneBVH(SceneBVH& bvh, const std::vector<UINT>& movedInstances)
+{
+    // Collect the leaves of moved instances and everything above them. Children are always stored
+    // after their parent, so going through the collected nodes from the highest index down refits
+    // every node after its children.
+    ArenaScope scratch(ScratchArena());
+    ArenaVector<UINT> refitNodes(ScratchArena());
+    ArenaVector<bool> marked(bvh.nodes.size(), false, ScratchArena());
+    for (UINT instance : movedInstances)
+    {
+        for (UINT node = bvh.instanceLeaves[instance]; !marked[node]; node = bvh.parents[node])
+        {
+            marked[node] = true;
+            refitNodes.push_back(node);
+        }
+    }
+
+    std::sort(refitNodes.begin(), refitNodes.end(), std::greater<UINT>());
+    for (UINT index : refitNodes)
+    {
+        BVHNode& node = bvh.nodes[index];
+        AABB bounds = emptyBounds();
+        if (node.primitiveCount == 0)
+        {
+            const BVHNode& left = bvh.nodes[node.leftOrFirst];
+            const BVHNode& right = bvh.nodes[node.leftOrFirst + 1];
+            growBounds(bounds, AABB{ left.boundsMin, left.boundsMax });
+            growBounds(bounds, AABB{ right.boundsMin, right.boundsMax });
+        }
+        else
+        {
+            for (UINT p = node.leftOrFirst; p < node.leftOrFirst + node.primitiveCount; ++p)
+            {
+                growBounds(bounds, bvh.instanceBounds[bvh.primitiveOrder[p]]);
+            }
+        }
+        node.boundsMin = bounds.min;
+        node.boundsMax = bounds.max;
+    }
+}
+
+void UpdateSceneBVH(bool topologyChanged)
+{
+    if (topologyChanged)
+    {
+        sceneBVH.instanceBounds.resize(proceduralInstances.size());
+        for (UINT i = 0; i < (UINT)proceduralInstances.size(); ++i)
+        {
+            sceneBVH.instanceBounds[i] = InstanceWorldBounds(proceduralInstances[i]);
+        }
+        BuildSceneBVH(sceneBVH);
+        return;
+    }
+
+    if (dirtyInstances.empty())
+    {
+        return;
+    }
+
+    for (UINT instance : dirtyInstances)
+    {
+        sceneBVH.instanceBounds[instance] = InstanceWorldBounds(proceduralInstances[instance]);
+    }
+
+    // Refitting keeps the old topology, which gets worse the more things moved. Once a big part
+    // of the scene moved, a rebuild is both better and not much slower.
+    if (dirtyInstances.size() * 4 > proceduralInstances.size())
+    {
+        BuildSceneBVH(sceneBVH);
+    }
+    else
+    {
+        RefitSceneBVH(sceneBVH, dirtyInstances);
+    }
+}
+
+void BuildMotionBVH(MotionBVH& bvh)
+{
+    // Topology comes from the swept bounds, which is what a ray with an unknown time could hit.
+    const size_t instanceCount = proceduralInstances.size();
+    ArenaScope scratch(ScratchArena());
+    ArenaVector<AABB> sweptBounds(instanceCount, ScratchArena());
+    for (UINT i = 0; i < (UINT)instanceCount; ++i)
+    {
+        sweptBounds[i] = InstanceWorldBounds(proceduralInstances[i]);
+    }
+
+    ArenaVector<BVHNode> nodes(instanceCount ? 2 * instanceCount - 1 : 0, ScratchArena());
+    bvh.primitiveOrder.resize(instanceCount);
+    nodes.resize(BuildBVH(sweptBounds, nodes, bvh.primitiveOrder));
+
+    bvh.nodes.resize(nodes.size());
+    for (UINT i = 0; i < (UINT)nodes.size(); ++i)
+    {
+        bvh.nodes[i].leftOrFirst = nodes[i].leftOrFirst;
+        bvh.nodes[i].primitiveCount = nodes[i].primitiveCount;
+    }
+
+    RefitMotionBVH(bvh);
+}
+
+void RefitMotionBVH(MotionBVH& bvh)
+{
+    // Every animation frame moves the shutter, but the topology built for the first frame is still
+    // good enough for the next ones. Just recompute bounds at both shutter ends, children first.
+    bvh.instanceBounds[0].resize(proceduralInstances.size());
+    bvh.instanceBounds[1].resize(proceduralInstances.size());
+    for (UINT i = 0; i < (UINT)proceduralInstances.size(); ++i)
+    {
+        bvh.instanceBounds[0][i] = instanceOpenBounds(proceduralInstances[i]);
+        bvh.instanceBounds[1][i] = instanceCloseBounds(proceduralInstances[i], bvh.instanceBounds[0][i]);
+    }
+
+    for (UINT index = (UINT)bvh.nodes.size(); index-- > 0;)
+    {
+        MotionBVHNode& node = bvh.nodes[index];
+        for (UINT end = 0; end < 2; ++end)
+        {
+            AABB bounds = emptyBounds();
+            if (node.primitiveCount == 0)
+            {
+                growBounds(bounds, bvh.nodes[node.leftOrFirst].bounds[end]);
+                growBounds(bounds, bvh.nodes[node.leftOrFirst + 1].bounds[end]);
+            }
+            else
+            {
+                for (UINT p = node.leftOrFirst; p < node.leftOrFirst + node.primitiveCount; ++p)
+                {
+                    growBounds(bounds, bvh.instanceBounds[end][bvh.primitiveOrder[p]]);
+                }
+            }
+            node.bounds[end] = bounds;
+        }
+    }
+}
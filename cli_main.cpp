@@ -0,0 +1,22 @@
+#include "core.h"
+
+// Entry point of the portable build, which has everything but the D3D12 frontend.
+int main(int argc, char** argv)
+{
+    if (int exitCode; RunCommandLine(argc, argv, exitCode))
+    {
+        return exitCode;
+    }
+
+    printf("Usage: %s\n"
+           "  --bench\n"
+           "  --animate <outputDir> [frameCount]\n"
+           "  --coordinator <port> <output.ppm> [scene] [width] [height] [spp]\n"
+           "  --worker <host> <port>\n"
+           "  --render-samples <scene> <firstSample> <sampleCount> <output.partial> [width] [height] [frameIndex]\n"
+           "  --merge <output> <partial>...\n"
+           "--spectral with --coordinator or --render-samples renders spectrally instead of in RGB.\n"
+           "--page-meshes <budgetMB> keeps at most that much of the meshes in memory while rendering. Each mesh\n"
+           "  is still loaded whole before it is paged out, so scenes must fit in memory to load.\n", argv[0]);
+    return 1;
+}
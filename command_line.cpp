@@ -0,0 +1,146 @@
+#include "core.h"
+#include <fstream>
+
+// Modes that don't need a window or the GPU. The D3D12 frontend runs them before opening its window,
+// cli_main.cpp is all there is to the portable build.
+
+bool RunCommandLine(int argc, char** argv, int& exitCode)
+{
+    // --spectral anywhere makes --coordinator and --render-samples render with hero wavelengths.
+    // --page-meshes <budgetMB> anywhere pages meshes out of memory after loading them, see mesh_paging.cpp.
+    bool spectral = false;
+    for (int i = 1; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "--spectral") == 0)
+        {
+            spectral = true;
+            std::copy(argv + i + 1, argv + argc, argv + i);
+            --argc;
+            --i;
+        }
+        else if (strcmp(argv[i], "--page-meshes") == 0 && i + 1 < argc)
+        {
+            pageMeshes = true;
+            SetMeshPageBudget((size_t)atoi(argv[i + 1]) << 20);
+            std::copy(argv + i + 2, argv + argc, argv + i);
+            argc -= 2;
+            --i;
+        }
+    }
+
+    if (argc > 1 && strcmp(argv[1], "--bench") == 0)
+    {
+        exitCode = RunBenchmarks();
+        return true;
+    }
+
+    if (argc > 2 && strcmp(argv[1], "--animate") == 0)
+    {
+        // Offline render of the bouncing spheres on the CPU, --animate <outputDir> [frameCount].
+        ThreadPool pool;
+        AnimationSettings settings = { .scene = 17,
+                                       .frameCount = (argc > 3) ? (UINT)atoi(argv[3]) : 120,
+                                       .frameTime = 1.0f / 30.0f,
+                                       .width = 640,
+                                       .height = 360,
+                                       .samplesPerPixel = 16,
+                                       .outputDir = argv[2],
+                                       .pipelined = true };
+        RenderAnimation(settings, pool);
+        exitCode = 0;
+        return true;
+    }
+
+    if (argc > 3 && strcmp(argv[1], "--coordinator") == 0)
+    {
+        // Distributed still, --coordinator <port> <output.ppm> [scene] [width] [height] [spp].
+        DistributedSettings settings = { .scene = (argc > 4) ? (UINT)atoi(argv[4]) : 15,
+                                         .width = (argc > 5) ? (UINT)atoi(argv[5]) : 1920,
+                                         .height = (argc > 6) ? (UINT)atoi(argv[6]) : 1080,
+                                         .samplesPerPixel = (argc > 7) ? (UINT)atoi(argv[7]) : 64,
+                                         .frameIndex = 0,
+                                         .tileSize = 64,
+                                         .port = argv[2],
+                                         .output = argv[3],
+                                         .spectral = spectral };
+        RenderDistributed(settings);
+        exitCode = 0;
+        return true;
+    }
+
+    if (argc > 5 && strcmp(argv[1], "--render-samples") == 0)
+    {
+        // One sample range of a still, --render-samples <scene> <firstSample> <sampleCount> <output.partial>
+        // [width] [height] [frameIndex]. Partials of the same scene and frame merge with --merge. The pool
+        // is pinned per NUMA node, which is nothing more than one node with every CPU on most machines.
+        ThreadPool pool(0, NumaNodeCpus());
+        SetupScene((UINT)atoi(argv[2]));
+        cameraData.frameIndex = (argc > 8) ? (UINT)atoi(argv[8]) : 0;
+        cameraData.spectral = spectral;
+        AnimateInstances(cameraData.shutterOpen, cameraData.shutterClose);
+        MotionBVH bvh;
+        BuildMotionBVH(bvh);
+        ReferenceFrame frame;
+        CaptureReferenceFrame(frame, bvh);
+        PartialImage partial = RenderPartialImage(frame, (argc > 6) ? (UINT)atoi(argv[6]) : 1920, (argc > 7) ? (UINT)atoi(argv[7]) : 1080,
+            (UINT)atoi(argv[3]), (UINT)atoi(argv[4]), &pool);
+        WritePartialImage(argv[5], partial);
+        if (!textureList.empty())
+        {
+            TextureCacheStats stats = GetTextureCacheStats();
+            printf("Texture cache: %.2f%% of %llu tile lookups hit, %llu tiles read, %llu evicted, %.1f MB peak of %.1f MB budget\n",
+                100.0 * stats.hits / std::max<UINT64>(stats.lookups, 1), stats.lookups, stats.misses, stats.evictions,
+                stats.peakBytes / 1048576.0, stats.budgetBytes / 1048576.0);
+        }
+        if (pageMeshes && !meshList.empty())
+        {
+            MeshPagingStats stats = GetMeshPagingStats();
+            printf("Mesh pages: %.2f%% of %llu treelet lookups hit, %llu page faults (%.1f MB read), %llu evicted, %.1f MB peak of %.1f MB budget\n",
+                100.0 * stats.hits / std::max<UINT64>(stats.lookups, 1), stats.lookups, stats.faults, stats.bytesRead / 1048576.0,
+                stats.evictions, stats.peakBytes / 1048576.0, stats.budgetBytes / 1048576.0);
+        }
+        exitCode = 0;
+        return true;
+    }
+
+    if (argc > 3 && strcmp(argv[1], "--merge") == 0)
+    {
+        // --merge <output> <partial>..., the output is a PPM if it ends in .ppm, another partial otherwise.
+        PartialImage merged = {};
+        for (int i = 3; i < argc; ++i)
+        {
+            MergePartialImage(merged, ReadPartialImage(argv[i]));
+        }
+        printf("Merged %d partial images, %llu samples per pixel\n", argc - 3, PartialImageSampleCount(merged));
+
+        std::string output = argv[2];
+        if (output.ends_with(".ppm"))
+        {
+            std::vector<UINT8> encoded = EncodePPM(merged.width, merged.height, ResolvePartialImage(merged));
+            std::ofstream file(output, std::ios::binary);
+            file.write(reinterpret_cast<const char*>(encoded.data()), encoded.size());
+            if (!file)
+            {
+                throw std::runtime_error("Can't write " + output);
+            }
+        }
+        else
+        {
+            WritePartialImage(output.c_str(), merged);
+        }
+        exitCode = 0;
+        return true;
+    }
+
+    if (argc > 3 && strcmp(argv[1], "--worker") == 0)
+    {
+        // --worker <host> <port>, any number of them can join a coordinator. Pinned like --render-samples.
+        ThreadPool pool(0, NumaNodeCpus());
+        exitCode = RunRenderWorker(argv[2], argv[3], pool);
+        return true;
+    }
+
+    // Whatever runs next renders on the GPU, which needs its meshes whole.
+    pageMeshes = false;
+    return false;
+}
@@ -0,0 +1,771 @@
+#pragma once
+
+// Everything but the D3D12 frontend: the scene description, the CPU reference renderer and the tools
+// around it. Builds with MSVC, GCC and Clang, program.h adds the Windows and D3D12 parts on top.
+
+#include <algorithm>
+#include <vector>
+#include <deque>
+#include <map>
+#include <stdexcept>
+#include <cmath>
+#include <cfloat>
+#include <cstddef>
+#include <climits>
+#include <numbers>
+#include <chrono>
+#include <string>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+#include <cstdlib>
+#include <span>
+
+#if defined(_WIN32) && !defined(RT_PORTABLE_MATH)
+#include <DirectXMath.h>
+constexpr const char* MATH_LIBRARY = "DirectXMath";
+#else
+#include "vector_math.h"
+namespace DirectX = rtmath;
+constexpr const char* MATH_LIBRARY = rtmath::XM_IMPLEMENTATION;
+#endif
+
+#include "arena.h"
+
+// Same types as Windows has, so struct layouts and printf formats don't depend on the platform.
+typedef unsigned char UINT8;
+typedef unsigned short UINT16;
+typedef unsigned int UINT;
+typedef unsigned int UINT32;
+typedef long long INT64;
+typedef unsigned long long UINT64;
+
+enum OBJECT_TYPE {
+    OBJECT_TYPE_SPHERE = 0,
+    OBJECT_TYPE_QUAD = 1,
+    OBJECT_TYPE_VOLUMETRIC_CUBE = 2,
+    OBJECT_TYPE_TRIANGLE_MESH = 3,
+    OBJECT_TYPE_QUAD_GROUP = 4,
+    OBJECT_TYPE_MOVING_SPHERE = 5,
+    OBJECT_TYPE_COUNT
+};
+
+// Transform of an animated instance at a given scene time. Transforms in between are interpolated linearly.
+// Keyframes may rotate and scale too, but motion blur only follows the translation, see AnimateInstances.
+struct InstanceKeyframe
+{
+    float time;
+    DirectX::XMMATRIX transform;
+};
+
+struct ProceduralInstance
+{
+    DirectX::XMMATRIX transform;
+    UINT instanceID;
+    UINT hitGroupIndex;
+    OBJECT_TYPE type;
+    UINT prototypeIndex; // Mesh or quad group index for OBJECT_TYPE_TRIANGLE_MESH and OBJECT_TYPE_QUAD_GROUP,
+                         // motion BLAS index for OBJECT_TYPE_MOVING_SPHERE, density grid index (or
+                         // NO_DENSITY_GRID) for OBJECT_TYPE_VOLUMETRIC_CUBE.
+    bool dirty;          // Moved since the last TLAS/scene BVH update.
+
+    // Animated instances only. Keyframes are sorted by time, transform is the one at shutter open
+    // and motion is how far the instance moves (in world space) until the shutter closes. Rotation
+    // and scale stay as they are at shutter open for the whole exposure.
+    ArenaVector<InstanceKeyframe> keyframes; // On the arena of its scene.
+    DirectX::XMFLOAT3 motion;
+};
+
+enum MATERIAL_TYPE {
+    MATERIAL_TYPE_LAMBERTIAN = 0,
+    MATERIAL_TYPE_METAL = 1,
+    MATERIAL_TYPE_DIELECTRIC = 2,
+    MATERIAL_TYPE_DIFFUSE_LIGHT = 3,
+    MATERIAL_TYPE_SMOKE = 4,
+    MATERIAL_TYPE_COUNT
+};
+
+// What kind of scattering a bounce was, every kind has its own limit per path. Same as in the shaders.
+enum BOUNCE_TYPE {
+    BOUNCE_TYPE_DIFFUSE = 0,      // Lambertian.
+    BOUNCE_TYPE_SPECULAR = 1,     // Metal.
+    BOUNCE_TYPE_TRANSMISSION = 2, // Dielectric, whether it reflected or refracted.
+    BOUNCE_TYPE_VOLUME = 3,       // Smoke.
+    BOUNCE_TYPE_COUNT
+};
+
+// Where a Lambertian material takes its color from, see textures.cpp. Same as in the shaders.
+enum TEXTURE_TYPE {
+    TEXTURE_TYPE_NONE = 0,  // Albedo.
+    TEXTURE_TYPE_IMAGE = 1, // Image from textureList, albedo is its average color which is all the GPU path shows.
+    TEXTURE_TYPE_NOISE = 2, // Perlin marble from the book, textureScale is the noise frequency.
+};
+
+#pragma pack(4)
+struct MaterialData
+{
+    DirectX::XMFLOAT3 albedo;
+    float fuzz;
+    float refractionIndex;
+    float density;
+    MATERIAL_TYPE type;
+    TEXTURE_TYPE textureType;
+    UINT textureIndex;
+    float textureScale;
+    // Dielectrics only, 0 for none. Spreads the index of refraction over wavelengths like glass with
+    // this Abbe number would, refractionIndex is the one at 587.6 nm. Only spectral CPU renders show it.
+    float abbeNumber;
+};
+
+// Per instance data, kept small as it's fetched on every hit. Materials are shared through the
+// material table and light geometry lives in its own array, as only light sampling needs it.
+struct ObjectData
+{
+    UINT16 materialIndex; // Scenes have way less than 64K distinct materials.
+    UINT16 type;          // OBJECT_TYPE, shaders read both as a single uint.
+
+    // Triangle mesh: offset into the shared mesh index buffer. Quad group: offset into the group quad buffer.
+    UINT geometryOffset;
+    // Triangle mesh only, offset into the shared mesh vertex buffer.
+    UINT vertexOffset;
+};
+
+// Geometry of the lights we sample directly, quads and spheres only.
+enum LIGHT_FLAG {
+    LIGHT_FLAG_ONE_SIDED = 1, // Emits from its front face only, which looks against the normal.
+    LIGHT_FLAG_BOX_FACE = 2,  // Face of a closed box, only seen from outside, where the normal points.
+};
+
+// Light sampling leaves out the lights LightMayReach rules out only in scenes with MIN_CULLED_LIGHTS to
+// MAX_CULLED_LIGHTS of them. With fewer, the pass of bounds tests costs more than the exact tests it saves
+// (see benchmarkLightCulling). With more, they don't fit the bit per light the shaders keep, see
+// ReachableLights in shaders_helpers.hlsli. Either way every light is sampled.
+constexpr UINT MIN_CULLED_LIGHTS = 4;
+constexpr UINT MAX_CULLED_LIGHTS = 32;
+
+struct LightData
+{
+    DirectX::XMFLOAT3 Q; // Quad corner or sphere center.
+    OBJECT_TYPE type;
+    DirectX::XMFLOAT3 U;
+    float radius;        // Sphere only.
+    DirectX::XMFLOAT3 V;
+    UINT flags;          // LIGHT_FLAG.
+    // Derived from the above when the light is added, so light sampling can skip lights that can't
+    // reach a point with a bounds test, see LightMayReach, and the exact test doesn't redo the rest.
+    DirectX::XMFLOAT3 boundsCenter; // Sphere around the whole light.
+    float boundsRadius;
+    DirectX::XMFLOAT3 normal;       // Quad only, unit length along U x V.
+    float area;                     // Quad only.
+};
+
+// Quad of a quad group, in the group's object space. Same Q/U/V convention as addQuad.
+struct GroupQuad
+{
+    DirectX::XMFLOAT3 Q;
+    DirectX::XMFLOAT3 U;
+    DirectX::XMFLOAT3 V;
+};
+
+struct CameraData
+{
+    DirectX::XMFLOAT3 lookfrom;
+    float padding1;
+    DirectX::XMFLOAT3 lookat;
+    float padding2;
+    DirectX::XMFLOAT3 backgroundColor;
+    float vfov;
+    float focusDist;
+    float defocusAngle;
+    UINT frameIndex;
+    UINT samplesPerPixel;
+    UINT doStratify;
+    UINT numLights;
+    float shutterOpen;  // Scene time at which the shutter opens and closes, every ray
+    float shutterClose; // gets a random time in between.
+    DirectX::XMFLOAT3 previousLookfrom; // Camera of the previous frame, the history was rendered with it.
+    UINT temporalReuse;                 // 0 when there is no usable history, see reprojection.cpp.
+    DirectX::XMFLOAT3 previousLookat;
+    float padding3;
+    // Bounces of each BOUNCE_TYPE a path may take, the one past the limit ends it without light.
+    UINT maxBounces[BOUNCE_TYPE_COUNT] = { 256, 256, 256, 256 };
+    UINT spectral; // CPU reference renderer only, hero wavelength sampling instead of RGB.
+};
+#pragma pack()
+
+// These are read as StructuredBuffers, so they have to match shaders_helpers.hlsli member by member. The layout
+// tests check every member against the HLSL, these catch C++ changes in any build.
+static_assert(sizeof(MaterialData) == 44 && offsetof(MaterialData, type) == 24 && offsetof(MaterialData, abbeNumber) == 40);
+static_assert(sizeof(ObjectData) == 12 && offsetof(ObjectData, type) == 2 && offsetof(ObjectData, vertexOffset) == 8);
+static_assert(sizeof(LightData) == 80 && offsetof(LightData, type) == 12 && offsetof(LightData, radius) == 28 && offsetof(LightData, V) == 32 &&
+              offsetof(LightData, boundsRadius) == 60 && offsetof(LightData, area) == 76);
+static_assert(sizeof(GroupQuad) == 36);
+// And this one is a constant buffer, where a float3 can't straddle a 16 byte boundary.
+static_assert(offsetof(CameraData, lookat) == 16 && offsetof(CameraData, backgroundColor) == 32 && offsetof(CameraData, shutterOpen) == 72 &&
+              offsetof(CameraData, spectral) == 128);
+
+struct AABB
+{
+    DirectX::XMFLOAT3 min;
+    DirectX::XMFLOAT3 max;
+};
+
+// Flattened BVH node. Interior nodes have primitiveCount == 0 and their children
+// stored next to each other at leftOrFirst and leftOrFirst + 1. Leaves reference
+// primitiveCount primitives starting at leftOrFirst.
+struct BVHNode
+{
+    DirectX::XMFLOAT3 boundsMin;
+    UINT leftOrFirst;
+    DirectX::XMFLOAT3 boundsMax;
+    UINT primitiveCount;
+};
+
+// BuildBVH never puts a node deeper than this below the root. Traversal leaves at most one sibling per
+// level on its stack, so BVH_STACK_SIZE entries always do.
+constexpr UINT BVH_MAX_DEPTH = 48;
+constexpr UINT BVH_STACK_SIZE = BVH_MAX_DEPTH + 1;
+
+// Subtree of a paged mesh's BVH, stored in the mesh's page file with its triangles, see mesh_paging.cpp.
+struct MeshTreelet
+{
+    UINT64 offset; // Of its nodes in the page file, three vertices per triangle follow them.
+    UINT nodeCount;
+    UINT triangleCount;
+};
+
+struct MeshPageFile; // The mapped page file, see mesh_paging.cpp.
+
+struct MeshData
+{
+    // Ranges in meshVertices/meshIndices. Indices are relative to vertexOffset.
+    UINT vertexOffset;
+    UINT vertexCount;
+    UINT indexOffset;
+    UINT indexCount;
+
+    AABB bounds;
+
+    // CPU side BVH over the mesh triangles. Triangles are stored in BVH leaf order,
+    // so leaves reference contiguous triangle ranges.
+    std::vector<BVHNode> bvh;
+
+    // Paged meshes only, see PageOutMesh. Their bvh is just the top of the tree, its leaves hold a
+    // treelet index in leftOrFirst, and their triangles are in the page file instead of meshVertices
+    // and meshIndices (the counts stay, the ranges are gone). CPU renderer only.
+    std::string pagePath;
+    std::vector<MeshTreelet> treelets;
+    std::shared_ptr<const MeshPageFile> pageFile;
+};
+
+// A treelet as the CPU renderer gets it from the page cache. Its nodes index its own triangles.
+struct MeshTreeletPage
+{
+    std::vector<BVHNode> nodes;
+    std::vector<DirectX::XMFLOAT3> vertices; // Three per triangle, in leaf order.
+
+    size_t bytes() const { return sizeof(MeshTreeletPage) + nodes.size() * sizeof(BVHNode) + vertices.size() * sizeof(DirectX::XMFLOAT3); }
+};
+
+// Treelets are cut as big as possible without going over this many triangles.
+constexpr UINT MESH_TREELET_TRIANGLES = 4096;
+constexpr size_t MESH_PAGE_CACHE_DEFAULT_BUDGET = 256ull << 20;
+
+struct MeshPagingStats
+{
+    UINT64 lookups;
+    UINT64 hits;
+    UINT64 faults;     // Treelets read from a page file.
+    UINT64 evictions;
+    UINT64 bytesRead;
+    // TraceMeshRays only: rays put off until their treelet was read, and the queues they waited in.
+    UINT64 queuedRays;
+    UINT64 queues;
+    UINT64 maxQueueLength;
+    size_t bytes;
+    size_t peakBytes;
+    size_t budgetBytes;
+};
+
+// Ray in the object space of a mesh, for TraceMeshRays. Misses keep t at FLT_MAX.
+struct MeshRay
+{
+    DirectX::XMFLOAT3 origin;
+    DirectX::XMFLOAT3 direction;
+};
+
+struct MeshRayHit
+{
+    float t;
+    DirectX::XMFLOAT3 normal; // Geometric, not normalized.
+};
+
+// Image texture, only its header and average color are kept around. Texels are read through the
+// texture cache, a tile at a time, see textures.cpp.
+struct TextureData
+{
+    std::string path;    // Binary PPM.
+    std::string mipPath; // Levels 1 and up, written when the texture is loaded.
+    UINT width;
+    UINT height;
+    UINT mipLevels;
+    UINT64 dataOffset; // Where the texels start in the file.
+    DirectX::XMFLOAT3 average;
+};
+
+constexpr UINT TEXTURE_TILE_SIZE = 32;
+constexpr size_t TEXTURE_CACHE_DEFAULT_BUDGET = 256ull << 20;
+
+struct TextureCacheStats
+{
+    UINT64 lookups;
+    UINT64 hits;
+    UINT64 misses; // Tiles read from the file or filtered from the level below.
+    UINT64 evictions;
+    size_t bytes;
+    size_t peakBytes;
+    size_t budgetBytes;
+};
+
+// Density of a smoke volumetric cube that varies over its object space [-1, 1]^3, see volume_grid.cpp.
+// Voxels are relative to the mean, the material density is the mean density of the whole volume.
+struct DensityGrid
+{
+    UINT resolution[3];
+    std::vector<float> density;       // Constant within a voxel, x fastest, then y, then z.
+    float meanDensity;
+
+    // Highest density in every block of majorantBlock^3 voxels, blocks of zeros are skipped entirely.
+    UINT majorantBlock;
+    UINT majorantResolution[3];
+    std::vector<float> majorants;
+};
+
+constexpr UINT NO_DENSITY_GRID = UINT_MAX;
+constexpr UINT MAJORANT_BLOCK = 8;
+
+// What tracking through a density grid did, to compare the methods.
+struct VolumeTrackingStats
+{
+    UINT64 densityLookups;
+    UINT64 majorantCells; // Cells of the majorant grid visited, or steps of a fixed step march.
+};
+
+// BVH over world space instance bounds, with the bookkeeping needed to refit just the parts
+// above moved instances.
+struct SceneBVH
+{
+    std::vector<AABB> instanceBounds;
+    std::vector<BVHNode> nodes;
+    std::vector<UINT> primitiveOrder;
+    std::vector<UINT> parents;        // Parent of every node, the root is its own parent.
+    std::vector<UINT> instanceLeaves; // Leaf node holding every instance.
+};
+
+// BVH node with bounds at shutter open and shutter close. Instances move linearly in between,
+// so interpolating the two gives valid bounds at any ray time.
+struct MotionBVHNode
+{
+    AABB bounds[2];
+    UINT leftOrFirst;
+    UINT primitiveCount;
+};
+
+// CPU side BVH for motion blurred rendering. The topology is built over bounds swept across
+// the shutter and then just refitted as the animation plays.
+struct MotionBVH
+{
+    std::vector<AABB> instanceBounds[2];
+    std::vector<MotionBVHNode> nodes;
+    std::vector<UINT> primitiveOrder;
+};
+
+// Which structure the CPU renderer finds instances with, see uniform_grid.cpp.
+enum SPATIAL_INDEX {
+    SPATIAL_INDEX_AUTO = 0, // Grid if the instances fill it evenly enough, BVH otherwise.
+    SPATIAL_INDEX_BVH = 1,
+    SPATIAL_INDEX_GRID = 2,
+};
+
+// Uniform grid over the swept bounds of instances, for dense fields of similar sized ones. Cells
+// list the instances overlapping them, instances much bigger than typical and media are tested by
+// every ray instead.
+struct UniformGrid
+{
+    AABB bounds;
+    UINT resolution[3];
+    DirectX::XMFLOAT3 cellSize;
+    std::vector<UINT> cellStart;     // Per cell, where its instances start in cellInstances. One more at the end.
+    std::vector<UINT> cellInstances;
+    std::vector<UINT> unbinned;
+
+    // For picking between the grid and the BVH.
+    UINT binnedInstances;
+    UINT occupiedCells;
+    UINT maxCellInstances;
+};
+
+// Everything the reference renderer needs from one animation frame. Frames get traced from their
+// own copy, so the next frame can already be animated meanwhile.
+struct ReferenceFrame
+{
+    CameraData camera;
+    std::vector<DirectX::XMMATRIX> transforms;
+    std::vector<DirectX::XMFLOAT3> motion;
+    MotionBVH bvh;
+    SPATIAL_INDEX spatialIndex; // Never SPATIAL_INDEX_AUTO, that's resolved when the frame is captured.
+    UniformGrid grid;           // Empty unless spatialIndex is SPATIAL_INDEX_GRID.
+};
+
+struct AnimationSettings
+{
+    UINT scene;
+    UINT frameCount;
+    float frameTime;         // Seconds between frames, the shutter stays open for half of it.
+    UINT width;
+    UINT height;
+    UINT samplesPerPixel;
+    const char* outputDir;   // Frames are written there as PPMs, nullptr just encodes them in memory.
+    bool pipelined;          // Off runs update, trace and encode one after another, like Render() does.
+};
+
+enum ANIMATION_STAGE {
+    ANIMATION_STAGE_UPDATE = 0,
+    ANIMATION_STAGE_TRACE = 1,
+    ANIMATION_STAGE_ENCODE = 2,
+    ANIMATION_STAGE_COUNT
+};
+
+struct AnimationStats
+{
+    double totalMilliseconds;
+    double busyMilliseconds[ANIMATION_STAGE_COUNT]; // Time every stage spent working, the rest it waited on its queues.
+};
+
+struct ImageRect
+{
+    UINT x;
+    UINT y;
+    UINT width;
+    UINT height;
+};
+
+// Same generator as the shaders.
+inline UINT SetupSeed(UINT val0, UINT val1, UINT backoff = 16)
+{
+    UINT v0 = val0, v1 = val1, s0 = 0;
+    for (UINT n = 0; n < backoff; n++)
+    {
+        s0 += 0x9e3779b9;
+        v0 += ((v1 << 4) + 0xa341316c) ^ (v1 + s0) ^ ((v1 >> 5) + 0xc8013ea4);
+        v1 += ((v0 << 4) + 0xad90777d) ^ (v0 + s0) ^ ((v0 >> 5) + 0x7e95761e);
+    }
+    return v0;
+}
+
+inline float RandomFloat(UINT& seed, float minValue = 0.0f, float maxValue = 1.0f)
+{
+    seed = 1664525 * seed + 1013904223;
+    float random = float(seed & 0x00FFFFFF) / float(0x01000000);
+    return minValue + (maxValue - minValue) * random;
+}
+
+// Sample sums are kept in 32.32 fixed point. Unlike floats, they add up to the same bits whatever
+// order the samples come in, so renders split into sample ranges merge into exactly the full render.
+constexpr double SAMPLE_FIXED_POINT_ONE = 4294967296.0;
+
+inline INT64 ToSampleFixedPoint(float value)
+{
+    // NaNs from degenerate paths are dropped rather than poisoning the whole sum.
+    return std::isfinite(value) ? std::llround(std::clamp(value, -1e6f, 1e6f) * SAMPLE_FIXED_POINT_ONE) : 0;
+}
+
+inline float FromSampleFixedPoint(INT64 sum, UINT64 sampleCount)
+{
+    return (float)(sum / (SAMPLE_FIXED_POINT_ONE * sampleCount));
+}
+
+// Unnormalized sum of some sample ranges of every pixel, see partial_image.cpp.
+struct PartialImage
+{
+    UINT width;
+    UINT height;
+    UINT frameIndex;
+    UINT64 sceneHash;                            // Partials of different scenes or cameras don't merge.
+    std::vector<std::pair<UINT, UINT>> sampleRanges; // First sample and count, sorted, never overlapping.
+    std::vector<INT64> sums;                     // Three fixed point channels per pixel.
+};
+
+// Still rendered by worker processes, see distributed.cpp. The coordinator listens on port, workers
+// connect to it, get the scene and render tiles until the image is done.
+struct DistributedSettings
+{
+    UINT scene;
+    UINT width;
+    UINT height;
+    UINT samplesPerPixel;
+    UINT frameIndex;       // Seeds every pixel's generator, the same value gives the same image.
+    UINT tileSize;
+    const char* port;
+    const char* output;    // PPM, nullptr just returns the image.
+    bool spectral;         // See CameraData::spectral.
+};
+
+// Where the paths of a reference render ended up, to see what the bounce limits cut off and what
+// they cost.
+struct PathStats
+{
+    UINT64 paths;
+    UINT64 bounces[BOUNCE_TYPE_COUNT];   // Bounces of each type over all paths.
+    UINT64 truncated[BOUNCE_TYPE_COUNT]; // Paths ended by that type's limit.
+    UINT64 lengths[12];                  // Paths by bounce count, bucket i > 0 holds [2^(i-1), 2^i), the last one everything longer.
+};
+
+// Features the CPU path tracing kernel is compiled for. Every combination has a kernel of its own, and
+// a render runs the one with just what its camera and scene use, see ReferenceKernelFeatures.
+enum REFERENCE_KERNEL_FEATURE {
+    REFERENCE_KERNEL_DEFOCUS = 1 << 0,  // Thin lens, defocusAngle > 0.
+    REFERENCE_KERNEL_MOTION = 1 << 1,   // Ray times over an open shutter.
+    REFERENCE_KERNEL_SPECTRAL = 1 << 2, // Hero wavelengths, CameraData::spectral.
+    REFERENCE_KERNEL_TEXTURES = 1 << 3, // Image or noise textured materials.
+    REFERENCE_KERNEL_ALL = (1 << 4) - 1 // The generic kernel, which checks all of them per sample.
+};
+
+// Limits of reusing the previous frame's first hits and radiance, see reprojection.cpp. The shaders
+// have their own copies.
+constexpr float HISTORY_POSITION_TOLERANCE = 0.01f; // Relative to the distance from the camera.
+constexpr float HISTORY_NORMAL_TOLERANCE = 0.9f;    // Cosine between the normals.
+constexpr UINT HISTORY_MAX_SAMPLES = 256;
+
+// CPUs of every NUMA node the process may run on, see thread_pool.cpp. A single node with all of them
+// where there's no NUMA or it can't be found out.
+std::vector<std::vector<UINT>> NumaNodeCpus();
+
+// Fixed set of worker threads. ParallelFor is the only thing the renderer needs, Submit is there
+// for everything else that just has to run somewhere.
+class ThreadPool
+{
+public:
+    explicit ThreadPool(UINT threadCount = 0); // Zero means one thread per hardware thread.
+    // Threads spread evenly over the nodes, each pinned to the CPUs of its node. Zero threads means one
+    // per CPU of the nodes.
+    ThreadPool(UINT threadCount, const std::vector<std::vector<UINT>>& nodeCpus);
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    void Submit(std::function<void()> task);
+    // Runs task on one of the threads of node.
+    void SubmitToNode(UINT node, std::function<void()> task);
+    // Runs func(0) .. func(count - 1) on the pool and the calling thread, returns once all of them finished.
+    // This and the other calls that wait for the pool throw std::logic_error on the pool's own threads.
+    void ParallelFor(UINT count, const std::function<void(UINT)>& func);
+    // Like ParallelFor, but every node gets a contiguous share of [0, count) that its threads work through
+    // before helping out the others, and func(index, node) is told which node runs it. The calling thread
+    // counts as one of the node it runs on, node 0 when that isn't one of the pinned ones.
+    void ParallelForNodes(UINT count, const std::function<void(UINT, UINT)>& func);
+    // Runs func(node) once on a thread of every node and waits for all of them, so whatever func allocates
+    // and fills in is first touched, and so placed, on that node.
+    void RunOnEachNode(const std::function<void(UINT)>& func);
+    UINT ThreadCount() const { return (UINT)threads.size(); }
+    UINT NodeCount() const { return (UINT)nodeTasks.size(); }
+
+private:
+    void start(UINT threadCount, const std::vector<std::vector<UINT>>& nodeCpus, bool pinned);
+    void checkNotWorker() const;
+    UINT callerNode() const;
+    void WorkerLoop(UINT node);
+
+    std::vector<std::thread> threads;
+    std::vector<UINT> nodeThreadCounts;
+    std::vector<std::vector<UINT>> pinnedCpus; // CPUs of every node, empty unless the threads are pinned.
+    std::deque<std::function<void()>> tasks;
+    std::vector<std::deque<std::function<void()>>> nodeTasks; // Only for the threads of their node.
+    std::mutex mutex;
+    std::condition_variable taskAvailable;
+    bool stopping = false;
+};
+
+// Prototype made of several quads (like a box) that gets a single BLAS and is then
+// instanced as a whole, instead of spending a TLAS instance and ObjectData per quad.
+struct QuadGroupData
+{
+    UINT quadOffset;
+    UINT quadCount;
+};
+
+// Everything BuildScene makes for a scene. The globals below are the current scene, a SceneState
+// is where the next one gets built meanwhile (on another thread if need be), SwapSceneState then
+// trades the two. The scene BVH isn't here, it's derived from the instances after the swap.
+struct SceneState
+{
+    std::vector<ProceduralInstance> proceduralInstances;
+    std::vector<UINT> dirtyInstances;
+    std::vector<UINT> animatedInstances;
+    std::vector<ObjectData> objectList;
+    std::vector<LightData> lightsList;
+    std::vector<MaterialData> materialList;
+    std::vector<MeshData> meshList;
+    std::vector<DirectX::XMFLOAT3> meshVertices;
+    std::vector<UINT> meshIndices;
+    std::vector<QuadGroupData> groupList;
+    std::vector<GroupQuad> groupQuads;
+    std::vector<DensityGrid> gridList;
+    std::vector<TextureData> textureList;
+    CameraData camera = {};
+    bool autoAdaptSamplesCount = false;
+    SPATIAL_INDEX spatialIndex = SPATIAL_INDEX_AUTO;
+    // Keyframes and the material registry live here, a pointer so it can change hands with the rest.
+    std::unique_ptr<Arena> arena = std::make_unique<Arena>();
+};
+
+inline CameraData cameraData;
+
+inline bool autoAdaptSamplesCount = false;
+
+inline SPATIAL_INDEX sceneSpatialIndex = SPATIAL_INDEX_AUTO;
+
+// On, reference renders pick the kernel specialized on the frame's features. Both give the same images;
+// the specialized ones measure 1-10% slower in benchmarkKernelSpecialization, so they stay off.
+inline bool specializedReferenceKernels = false;
+
+// On pools spread over several NUMA nodes, every node renders reference frames from a copy of its own,
+// see ReplicateReferenceFrame. Off, all of them read the caller's. Both give the same images.
+inline bool replicateFramePerNode = true;
+
+// On, LoadMesh pages every mesh out to a file right after building its BVH, see mesh_paging.cpp. Each
+// mesh is still loaded whole first, so this doesn't make scenes larger than memory render. The D3D12
+// frontend needs its meshes whole, so only the command line turns this on.
+inline bool pageMeshes = false;
+
+// Heap allocations made so far, where the program counts them (raytracer_bench, see bench_main.cpp).
+// Null everywhere else.
+inline const std::atomic<UINT64>* heapAllocationCounter = nullptr;
+
+// Whatever lives exactly as long as the current scene, released all at once when it's replaced.
+inline std::unique_ptr<Arena> sceneArena = std::make_unique<Arena>();
+
+inline std::vector<ProceduralInstance> proceduralInstances;
+inline std::vector<UINT> dirtyInstances; // Instances moved since the last update, see MoveInstance.
+inline std::vector<UINT> animatedInstances; // Instances with keyframes.
+inline SceneBVH sceneBVH;
+inline std::vector<ObjectData> objectList;
+inline std::vector<LightData> lightsList;
+inline std::vector<MaterialData> materialList;
+
+inline std::vector<MeshData> meshList;
+inline std::vector<DirectX::XMFLOAT3> meshVertices;
+inline std::vector<UINT> meshIndices;
+
+inline std::vector<QuadGroupData> groupList;
+inline std::vector<GroupQuad> groupQuads;
+
+inline std::vector<DensityGrid> gridList;
+
+inline std::vector<TextureData> textureList;
+
+constexpr UINT SCENE_COUNT = 20;
+
+inline UINT getNumInstances()
+{
+    return (UINT)proceduralInstances.size();
+}
+
+// Size of a D3D12_RAYTRACING_INSTANCE_DESC, for the scene stats. program.h checks it.
+constexpr size_t INSTANCE_DESC_BYTES = 64;
+
+UINT NextScene();
+void SetupNextScene();
+void SetupScene(UINT scene);
+void BuildScene(UINT scene, SceneState& into);
+void SwapSceneState(SceneState& scene);
+UINT LoadMesh(const std::string& path, SceneState& scene);
+DensityGrid LoadDensityGrid(const std::string& path);
+void WriteDensityGrid(const std::string& path, const DensityGrid& grid, bool compressed);
+void BuildMajorantGrid(DensityGrid& grid, UINT block = MAJORANT_BLOCK);
+DensityGrid MakeCloudGrid(UINT resolution, UINT blobs, UINT seed);
+UINT LoadTexture(const std::string& path, std::vector<TextureData>& textures = textureList);
+DirectX::XMFLOAT3 SampleTexture(UINT texture, float u, float v, float footprint);
+float Turbulence(DirectX::XMFLOAT3 p, UINT depth = 7);
+DirectX::XMFLOAT3 NoiseTextureColor(DirectX::XMFLOAT3 p, float scale);
+void SetTextureCacheBudget(size_t bytes);
+void ClearTextureCache();
+void ClearTextures(std::vector<TextureData>& textures = textureList);
+TextureCacheStats GetTextureCacheStats();
+void PageOutMesh(MeshData& mesh, SceneState& scene);
+std::span<const UINT8> MeshPageData(const MeshData& mesh);
+void StoreMeshPages(MeshData& mesh, std::span<const UINT8> pages);
+std::shared_ptr<const MeshTreeletPage> GetMeshTreelet(UINT mesh, UINT treelet);
+std::shared_ptr<const MeshTreeletPage> FindMeshTreelet(UINT mesh, UINT treelet);
+void RecordMeshRayQueues(UINT64 queuedRays, UINT64 queues, UINT64 maxQueueLength);
+void SetMeshPageBudget(size_t bytes);
+void ClearMeshPageCache();
+MeshPagingStats GetMeshPagingStats();
+bool SampleGridScattering(const DensityGrid& grid, float density, DirectX::FXMVECTOR origin, DirectX::FXMVECTOR direction,
+    float tEnter, float tExit, UINT& seed, float& t, VolumeTrackingStats* stats = nullptr);
+float EstimateGridTransmittance(const DensityGrid& grid, float density, DirectX::FXMVECTOR origin, DirectX::FXMVECTOR direction,
+    float tEnter, float tExit, UINT& seed, VolumeTrackingStats* stats = nullptr);
+bool MarchGridScattering(const DensityGrid& grid, float density, DirectX::FXMVECTOR origin, DirectX::FXMVECTOR direction,
+    float tEnter, float tExit, float step, UINT& seed, float& t, VolumeTrackingStats* stats = nullptr);
+float MarchGridTransmittance(const DensityGrid& grid, float density, DirectX::FXMVECTOR origin, DirectX::FXMVECTOR direction,
+    float tEnter, float tExit, float step, VolumeTrackingStats* stats = nullptr);
+// Nodes needs room for 2 * primitive count - 1 nodes, primitiveOrder for one index per primitive.
+// Returns how many nodes the tree used.
+UINT BuildBVH(std::span<const AABB> primitiveBounds, std::span<BVHNode> nodes, std::span<UINT> primitiveOrder);
+// Deepest node of a tree, for checking ones that weren't built here. Throws on child indices that
+// would go out of the array or back up the tree.
+UINT BVHDepth(std::span<const BVHNode> nodes);
+AABB InstanceWorldBounds(const ProceduralInstance& instance);
+void BuildSceneBVH(SceneBVH& bvh);
+void RefitSceneBVH(SceneBVH& bvh, const std::vector<UINT>& movedInstances);
+void UpdateSceneBVH(bool topologyChanged);
+void BuildMotionBVH(MotionBVH& bvh);
+void RefitMotionBVH(MotionBVH& bvh);
+void BuildUniformGrid(UniformGrid& grid, const MotionBVH& bvh);
+SPATIAL_INDEX ChooseSpatialIndex(const UniformGrid& grid);
+
+void MoveInstance(UINT instance, DirectX::XMMATRIX transform);
+bool LightMayReach(const LightData& light, DirectX::XMFLOAT3 p, DirectX::XMFLOAT3 n);
+void ClearDirtyInstances();
+DirectX::XMMATRIX InstanceTransformAt(const ProceduralInstance& instance, float time);
+void AnimateInstances(float shutterOpen, float shutterClose);
+void CaptureReferenceFrame(ReferenceFrame& frame, const MotionBVH& bvh);
+UINT ReferenceKernelFeatures(const CameraData& camera);
+std::vector<ReferenceFrame> ReplicateReferenceFrame(const ReferenceFrame& frame, ThreadPool& pool);
+void RenderReference(const ReferenceFrame& frame, UINT width, UINT height, std::vector<DirectX::XMFLOAT3>& image,
+    ThreadPool* pool = nullptr, PathStats* stats = nullptr);
+// Renders with the frame's replicas for pool when given, instead of making them for just this region.
+void RenderReferenceRegion(const ReferenceFrame& frame, UINT width, UINT height, const ImageRect& region,
+    std::vector<DirectX::XMFLOAT3>& image, ThreadPool* pool = nullptr, PathStats* stats = nullptr,
+    std::span<const ReferenceFrame> replicas = {});
+void RenderReferenceSamples(const ReferenceFrame& frame, UINT width, UINT height, UINT firstSample, UINT sampleCount,
+    std::vector<INT64>& sums, ThreadPool* pool = nullptr);
+void TraceMeshRays(UINT mesh, std::span<const MeshRay> rays, std::span<MeshRayHit> hits, ThreadPool* pool = nullptr, bool queue = true);
+UINT TraceReferencePrimaryHits(const ReferenceFrame& frame, UINT width, UINT height, bool packets);
+void TraceReferenceFirstHits(const ReferenceFrame& frame, UINT width, UINT height,
+    std::vector<DirectX::XMFLOAT3>& positions, std::vector<DirectX::XMFLOAT3>& normals);
+bool ReprojectToPixel(DirectX::XMFLOAT3 lookfrom, DirectX::XMFLOAT3 lookat, float vfov, UINT width, UINT height,
+    DirectX::XMFLOAT3 position, DirectX::XMINT2& pixel);
+bool IsHistoryValid(DirectX::XMFLOAT3 position, DirectX::XMFLOAT3 normal, DirectX::XMFLOAT3 historyPosition,
+    DirectX::XMFLOAT3 historyNormal, DirectX::XMFLOAT3 lookfrom);
+DirectX::XMFLOAT4 AccumulateHistory(DirectX::XMFLOAT4 history, DirectX::XMFLOAT3 color, UINT samples);
+AnimationStats RenderAnimation(const AnimationSettings& settings, ThreadPool& pool);
+PartialImage RenderPartialImage(const ReferenceFrame& frame, UINT width, UINT height, UINT firstSample, UINT sampleCount, ThreadPool* pool = nullptr);
+void MergePartialImage(PartialImage& merged, const PartialImage& partial);
+UINT64 PartialImageSampleCount(const PartialImage& partial);
+std::vector<DirectX::XMFLOAT3> ResolvePartialImage(const PartialImage& partial);
+void WritePartialImage(const char* path, const PartialImage& partial);
+PartialImage ReadPartialImage(const char* path);
+std::vector<UINT8> EncodePPM(UINT width, UINT height, const std::vector<DirectX::XMFLOAT3>& image);
+std::vector<UINT8> SerializeScene(const ReferenceFrame& frame);
+void DeserializeScene(const UINT8* data, size_t size, ReferenceFrame& frame);
+std::vector<DirectX::XMFLOAT3> RenderDistributed(const DistributedSettings& settings);
+int RunRenderWorker(const char* host, const char* port, ThreadPool& pool);
+int RunBenchmarks();
+bool RunCommandLine(int argc, char** argv, int& exitCode);
@@ -0,0 +1,1458 @@
+#include "core.h"
+#include <bit>
+#include <optional>
+
+// CPU reference path tracer. It uses the same geometry conventions, materials and camera as the
+// shaders, but only samples materials (no direct light sampling), which makes it slower to
+// converge and easy to trust. It needs no GPU, so benchmarks can render with it anywhere.
+
+namespace
+{
+    using namespace DirectX;
+
+    constexpr float RAY_T_MIN = 0.001f;
+
+    // Ray cones after a diffuse bounce. Anything seen through one doesn't need fine texture detail,
+    // a texel about as big as a tenth of the distance is plenty.
+    constexpr float DIFFUSE_CONE_SPREAD = 0.1f;
+    constexpr float RAY_T_MAX = 1000.0f;
+
+    // Primary rays are traced in packets of 8x8 pixel blocks.
+    constexpr UINT PACKET_WIDTH = 8;
+    constexpr UINT PACKET_SIZE = PACKET_WIDTH * PACKET_WIDTH;
+
+    XMVECTOR randomUnitVector(UINT& seed)
+    {
+        while (true)
+        {
+            XMVECTOR p = XMVectorSet(RandomFloat(seed, -1, 1), RandomFloat(seed, -1, 1), RandomFloat(seed, -1, 1), 0);
+            float lensq = XMVectorGetX(XMVector3LengthSq(p));
+            if (0.01f < lensq && lensq <= 1)
+                return p / std::sqrt(lensq);
+        }
+    }
+
+    float dot3(FXMVECTOR a, FXMVECTOR b)
+    {
+        return XMVectorGetX(XMVector3Dot(a, b));
+    }
+
+    XMVECTOR reflect(FXMVECTOR v, FXMVECTOR n)
+    {
+        return v - 2 * dot3(v, n) * n;
+    }
+
+    float reflectance(float cosine, float refractionIndex)
+    {
+        // Use Schlick's approximation for reflectance.
+        float r0 = (1 - refractionIndex) / (1 + refractionIndex);
+        r0 = r0 * r0;
+        return r0 + (1 - r0) * std::pow(1 - cosine, 5.0f);
+    }
+
+    // Hero wavelength rendering (Wilkie et al. 2014). A spectral path carries radiance at four
+    // wavelengths, one per vector lane, so it costs about what an RGB path does. The hero wavelength is
+    // drawn uniformly over the visible range and the other three follow it evenly spaced, wrapping around.
+    constexpr float WAVELENGTH_MIN = 380.0f;
+    constexpr float WAVELENGTH_MAX = 720.0f;
+    constexpr UINT WAVELENGTH_TABLE_SIZE = 341; // One entry per nanometer, both ends included.
+
+    // RGB colors become spectra as a mix of a red, a green and a blue basis spectrum. They are smooth
+    // and sum to one, so white stays exactly one at every wavelength.
+    XMFLOAT3 spectralBasis(float wavelength)
+    {
+        auto smoothstep = [wavelength](float edge0, float edge1) {
+            const float t = std::clamp((wavelength - edge0) / (edge1 - edge0), 0.0f, 1.0f);
+            return t * t * (3 - 2 * t);
+        };
+        const float blueToGreen = smoothstep(460.0f, 520.0f);
+        const float greenToRed = smoothstep(565.0f, 615.0f);
+        return { greenToRed, blueToGreen - greenToRed, 1 - blueToGreen };
+    }
+
+    // CIE 1931 color matching functions in linear sRGB, using the multi lobe fit of Wyman, Sloan and Shirley.
+    XMFLOAT3 colorMatching(float wavelength)
+    {
+        auto lobe = [wavelength](float mean, float sigmaBelow, float sigmaAbove) {
+            const float t = (wavelength - mean) / (wavelength < mean ? sigmaBelow : sigmaAbove);
+            return std::exp(-0.5f * t * t);
+        };
+        const float x = 1.056f * lobe(599.8f, 37.9f, 31.0f) + 0.362f * lobe(442.0f, 16.0f, 26.7f) - 0.065f * lobe(501.1f, 20.4f, 26.2f);
+        const float y = 0.821f * lobe(568.8f, 46.9f, 40.5f) + 0.286f * lobe(530.9f, 16.3f, 31.1f);
+        const float z = 1.217f * lobe(437.0f, 11.8f, 36.0f) + 0.681f * lobe(459.0f, 26.0f, 13.8f);
+        return { 3.2406f * x - 1.5372f * y - 0.4986f * z, -0.9689f * x + 1.8758f * y + 0.0415f * z, 0.0557f * x - 0.2040f * y + 1.0570f * z };
+    }
+
+    // Basis spectra and the RGB weights of radiance at each wavelength. The weights are the color
+    // matching functions times the inverse of how they see the basis, so any upsampled color comes back
+    // as itself. They are scaled for one uniformly drawn wavelength.
+    struct SpectralTables
+    {
+        XMFLOAT3 basis[WAVELENGTH_TABLE_SIZE];
+        XMFLOAT3 rgbWeights[WAVELENGTH_TABLE_SIZE];
+
+        SpectralTables()
+        {
+            XMFLOAT3 matching[WAVELENGTH_TABLE_SIZE];
+            XMFLOAT3 response[3] = {};
+            for (UINT i = 0; i < WAVELENGTH_TABLE_SIZE; ++i)
+            {
+                const float wavelength = WAVELENGTH_MIN + i;
+                basis[i] = spectralBasis(wavelength);
+                matching[i] = colorMatching(wavelength);
+                const float weight = (i == 0 || i == WAVELENGTH_TABLE_SIZE - 1) ? 0.5f : 1.0f;
+                for (int j = 0; j < 3; ++j)
+                {
+                    const float b = weight * (&basis[i].x)[j];
+                    response[j] = { response[j].x + b * matching[i].x, response[j].y + b * matching[i].y, response[j].z + b * matching[i].z };
+                }
+            }
+
+            const XMMATRIX inverse = XMMatrixInverse(nullptr, XMMATRIX(XMLoadFloat3(&response[0]), XMLoadFloat3(&response[1]),
+                XMLoadFloat3(&response[2]), XMVectorSet(0, 0, 0, 1)));
+            for (UINT i = 0; i < WAVELENGTH_TABLE_SIZE; ++i)
+            {
+                XMStoreFloat3(&rgbWeights[i], XMVector3TransformNormal(XMLoadFloat3(&matching[i]), inverse) * (WAVELENGTH_MAX - WAVELENGTH_MIN));
+            }
+        }
+    };
+
+    const SpectralTables spectralTables;
+
+    struct Wavelengths
+    {
+        float nanometers[4];    // Hero first.
+        XMVECTOR basis[3];      // Red, green and blue basis spectra, a lane per wavelength.
+        XMVECTOR rgbWeights[3]; // Red, green and blue weights of each lane, a quarter as lanes are averaged.
+    };
+
+    Wavelengths sampleWavelengths(float u)
+    {
+        Wavelengths wavelengths;
+        float basis[3][4], weights[3][4];
+        for (UINT lane = 0; lane < 4; ++lane)
+        {
+            float offset = u + lane * 0.25f;
+            offset -= (offset >= 1) ? 1 : 0;
+            wavelengths.nanometers[lane] = WAVELENGTH_MIN + offset * (WAVELENGTH_MAX - WAVELENGTH_MIN);
+
+            const float position = offset * (WAVELENGTH_TABLE_SIZE - 1);
+            const UINT index = std::min((UINT)position, WAVELENGTH_TABLE_SIZE - 2);
+            const float f = position - index;
+            for (int c = 0; c < 3; ++c)
+            {
+                const float* b = &spectralTables.basis[index].x;
+                const float* w = &spectralTables.rgbWeights[index].x;
+                basis[c][lane] = b[c] + f * (b[c + 3] - b[c]);
+                weights[c][lane] = 0.25f * (w[c] + f * (w[c + 3] - w[c]));
+            }
+        }
+        for (int c = 0; c < 3; ++c)
+        {
+            wavelengths.basis[c] = XMVectorSet(basis[c][0], basis[c][1], basis[c][2], basis[c][3]);
+            wavelengths.rgbWeights[c] = XMVectorSet(weights[c][0], weights[c][1], weights[c][2], weights[c][3]);
+        }
+        return wavelengths;
+    }
+
+    XMVECTOR upsample(const Wavelengths& wavelengths, FXMVECTOR rgb)
+    {
+        return XMVectorSplatX(rgb) * wavelengths.basis[0] + XMVectorSplatY(rgb) * wavelengths.basis[1] + XMVectorSplatZ(rgb) * wavelengths.basis[2];
+    }
+
+    XMVECTOR spectrumToRGB(const Wavelengths& wavelengths, FXMVECTOR radiance)
+    {
+        return XMVectorSet(XMVectorGetX(XMVector4Dot(radiance, wavelengths.rgbWeights[0])),
+                           XMVectorGetX(XMVector4Dot(radiance, wavelengths.rgbWeights[1])),
+                           XMVectorGetX(XMVector4Dot(radiance, wavelengths.rgbWeights[2])), 0);
+    }
+
+    // Cauchy's equation, n = A + B / wavelength^2, through the material's index at the helium d line
+    // and with B from its Abbe number, (n_d - 1) / (n_F - n_C).
+    float refractionIndexAt(const MaterialData& material, float nanometers)
+    {
+        constexpr float LINE_D = 0.5876f; // Micrometers.
+        constexpr float LINE_F = 0.4861f;
+        constexpr float LINE_C = 0.6563f;
+        const float b = (material.refractionIndex - 1) / (material.abbeNumber * (1 / (LINE_F * LINE_F) - 1 / (LINE_C * LINE_C)));
+        const float micrometers = nanometers / 1000;
+        return material.refractionIndex + b * (1 / (micrometers * micrometers) - 1 / (LINE_D * LINE_D));
+    }
+
+    struct Ray
+    {
+        XMVECTOR origin;
+        XMVECTOR direction;
+        float time; // Fraction of the shutter interval, in [0, 1].
+        float coneSpread = 0; // Growth of the ray cone width per unit of distance, picks texture mip levels.
+    };
+
+    struct Hit
+    {
+        float t;
+        XMVECTOR normal; // World space, facing against the ray.
+        bool frontFace;
+        bool inMedium;   // Scattered inside smoke, normal is meaningless.
+        UINT instance;
+        float u, v;      // Only for image textured materials.
+        float uvScale;   // World units per uv unit around the hit, about.
+    };
+
+    // Per frame state of an instance, the inverse is needed for every ray so it's computed just once.
+    struct InstanceFrame
+    {
+        XMMATRIX worldToObject;
+        XMMATRIX objectToWorld;
+        XMMATRIX normalToWorld;
+        XMVECTOR motion;
+    };
+
+    class ReferenceScene
+    {
+    public:
+        ReferenceScene(const ReferenceFrame& frame)
+            : background(XMLoadFloat3(&frame.camera.backgroundColor)), bvh(frame.bvh),
+              grid(frame.spatialIndex == SPATIAL_INDEX_GRID ? &frame.grid : nullptr)
+        {
+            frames.reserve(frame.transforms.size());
+            for (size_t i = 0; i < frame.transforms.size(); ++i)
+            {
+                XMMATRIX worldToObject = XMMatrixInverse(nullptr, frame.transforms[i]);
+                frames.push_back({ worldToObject, frame.transforms[i], XMMatrixTranspose(worldToObject), XMLoadFloat3(&frame.motion[i]) });
+            }
+        }
+
+        const XMVECTOR background;
+
+        bool intersect(const Ray& ray, UINT& seed, Hit& hit) const
+        {
+            if (grid)
+                return intersectGrid(ray, seed, hit);
+            if (bvh.nodes.empty())
+                return false;
+
+            hit.t = RAY_T_MAX;
+            bool found = false;
+
+            XMFLOAT3 origin, invDirection;
+            XMStoreFloat3(&origin, ray.origin);
+            XMStoreFloat3(&invDirection, XMVectorReciprocal(ray.direction));
+
+            UINT stack[BVH_STACK_SIZE];
+            UINT stackSize = 0;
+            stack[stackSize++] = 0;
+            while (stackSize > 0)
+            {
+                const MotionBVHNode& node = bvh.nodes[stack[--stackSize]];
+                if (!intersectBounds(node, ray.time, origin, invDirection, hit.t))
+                    continue;
+
+                if (node.primitiveCount == 0)
+                {
+                    stack[stackSize++] = node.leftOrFirst;
+                    stack[stackSize++] = node.leftOrFirst + 1;
+                    continue;
+                }
+
+                for (UINT p = node.leftOrFirst; p < node.leftOrFirst + node.primitiveCount; ++p)
+                {
+                    found |= intersectInstance(bvh.primitiveOrder[p], ray, seed, hit);
+                }
+            }
+            return found;
+        }
+
+        // Same as intersect for every ray of the packet, hits and seeds come out exactly like tracing
+        // the rays one by one. Nodes are culled for the whole packet with interval arithmetic when
+        // possible, otherwise traversal continues from the first ray that hits the node.
+        void intersectPacket(const Ray* rays, UINT count, UINT* seeds, Hit* hits, bool* found) const
+        {
+            if (grid)
+            {
+                // Rays of a packet go through different cells soon enough, the grid walks them one by one.
+                for (UINT i = 0; i < count; ++i)
+                {
+                    found[i] = intersectGrid(rays[i], seeds[i], hits[i]);
+                }
+                return;
+            }
+
+            XMFLOAT3 origins[PACKET_SIZE];
+            XMFLOAT3 invDirections[PACKET_SIZE];
+            for (UINT i = 0; i < count; ++i)
+            {
+                hits[i].t = RAY_T_MAX;
+                found[i] = false;
+                XMStoreFloat3(&origins[i], rays[i].origin);
+                XMStoreFloat3(&invDirections[i], XMVectorReciprocal(rays[i].direction));
+            }
+            if (bvh.nodes.empty() || count == 0)
+                return;
+
+            const PacketInterval interval = packetInterval(rays, count, origins, invDirections);
+            float packetTMax = RAY_T_MAX;
+
+            struct Entry
+            {
+                UINT node;
+                UINT firstActive;
+            };
+            Entry stack[BVH_STACK_SIZE];
+            UINT stackSize = 0;
+            stack[stackSize++] = { 0, 0 };
+            while (stackSize > 0)
+            {
+                const Entry entry = stack[--stackSize];
+                const MotionBVHNode& node = bvh.nodes[entry.node];
+                if (interval.coherent && missesInterval(interval, node, packetTMax))
+                    continue;
+
+                // Rays before the first one hitting the node don't need to look at it at all.
+                UINT first = entry.firstActive;
+                while (first < count && !intersectBounds(node, rays[first].time, origins[first], invDirections[first], hits[first].t))
+                    ++first;
+                if (first == count)
+                    continue;
+
+                if (node.primitiveCount == 0)
+                {
+                    stack[stackSize++] = { node.leftOrFirst, first };
+                    stack[stackSize++] = { node.leftOrFirst + 1, first };
+                    continue;
+                }
+
+                for (UINT i = first; i < count; ++i)
+                {
+                    if (i != first && !intersectBounds(node, rays[i].time, origins[i], invDirections[i], hits[i].t))
+                        continue;
+                    for (UINT p = node.leftOrFirst; p < node.leftOrFirst + node.primitiveCount; ++p)
+                    {
+                        found[i] |= intersectInstance(bvh.primitiveOrder[p], rays[i], seeds[i], hits[i]);
+                    }
+                }
+
+                packetTMax = 0;
+                for (UINT i = 0; i < count; ++i)
+                {
+                    packetTMax = std::max(packetTMax, hits[i].t);
+                }
+            }
+        }
+
+    private:
+        // Instances too big for the grid first, then a 3D DDA through the cells the ray crosses
+        // (Amanatides and Woo), stopping at the first cell that ends past the closest hit so far.
+        // Instances overlapping several cells get tested again in each, which costs a little but
+        // can't change the hit, media are never binned.
+        bool intersectGrid(const Ray& ray, UINT& seed, Hit& hit) const
+        {
+            hit.t = RAY_T_MAX;
+            bool found = false;
+            for (UINT id : grid->unbinned)
+            {
+                found |= intersectInstance(id, ray, seed, hit);
+            }
+            if (grid->cellInstances.empty())
+                return found;
+
+            XMFLOAT3 originValues, directionValues, invDirectionValues;
+            XMStoreFloat3(&originValues, ray.origin);
+            XMStoreFloat3(&directionValues, ray.direction);
+            XMStoreFloat3(&invDirectionValues, XMVectorReciprocal(ray.direction));
+            const float* origin = &originValues.x;
+            const float* direction = &directionValues.x;
+            const float* invDirection = &invDirectionValues.x;
+            const float* boundsMin = &grid->bounds.min.x;
+            const float* boundsMax = &grid->bounds.max.x;
+            const float* cellSize = &grid->cellSize.x;
+
+            float tEnter = RAY_T_MIN;
+            float tExit = hit.t;
+            for (int axis = 0; axis < 3; ++axis)
+            {
+                const float t0 = (boundsMin[axis] - origin[axis]) * invDirection[axis];
+                const float t1 = (boundsMax[axis] - origin[axis]) * invDirection[axis];
+                tEnter = std::max(tEnter, std::min(t0, t1));
+                tExit = std::min(tExit, std::max(t0, t1));
+            }
+            if (!(tEnter <= tExit))
+                return found;
+
+            int cell[3], step[3], end[3];
+            float tNext[3], tDelta[3];
+            for (int axis = 0; axis < 3; ++axis)
+            {
+                const int resolution = (int)grid->resolution[axis];
+                const float position = origin[axis] + tEnter * direction[axis] - boundsMin[axis];
+                cell[axis] = std::clamp((int)(position / cellSize[axis]), 0, resolution - 1);
+                if (direction[axis] > 0)
+                {
+                    step[axis] = 1;
+                    end[axis] = resolution;
+                    tNext[axis] = tEnter + ((cell[axis] + 1) * cellSize[axis] - position) * invDirection[axis];
+                    tDelta[axis] = cellSize[axis] * invDirection[axis];
+                }
+                else if (direction[axis] < 0)
+                {
+                    step[axis] = -1;
+                    end[axis] = -1;
+                    tNext[axis] = tEnter + (cell[axis] * cellSize[axis] - position) * invDirection[axis];
+                    tDelta[axis] = -cellSize[axis] * invDirection[axis];
+                }
+                else
+                {
+                    step[axis] = 0;
+                    end[axis] = -1;
+                    tNext[axis] = FLT_MAX;
+                    tDelta[axis] = FLT_MAX;
+                }
+            }
+
+            for (;;)
+            {
+                const UINT index = ((UINT)cell[2] * grid->resolution[1] + (UINT)cell[1]) * grid->resolution[0] + (UINT)cell[0];
+                for (UINT i = grid->cellStart[index]; i < grid->cellStart[index + 1]; ++i)
+                {
+                    found |= intersectInstance(grid->cellInstances[i], ray, seed, hit);
+                }
+
+                const int axis = (tNext[0] < tNext[1]) ? (tNext[0] < tNext[2] ? 0 : 2) : (tNext[1] < tNext[2] ? 1 : 2);
+                if (tNext[axis] >= std::min(hit.t, tExit))
+                    break;
+                cell[axis] += step[axis];
+                if (cell[axis] == end[axis])
+                    break;
+                tNext[axis] += tDelta[axis];
+            }
+            return found;
+        }
+
+        // Ranges of origins, inverse directions and times over a whole packet.
+        struct PacketInterval
+        {
+            bool coherent; // Directions agree in sign on every axis, otherwise 1 / direction has no finite range.
+            float originMin[3];
+            float originMax[3];
+            float invDirectionMin[3];
+            float invDirectionMax[3];
+            float timeMin;
+            float timeMax;
+        };
+
+        static PacketInterval packetInterval(const Ray* rays, UINT count, const XMFLOAT3* origins, const XMFLOAT3* invDirections)
+        {
+            PacketInterval interval = { .coherent = true, .timeMin = rays[0].time, .timeMax = rays[0].time };
+            for (int axis = 0; axis < 3; ++axis)
+            {
+                interval.originMin[axis] = interval.originMax[axis] = (&origins[0].x)[axis];
+                interval.invDirectionMin[axis] = interval.invDirectionMax[axis] = (&invDirections[0].x)[axis];
+            }
+            for (UINT i = 1; i < count; ++i)
+            {
+                interval.timeMin = std::min(interval.timeMin, rays[i].time);
+                interval.timeMax = std::max(interval.timeMax, rays[i].time);
+                for (int axis = 0; axis < 3; ++axis)
+                {
+                    interval.originMin[axis] = std::min(interval.originMin[axis], (&origins[i].x)[axis]);
+                    interval.originMax[axis] = std::max(interval.originMax[axis], (&origins[i].x)[axis]);
+                    interval.invDirectionMin[axis] = std::min(interval.invDirectionMin[axis], (&invDirections[i].x)[axis]);
+                    interval.invDirectionMax[axis] = std::max(interval.invDirectionMax[axis], (&invDirections[i].x)[axis]);
+                }
+            }
+            for (int axis = 0; axis < 3; ++axis)
+            {
+                interval.coherent &= std::isfinite(interval.invDirectionMin[axis]) && std::isfinite(interval.invDirectionMax[axis]) &&
+                                     (interval.invDirectionMin[axis] > 0 || interval.invDirectionMax[axis] < 0);
+            }
+            return interval;
+        }
+
+        // True if no ray in the packet can hit the node. Every ray's slab distances lie in the
+        // product of the (plane - origin) and inverse direction ranges, so if even the smallest
+        // possible entry is past the largest possible exit, all of them miss.
+        static bool missesInterval(const PacketInterval& interval, const MotionBVHNode& node, float tMax)
+        {
+            auto productMin = [](float a0, float a1, float b0, float b1) { return std::min({ a0 * b0, a0 * b1, a1 * b0, a1 * b1 }); };
+            auto productMax = [](float a0, float a1, float b0, float b1) { return std::max({ a0 * b0, a0 * b1, a1 * b0, a1 * b1 }); };
+
+            float nearMin = RAY_T_MIN;
+            float farMax = tMax;
+            for (int axis = 0; axis < 3; ++axis)
+            {
+                // Bounds move linearly, so over the packet's time range they stay inside the union of both ends.
+                const float min0 = (&node.bounds[0].min.x)[axis];
+                const float min1 = (&node.bounds[1].min.x)[axis];
+                const float max0 = (&node.bounds[0].max.x)[axis];
+                const float max1 = (&node.bounds[1].max.x)[axis];
+                const float boundsMin = std::min(min0 + (min1 - min0) * interval.timeMin, min0 + (min1 - min0) * interval.timeMax);
+                const float boundsMax = std::max(max0 + (max1 - max0) * interval.timeMin, max0 + (max1 - max0) * interval.timeMax);
+
+                const bool positive = interval.invDirectionMin[axis] > 0;
+                const float nearPlane = positive ? boundsMin : boundsMax;
+                const float farPlane = positive ? boundsMax : boundsMin;
+                nearMin = std::max(nearMin, productMin(nearPlane - interval.originMax[axis], nearPlane - interval.originMin[axis],
+                                                       interval.invDirectionMin[axis], interval.invDirectionMax[axis]));
+                farMax = std::min(farMax, productMax(farPlane - interval.originMax[axis], farPlane - interval.originMin[axis],
+                                                     interval.invDirectionMin[axis], interval.invDirectionMax[axis]));
+            }
+            return nearMin > farMax;
+        }
+
+        static bool intersectBounds(const MotionBVHNode& node, float time, const XMFLOAT3& origin, const XMFLOAT3& invDirection, float tMax)
+        {
+            // Linear motion keeps everything inside the interpolated bounds.
+            const AABB& b0 = node.bounds[0];
+            const AABB& b1 = node.bounds[1];
+            float tEnter = RAY_T_MIN;
+            float tExit = tMax;
+            auto slab = [&](float min0, float min1, float max0, float max1, float o, float invD) {
+                float t0 = (min0 + (min1 - min0) * time - o) * invD;
+                float t1 = (max0 + (max1 - max0) * time - o) * invD;
+                tEnter = std::max(tEnter, std::min(t0, t1));
+                tExit = std::min(tExit, std::max(t0, t1));
+            };
+            slab(b0.min.x, b1.min.x, b0.max.x, b1.max.x, origin.x, invDirection.x);
+            slab(b0.min.y, b1.min.y, b0.max.y, b1.max.y, origin.y, invDirection.y);
+            slab(b0.min.z, b1.min.z, b0.max.z, b1.max.z, origin.z, invDirection.z);
+            return tEnter <= tExit;
+        }
+
+        bool intersectInstance(UINT id, const Ray& ray, UINT& seed, Hit& hit) const
+        {
+            const ProceduralInstance& instance = proceduralInstances[id];
+            const InstanceFrame& frame = frames[id];
+            const MaterialData& material = materialList[objectList[id].materialIndex];
+
+            // Moving the ray back is the same as moving the instance forward by the ray time.
+            // Direction isn't normalized in object space, so t stays the same in both spaces.
+            XMVECTOR origin = XMVector3TransformCoord(ray.origin - ray.time * frame.motion, frame.worldToObject);
+            XMVECTOR direction = XMVector3TransformNormal(ray.direction, frame.worldToObject);
+
+            float t = 0;
+            XMVECTOR normal = XMVectorZero();
+            bool inMedium = false;
+            switch (instance.type)
+            {
+            case OBJECT_TYPE_SPHERE:
+            case OBJECT_TYPE_MOVING_SPHERE:
+                {
+                    float tEnter, tExit;
+                    if (!intersectUnitSphere(origin, direction, hit.t, tEnter, tExit))
+                        return false;
+
+                    if (material.type == MATERIAL_TYPE_SMOKE)
+                    {
+                        if (!intersectMedium(material, tEnter, std::min(tExit, hit.t), seed, t))
+                            return false;
+                        inMedium = true;
+                    }
+                    else
+                    {
+                        t = (tEnter >= RAY_T_MIN) ? tEnter : tExit;
+                        if (t < RAY_T_MIN || t >= hit.t)
+                            return false;
+                        normal = origin + t * direction;
+                        if (material.textureType == TEXTURE_TYPE_IMAGE)
+                        {
+                            // Same mapping as the book, u around y from -x, v from -y up. One uv unit
+                            // is 2 pi radii along u and pi radii along v.
+                            XMFLOAT3 n;
+                            XMStoreFloat3(&n, normal);
+                            hit.u = (std::atan2(-n.z, n.x) + XM_PI) / XM_2PI;
+                            hit.v = std::acos(std::clamp(-n.y, -1.0f, 1.0f)) / XM_PI;
+                            hit.uvScale = XM_PI * std::sqrt(2.0f) * XMVectorGetX(XMVector3Length(XMVector3TransformNormal(XMVectorSet(1, 0, 0, 0), frame.objectToWorld)));
+                        }
+                    }
+                }
+                break;
+            case OBJECT_TYPE_QUAD:
+                {
+                    float dz = XMVectorGetZ(direction);
+                    if (std::abs(dz) < 1e-8f)
+                        return false;
+                    t = -XMVectorGetZ(origin) / dz;
+                    XMVECTOR p = origin + t * direction;
+                    if (t < RAY_T_MIN || t >= hit.t || std::abs(XMVectorGetX(p)) > 1 || std::abs(XMVectorGetY(p)) > 1)
+                        return false;
+                    normal = XMVectorSet(0, 0, -1, 0);
+                    if (material.textureType == TEXTURE_TYPE_IMAGE)
+                    {
+                        // u along V, v along U, one uv unit is the whole edge.
+                        hit.u = (XMVectorGetX(p) + 1) / 2;
+                        hit.v = (XMVectorGetY(p) + 1) / 2;
+                        hit.uvScale = 2 * std::sqrt(XMVectorGetX(XMVector3Length(XMVector3TransformNormal(XMVectorSet(1, 0, 0, 0), frame.objectToWorld))) *
+                                                    XMVectorGetX(XMVector3Length(XMVector3TransformNormal(XMVectorSet(0, 1, 0, 0), frame.objectToWorld))));
+                    }
+                }
+                break;
+            case OBJECT_TYPE_VOLUMETRIC_CUBE:
+                {
+                    float tEnter, tExit;
+                    if (!intersectUnitCube(origin, direction, hit.t, tEnter, tExit))
+                        return false;
+
+                    if (material.type == MATERIAL_TYPE_SMOKE)
+                    {
+                        // Grid densities are relative to the mean, so the material density works the same for both.
+                        if (instance.prototypeIndex != NO_DENSITY_GRID
+                                ? !SampleGridScattering(gridList[instance.prototypeIndex], material.density, origin, direction,
+                                                        std::max(tEnter, RAY_T_MIN), std::min(tExit, hit.t), seed, t)
+                                : !intersectMedium(material, tEnter, std::min(tExit, hit.t), seed, t))
+                            return false;
+                        inMedium = true;
+                    }
+                    else
+                    {
+                        t = (tEnter >= RAY_T_MIN) ? tEnter : tExit;
+                        if (t < RAY_T_MIN || t >= hit.t)
+                            return false;
+                        XMFLOAT3 p;
+                        XMStoreFloat3(&p, origin + t * direction);
+                        float m = std::max({ std::abs(p.x), std::abs(p.y), std::abs(p.z) });
+                        normal = XMVectorSet(std::abs(p.x) == m ? std::copysign(1.0f, p.x) : 0.0f,
+                                             std::abs(p.y) == m ? std::copysign(1.0f, p.y) : 0.0f,
+                                             std::abs(p.z) == m ? std::copysign(1.0f, p.z) : 0.0f, 0);
+                    }
+                }
+                break;
+            case OBJECT_TYPE_QUAD_GROUP:
+                {
+                    const QuadGroupData& group = groupList[instance.prototypeIndex];
+                    bool found = false;
+                    t = hit.t;
+                    for (UINT i = group.quadOffset; i < group.quadOffset + group.quadCount; ++i)
+                    {
+                        found |= intersectQuad(groupQuads[i], origin, direction, t, normal);
+                    }
+                    if (!found)
+                        return false;
+                }
+                break;
+            case OBJECT_TYPE_TRIANGLE_MESH:
+                t = hit.t;
+                if (!intersectMesh(instance.prototypeIndex, origin, direction, t, normal))
+                    return false;
+                break;
+            default:
+                return false;
+            }
+
+            hit.t = t;
+            hit.instance = id;
+            hit.inMedium = inMedium;
+            if (!inMedium)
+            {
+                normal = XMVector3Normalize(XMVector3TransformNormal(normal, frame.normalToWorld));
+                hit.frontFace = dot3(ray.direction, normal) < 0;
+                hit.normal = hit.frontFace ? normal : -normal;
+            }
+            return true;
+        }
+
+        static bool intersectUnitSphere(FXMVECTOR origin, FXMVECTOR direction, float tMax, float& tEnter, float& tExit)
+        {
+            float a = dot3(direction, direction);
+            float h = dot3(origin, direction);
+            float c = dot3(origin, origin) - 1;
+            float discriminant = h * h - a * c;
+            if (discriminant < 0)
+                return false;
+
+            float sqrtd = std::sqrt(discriminant);
+            tEnter = (-h - sqrtd) / a;
+            tExit = (-h + sqrtd) / a;
+            return tEnter < tMax && tExit >= RAY_T_MIN;
+        }
+
+        static bool intersectUnitCube(FXMVECTOR origin, FXMVECTOR direction, float tMax, float& tEnter, float& tExit)
+        {
+            XMVECTOR invDirection = XMVectorReciprocal(direction);
+            XMVECTOR t0 = (XMVectorSet(-1, -1, -1, 0) - origin) * invDirection;
+            XMVECTOR t1 = (XMVectorSet(1, 1, 1, 0) - origin) * invDirection;
+            XMFLOAT3 tmin, tmax;
+            XMStoreFloat3(&tmin, XMVectorMin(t0, t1));
+            XMStoreFloat3(&tmax, XMVectorMax(t0, t1));
+            tEnter = std::max({ tmin.x, tmin.y, tmin.z });
+            tExit = std::min({ tmax.x, tmax.y, tmax.z });
+            return tEnter <= tExit && tEnter < tMax && tExit >= RAY_T_MIN;
+        }
+
+        static bool intersectMedium(const MaterialData& material, float tEnter, float tExit, UINT& seed, float& t)
+        {
+            // Constant density medium, same as the book: the ray scatters somewhere inside with
+            // probability growing with the distance travelled through it.
+            tEnter = std::max(tEnter, RAY_T_MIN);
+            float hitDistance = -1 / material.density * std::log(RandomFloat(seed));
+            if (hitDistance > tExit - tEnter)
+                return false;
+            t = tEnter + hitDistance;
+            return true;
+        }
+
+        static bool intersectQuad(const GroupQuad& quad, FXMVECTOR origin, FXMVECTOR direction, float& t, XMVECTOR& normal)
+        {
+            XMVECTOR Q = XMLoadFloat3(&quad.Q);
+            XMVECTOR U = XMLoadFloat3(&quad.U);
+            XMVECTOR V = XMLoadFloat3(&quad.V);
+            XMVECTOR n = XMVector3Cross(U, V);
+            float denom = dot3(n, direction);
+            if (std::abs(denom) < 1e-8f)
+                return false;
+
+            float quadT = dot3(n, Q - origin) / denom;
+            if (quadT < RAY_T_MIN || quadT >= t)
+                return false;
+
+            XMVECTOR w = n / dot3(n, n);
+            XMVECTOR planarHitptVector = origin + quadT * direction - Q;
+            float alpha = dot3(w, XMVector3Cross(planarHitptVector, V));
+            float beta = dot3(w, XMVector3Cross(U, planarHitptVector));
+            if (alpha < 0 || alpha > 1 || beta < 0 || beta > 1)
+                return false;
+
+            // Faces against U x V, like single quads.
+            t = quadT;
+            normal = -n;
+            return true;
+        }
+
+        static bool intersectMesh(UINT meshIndex, FXMVECTOR origin, FXMVECTOR direction, float& t, XMVECTOR& normal)
+        {
+            const MeshData& mesh = meshList[meshIndex];
+            if (mesh.treelets.empty())
+            {
+                const UINT* indices = &meshIndices[mesh.indexOffset];
+                const XMFLOAT3* vertices = &meshVertices[mesh.vertexOffset];
+                return intersectMeshNodes(mesh.bvh.data(), [&](UINT triangle, XMVECTOR& a, XMVECTOR& b, XMVECTOR& c) {
+                    a = XMLoadFloat3(&vertices[indices[3 * triangle]]);
+                    b = XMLoadFloat3(&vertices[indices[3 * triangle + 1]]);
+                    c = XMLoadFloat3(&vertices[indices[3 * triangle + 2]]);
+                }, origin, direction, t, normal);
+            }
+
+            // Paged, the treelets below the top of the tree come from the page cache, read right away if
+            // they aren't in. Walking each one whole where the whole tree has it keeps the same order.
+            bool found = false;
+            walkMeshTop(mesh, origin, direction, t, [&](UINT treelet) {
+                found |= intersectTreelet(*GetMeshTreelet(meshIndex, treelet), origin, direction, t, normal);
+            });
+            return found;
+        }
+
+    public:
+        // Closest triangle below t in the tree under nodes[0], whose leaves index triangles that
+        // triangle(i, a, b, c) loads the corners of.
+        template <typename Triangle>
+        static bool intersectMeshNodes(const BVHNode* nodes, const Triangle& triangle, FXMVECTOR origin, FXMVECTOR direction, float& t, XMVECTOR& normal)
+        {
+            XMFLOAT3 o, invDirection;
+            XMStoreFloat3(&o, origin);
+            XMStoreFloat3(&invDirection, XMVectorReciprocal(direction));
+
+            bool found = false;
+            UINT stack[BVH_STACK_SIZE];
+            UINT stackSize = 0;
+            stack[stackSize++] = 0;
+            while (stackSize > 0)
+            {
+                const BVHNode& node = nodes[stack[--stackSize]];
+                MotionBVHNode staticNode = { { { node.boundsMin, node.boundsMax }, { node.boundsMin, node.boundsMax } } };
+                if (!intersectBounds(staticNode, 0, o, invDirection, t))
+                    continue;
+
+                if (node.primitiveCount == 0)
+                {
+                    stack[stackSize++] = node.leftOrFirst;
+                    stack[stackSize++] = node.leftOrFirst + 1;
+                    continue;
+                }
+
+                // Triangles are stored in leaf order, so leaves index them directly.
+                for (UINT i = node.leftOrFirst; i < node.leftOrFirst + node.primitiveCount; ++i)
+                {
+                    XMVECTOR a, b, c;
+                    triangle(i, a, b, c);
+
+                    // Moller-Trumbore.
+                    XMVECTOR e1 = b - a;
+                    XMVECTOR e2 = c - a;
+                    XMVECTOR pvec = XMVector3Cross(direction, e2);
+                    float det = dot3(e1, pvec);
+                    if (std::abs(det) < 1e-12f)
+                        continue;
+                    float invDet = 1 / det;
+                    XMVECTOR tvec = origin - a;
+                    float u = dot3(tvec, pvec) * invDet;
+                    if (u < 0 || u > 1)
+                        continue;
+                    XMVECTOR qvec = XMVector3Cross(tvec, e1);
+                    float v = dot3(direction, qvec) * invDet;
+                    if (v < 0 || u + v > 1)
+                        continue;
+                    float triangleT = dot3(e2, qvec) * invDet;
+                    if (triangleT < RAY_T_MIN || triangleT >= t)
+                        continue;
+
+                    t = triangleT;
+                    normal = XMVector3Cross(e1, e2);
+                    found = true;
+                }
+            }
+            return found;
+        }
+
+        static bool intersectTreelet(const MeshTreeletPage& page, FXMVECTOR origin, FXMVECTOR direction, float& t, XMVECTOR& normal)
+        {
+            const XMFLOAT3* vertices = page.vertices.data();
+            return intersectMeshNodes(page.nodes.data(), [&](UINT triangle, XMVECTOR& a, XMVECTOR& b, XMVECTOR& c) {
+                a = XMLoadFloat3(&vertices[3 * triangle]);
+                b = XMLoadFloat3(&vertices[3 * triangle + 1]);
+                c = XMLoadFloat3(&vertices[3 * triangle + 2]);
+            }, origin, direction, t, normal);
+        }
+
+        // Calls treelet(index) for the treelets of a paged mesh whose bounds the ray hits before t, in
+        // the order the whole tree would get to them. treelet may lower t.
+        template <typename Treelet>
+        static void walkMeshTop(const MeshData& mesh, FXMVECTOR origin, FXMVECTOR direction, const float& t, const Treelet& treelet)
+        {
+            XMFLOAT3 o, invDirection;
+            XMStoreFloat3(&o, origin);
+            XMStoreFloat3(&invDirection, XMVectorReciprocal(direction));
+
+            UINT stack[BVH_STACK_SIZE];
+            UINT stackSize = 0;
+            stack[stackSize++] = 0;
+            while (stackSize > 0)
+            {
+                const BVHNode& node = mesh.bvh[stack[--stackSize]];
+                MotionBVHNode staticNode = { { { node.boundsMin, node.boundsMax }, { node.boundsMin, node.boundsMax } } };
+                if (!intersectBounds(staticNode, 0, o, invDirection, t))
+                    continue;
+
+                if (node.primitiveCount == 0)
+                {
+                    stack[stackSize++] = node.leftOrFirst;
+                    stack[stackSize++] = node.leftOrFirst + 1;
+                    continue;
+                }
+                treelet(node.leftOrFirst);
+            }
+        }
+
+    private:
+        const MotionBVH& bvh;
+        const UniformGrid* grid; // Only when the frame uses the grid.
+        std::vector<InstanceFrame> frames;
+    };
+
+    void addPathStats(PathStats& to, const PathStats& from)
+    {
+        to.paths += from.paths;
+        for (UINT type = 0; type < BOUNCE_TYPE_COUNT; ++type)
+        {
+            to.bounces[type] += from.bounces[type];
+            to.truncated[type] += from.truncated[type];
+        }
+        for (size_t bucket = 0; bucket < std::size(to.lengths); ++bucket)
+        {
+            to.lengths[bucket] += from.lengths[bucket];
+        }
+    }
+
+    // Follows a path whose first intersection is already known, so primary hits can come from packets.
+    // Paths end like in the ray generation shader, past the camera's bounce limit of any type or once
+    // they can't contribute anything noticeable anymore. Features missing from Features (a set of
+    // REFERENCE_KERNEL_FEATURE) are compiled out, and the checks for them fold away.
+    template <UINT Features>
+    XMVECTOR tracePath(const ReferenceScene& scene, const CameraData& camera, Ray ray, UINT& seed, bool found, Hit hit, PathStats* stats)
+    {
+        constexpr bool TEXTURES = (Features & REFERENCE_KERNEL_TEXTURES) != 0;
+
+        // Spectral paths weigh four wavelengths instead of RGB, every color they meet is upsampled.
+        const bool spectral = (Features & REFERENCE_KERNEL_SPECTRAL) && camera.spectral != 0;
+        Wavelengths wavelengths;
+        if (spectral)
+            wavelengths = sampleWavelengths(RandomFloat(seed));
+        bool heroOnly = false;
+        auto spectrum = [&](FXMVECTOR rgb) { return spectral ? upsample(wavelengths, rgb) : rgb; };
+
+        const XMVECTOR background = spectrum(scene.background);
+        XMVECTOR attenuation = spectral ? XMVectorReplicate(1) : XMVectorSet(1, 1, 1, 0);
+        UINT bounces[BOUNCE_TYPE_COUNT] = {};
+        UINT length = 0;
+        float coneWidth = 0;
+
+        auto finish = [&](XMVECTOR color, int truncatedBy = -1) {
+            if (stats)
+            {
+                ++stats->paths;
+                for (UINT type = 0; type < BOUNCE_TYPE_COUNT; ++type)
+                {
+                    stats->bounces[type] += bounces[type];
+                }
+                if (truncatedBy >= 0)
+                    ++stats->truncated[truncatedBy];
+                ++stats->lengths[std::min<size_t>(std::bit_width(length), std::size(stats->lengths) - 1)];
+            }
+            return spectral ? spectrumToRGB(wavelengths, color) : color;
+        };
+
+        while (true)
+        {
+            if (length > 0)
+                found = scene.intersect(ray, seed, hit);
+            if (!found)
+                return finish(attenuation * background);
+
+            const MaterialData& material = materialList[objectList[hit.instance].materialIndex];
+            const XMVECTOR p = ray.origin + hit.t * ray.direction;
+            coneWidth += ray.coneSpread * hit.t * XMVectorGetX(XMVector3Length(ray.direction));
+            XMVECTOR albedo = XMLoadFloat3(&material.albedo);
+            if (TEXTURES && material.textureType == TEXTURE_TYPE_NOISE)
+            {
+                XMFLOAT3 position, color;
+                XMStoreFloat3(&position, p);
+                color = NoiseTextureColor(position, material.textureScale);
+                albedo = XMLoadFloat3(&color);
+            }
+            else if (TEXTURES && material.textureType == TEXTURE_TYPE_IMAGE)
+            {
+                XMFLOAT3 color = SampleTexture(material.textureIndex, hit.u, hit.v, coneWidth / hit.uvScale);
+                albedo = XMLoadFloat3(&color);
+            }
+            XMVECTOR direction;
+            BOUNCE_TYPE type;
+            switch (material.type)
+            {
+            case MATERIAL_TYPE_DIFFUSE_LIGHT:
+                return finish(hit.frontFace ? attenuation * spectrum(albedo) : XMVectorZero());
+            case MATERIAL_TYPE_SMOKE:
+                type = BOUNCE_TYPE_VOLUME;
+                direction = randomUnitVector(seed);
+                ray.coneSpread = std::max(ray.coneSpread, DIFFUSE_CONE_SPREAD);
+                break;
+            case MATERIAL_TYPE_METAL:
+                type = BOUNCE_TYPE_SPECULAR;
+                direction = reflect(XMVector3Normalize(ray.direction), hit.normal) + material.fuzz * randomUnitVector(seed);
+                ray.coneSpread += material.fuzz * DIFFUSE_CONE_SPREAD;
+                if (dot3(direction, hit.normal) <= 0)
+                    return finish(XMVectorZero());
+                break;
+            case MATERIAL_TYPE_DIELECTRIC:
+                {
+                    type = BOUNCE_TYPE_TRANSMISSION;
+                    float refractionIndex = material.refractionIndex;
+                    if (spectral && material.abbeNumber > 0)
+                    {
+                        // Every wavelength would bend its own way, only the hero goes on and takes over the others' weight.
+                        refractionIndex = refractionIndexAt(material, wavelengths.nanometers[0]);
+                        if (!heroOnly)
+                            attenuation = XMVectorSet(4 * XMVectorGetX(attenuation), 0, 0, 0);
+                        heroOnly = true;
+                    }
+                    const float ri = hit.frontFace ? (1.0f / refractionIndex) : refractionIndex;
+                    const XMVECTOR unitDirection = XMVector3Normalize(ray.direction);
+                    const float cosTheta = std::min(dot3(-unitDirection, hit.normal), 1.0f);
+                    const float sinTheta = std::sqrt(1.0f - cosTheta * cosTheta);
+                    if (ri * sinTheta > 1.0f || reflectance(cosTheta, ri) > RandomFloat(seed))
+                    {
+                        direction = reflect(unitDirection, hit.normal);
+                    }
+                    else
+                    {
+                        XMVECTOR perpendicular = ri * (unitDirection + cosTheta * hit.normal);
+                        XMVECTOR parallel = -std::sqrt(std::abs(1.0f - dot3(perpendicular, perpendicular))) * hit.normal;
+                        direction = perpendicular + parallel;
+                    }
+                }
+                break;
+            default:
+                type = BOUNCE_TYPE_DIFFUSE;
+                direction = hit.normal + randomUnitVector(seed);
+                if (XMVectorGetX(XMVector3LengthSq(direction)) < 1e-12f)
+                    direction = hit.normal;
+                ray.coneSpread = std::max(ray.coneSpread, DIFFUSE_CONE_SPREAD);
+                break;
+            }
+
+            attenuation *= spectrum(albedo);
+            ++length;
+            if (++bounces[type] > camera.maxBounces[type])
+                return finish(XMVectorZero(), type);
+            if (XMVectorGetX(spectral ? XMVector4Length(attenuation) : XMVector3Length(attenuation)) < 0.0001f)
+                return finish(XMVectorZero());
+
+            ray.direction = XMVector3Normalize(direction);
+            ray.origin = p + ray.direction * 0.001f;
+        }
+    }
+
+    // Same camera as the ray generation shader.
+    class CameraRays
+    {
+    public:
+        CameraRays(const CameraData& camera, UINT width, UINT height) : camera(camera)
+        {
+            lookfrom = XMLoadFloat3(&camera.lookfrom);
+            const XMVECTOR lookat = XMLoadFloat3(&camera.lookat);
+            const float h = std::tan(XMConvertToRadians(camera.vfov) / 2);
+            const float viewportHeight = 2 * h * camera.focusDist;
+            const float viewportWidth = viewportHeight * ((float)width / height);
+
+            const XMVECTOR w = XMVector3Normalize(lookfrom - lookat);
+            u = XMVector3Normalize(XMVector3Cross(XMVectorSet(0, 1, 0, 0), w));
+            v = XMVector3Cross(w, u);
+
+            const XMVECTOR viewportU = viewportWidth * -u;
+            const XMVECTOR viewportV = viewportHeight * -v;
+            pixelDeltaU = viewportU / (float)width;
+            pixelDeltaV = viewportV / (float)height;
+            pixelSpread = 2 * h / height;
+            pixel00 = lookfrom - camera.focusDist * w - viewportU / 2 - viewportV / 2 + 0.5f * (pixelDeltaU + pixelDeltaV);
+
+            defocusRadius = camera.focusDist * std::tan(XMConvertToRadians(camera.defocusAngle / 2));
+            hasMotion = camera.shutterClose > camera.shutterOpen;
+        }
+
+        // Pixels are seeded by their position in the whole image and every sample by its index, like
+        // the unstratified samples of the ray generation shader. Any region or sample range comes out
+        // exactly like the same samples of a full render.
+        UINT pixelSeed(UINT x, UINT y) const
+        {
+            return SetupSeed(SetupSeed(x, y), camera.frameIndex);
+        }
+
+        static UINT sampleSeed(UINT pixelSeed, UINT sample)
+        {
+            return SetupSeed(SetupSeed(pixelSeed, sample), 0);
+        }
+
+        template <UINT Features = REFERENCE_KERNEL_ALL>
+        Ray generate(UINT x, UINT y, UINT& seed) const
+        {
+            XMVECTOR pixelSample = pixel00 + (x + RandomFloat(seed, -0.5f, 0.5f)) * pixelDeltaU + (y + RandomFloat(seed, -0.5f, 0.5f)) * pixelDeltaV;
+
+            Ray ray = { lookfrom };
+            if ((Features & REFERENCE_KERNEL_DEFOCUS) && camera.defocusAngle > 0)
+            {
+                float diskX, diskY;
+                do
+                {
+                    diskX = RandomFloat(seed, -1, 1);
+                    diskY = RandomFloat(seed, -1, 1);
+                } while (diskX * diskX + diskY * diskY >= 1);
+                ray.origin += defocusRadius * (diskX * u + diskY * v);
+            }
+            ray.direction = pixelSample - ray.origin;
+            ray.time = (Features & REFERENCE_KERNEL_MOTION) && hasMotion ? RandomFloat(seed) : 0.0f;
+            ray.coneSpread = pixelSpread;
+            return ray;
+        }
+
+    private:
+        const CameraData& camera;
+        XMVECTOR lookfrom;
+        XMVECTOR u;
+        XMVECTOR v;
+        XMVECTOR pixelDeltaU;
+        XMVECTOR pixelDeltaV;
+        XMVECTOR pixel00;
+        float defocusRadius;
+        float pixelSpread;
+        bool hasMotion;
+    };
+
+    // Calls func(x0, y0, columns, rows) for every packet sized block in block row blockRow of region.
+    template <typename Func>
+    void forEachBlock(const ImageRect& region, UINT blockRow, Func&& func)
+    {
+        const UINT y0 = region.y + blockRow * PACKET_WIDTH;
+        const UINT rows = std::min(PACKET_WIDTH, region.y + region.height - y0);
+        for (UINT x0 = region.x; x0 < region.x + region.width; x0 += PACKET_WIDTH)
+        {
+            func(x0, y0, std::min(PACKET_WIDTH, region.x + region.width - x0), rows);
+        }
+    }
+}
+
+void CaptureReferenceFrame(ReferenceFrame& frame, const MotionBVH& bvh)
+{
+    frame.camera = cameraData;
+    frame.transforms.resize(proceduralInstances.size());
+    frame.motion.resize(proceduralInstances.size());
+    for (size_t i = 0; i < proceduralInstances.size(); ++i)
+    {
+        frame.transforms[i] = proceduralInstances[i].transform;
+        frame.motion[i] = proceduralInstances[i].motion;
+    }
+    frame.bvh = bvh;
+
+    // A grid left over from an earlier capture keeps its memory for the next one, ReferenceScene
+    // only looks at it when spatialIndex says so.
+    frame.spatialIndex = sceneSpatialIndex;
+    if (frame.spatialIndex != SPATIAL_INDEX_BVH)
+    {
+        BuildUniformGrid(frame.grid, bvh);
+        if (frame.spatialIndex == SPATIAL_INDEX_AUTO)
+            frame.spatialIndex = ChooseSpatialIndex(frame.grid);
+    }
+}
+
+UINT ReferenceKernelFeatures(const CameraData& camera)
+{
+    if (!specializedReferenceKernels)
+        return REFERENCE_KERNEL_ALL;
+
+    UINT features = 0;
+    if (camera.defocusAngle > 0)
+        features |= REFERENCE_KERNEL_DEFOCUS;
+    if (camera.shutterClose > camera.shutterOpen)
+        features |= REFERENCE_KERNEL_MOTION;
+    if (camera.spectral)
+        features |= REFERENCE_KERNEL_SPECTRAL;
+    if (std::any_of(materialList.begin(), materialList.end(), [](const MaterialData& material) { return material.textureType != TEXTURE_TYPE_NONE; }))
+        features |= REFERENCE_KERNEL_TEXTURES;
+    return features;
+}
+
+// On a pool spread over NUMA nodes, every node traces a copy of the frame (its BVH, grid and instances)
+// made by one of its own threads, so the copy is first touched in, and placed in, that node's memory.
+// Scene globals like meshes and materials are still shared. No copies on a single node.
+std::vector<ReferenceFrame> ReplicateReferenceFrame(const ReferenceFrame& frame, ThreadPool& pool)
+{
+    std::vector<ReferenceFrame> replicas;
+    if (replicateFramePerNode && pool.NodeCount() > 1)
+    {
+        replicas.resize(pool.NodeCount());
+        pool.RunOnEachNode([&](UINT node) { replicas[node] = frame; });
+    }
+    return replicas;
+}
+
+namespace
+{
+    // Adds samples [firstSample, firstSample + sampleCount) of every pixel in region to sums, three
+    // fixed point channels per pixel, in region order. Nodes of pool trace the frame's replicas, made
+    // here unless the caller passes them in.
+    template <UINT Features>
+    void accumulateSamplesWith(const ReferenceFrame& frame, UINT width, UINT height, const ImageRect& region,
+        UINT firstSample, UINT sampleCount, INT64* sums, ThreadPool* pool, PathStats* stats,
+        std::span<const ReferenceFrame> replicas)
+    {
+        std::vector<ReferenceFrame> ownReplicas;
+        if (pool && replicas.empty())
+        {
+            ownReplicas = ReplicateReferenceFrame(frame, *pool);
+            replicas = ownReplicas;
+        }
+        if (!replicas.empty() && (!pool || replicas.size() != pool->NodeCount()))
+        {
+            throw std::invalid_argument("Reference frame replicas are for another pool");
+        }
+
+        std::vector<std::optional<ReferenceScene>> scenes(std::max<size_t>(replicas.size(), 1));
+        if (!replicas.empty())
+        {
+            pool->RunOnEachNode([&](UINT node) { scenes[node].emplace(replicas[node]); });
+        }
+        else
+        {
+            scenes[0].emplace(frame);
+        }
+
+        const CameraRays camera(frame.camera, width, height);
+        std::mutex statsMutex;
+
+        // Every sample of a block is a packet of primary rays, each path then continues on its own.
+        auto renderBlockRow = [&](UINT blockRow, UINT node) {
+            const ReferenceScene& scene = *scenes[replicas.empty() ? 0 : node];
+            PathStats rowStats = {};
+            forEachBlock(region, blockRow, [&](UINT x0, UINT y0, UINT columns, UINT rows) {
+                const UINT count = columns * rows;
+                UINT pixelSeeds[PACKET_SIZE];
+                for (UINT i = 0; i < count; ++i)
+                {
+                    pixelSeeds[i] = camera.pixelSeed(x0 + i % columns, y0 + i / columns);
+                }
+
+                Ray rays[PACKET_SIZE];
+                UINT seeds[PACKET_SIZE];
+                Hit hits[PACKET_SIZE];
+                bool found[PACKET_SIZE];
+                for (UINT sample = firstSample; sample < firstSample + sampleCount; ++sample)
+                {
+                    for (UINT i = 0; i < count; ++i)
+                    {
+                        seeds[i] = CameraRays::sampleSeed(pixelSeeds[i], sample);
+                        rays[i] = camera.generate<Features>(x0 + i % columns, y0 + i / columns, seeds[i]);
+                    }
+                    scene.intersectPacket(rays, count, seeds, hits, found);
+
+                    for (UINT i = 0; i < count; ++i)
+                    {
+                        XMFLOAT3 color;
+                        XMStoreFloat3(&color, tracePath<Features>(scene, frame.camera, rays[i], seeds[i], found[i], hits[i], stats ? &rowStats : nullptr));
+                        INT64* pixelSums = sums + ((size_t)(y0 + i / columns - region.y) * region.width + x0 + i % columns - region.x) * 3;
+                        pixelSums[0] += ToSampleFixedPoint(color.x);
+                        pixelSums[1] += ToSampleFixedPoint(color.y);
+                        pixelSums[2] += ToSampleFixedPoint(color.z);
+                    }
+                }
+            });
+
+            if (stats)
+            {
+                std::lock_guard lock(statsMutex);
+                addPathStats(*stats, rowStats);
+            }
+        };
+
+        // Block rows are independent, every sample seeds its own generator. Each node gets a band of
+        // them, so the rows of sums it writes stay together too.
+        const UINT blockRows = (region.height + PACKET_WIDTH - 1) / PACKET_WIDTH;
+        if (pool)
+        {
+            pool->ParallelForNodes(blockRows, renderBlockRow);
+        }
+        else
+        {
+            for (UINT blockRow = 0; blockRow < blockRows; ++blockRow)
+            {
+                renderBlockRow(blockRow, 0);
+            }
+        }
+    }
+
+    using AccumulateSamples = decltype(&accumulateSamplesWith<0>);
+
+    template <UINT... Features>
+    constexpr std::array<AccumulateSamples, sizeof...(Features)> accumulateKernels(std::integer_sequence<UINT, Features...>)
+    {
+        return { &accumulateSamplesWith<Features>... };
+    }
+
+    // Indexed by the set of features, one kernel for every combination.
+    constexpr auto ACCUMULATE_KERNELS = accumulateKernels(std::make_integer_sequence<UINT, REFERENCE_KERNEL_ALL + 1>());
+
+    void accumulateSamples(const ReferenceFrame& frame, UINT width, UINT height, const ImageRect& region,
+        UINT firstSample, UINT sampleCount, INT64* sums, ThreadPool* pool, PathStats* stats,
+        std::span<const ReferenceFrame> replicas = {})
+    {
+        const UINT features = ReferenceKernelFeatures(frame.camera);
+        ACCUMULATE_KERNELS[features](frame, width, height, region, firstSample, sampleCount, sums, pool, stats, replicas);
+    }
+}
+
+void RenderReference(const ReferenceFrame& frame, UINT width, UINT height, std::vector<DirectX::XMFLOAT3>& image,
+    ThreadPool* pool, PathStats* stats)
+{
+    RenderReferenceRegion(frame, width, height, { 0, 0, width, height }, image, pool, stats);
+}
+
+void RenderReferenceRegion(const ReferenceFrame& frame, UINT width, UINT height, const ImageRect& region,
+    std::vector<DirectX::XMFLOAT3>& image, ThreadPool* pool, PathStats* stats, std::span<const ReferenceFrame> replicas)
+{
+    const UINT samples = std::max(frame.camera.samplesPerPixel, 1u);
+    std::vector<INT64> sums((size_t)region.width * region.height * 3, 0);
+    accumulateSamples(frame, width, height, region, 0, samples, sums.data(), pool, stats, replicas);
+
+    image.resize((size_t)region.width * region.height);
+    for (size_t i = 0; i < image.size(); ++i)
+    {
+        image[i] = { FromSampleFixedPoint(sums[3 * i], samples),
+                     FromSampleFixedPoint(sums[3 * i + 1], samples),
+                     FromSampleFixedPoint(sums[3 * i + 2], samples) };
+    }
+}
+
+void RenderReferenceSamples(const ReferenceFrame& frame, UINT width, UINT height, UINT firstSample, UINT sampleCount,
+    std::vector<INT64>& sums, ThreadPool* pool)
+{
+    sums.assign((size_t)width * height * 3, 0);
+    accumulateSamples(frame, width, height, { 0, 0, width, height }, firstSample, sampleCount, sums.data(), pool, nullptr);
+}
+
+UINT TraceReferencePrimaryHits(const ReferenceFrame& frame, UINT width, UINT height, bool packets)
+{
+    const ReferenceScene scene(frame);
+    const CameraRays camera(frame.camera, width, height);
+    const ImageRect region = { 0, 0, width, height };
+
+    UINT hitCount = 0;
+    for (UINT blockRow = 0; blockRow < (height + PACKET_WIDTH - 1) / PACKET_WIDTH; ++blockRow)
+    {
+        forEachBlock(region, blockRow, [&](UINT x0, UINT y0, UINT columns, UINT rows) {
+            const UINT count = columns * rows;
+            Ray rays[PACKET_SIZE];
+            UINT seeds[PACKET_SIZE];
+            Hit hits[PACKET_SIZE];
+            bool found[PACKET_SIZE];
+            for (UINT i = 0; i < count; ++i)
+            {
+                seeds[i] = CameraRays::sampleSeed(camera.pixelSeed(x0 + i % columns, y0 + i / columns), 0);
+                rays[i] = camera.generate(x0 + i % columns, y0 + i / columns, seeds[i]);
+            }
+
+            if (packets)
+            {
+                scene.intersectPacket(rays, count, seeds, hits, found);
+            }
+            else
+            {
+                for (UINT i = 0; i < count; ++i)
+                {
+                    found[i] = scene.intersect(rays[i], seeds[i], hits[i]);
+                }
+            }
+
+            for (UINT i = 0; i < count; ++i)
+            {
+                hitCount += found[i];
+            }
+        });
+    }
+    return hitCount;
+}
+
+void TraceReferenceFirstHits(const ReferenceFrame& frame, UINT width, UINT height,
+    std::vector<XMFLOAT3>& positions, std::vector<XMFLOAT3>& normals)
+{
+    const ReferenceScene scene(frame);
+    const CameraRays camera(frame.camera, width, height);
+    const ImageRect region = { 0, 0, width, height };
+
+    positions.assign((size_t)width * height, { 0, 0, 0 });
+    normals.assign((size_t)width * height, { 0, 0, 0 });
+    for (UINT blockRow = 0; blockRow < (height + PACKET_WIDTH - 1) / PACKET_WIDTH; ++blockRow)
+    {
+        forEachBlock(region, blockRow, [&](UINT x0, UINT y0, UINT columns, UINT rows) {
+            const UINT count = columns * rows;
+            Ray rays[PACKET_SIZE];
+            UINT seeds[PACKET_SIZE];
+            Hit hits[PACKET_SIZE];
+            bool found[PACKET_SIZE];
+            for (UINT i = 0; i < count; ++i)
+            {
+                seeds[i] = CameraRays::sampleSeed(camera.pixelSeed(x0 + i % columns, y0 + i / columns), 0);
+                rays[i] = camera.generate(x0 + i % columns, y0 + i / columns, seeds[i]);
+            }
+            scene.intersectPacket(rays, count, seeds, hits, found);
+
+            for (UINT i = 0; i < count; ++i)
+            {
+                if (!found[i])
+                    continue;
+
+                // Like the shaders, only view independent first hits get a normal, see IsHistoryValid.
+                const size_t pixel = (size_t)(y0 + i / columns) * width + x0 + i % columns;
+                XMStoreFloat3(&positions[pixel], rays[i].origin + hits[i].t * rays[i].direction);
+                const MATERIAL_TYPE type = materialList[objectList[hits[i].instance].materialIndex].type;
+                if (type == MATERIAL_TYPE_LAMBERTIAN || type == MATERIAL_TYPE_DIFFUSE_LIGHT)
+                    XMStoreFloat3(&normals[pixel], hits[i].normal);
+            }
+        });
+    }
+}
+
+void TraceMeshRays(UINT mesh, std::span<const MeshRay> rays, std::span<MeshRayHit> hits, ThreadPool* pool, bool queue)
+{
+    // Rays in chunks, every chunk keeps the rays it had to put off for a treelet that wasn't in memory.
+    // Without queue they read it right where they get to it instead, like paths in the renderer do.
+    constexpr UINT CHUNK_SIZE = 1024;
+    struct Deferred
+    {
+        UINT treelet;
+        UINT ray;
+    };
+    const MeshData& data = meshList[mesh];
+    const UINT chunkCount = (UINT)((rays.size() + CHUNK_SIZE - 1) / CHUNK_SIZE);
+    std::vector<std::vector<Deferred>> chunkDeferred(chunkCount);
+    auto runAll = [pool](UINT count, const std::function<void(UINT)>& func) {
+        if (pool)
+            pool->ParallelFor(count, func);
+        else
+            for (UINT i = 0; i < count; ++i)
+                func(i);
+    };
+
+    // Whatever is in memory already is traced right away, like intersectMesh does.
+    runAll(chunkCount, [&](UINT chunk) {
+        for (UINT i = chunk * CHUNK_SIZE; i < std::min<size_t>(rays.size(), (size_t)(chunk + 1) * CHUNK_SIZE); ++i)
+        {
+            const XMVECTOR origin = XMLoadFloat3(&rays[i].origin);
+            const XMVECTOR direction = XMLoadFloat3(&rays[i].direction);
+            float t = FLT_MAX;
+            XMVECTOR normal = XMVectorZero();
+            if (data.treelets.empty())
+            {
+                const UINT* indices = &meshIndices[data.indexOffset];
+                const XMFLOAT3* vertices = &meshVertices[data.vertexOffset];
+                ReferenceScene::intersectMeshNodes(data.bvh.data(), [&](UINT triangle, XMVECTOR& a, XMVECTOR& b, XMVECTOR& c) {
+                    a = XMLoadFloat3(&vertices[indices[3 * triangle]]);
+                    b = XMLoadFloat3(&vertices[indices[3 * triangle + 1]]);
+                    c = XMLoadFloat3(&vertices[indices[3 * triangle + 2]]);
+                }, origin, direction, t, normal);
+            }
+            else
+            {
+                ReferenceScene::walkMeshTop(data, origin, direction, t, [&](UINT treelet) {
+                    if (auto page = queue ? FindMeshTreelet(mesh, treelet) : GetMeshTreelet(mesh, treelet))
+                        ReferenceScene::intersectTreelet(*page, origin, direction, t, normal);
+                    else
+                        chunkDeferred[chunk].push_back({ treelet, i });
+                });
+            }
+            hits[i].t = t;
+            XMStoreFloat3(&hits[i].normal, normal);
+        }
+    });
+
+    // The rest waits in one queue per treelet, which is then read once for all of them.
+    std::vector<Deferred> deferred;
+    for (const auto& chunk : chunkDeferred)
+    {
+        deferred.insert(deferred.end(), chunk.begin(), chunk.end());
+    }
+    if (deferred.empty())
+        return;
+    std::sort(deferred.begin(), deferred.end(), [](const Deferred& a, const Deferred& b) {
+        return a.treelet != b.treelet ? a.treelet < b.treelet : a.ray < b.ray;
+    });
+    std::vector<UINT> queueStarts;
+    UINT64 maxQueueLength = 0;
+    for (UINT i = 0; i < (UINT)deferred.size(); ++i)
+    {
+        if (i == 0 || deferred[i].treelet != deferred[i - 1].treelet)
+        {
+            if (!queueStarts.empty())
+                maxQueueLength = std::max<UINT64>(maxQueueLength, i - queueStarts.back());
+            queueStarts.push_back(i);
+        }
+    }
+    maxQueueLength = std::max<UINT64>(maxQueueLength, deferred.size() - queueStarts.back());
+    queueStarts.push_back((UINT)deferred.size());
+    RecordMeshRayQueues(deferred.size(), queueStarts.size() - 1, maxQueueLength);
+
+    // Hits from the first pass stay as they are while the queues run, a queued ray only has to beat
+    // those. Every queue entry gets its own result and the closest one wins afterwards.
+    std::vector<MeshRayHit> queuedHits(deferred.size());
+    runAll((UINT)queueStarts.size() - 1, [&](UINT queue) {
+        const auto page = GetMeshTreelet(mesh, deferred[queueStarts[queue]].treelet);
+        for (UINT i = queueStarts[queue]; i < queueStarts[queue + 1]; ++i)
+        {
+            const MeshRay& ray = rays[deferred[i].ray];
+            float t = hits[deferred[i].ray].t;
+            XMVECTOR normal = XMVectorZero();
+            queuedHits[i].t = ReferenceScene::intersectTreelet(*page, XMLoadFloat3(&ray.origin), XMLoadFloat3(&ray.direction), t, normal)
+                                  ? t : FLT_MAX;
+            XMStoreFloat3(&queuedHits[i].normal, normal);
+        }
+    });
+    for (size_t i = 0; i < deferred.size(); ++i)
+    {
+        MeshRayHit& hit = hits[deferred[i].ray];
+        if (queuedHits[i].t < hit.t)
+            hit = queuedHits[i];
+    }
+}
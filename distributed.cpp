@@ -0,0 +1,794 @@
+#include "core.h"
+#include <fstream>
+#include <type_traits>
+
+#ifdef _WIN32
+#define NOMINMAX
+#define WIN32_LEAN_AND_MEAN
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#pragma comment(lib, "ws2_32")
+#else
+#include <netdb.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+// Distributed still rendering with the reference renderer. A coordinator splits the image into
+// tiles and hands them out to worker processes over TCP, local or not. Workers get the whole scene
+// once in a compact binary form, so they don't need to reproduce scene setup (random scenes
+// wouldn't come out the same anyway). Tiles of workers that disconnect or time out are handed out
+// again, and once nothing is left to hand out, idle workers duplicate the oldest outstanding tiles,
+// so a slow worker can't hold up the whole image. Every pixel is seeded from its position and
+// cameraData.frameIndex, which makes the result identical to a single process render.
+
+namespace
+{
+    using namespace DirectX;
+
+#ifdef _WIN32
+    using Socket = SOCKET;
+    constexpr Socket NO_SOCKET = INVALID_SOCKET;
+    constexpr int NO_SIGNAL = 0;
+
+    void closeSocket(Socket socket) { closesocket(socket); }
+    int pollSockets(pollfd* fds, size_t count, int timeoutMilliseconds) { return WSAPoll(fds, (ULONG)count, timeoutMilliseconds); }
+
+    // Winsock has to be started before anything else touches it.
+    struct SocketLibrary
+    {
+        SocketLibrary() { WSADATA data; WSAStartup(MAKEWORD(2, 2), &data); }
+        ~SocketLibrary() { WSACleanup(); }
+    };
+#else
+    using Socket = int;
+    constexpr Socket NO_SOCKET = -1;
+    // Writing to a worker that went away must not kill the coordinator with SIGPIPE.
+    constexpr int NO_SIGNAL = MSG_NOSIGNAL;
+
+    void closeSocket(Socket socket) { close(socket); }
+    int pollSockets(pollfd* fds, size_t count, int timeoutMilliseconds) { return poll(fds, count, timeoutMilliseconds); }
+
+    struct SocketLibrary {};
+#endif
+
+    constexpr UINT SCENE_MAGIC = 0x43535452; // "RTSC"
+    constexpr UINT SCENE_VERSION = 10;
+
+    // Messages are a header followed by size bytes of payload.
+    enum MESSAGE_TYPE : UINT {
+        MESSAGE_TYPE_JOB = 0,    // Coordinator to worker: JobHeader and the serialized scene.
+        MESSAGE_TYPE_TILE = 1,   // Coordinator to worker: TileRequest.
+        MESSAGE_TYPE_RESULT = 2, // Worker to coordinator: tile index and its pixels.
+        MESSAGE_TYPE_DONE = 3,   // Coordinator to worker: image finished, disconnect.
+    };
+
+    struct MessageHeader
+    {
+        MESSAGE_TYPE type;
+        UINT size;
+    };
+
+    struct JobHeader
+    {
+        UINT width;
+        UINT height;
+    };
+
+    struct TileRequest
+    {
+        UINT tile;
+        ImageRect rect;
+    };
+
+    // Anything bigger is a broken or foreign peer, not a tile.
+    constexpr UINT MAX_MESSAGE_SIZE = 1u << 30;
+    // A worker sitting on a tile that long is considered lost.
+    constexpr auto TILE_TIMEOUT = std::chrono::seconds(120);
+    // Copies of one tile out at the same time, the original and one duplicate for slow workers.
+    constexpr UINT MAX_TILE_COPIES = 2;
+    constexpr UINT NO_TILE = UINT_MAX;
+
+    // Instance as far as rendering is concerned, keyframes stay with the coordinator.
+    struct SerializedInstance
+    {
+        XMFLOAT4X3 transform;
+        XMFLOAT3 motion;
+        UINT instanceID;
+        UINT hitGroupIndex;
+        OBJECT_TYPE type;
+        UINT prototypeIndex;
+    };
+
+    struct SerializedMesh
+    {
+        UINT vertexOffset;
+        UINT vertexCount;
+        UINT indexOffset;
+        UINT indexCount;
+        AABB bounds;
+    };
+
+    class ByteWriter
+    {
+    public:
+        explicit ByteWriter(std::vector<UINT8>& bytes) : bytes(bytes) {}
+
+        template <typename T>
+        void Write(const T& value)
+        {
+            static_assert(std::is_trivially_copyable_v<T>);
+            const size_t at = bytes.size();
+            bytes.resize(at + sizeof(T));
+            memcpy(bytes.data() + at, &value, sizeof(T));
+        }
+
+        template <typename T>
+        void WriteArray(std::span<const T> values)
+        {
+            static_assert(std::is_trivially_copyable_v<T>);
+            if (values.size() > UINT_MAX)
+            {
+                throw std::runtime_error("Scene array too large to send");
+            }
+            Write((UINT)values.size());
+            const UINT8* data = reinterpret_cast<const UINT8*>(values.data());
+            bytes.insert(bytes.end(), data, data + values.size_bytes());
+        }
+
+        template <typename T>
+        void WriteArray(const std::vector<T>& values)
+        {
+            WriteArray(std::span<const T>(values));
+        }
+
+    private:
+        std::vector<UINT8>& bytes;
+    };
+
+    class ByteReader
+    {
+    public:
+        ByteReader(const UINT8* data, size_t size) : data(data), end(data + size) {}
+
+        template <typename T>
+        T Read()
+        {
+            static_assert(std::is_trivially_copyable_v<T>);
+            T value;
+            memcpy(&value, take(sizeof(T)), sizeof(T));
+            return value;
+        }
+
+        template <typename T>
+        void ReadArray(std::vector<T>& values)
+        {
+            static_assert(std::is_trivially_copyable_v<T>);
+            UINT count = Read<UINT>();
+            if (count > (size_t)(end - data) / sizeof(T))
+            {
+                throw std::runtime_error("Truncated scene data");
+            }
+            values.resize(count);
+            memcpy(values.data(), take(count * sizeof(T)), count * sizeof(T));
+        }
+
+    private:
+        const UINT8* take(size_t size)
+        {
+            if (size > (size_t)(end - data))
+            {
+                throw std::runtime_error("Truncated scene data");
+            }
+            const UINT8* taken = data;
+            data += size;
+            return taken;
+        }
+
+        const UINT8* data;
+        const UINT8* end;
+    };
+
+    // Scenes come off the network, so every index in them is checked before anything follows it.
+    void checkRange(UINT64 offset, UINT64 count, size_t size, const char* what)
+    {
+        if (offset + count > size)
+        {
+            throw std::runtime_error(std::string(what) + " out of range");
+        }
+    }
+
+    // Children are checked by BVHDepth.
+    void checkBVHShape(std::span<const BVHNode> nodes)
+    {
+        if (nodes.empty())
+            throw std::runtime_error("Mesh without a BVH");
+        if (BVHDepth(nodes) > BVH_MAX_DEPTH)
+            throw std::runtime_error("Mesh BVH deeper than traversal can handle");
+    }
+
+    // Leaves index triangles [0, triangleCount).
+    void checkMeshBVH(std::span<const BVHNode> nodes, size_t triangleCount)
+    {
+        checkBVHShape(nodes);
+        for (const BVHNode& node : nodes)
+        {
+            if (node.primitiveCount > 0)
+                checkRange(node.leftOrFirst, node.primitiveCount, triangleCount, "Mesh BVH leaf");
+        }
+    }
+
+    // Treelets must lie in the pages and their BVHs index their own triangles, the top's leaves index treelets.
+    void checkPagedMesh(const MeshData& mesh, std::span<const UINT8> pages)
+    {
+        checkBVHShape(mesh.bvh);
+        for (const BVHNode& node : mesh.bvh)
+        {
+            if (node.primitiveCount > 0 && node.leftOrFirst >= mesh.treelets.size())
+                throw std::runtime_error("Mesh treelet out of range");
+        }
+
+        std::vector<BVHNode> nodes;
+        for (const MeshTreelet& treelet : mesh.treelets)
+        {
+            const size_t nodeBytes = (size_t)treelet.nodeCount * sizeof(BVHNode);
+            checkRange(treelet.offset, nodeBytes + (UINT64)treelet.triangleCount * 3 * sizeof(XMFLOAT3), pages.size(), "Mesh treelet");
+            nodes.resize(treelet.nodeCount);
+            memcpy(nodes.data(), pages.data() + treelet.offset, nodeBytes);
+            checkMeshBVH(nodes, treelet.triangleCount);
+        }
+    }
+
+    void checkMesh(const MeshData& mesh)
+    {
+        checkRange(mesh.vertexOffset, mesh.vertexCount, meshVertices.size(), "Mesh vertices");
+        checkRange(mesh.indexOffset, mesh.indexCount, meshIndices.size(), "Mesh indices");
+        if (mesh.indexCount % 3 != 0)
+            throw std::runtime_error("Mesh index count isn't a multiple of three");
+        for (UINT i = 0; i < mesh.indexCount; ++i)
+        {
+            if (meshIndices[mesh.indexOffset + i] >= mesh.vertexCount)
+                throw std::runtime_error("Mesh index out of range");
+        }
+        checkMeshBVH(mesh.bvh, mesh.indexCount / 3);
+    }
+
+    // After everything is read, what instances, objects and materials point at has to be there.
+    void checkSceneReferences()
+    {
+        for (const ObjectData& object : objectList)
+        {
+            if (object.materialIndex >= materialList.size())
+                throw std::runtime_error("Object material out of range");
+        }
+        for (const MaterialData& material : materialList)
+        {
+            if (material.textureType == TEXTURE_TYPE_IMAGE && material.textureIndex >= textureList.size())
+                throw std::runtime_error("Material texture out of range");
+        }
+        for (const QuadGroupData& group : groupList)
+        {
+            checkRange(group.quadOffset, group.quadCount, groupQuads.size(), "Quad group");
+        }
+
+        for (const ProceduralInstance& instance : proceduralInstances)
+        {
+            if (instance.instanceID >= objectList.size())
+                throw std::runtime_error("Instance object out of range");
+            switch (instance.type)
+            {
+            case OBJECT_TYPE_SPHERE:
+            case OBJECT_TYPE_QUAD:
+            case OBJECT_TYPE_MOVING_SPHERE: // Its motion BLAS index is for the GPU only.
+                break;
+            case OBJECT_TYPE_VOLUMETRIC_CUBE:
+                if (instance.prototypeIndex != NO_DENSITY_GRID && instance.prototypeIndex >= gridList.size())
+                    throw std::runtime_error("Instance density grid out of range");
+                break;
+            case OBJECT_TYPE_TRIANGLE_MESH:
+                if (instance.prototypeIndex >= meshList.size())
+                    throw std::runtime_error("Instance mesh out of range");
+                break;
+            case OBJECT_TYPE_QUAD_GROUP:
+                if (instance.prototypeIndex >= groupList.size())
+                    throw std::runtime_error("Instance quad group out of range");
+                break;
+            default:
+                throw std::runtime_error("Instance of unknown object type");
+            }
+        }
+    }
+
+    bool sendAll(Socket socket, const void* data, size_t size)
+    {
+        const char* bytes = static_cast<const char*>(data);
+        while (size > 0)
+        {
+            int sent = send(socket, bytes, (int)std::min<size_t>(size, INT_MAX), NO_SIGNAL);
+            if (sent <= 0)
+                return false;
+            bytes += sent;
+            size -= sent;
+        }
+        return true;
+    }
+
+    bool receiveAll(Socket socket, void* data, size_t size)
+    {
+        char* bytes = static_cast<char*>(data);
+        while (size > 0)
+        {
+            int received = recv(socket, bytes, (int)std::min<size_t>(size, INT_MAX), 0);
+            if (received <= 0)
+                return false;
+            bytes += received;
+            size -= received;
+        }
+        return true;
+    }
+
+    bool sendMessage(Socket socket, MESSAGE_TYPE type, const void* payload, size_t size, const void* payload2 = nullptr, size_t size2 = 0)
+    {
+        MessageHeader header = { type, (UINT)(size + size2) };
+        return sendAll(socket, &header, sizeof(header)) &&
+               sendAll(socket, payload, size) &&
+               sendAll(socket, payload2, size2);
+    }
+
+    bool receiveMessage(Socket socket, MessageHeader& header, std::vector<UINT8>& payload)
+    {
+        if (!receiveAll(socket, &header, sizeof(header)) || header.size > MAX_MESSAGE_SIZE)
+            return false;
+        payload.resize(header.size);
+        return receiveAll(socket, payload.data(), payload.size());
+    }
+
+    Socket openSocket(const char* host, const char* port, bool listening)
+    {
+        addrinfo hints = {};
+        hints.ai_family = AF_INET;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = listening ? AI_PASSIVE : 0;
+
+        addrinfo* addresses = nullptr;
+        if (getaddrinfo(host, port, &hints, &addresses) != 0 || addresses == nullptr)
+        {
+            throw std::runtime_error(std::string("Can't resolve ") + (host ? host : "") + ":" + port);
+        }
+
+        Socket socket = ::socket(addresses->ai_family, addresses->ai_socktype, addresses->ai_protocol);
+        bool ok = socket != NO_SOCKET;
+        if (ok && listening)
+        {
+            int reuse = 1;
+            setsockopt(socket, SOL_SOCKET, SO_REUSEADDR, reinterpret_cast<const char*>(&reuse), sizeof(reuse));
+            ok = bind(socket, addresses->ai_addr, (int)addresses->ai_addrlen) == 0 && listen(socket, SOMAXCONN) == 0;
+        }
+        else if (ok)
+        {
+            ok = connect(socket, addresses->ai_addr, (int)addresses->ai_addrlen) == 0;
+        }
+        freeaddrinfo(addresses);
+
+        if (!ok)
+        {
+            if (socket != NO_SOCKET)
+                closeSocket(socket);
+            throw std::runtime_error(std::string(listening ? "Can't listen on port " : "Can't connect to port ") + port);
+        }
+        return socket;
+    }
+
+    struct TileState
+    {
+        ImageRect rect;
+        bool done;
+        UINT copies; // Workers currently rendering it.
+        std::chrono::steady_clock::time_point issued;
+    };
+
+    struct WorkerConnection
+    {
+        Socket socket;
+        UINT tile;
+        std::chrono::steady_clock::time_point since;
+        UINT tilesRendered;
+    };
+}
+
+std::vector<UINT8> SerializeScene(const ReferenceFrame& frame)
+{
+    std::vector<UINT8> bytes;
+    ByteWriter writer(bytes);
+    writer.Write(SCENE_MAGIC);
+    writer.Write(SCENE_VERSION);
+    writer.Write(frame.camera);
+    // The scene's choice rather than the frame's, workers resolve SPATIAL_INDEX_AUTO from their own BVH.
+    writer.Write(sceneSpatialIndex);
+
+    std::vector<SerializedInstance> instances(proceduralInstances.size());
+    for (size_t i = 0; i < instances.size(); ++i)
+    {
+        const ProceduralInstance& instance = proceduralInstances[i];
+        XMStoreFloat4x3(&instances[i].transform, frame.transforms[i]);
+        instances[i].motion = frame.motion[i];
+        instances[i].instanceID = instance.instanceID;
+        instances[i].hitGroupIndex = instance.hitGroupIndex;
+        instances[i].type = instance.type;
+        instances[i].prototypeIndex = instance.prototypeIndex;
+    }
+    writer.WriteArray(instances);
+
+    writer.WriteArray(objectList);
+    writer.WriteArray(materialList);
+    writer.WriteArray(lightsList);
+    writer.WriteArray(groupList);
+    writer.WriteArray(groupQuads);
+    writer.WriteArray(meshVertices);
+    writer.WriteArray(meshIndices);
+
+    // Mesh BVHs go along, triangles are already stored in their leaf order. Paged meshes go with the
+    // top of their tree and their page file's contents, workers write those to page files of their own.
+    writer.Write((UINT)meshList.size());
+    for (const MeshData& mesh : meshList)
+    {
+        writer.Write(SerializedMesh{ mesh.vertexOffset, mesh.vertexCount, mesh.indexOffset, mesh.indexCount, mesh.bounds });
+        writer.WriteArray(mesh.bvh);
+        writer.WriteArray(mesh.treelets);
+        writer.WriteArray(MeshPageData(mesh));
+    }
+
+    // Density grids go without their majorants, those are quick to build again.
+    writer.Write((UINT)gridList.size());
+    for (const DensityGrid& grid : gridList)
+    {
+        for (UINT resolution : grid.resolution)
+            writer.Write(resolution);
+        writer.Write(grid.majorantBlock);
+        writer.WriteArray(grid.density);
+    }
+
+    // Textures go by path only, they are read a tile at a time when rendering. Workers need the
+    // same files at the same paths.
+    writer.Write((UINT)textureList.size());
+    for (const TextureData& texture : textureList)
+    {
+        writer.WriteArray(std::vector<char>(texture.path.begin(), texture.path.end()));
+    }
+    return bytes;
+}
+
+void DeserializeScene(const UINT8* data, size_t size, ReferenceFrame& frame)
+{
+    ByteReader reader(data, size);
+    if (reader.Read<UINT>() != SCENE_MAGIC || reader.Read<UINT>() != SCENE_VERSION)
+    {
+        throw std::runtime_error("Not a scene, or one from a different version");
+    }
+    cameraData = reader.Read<CameraData>();
+    sceneSpatialIndex = reader.Read<SPATIAL_INDEX>();
+
+    std::vector<SerializedInstance> instances;
+    reader.ReadArray(instances);
+    proceduralInstances.clear();
+    dirtyInstances.clear();
+    animatedInstances.clear();
+    for (const SerializedInstance& instance : instances)
+    {
+        proceduralInstances.push_back({ .transform = XMLoadFloat4x3(&instance.transform),
+                                        .instanceID = instance.instanceID,
+                                        .hitGroupIndex = instance.hitGroupIndex,
+                                        .type = instance.type,
+                                        .prototypeIndex = instance.prototypeIndex,
+                                        .motion = instance.motion });
+    }
+
+    reader.ReadArray(objectList);
+    reader.ReadArray(materialList);
+    reader.ReadArray(lightsList);
+    reader.ReadArray(groupList);
+    reader.ReadArray(groupQuads);
+    reader.ReadArray(meshVertices);
+    reader.ReadArray(meshIndices);
+
+    meshList.resize(reader.Read<UINT>());
+    for (MeshData& mesh : meshList)
+    {
+        auto header = reader.Read<SerializedMesh>();
+        mesh.vertexOffset = header.vertexOffset;
+        mesh.vertexCount = header.vertexCount;
+        mesh.indexOffset = header.indexOffset;
+        mesh.indexCount = header.indexCount;
+        mesh.bounds = header.bounds;
+        reader.ReadArray(mesh.bvh);
+        reader.ReadArray(mesh.treelets);
+        std::vector<UINT8> pages;
+        reader.ReadArray(pages);
+        mesh.pagePath.clear();
+        mesh.pageFile = nullptr;
+        if (!mesh.treelets.empty())
+        {
+            checkPagedMesh(mesh, pages);
+            StoreMeshPages(mesh, pages);
+        }
+        else
+        {
+            checkMesh(mesh);
+        }
+    }
+    ClearMeshPageCache();
+
+    gridList.resize(reader.Read<UINT>());
+    for (DensityGrid& grid : gridList)
+    {
+        for (UINT& resolution : grid.resolution)
+            resolution = reader.Read<UINT>();
+        UINT block = reader.Read<UINT>();
+        reader.ReadArray(grid.density);
+        if (grid.density.size() != (size_t)grid.resolution[0] * grid.resolution[1] * grid.resolution[2] || block == 0)
+        {
+            throw std::runtime_error("Density grid doesn't match its resolution");
+        }
+        BuildMajorantGrid(grid, block);
+    }
+
+    ClearTextures();
+    const UINT textureCount = reader.Read<UINT>();
+    for (UINT i = 0; i < textureCount; ++i)
+    {
+        std::vector<char> path;
+        reader.ReadArray(path);
+        LoadTexture(std::string(path.begin(), path.end()));
+    }
+    checkSceneReferences();
+
+    MotionBVH bvh;
+    BuildMotionBVH(bvh);
+    CaptureReferenceFrame(frame, bvh);
+}
+
+std::vector<XMFLOAT3> RenderDistributed(const DistributedSettings& settings)
+{
+    [[maybe_unused]] SocketLibrary socketLibrary;
+
+    SetupScene(settings.scene);
+    cameraData.samplesPerPixel = settings.samplesPerPixel;
+    cameraData.frameIndex = settings.frameIndex;
+    cameraData.spectral = settings.spectral;
+    AnimateInstances(cameraData.shutterOpen, cameraData.shutterClose);
+
+    ReferenceFrame frame;
+    CaptureReferenceFrame(frame, MotionBVH());
+    std::vector<UINT8> job;
+    ByteWriter(job).Write(JobHeader{ settings.width, settings.height });
+    std::vector<UINT8> scene = SerializeScene(frame);
+    job.insert(job.end(), scene.begin(), scene.end());
+
+    std::vector<TileState> tiles;
+    for (UINT y = 0; y < settings.height; y += settings.tileSize)
+    {
+        for (UINT x = 0; x < settings.width; x += settings.tileSize)
+        {
+            tiles.push_back({ .rect = { x, y, std::min(settings.tileSize, settings.width - x), std::min(settings.tileSize, settings.height - y) } });
+        }
+    }
+
+    std::deque<UINT> pending;
+    for (UINT tile = 0; tile < (UINT)tiles.size(); ++tile)
+    {
+        pending.push_back(tile);
+    }
+
+    std::vector<XMFLOAT3> image((size_t)settings.width * settings.height);
+    std::vector<WorkerConnection> workers;
+    UINT remaining = (UINT)tiles.size();
+    UINT reissued = 0;
+    UINT duplicated = 0;
+    UINT workersLost = 0;
+
+    Socket listener = openSocket(nullptr, settings.port, true);
+    printf("Coordinator: %ux%u, %u spp, %zu tiles of %u, scene %u (%zu bytes), waiting for workers on port %s\n",
+        settings.width, settings.height, settings.samplesPerPixel, tiles.size(), settings.tileSize,
+        settings.scene, scene.size(), settings.port);
+
+    auto t0 = std::chrono::steady_clock::now();
+
+    // Whatever the worker was rendering goes back to the front of the queue, unless another copy is still out.
+    auto dropWorker = [&](size_t index) {
+        WorkerConnection& worker = workers[index];
+        if (worker.tile != NO_TILE)
+        {
+            TileState& tile = tiles[worker.tile];
+            if (--tile.copies == 0 && !tile.done)
+            {
+                pending.push_front(worker.tile);
+                ++reissued;
+            }
+        }
+        closeSocket(worker.socket);
+        workers.erase(workers.begin() + index);
+        ++workersLost;
+    };
+
+    auto nextTile = [&]() {
+        while (!pending.empty())
+        {
+            UINT tile = pending.front();
+            pending.pop_front();
+            if (!tiles[tile].done)
+                return tile;
+        }
+
+        // Nothing new left, help out with the tile that has been out the longest.
+        UINT oldest = NO_TILE;
+        for (UINT tile = 0; tile < (UINT)tiles.size(); ++tile)
+        {
+            const TileState& state = tiles[tile];
+            if (!state.done && state.copies < MAX_TILE_COPIES && (oldest == NO_TILE || state.issued < tiles[oldest].issued))
+                oldest = tile;
+        }
+        if (oldest != NO_TILE)
+            ++duplicated;
+        return oldest;
+    };
+
+    std::vector<pollfd> fds;
+    std::vector<UINT8> payload;
+    while (remaining > 0)
+    {
+        auto now = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < workers.size();)
+        {
+            WorkerConnection& worker = workers[i];
+            if (worker.tile != NO_TILE && now - worker.since > TILE_TIMEOUT)
+            {
+                dropWorker(i);
+                continue;
+            }
+
+            if (worker.tile == NO_TILE)
+            {
+                UINT tile = nextTile();
+                if (tile != NO_TILE)
+                {
+                    TileRequest request = { tile, tiles[tile].rect };
+                    if (!sendMessage(worker.socket, MESSAGE_TYPE_TILE, &request, sizeof(request)))
+                    {
+                        pending.push_front(tile);
+                        dropWorker(i);
+                        continue;
+                    }
+                    worker.tile = tile;
+                    worker.since = now;
+                    tiles[tile].copies++;
+                    tiles[tile].issued = now;
+                }
+            }
+            ++i;
+        }
+
+        fds.assign(1, { .fd = listener, .events = POLLIN });
+        for (auto& worker : workers)
+        {
+            fds.push_back({ .fd = worker.socket, .events = POLLIN });
+        }
+        if (pollSockets(fds.data(), fds.size(), 1000) <= 0)
+            continue;
+
+        // Workers first, accepting appends to the list and would shift the poll results.
+        for (size_t i = workers.size(); i-- > 0;)
+        {
+            if (!(fds[i + 1].revents & (POLLIN | POLLHUP | POLLERR)))
+                continue;
+
+            WorkerConnection& worker = workers[i];
+            MessageHeader header;
+            bool ok = receiveMessage(worker.socket, header, payload) && header.type == MESSAGE_TYPE_RESULT && payload.size() >= sizeof(UINT);
+            UINT tile = ok ? ByteReader(payload.data(), payload.size()).Read<UINT>() : NO_TILE;
+            ok = ok && tile == worker.tile;
+            if (ok)
+            {
+                const ImageRect& rect = tiles[tile].rect;
+                ok = payload.size() == sizeof(UINT) + (size_t)rect.width * rect.height * sizeof(XMFLOAT3);
+            }
+            if (!ok)
+            {
+                dropWorker(i);
+                continue;
+            }
+
+            TileState& state = tiles[tile];
+            state.copies--;
+            worker.tile = NO_TILE;
+            worker.tilesRendered++;
+            if (state.done)
+                continue;
+
+            const XMFLOAT3* pixels = reinterpret_cast<const XMFLOAT3*>(payload.data() + sizeof(UINT));
+            for (UINT row = 0; row < state.rect.height; ++row)
+            {
+                memcpy(&image[(size_t)(state.rect.y + row) * settings.width + state.rect.x],
+                    pixels + (size_t)row * state.rect.width, state.rect.width * sizeof(XMFLOAT3));
+            }
+            state.done = true;
+            --remaining;
+        }
+
+        if (fds[0].revents & POLLIN)
+        {
+            Socket socket = accept(listener, nullptr, nullptr);
+            if (socket != NO_SOCKET)
+            {
+                if (sendMessage(socket, MESSAGE_TYPE_JOB, job.data(), job.size()))
+                {
+                    workers.push_back({ .socket = socket, .tile = NO_TILE });
+                    printf("Coordinator: worker %zu connected\n", workers.size());
+                }
+                else
+                {
+                    closeSocket(socket);
+                }
+            }
+        }
+    }
+
+    auto t1 = std::chrono::steady_clock::now();
+    for (auto& worker : workers)
+    {
+        sendMessage(worker.socket, MESSAGE_TYPE_DONE, nullptr, 0);
+        closeSocket(worker.socket);
+    }
+    closeSocket(listener);
+
+    printf("Coordinator: done in %.1f ms, %zu tiles, %u handed out again after %u lost workers, %u duplicated for slow workers\n",
+        std::chrono::duration<double, std::milli>(t1 - t0).count(), tiles.size(), reissued, workersLost, duplicated);
+
+    if (settings.output)
+    {
+        std::vector<UINT8> encoded = EncodePPM(settings.width, settings.height, image);
+        std::ofstream file(settings.output, std::ios::binary);
+        file.write(reinterpret_cast<const char*>(encoded.data()), encoded.size());
+        if (!file)
+        {
+            throw std::runtime_error(std::string("Can't write ") + settings.output);
+        }
+    }
+    return image;
+}
+
+int RunRenderWorker(const char* host, const char* port, ThreadPool& pool)
+{
+    [[maybe_unused]] SocketLibrary socketLibrary;
+    Socket socket = openSocket(host, port, false);
+
+    MessageHeader header;
+    std::vector<UINT8> payload;
+    if (!receiveMessage(socket, header, payload) || header.type != MESSAGE_TYPE_JOB || payload.size() < sizeof(JobHeader))
+    {
+        closeSocket(socket);
+        throw std::runtime_error("Coordinator didn't send a job");
+    }
+
+    JobHeader job = ByteReader(payload.data(), payload.size()).Read<JobHeader>();
+    ReferenceFrame frame;
+    DeserializeScene(payload.data() + sizeof(JobHeader), payload.size() - sizeof(JobHeader), frame);
+    printf("Worker: %ux%u, %zu instances\n", job.width, job.height, frame.transforms.size());
+    // Every tile is of the same frame, the nodes copy it once for all of them.
+    const std::vector<ReferenceFrame> replicas = ReplicateReferenceFrame(frame, pool);
+
+    UINT tilesRendered = 0;
+    std::vector<XMFLOAT3> pixels;
+    while (receiveMessage(socket, header, payload) && header.type == MESSAGE_TYPE_TILE && payload.size() == sizeof(TileRequest))
+    {
+        TileRequest request = ByteReader(payload.data(), payload.size()).Read<TileRequest>();
+        RenderReferenceRegion(frame, job.width, job.height, request.rect, pixels, &pool, nullptr, replicas);
+        if (!sendMessage(socket, MESSAGE_TYPE_RESULT, &request.tile, sizeof(request.tile), pixels.data(), pixels.size() * sizeof(XMFLOAT3)))
+            break;
+        ++tilesRendered;
+    }
+    closeSocket(socket);
+
+    printf("Worker: rendered %u tiles\n", tilesRendered);
+    return 0;
+}
@@ -0,0 +1,224 @@
+#include "core.h"
+#include <filesystem>
+#include <fstream>
+#include <memory>
+
+// Offline animation rendering with the reference renderer. Every frame goes through three stages:
+// update (animate instances and refit the motion BVH), trace (rows spread over the thread pool)
+// and encode (tonemap and write out a PPM). Pipelined, each stage runs on its own thread and hands
+// frames over through bounded queues, so frame N+1 gets animated while N is traced and N-1 encoded.
+
+namespace
+{
+    struct AnimationFrame
+    {
+        UINT index;
+        ReferenceFrame scene;
+        std::vector<DirectX::XMFLOAT3> hdr;
+        std::vector<UINT8> encoded;
+    };
+
+    using FramePtr = std::unique_ptr<AnimationFrame>;
+
+    // Producers block while the queue is full, which keeps a fast stage from running far ahead
+    // of a slow one (and from piling up frames in memory).
+    template <typename T>
+    class BoundedQueue
+    {
+    public:
+        explicit BoundedQueue(size_t capacity) : capacity(capacity) {}
+
+        void Push(T item)
+        {
+            std::unique_lock lock(mutex);
+            notFull.wait(lock, [&]() { return items.size() < capacity; });
+            items.push_back(std::move(item));
+            notEmpty.notify_one();
+        }
+
+        T Pop()
+        {
+            std::unique_lock lock(mutex);
+            notEmpty.wait(lock, [&]() { return !items.empty(); });
+            T item = std::move(items.front());
+            items.pop_front();
+            notFull.notify_one();
+            return item;
+        }
+
+    private:
+        std::deque<T> items;
+        size_t capacity;
+        std::mutex mutex;
+        std::condition_variable notFull;
+        std::condition_variable notEmpty;
+    };
+
+    // Frames in flight between two stages. One being worked on, one waiting is enough to keep
+    // all stages busy, more would just add latency.
+    constexpr size_t STAGE_QUEUE_CAPACITY = 2;
+
+    void updateFrame(const AnimationSettings& settings, MotionBVH& bvh, AnimationFrame& frame)
+    {
+        cameraData.frameIndex = frame.index;
+        cameraData.shutterOpen = frame.index * settings.frameTime;
+        cameraData.shutterClose = cameraData.shutterOpen + 0.5f * settings.frameTime;
+        AnimateInstances(cameraData.shutterOpen, cameraData.shutterClose);
+        ClearDirtyInstances();
+
+        // Topology of the first frame is kept for the whole sequence, later frames only refit it.
+        if (bvh.nodes.empty())
+        {
+            BuildMotionBVH(bvh);
+        }
+        else
+        {
+            RefitMotionBVH(bvh);
+        }
+
+        CaptureReferenceFrame(frame.scene, bvh);
+    }
+
+    void traceFrame(const AnimationSettings& settings, ThreadPool& pool, AnimationFrame& frame)
+    {
+        RenderReference(frame.scene, settings.width, settings.height, frame.hdr, &pool);
+    }
+
+    void encodeFrame(const AnimationSettings& settings, AnimationFrame& frame)
+    {
+        frame.encoded = EncodePPM(settings.width, settings.height, frame.hdr);
+
+        if (settings.outputDir)
+        {
+            char name[32];
+            snprintf(name, sizeof(name), "frame_%04u.ppm", frame.index);
+            std::ofstream file(std::filesystem::path(settings.outputDir) / name, std::ios::binary);
+            file.write(reinterpret_cast<const char*>(frame.encoded.data()), frame.encoded.size());
+            if (!file)
+            {
+                throw std::runtime_error(std::string("Can't write frame ") + name);
+            }
+        }
+    }
+}
+
+std::vector<UINT8> EncodePPM(UINT width, UINT height, const std::vector<DirectX::XMFLOAT3>& image)
+{
+    char header[32];
+    int headerSize = snprintf(header, sizeof(header), "P6\n%u %u\n255\n", width, height);
+
+    std::vector<UINT8> encoded(headerSize + image.size() * 3);
+    memcpy(encoded.data(), header, headerSize);
+
+    // Same tonemapping as the ray generation shader, gamma 2 and clamp.
+    UINT8* pixel = encoded.data() + headerSize;
+    for (const auto& color : image)
+    {
+        for (float channel : { color.x, color.y, color.z })
+        {
+            *pixel++ = (UINT8)(255.0f * std::clamp(std::sqrt(std::max(channel, 0.0f)), 0.0f, 1.0f) + 0.5f);
+        }
+    }
+    return encoded;
+}
+
+AnimationStats RenderAnimation(const AnimationSettings& settings, ThreadPool& pool)
+{
+    SetupScene(settings.scene);
+    cameraData.samplesPerPixel = settings.samplesPerPixel;
+
+    if (settings.outputDir)
+    {
+        std::filesystem::create_directories(settings.outputDir);
+    }
+
+    AnimationStats stats = {};
+    MotionBVH bvh;
+
+    // Every stage only ever runs on one thread, so each one can add up its own busy time.
+    auto timed = [&](ANIMATION_STAGE stage, auto&& func) {
+        auto t0 = std::chrono::high_resolution_clock::now();
+        func();
+        auto t1 = std::chrono::high_resolution_clock::now();
+        stats.busyMilliseconds[stage] += std::chrono::duration<double, std::milli>(t1 - t0).count();
+    };
+
+    auto t0 = std::chrono::high_resolution_clock::now();
+    if (!settings.pipelined)
+    {
+        AnimationFrame frame = {};
+        for (UINT i = 0; i < settings.frameCount; ++i)
+        {
+            frame.index = i;
+            timed(ANIMATION_STAGE_UPDATE, [&]() { updateFrame(settings, bvh, frame); });
+            timed(ANIMATION_STAGE_TRACE, [&]() { traceFrame(settings, pool, frame); });
+            timed(ANIMATION_STAGE_ENCODE, [&]() { encodeFrame(settings, frame); });
+        }
+    }
+    else
+    {
+        // A null frame tells the next stage the sequence is over.
+        BoundedQueue<FramePtr> toTrace(STAGE_QUEUE_CAPACITY);
+        BoundedQueue<FramePtr> toEncode(STAGE_QUEUE_CAPACITY);
+
+        // Update touches the scene globals, but only the update thread does, tracing works on the
+        // copy each frame carries.
+        std::thread updateThread([&]() {
+            for (UINT i = 0; i < settings.frameCount; ++i)
+            {
+                auto frame = std::make_unique<AnimationFrame>();
+                frame->index = i;
+                timed(ANIMATION_STAGE_UPDATE, [&]() { updateFrame(settings, bvh, *frame); });
+                toTrace.Push(std::move(frame));
+            }
+            toTrace.Push(nullptr);
+        });
+
+        std::exception_ptr encodeError;
+        std::thread encodeThread([&]() {
+            while (FramePtr frame = toEncode.Pop())
+            {
+                // Keep draining after an error, so tracing never blocks on a full queue.
+                if (encodeError)
+                    continue;
+                try
+                {
+                    timed(ANIMATION_STAGE_ENCODE, [&]() { encodeFrame(settings, *frame); });
+                }
+                catch (...)
+                {
+                    encodeError = std::current_exception();
+                }
+            }
+        });
+
+        // Tracing stays on this thread, which hands the rows out to the pool.
+        while (FramePtr frame = toTrace.Pop())
+        {
+            timed(ANIMATION_STAGE_TRACE, [&]() { traceFrame(settings, pool, *frame); });
+            toEncode.Push(std::move(frame));
+        }
+        toEncode.Push(nullptr);
+
+        updateThread.join();
+        encodeThread.join();
+        if (encodeError)
+        {
+            std::rethrow_exception(encodeError);
+        }
+    }
+    auto t1 = std::chrono::high_resolution_clock::now();
+    stats.totalMilliseconds = std::chrono::duration<double, std::milli>(t1 - t0).count();
+
+    printf("Animation %s: %u frames at %ux%u, %u spp in %.1f ms (%.2f ms per frame)\n",
+        settings.pipelined ? "pipelined" : "serial", settings.frameCount, settings.width, settings.height,
+        settings.samplesPerPixel, stats.totalMilliseconds, stats.totalMilliseconds / std::max(settings.frameCount, 1u));
+    const char* stageNames[ANIMATION_STAGE_COUNT] = { "update", "trace", "encode" };
+    for (UINT stage = 0; stage < ANIMATION_STAGE_COUNT; ++stage)
+    {
+        printf("  %-6s %9.1f ms busy, %5.1f%% utilization\n", stageNames[stage], stats.busyMilliseconds[stage],
+            100.0 * stats.busyMilliseconds[stage] / stats.totalMilliseconds);
+    }
+
+    return stats;
+}
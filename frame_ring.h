@@ -0,0 +1,97 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Ring of per frame resources (command allocators, constant buffers...) for FrameCount frames
+// in flight. The ring only tracks fence values and doesn't know anything about D3D12, the queue
+// it signals and waits on needs:
+//   uint64_t Signal();                 signal after everything submitted so far, returns the value
+//   uint64_t CompletedValue() const;   last value the GPU got to
+//   void WaitFor(uint64_t value);      block until the GPU gets to value
+// Signalled values have to keep increasing, 0 means the slot was never submitted.
+template <typename Queue, typename Resources, size_t FrameCount>
+class FrameRing
+{
+    static_assert(FrameCount > 0, "Need at least one frame");
+
+public:
+    // Returns the resources for the next frame. The slot gets reused every FrameCount frames, so
+    // this only blocks if the GPU is still on the frame that used it last.
+    Resources& BeginFrame()
+    {
+        const uint64_t pending = fenceValues[current];
+        if (pending > queue.CompletedValue())
+        {
+            queue.WaitFor(pending);
+            ++stalls;
+        }
+        return frames[current];
+    }
+
+    // Call once the frame's work is submitted, its slot is free again when the GPU gets to this signal.
+    void EndFrame()
+    {
+        fenceValues[current] = queue.Signal();
+        current = (current + 1) % FrameCount;
+        ++submitted;
+    }
+
+    // Waits for all submitted work, for anything that touches resources shared between frames
+    // (resizing, scene changes, shutdown).
+    void WaitIdle()
+    {
+        queue.WaitFor(queue.Signal());
+        fenceValues.fill(0);
+    }
+
+    Queue& GetQueue() { return queue; }
+    Resources& Current() { return frames[current]; }
+    std::array<Resources, FrameCount>& Frames() { return frames; }
+    size_t CurrentIndex() const { return current; }
+    uint64_t FramesSubmitted() const { return submitted; }
+    // Frames that had to wait for the GPU to free their slot.
+    uint64_t Stalls() const { return stalls; }
+
+private:
+    Queue queue = {};
+    std::array<Resources, FrameCount> frames = {};
+    std::array<uint64_t, FrameCount> fenceValues = {};
+    size_t current = 0;
+    uint64_t submitted = 0;
+    uint64_t stalls = 0;
+};
+
+// Stand in for a GPU queue, on a virtual clock so a FrameRing runs anywhere and instantly, for the
+// tests and the frame pacing benchmark. Submitted work executes in order, each frame taking a fixed
+// time once the GPU gets to it.
+struct SimulatedFrameQueue
+{
+    void Submit(double gpuMilliseconds)
+    {
+        gpuIdleAt = std::max(gpuIdleAt, now) + gpuMilliseconds;
+    }
+
+    uint64_t Signal()
+    {
+        signalTimes.push_back(gpuIdleAt);
+        return signalTimes.size();
+    }
+
+    uint64_t CompletedValue() const
+    {
+        return std::upper_bound(signalTimes.begin(), signalTimes.end(), now) - signalTimes.begin();
+    }
+
+    void WaitFor(uint64_t value)
+    {
+        now = std::max(now, signalTimes[value - 1]);
+    }
+
+    double now = 0; // CPU time.
+    double gpuIdleAt = 0;
+    std::vector<double> signalTimes;
+};
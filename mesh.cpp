@@ -0,0 +1,510 @@
+#include "core.h"
+#include <fstream>
+#include <charconv>
+#include <string_view>
+
+// Streaming OBJ/PLY loader. Files are read in fixed size chunks and parsed on the fly straight
+// into the mesh vertices/indices of the scene being built, so even multi-million triangle files
+// never sit in memory as text and we don't keep anything besides positions and triangle indices.
+
+namespace
+{
+    constexpr size_t MESH_READ_CHUNK_SIZE = 1 << 20;
+
+    class ChunkedFileReader
+    {
+    public:
+        explicit ChunkedFileReader(const std::string& path)
+            : file(path, std::ios::binary)
+            , buffer(MESH_READ_CHUNK_SIZE)
+        {
+            if (!file)
+            {
+                throw std::runtime_error("Cannot open mesh file: " + path);
+            }
+        }
+
+        // Returned view is valid until the next read. Line endings are stripped.
+        bool readLine(std::string_view& line)
+        {
+            while (true)
+            {
+                auto* data = buffer.data();
+                auto* newline = static_cast<char*>(memchr(data + begin, '\n', end - begin));
+                if (newline || (eof && begin < end))
+                {
+                    size_t lineEnd = newline ? newline - data : end;
+                    line = std::string_view(data + begin, lineEnd - begin);
+                    if (!line.empty() && line.back() == '\r')
+                    {
+                        line.remove_suffix(1);
+                    }
+                    begin = newline ? lineEnd + 1 : end;
+                    return true;
+                }
+
+                if (eof)
+                {
+                    return false;
+                }
+
+                if (begin == 0 && end == buffer.size())
+                {
+                    // Line longer than our buffer, just grow it.
+                    buffer.resize(buffer.size() * 2);
+                }
+                refill();
+            }
+        }
+
+        bool readBytes(void* destination, size_t size)
+        {
+            auto* out = static_cast<char*>(destination);
+            while (size > 0)
+            {
+                if (begin == end)
+                {
+                    if (eof)
+                    {
+                        return false;
+                    }
+                    refill();
+                    continue;
+                }
+
+                size_t chunk = std::min(size, end - begin);
+                memcpy(out, buffer.data() + begin, chunk);
+                begin += chunk;
+                out += chunk;
+                size -= chunk;
+            }
+            return true;
+        }
+
+    private:
+        void refill()
+        {
+            // Keep the unread tail and append the next chunk after it.
+            memmove(buffer.data(), buffer.data() + begin, end - begin);
+            end -= begin;
+            begin = 0;
+
+            file.read(buffer.data() + end, buffer.size() - end);
+            end += (size_t)file.gcount();
+            eof = !file;
+        }
+
+        std::ifstream file;
+        std::vector<char> buffer;
+        size_t begin = 0;
+        size_t end = 0;
+        bool eof = false;
+    };
+
+    void skipSpaces(std::string_view& s)
+    {
+        while (!s.empty() && (s.front() == ' ' || s.front() == '\t'))
+        {
+            s.remove_prefix(1);
+        }
+    }
+
+    std::string_view nextToken(std::string_view& s)
+    {
+        skipSpaces(s);
+        size_t length = 0;
+        while (length < s.size() && s[length] != ' ' && s[length] != '\t')
+        {
+            ++length;
+        }
+        std::string_view token = s.substr(0, length);
+        s.remove_prefix(length);
+        return token;
+    }
+
+    template <typename T>
+    bool parseNumber(std::string_view token, T& value)
+    {
+        if (!token.empty() && token.front() == '+')
+        {
+            token.remove_prefix(1);
+        }
+        auto result = std::from_chars(token.data(), token.data() + token.size(), value);
+        return result.ec == std::errc();
+    }
+
+    void addPolygon(const std::vector<UINT>& polygon, SceneState& scene)
+    {
+        // Convex polygons are triangulated as a fan, which is what pretty much every exporter expects.
+        for (size_t i = 2; i < polygon.size(); ++i)
+        {
+            scene.meshIndices.push_back(polygon[0]);
+            scene.meshIndices.push_back(polygon[i - 1]);
+            scene.meshIndices.push_back(polygon[i]);
+        }
+    }
+
+    void loadOBJ(const std::string& path, UINT firstVertex, SceneState& scene)
+    {
+        ChunkedFileReader reader(path);
+        std::vector<UINT> polygon;
+        std::string_view line;
+
+        while (reader.readLine(line))
+        {
+            skipSpaces(line);
+            std::string_view keyword = nextToken(line);
+
+            if (keyword == "v")
+            {
+                DirectX::XMFLOAT3 position;
+                if (!parseNumber(nextToken(line), position.x) ||
+                    !parseNumber(nextToken(line), position.y) ||
+                    !parseNumber(nextToken(line), position.z))
+                {
+                    throw std::runtime_error("Malformed vertex in OBJ file: " + path);
+                }
+                scene.meshVertices.push_back(position);
+            }
+            else if (keyword == "f")
+            {
+                // Only positions are used, so "v", "v/vt", "v//vn" and "v/vt/vn" all work the same.
+                const long long vertexCount = (long long)(scene.meshVertices.size() - firstVertex);
+                polygon.clear();
+                for (auto token = nextToken(line); !token.empty(); token = nextToken(line))
+                {
+                    long long index;
+                    if (!parseNumber(token.substr(0, token.find('/')), index) || index == 0)
+                    {
+                        throw std::runtime_error("Malformed face in OBJ file: " + path);
+                    }
+
+                    // OBJ indices are 1-based, negative ones are relative to the last vertex read so far.
+                    index = (index > 0) ? index - 1 : vertexCount + index;
+                    if (index < 0 || index >= vertexCount)
+                    {
+                        throw std::runtime_error("Face references a missing vertex in OBJ file: " + path);
+                    }
+                    polygon.push_back((UINT)index);
+                }
+                addPolygon(polygon, scene);
+            }
+            // Everything else (normals, texture coordinates, groups, materials...) is ignored.
+        }
+    }
+
+    enum PLY_FORMAT {
+        PLY_FORMAT_ASCII,
+        PLY_FORMAT_BINARY_LITTLE_ENDIAN,
+        PLY_FORMAT_BINARY_BIG_ENDIAN
+    };
+
+    struct PlyProperty
+    {
+        std::string name;
+        std::string type;
+        std::string listCountType; // Empty if it's not a list.
+    };
+
+    struct PlyElement
+    {
+        std::string name;
+        size_t count;
+        std::vector<PlyProperty> properties;
+    };
+
+    size_t plyTypeSize(const std::string& type)
+    {
+        if (type == "char" || type == "uchar" || type == "int8" || type == "uint8") return 1;
+        if (type == "short" || type == "ushort" || type == "int16" || type == "uint16") return 2;
+        if (type == "int" || type == "uint" || type == "int32" || type == "uint32" || type == "float" || type == "float32") return 4;
+        if (type == "double" || type == "float64") return 8;
+        throw std::runtime_error("Unknown PLY property type: " + type);
+    }
+
+    class PlyValueReader
+    {
+    public:
+        PlyValueReader(ChunkedFileReader& reader, PLY_FORMAT format)
+            : reader(reader)
+            , format(format)
+        {
+        }
+
+        // ASCII records are one per line, binary ones don't need this.
+        void beginRecord()
+        {
+            if (format == PLY_FORMAT_ASCII && !reader.readLine(line))
+            {
+                throw std::runtime_error("Unexpected end of PLY file");
+            }
+        }
+
+        double read(const std::string& type)
+        {
+            if (format == PLY_FORMAT_ASCII)
+            {
+                double value;
+                if (!parseNumber(nextToken(line), value))
+                {
+                    throw std::runtime_error("Malformed value in PLY file");
+                }
+                return value;
+            }
+
+            size_t size = plyTypeSize(type);
+            unsigned char bytes[8];
+            if (!reader.readBytes(bytes, size))
+            {
+                throw std::runtime_error("Unexpected end of PLY file");
+            }
+            if (format == PLY_FORMAT_BINARY_BIG_ENDIAN)
+            {
+                std::reverse(bytes, bytes + size);
+            }
+
+            auto as = [&](auto value) { memcpy(&value, bytes, sizeof(value)); return (double)value; };
+            if (type == "char" || type == "int8") return as(int8_t());
+            if (type == "uchar" || type == "uint8") return as(uint8_t());
+            if (type == "short" || type == "int16") return as(int16_t());
+            if (type == "ushort" || type == "uint16") return as(uint16_t());
+            if (type == "int" || type == "int32") return as(int32_t());
+            if (type == "uint" || type == "uint32") return as(uint32_t());
+            if (type == "float" || type == "float32") return as(float());
+            return as(double());
+        }
+
+    private:
+        ChunkedFileReader& reader;
+        PLY_FORMAT format;
+        std::string_view line;
+    };
+
+    void loadPLY(const std::string& path, UINT firstVertex, SceneState& scene)
+    {
+        ChunkedFileReader reader(path);
+        std::string_view line;
+
+        if (!reader.readLine(line) || line != "ply")
+        {
+            throw std::runtime_error("Not a PLY file: " + path);
+        }
+
+        PLY_FORMAT format = PLY_FORMAT_ASCII;
+        std::vector<PlyElement> elements;
+        while (true)
+        {
+            if (!reader.readLine(line))
+            {
+                throw std::runtime_error("Missing end_header in PLY file: " + path);
+            }
+
+            std::string_view keyword = nextToken(line);
+            if (keyword == "end_header")
+            {
+                break;
+            }
+            else if (keyword == "format")
+            {
+                std::string_view name = nextToken(line);
+                format = (name == "binary_little_endian") ? PLY_FORMAT_BINARY_LITTLE_ENDIAN
+                       : (name == "binary_big_endian")    ? PLY_FORMAT_BINARY_BIG_ENDIAN
+                                                          : PLY_FORMAT_ASCII;
+            }
+            else if (keyword == "element")
+            {
+                PlyElement element = { .name = std::string(nextToken(line)) };
+                if (!parseNumber(nextToken(line), element.count))
+                {
+                    throw std::runtime_error("Malformed element in PLY file: " + path);
+                }
+                elements.push_back(element);
+            }
+            else if (keyword == "property" && !elements.empty())
+            {
+                PlyProperty property;
+                std::string_view type = nextToken(line);
+                if (type == "list")
+                {
+                    property.listCountType = nextToken(line);
+                    type = nextToken(line);
+                }
+                property.type = type;
+                property.name = nextToken(line);
+                elements.back().properties.push_back(property);
+            }
+        }
+
+        PlyValueReader values(reader, format);
+        std::vector<UINT> polygon;
+        for (auto& element : elements)
+        {
+            if (element.name == "vertex")
+            {
+                scene.meshVertices.reserve(scene.meshVertices.size() + element.count);
+            }
+
+            for (size_t record = 0; record < element.count; ++record)
+            {
+                values.beginRecord();
+
+                DirectX::XMFLOAT3 position = { 0, 0, 0 };
+                for (auto& property : element.properties)
+                {
+                    if (!property.listCountType.empty())
+                    {
+                        bool isFace = element.name == "face" && (property.name == "vertex_indices" || property.name == "vertex_index");
+                        size_t count = (size_t)values.read(property.listCountType);
+                        polygon.clear();
+                        for (size_t i = 0; i < count; ++i)
+                        {
+                            double index = values.read(property.type);
+                            if (isFace)
+                            {
+                                if (index < 0 || index >= (double)(scene.meshVertices.size() - firstVertex))
+                                {
+                                    throw std::runtime_error("Face references a missing vertex in PLY file: " + path);
+                                }
+                                polygon.push_back((UINT)index);
+                            }
+                        }
+                        if (isFace)
+                        {
+                            addPolygon(polygon, scene);
+                        }
+                        continue;
+                    }
+
+                    float value = (float)values.read(property.type);
+                    if (element.name == "vertex")
+                    {
+                        if (property.name == "x") position.x = value;
+                        else if (property.name == "y") position.y = value;
+                        else if (property.name == "z") position.z = value;
+                    }
+                }
+
+                if (element.name == "vertex")
+                {
+                    scene.meshVertices.push_back(position);
+                }
+            }
+        }
+    }
+
+    void sortMeshForLocality(MeshData& mesh, const std::vector<UINT>& triangleOrder, SceneState& scene)
+    {
+        // Put triangles in BVH leaf order, so each leaf references a contiguous range of them.
+        UINT* indices = scene.meshIndices.data() + mesh.indexOffset;
+        {
+            std::vector<UINT> sorted(mesh.indexCount);
+            for (UINT i = 0; i < (UINT)triangleOrder.size(); ++i)
+            {
+                memcpy(&sorted[3 * i], &indices[3 * triangleOrder[i]], 3 * sizeof(UINT));
+            }
+            memcpy(indices, sorted.data(), mesh.indexCount * sizeof(UINT));
+        }
+
+        // Then renumber vertices in the order triangles first use them, so that neighbouring triangles
+        // also fetch neighbouring vertices. Unreferenced vertices are dropped on the way.
+        std::vector<UINT> remap(mesh.vertexCount, UINT_MAX);
+        std::vector<DirectX::XMFLOAT3> sortedVertices;
+        sortedVertices.reserve(mesh.vertexCount);
+        DirectX::XMFLOAT3* vertices = scene.meshVertices.data() + mesh.vertexOffset;
+        for (UINT i = 0; i < mesh.indexCount; ++i)
+        {
+            UINT& index = indices[i];
+            if (remap[index] == UINT_MAX)
+            {
+                remap[index] = (UINT)sortedVertices.size();
+                sortedVertices.push_back(vertices[index]);
+            }
+            index = remap[index];
+        }
+
+        std::copy(sortedVertices.begin(), sortedVertices.end(), vertices);
+        mesh.vertexCount = (UINT)sortedVertices.size();
+        scene.meshVertices.resize(mesh.vertexOffset + mesh.vertexCount);
+    }
+}
+
+UINT LoadMesh(const std::string& path, SceneState& scene)
+{
+    auto t0 = std::chrono::high_resolution_clock::now();
+
+    MeshData mesh = { .vertexOffset = (UINT)scene.meshVertices.size(),
+                      .indexOffset = (UINT)scene.meshIndices.size() };
+
+    std::string extension = path.substr(path.find_last_of('.') + 1);
+    std::transform(extension.begin(), extension.end(), extension.begin(), [](char c) { return (char)tolower(c); });
+    try
+    {
+        if (extension == "obj")
+        {
+            loadOBJ(path, mesh.vertexOffset, scene);
+        }
+        else if (extension == "ply")
+        {
+            loadPLY(path, mesh.vertexOffset, scene);
+        }
+        else
+        {
+            throw std::runtime_error("Unsupported mesh format: " + path);
+        }
+    }
+    catch (...)
+    {
+        // Don't leave half of a mesh behind.
+        scene.meshVertices.resize(mesh.vertexOffset);
+        scene.meshIndices.resize(mesh.indexOffset);
+        throw;
+    }
+
+    mesh.vertexCount = (UINT)scene.meshVertices.size() - mesh.vertexOffset;
+    mesh.indexCount = (UINT)scene.meshIndices.size() - mesh.indexOffset;
+    if (mesh.indexCount == 0)
+    {
+        scene.meshVertices.resize(mesh.vertexOffset);
+        throw std::runtime_error("Mesh has no faces: " + path);
+    }
+
+    // Triangle bounds are only needed for the BVH build, let's not keep them around afterwards.
+    const UINT triangleCount = mesh.indexCount / 3;
+    {
+        std::vector<AABB> triangleBounds(triangleCount);
+        const UINT* indices = scene.meshIndices.data() + mesh.indexOffset;
+        const DirectX::XMFLOAT3* vertices = scene.meshVertices.data() + mesh.vertexOffset;
+        for (UINT i = 0; i < triangleCount; ++i)
+        {
+            const auto& a = vertices[indices[3 * i + 0]];
+            const auto& b = vertices[indices[3 * i + 1]];
+            const auto& c = vertices[indices[3 * i + 2]];
+            triangleBounds[i] = { { std::min({ a.x, b.x, c.x }), std::min({ a.y, b.y, c.y }), std::min({ a.z, b.z, c.z }) },
+                                  { std::max({ a.x, b.x, c.x }), std::max({ a.y, b.y, c.y }), std::max({ a.z, b.z, c.z }) } };
+        }
+
+        std::vector<UINT> triangleOrder(triangleCount);
+        mesh.bvh.resize(triangleCount ? 2 * (size_t)triangleCount - 1 : 0);
+        mesh.bvh.resize(BuildBVH(triangleBounds, mesh.bvh, triangleOrder));
+        triangleBounds = {};
+
+        sortMeshForLocality(mesh, triangleOrder, scene);
+    }
+
+    // Root of the BVH holds the bounds of the whole mesh.
+    mesh.bounds = { mesh.bvh[0].boundsMin, mesh.bvh[0].boundsMax };
+    const size_t bvhNodes = mesh.bvh.size();
+    if (pageMeshes)
+    {
+        PageOutMesh(mesh, scene);
+    }
+    scene.meshList.push_back(std::move(mesh));
+
+    auto t1 = std::chrono::high_resolution_clock::now();
+    const MeshData& loaded = scene.meshList.back();
+    printf("Loaded mesh %s: %u vertices, %u triangles, %u BVH nodes in %d ms\n", path.c_str(),
+        loaded.vertexCount, triangleCount, (UINT)bvhNodes,
+        (int)std::chrono::duration_cast<std::chrono::milliseconds>(t1 - t0).count());
+
+    return (UINT)scene.meshList.size() - 1;
+}
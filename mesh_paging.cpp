@@ -0,0 +1,477 @@
+#include "core.h"
+#include <fstream>
+#include <list>
+#include <memory>
+#include <filesystem>
+#include <unordered_map>
+
+#ifdef _WIN32
+#define NOMINMAX
+#define WIN32_LEAN_AND_MEAN
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Out-of-core meshes for the CPU renderer.
+//
+// A paged mesh keeps just the top of its BVH in memory. Everything below is cut into treelets,
+// subtrees of at most MESH_TREELET_TRIANGLES triangles, which are written to a page file together
+// with their triangles, three plain vertices each so a treelet needs nothing outside of itself. The
+// file is mapped, and the renderer gets treelets through a cache with a memory budget that throws out
+// the least recently used ones once it's full, like the texture cache does with tiles. Treelets keep
+// the node order of the whole tree, so a paged mesh gives exactly the hits the whole one did.
+//
+// This bounds the memory rendering takes, not the memory loading takes: LoadMesh still reads the whole
+// mesh and builds its whole BVH in memory, and only pages it out after that, so the largest mesh has to
+// fit in memory once. Instances, materials and the scene and motion BVHs are never paged. Scenes that
+// don't fit in memory at all are not handled.
+//
+// Scenes sent to workers carry the page file's contents, which each worker writes to a page file of
+// its own. Its path is local to every process, and neither sent nor part of a partial's scene hash.
+
+using namespace DirectX;
+
+struct MeshPageFile
+{
+    MeshPageFile(const std::string& path, bool owned) : path(path), owned(owned)
+    {
+#ifdef _WIN32
+        file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        LARGE_INTEGER fileSize = {};
+        if (file == INVALID_HANDLE_VALUE || !GetFileSizeEx(file, &fileSize))
+        {
+            throw std::runtime_error("Cannot open mesh page file: " + path);
+        }
+        size = (size_t)fileSize.QuadPart;
+        mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        data = mapping ? static_cast<const std::byte*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0)) : nullptr;
+#else
+        const int file = open(path.c_str(), O_RDONLY);
+        struct stat status = {};
+        if (file < 0 || fstat(file, &status) != 0)
+        {
+            if (file >= 0)
+                close(file);
+            throw std::runtime_error("Cannot open mesh page file: " + path);
+        }
+        size = (size_t)status.st_size;
+        void* mapped = mmap(nullptr, size, PROT_READ, MAP_SHARED, file, 0);
+        close(file); // The mapping keeps the file.
+        data = (mapped != MAP_FAILED) ? static_cast<const std::byte*>(mapped) : nullptr;
+#endif
+        if (!data)
+        {
+            unmap();
+            throw std::runtime_error("Cannot map mesh page file: " + path);
+        }
+    }
+
+    ~MeshPageFile()
+    {
+        unmap();
+        if (owned)
+        {
+            std::error_code error;
+            std::filesystem::remove(path, error);
+        }
+    }
+
+    MeshPageFile(const MeshPageFile&) = delete;
+    MeshPageFile& operator=(const MeshPageFile&) = delete;
+
+    std::string path;
+    bool owned; // Written by this process, and deleted along with the last mesh using it.
+    const std::byte* data = nullptr;
+    size_t size = 0;
+
+private:
+    void unmap()
+    {
+#ifdef _WIN32
+        if (data)
+            UnmapViewOfFile(data);
+        if (mapping)
+            CloseHandle(mapping);
+        if (file != INVALID_HANDLE_VALUE)
+            CloseHandle(file);
+#else
+        if (data)
+            munmap(const_cast<std::byte*>(data), size);
+#endif
+        data = nullptr;
+    }
+
+#ifdef _WIN32
+    HANDLE file = INVALID_HANDLE_VALUE;
+    HANDLE mapping = nullptr;
+#endif
+};
+
+namespace
+{
+    // Writes the treelets below a node of the whole mesh BVH one after another, as they're cut.
+    class TreeletWriter
+    {
+    public:
+        TreeletWriter(const MeshData& mesh, const SceneState& scene, const std::string& path)
+            : mesh(mesh), scene(scene), file(path, std::ios::binary), path(path)
+        {
+            if (!file)
+            {
+                throw std::runtime_error("Cannot write mesh page file: " + path);
+            }
+            triangleCounts.resize(mesh.bvh.size());
+            countTriangles(0);
+        }
+
+        // Copies node into top at index, cutting a treelet wherever the subtree is small enough.
+        void cut(UINT node, std::vector<BVHNode>& top, UINT index)
+        {
+            const BVHNode& source = mesh.bvh[node];
+            if (source.primitiveCount > 0 || triangleCounts[node] <= MESH_TREELET_TRIANGLES)
+            {
+                top[index] = { source.boundsMin, (UINT)treelets.size(), source.boundsMax, triangleCounts[node] };
+                writeTreelet(node);
+                return;
+            }
+
+            const UINT children = (UINT)top.size();
+            top.resize(top.size() + 2);
+            top[index] = { source.boundsMin, children, source.boundsMax, 0 };
+            cut(source.leftOrFirst, top, children);
+            cut(source.leftOrFirst + 1, top, children + 1);
+        }
+
+        void finish()
+        {
+            file.close();
+            if (!file)
+            {
+                throw std::runtime_error("Cannot write mesh page file: " + path);
+            }
+        }
+
+        std::vector<MeshTreelet> treelets;
+        UINT64 bytes = 0;
+
+    private:
+        UINT countTriangles(UINT node)
+        {
+            const BVHNode& source = mesh.bvh[node];
+            triangleCounts[node] = (source.primitiveCount > 0) ? source.primitiveCount
+                                                               : countTriangles(source.leftOrFirst) + countTriangles(source.leftOrFirst + 1);
+            return triangleCounts[node];
+        }
+
+        // Nodes renumbered from zero with children still next to each other, so the treelet is walked
+        // in the same order as the whole tree. Leaves index the treelet's own triangles.
+        void copyNodes(UINT node, std::vector<BVHNode>& nodes, UINT index, UINT firstTriangle)
+        {
+            const BVHNode& source = mesh.bvh[node];
+            if (source.primitiveCount > 0)
+            {
+                if (source.leftOrFirst + source.primitiveCount - firstTriangle > triangleCounts[treeletRoot])
+                {
+                    throw std::logic_error("Mesh BVH subtree with triangles outside of its range");
+                }
+                nodes[index] = { source.boundsMin, source.leftOrFirst - firstTriangle, source.boundsMax, source.primitiveCount };
+                return;
+            }
+
+            const UINT children = (UINT)nodes.size();
+            nodes.resize(nodes.size() + 2);
+            nodes[index] = { source.boundsMin, children, source.boundsMax, 0 };
+            copyNodes(source.leftOrFirst, nodes, children, firstTriangle);
+            copyNodes(source.leftOrFirst + 1, nodes, children + 1, firstTriangle);
+        }
+
+        UINT firstTriangle(UINT node) const
+        {
+            const BVHNode& source = mesh.bvh[node];
+            return (source.primitiveCount > 0) ? source.leftOrFirst
+                                               : std::min(firstTriangle(source.leftOrFirst), firstTriangle(source.leftOrFirst + 1));
+        }
+
+        void writeTreelet(UINT root)
+        {
+            // A subtree's triangles are one contiguous range, BuildBVH splits ranges in place.
+            const UINT first = firstTriangle(root);
+            std::vector<BVHNode> nodes(1);
+            treeletRoot = root;
+            copyNodes(root, nodes, 0, first);
+
+            std::vector<XMFLOAT3> vertices((size_t)triangleCounts[root] * 3);
+            const UINT* indices = scene.meshIndices.data() + mesh.indexOffset + 3 * (size_t)first;
+            const XMFLOAT3* meshVertices = scene.meshVertices.data() + mesh.vertexOffset;
+            for (size_t i = 0; i < vertices.size(); ++i)
+            {
+                vertices[i] = meshVertices[indices[i]];
+            }
+
+            treelets.push_back({ bytes, (UINT)nodes.size(), triangleCounts[root] });
+            file.write(reinterpret_cast<const char*>(nodes.data()), nodes.size() * sizeof(BVHNode));
+            file.write(reinterpret_cast<const char*>(vertices.data()), vertices.size() * sizeof(XMFLOAT3));
+            bytes += nodes.size() * sizeof(BVHNode) + vertices.size() * sizeof(XMFLOAT3);
+        }
+
+        const MeshData& mesh;
+        const SceneState& scene;
+        std::ofstream file;
+        std::string path;
+        std::vector<UINT> triangleCounts; // Below every node of the whole tree.
+        UINT treeletRoot = 0;
+    };
+
+    class MeshPageCache
+    {
+    public:
+        // Mesh 24 bits, treelet 40 bits.
+        static UINT64 treeletKey(UINT mesh, UINT treelet)
+        {
+            return ((UINT64)mesh << 40) | treelet;
+        }
+
+        std::shared_ptr<const MeshTreeletPage> find(UINT mesh, UINT treelet)
+        {
+            const UINT64 key = treeletKey(mesh, treelet);
+            Shard& shard = shards[(key * 0x9E3779B97F4A7C15ull) >> 60];
+            ++lookups;
+            std::lock_guard lock(shard.mutex);
+            auto it = shard.pages.find(key);
+            if (it == shard.pages.end())
+                return nullptr;
+            shard.lru.splice(shard.lru.begin(), shard.lru, it->second.lru);
+            ++hits;
+            return it->second.page;
+        }
+
+        std::shared_ptr<const MeshTreeletPage> get(UINT mesh, UINT treelet)
+        {
+            if (auto page = find(mesh, treelet))
+                return page;
+
+            // Reading the file goes without the lock.
+            ++faults;
+            std::shared_ptr<const MeshTreeletPage> page = loadTreelet(mesh, treelet);
+
+            const UINT64 key = treeletKey(mesh, treelet);
+            Shard& shard = shards[(key * 0x9E3779B97F4A7C15ull) >> 60];
+            std::lock_guard lock(shard.mutex);
+            auto [it, inserted] = shard.pages.try_emplace(key);
+            if (!inserted)
+            {
+                // Some other thread got here first.
+                return it->second.page;
+            }
+            shard.lru.push_front(key);
+            it->second = { page, shard.lru.begin() };
+            shard.bytes += page->bytes();
+            size_t total = bytes += page->bytes();
+
+            // The treelet we just added stays, even if it's over the budget all on its own.
+            const size_t shardBudget = budget / SHARD_COUNT;
+            while (shard.bytes > shardBudget && shard.lru.size() > 1)
+            {
+                auto evicted = shard.pages.find(shard.lru.back());
+                const size_t evictedBytes = evicted->second.page->bytes();
+                shard.bytes -= evictedBytes;
+                total = bytes -= evictedBytes;
+                shard.pages.erase(evicted);
+                shard.lru.pop_back();
+                ++evictions;
+            }
+
+            size_t peak = peakBytes;
+            while (total > peak && !peakBytes.compare_exchange_weak(peak, total))
+            {
+            }
+            return page;
+        }
+
+        void recordQueues(UINT64 rays, UINT64 queueCount, UINT64 maxLength)
+        {
+            queuedRays += rays;
+            queues += queueCount;
+            UINT64 longest = maxQueueLength;
+            while (maxLength > longest && !maxQueueLength.compare_exchange_weak(longest, maxLength))
+            {
+            }
+        }
+
+        void clear()
+        {
+            for (Shard& shard : shards)
+            {
+                std::lock_guard lock(shard.mutex);
+                shard.pages.clear();
+                shard.lru.clear();
+                shard.bytes = 0;
+            }
+            bytes = peakBytes = 0;
+            lookups = hits = faults = evictions = bytesRead = 0;
+            queuedRays = queues = maxQueueLength = 0;
+        }
+
+        MeshPagingStats stats() const
+        {
+            return { lookups, hits, faults, evictions, bytesRead, queuedRays, queues, maxQueueLength, bytes, peakBytes, budget };
+        }
+
+        std::atomic<size_t> budget = MESH_PAGE_CACHE_DEFAULT_BUDGET;
+
+    private:
+        static constexpr UINT SHARD_COUNT = 16;
+
+        struct Entry
+        {
+            std::shared_ptr<const MeshTreeletPage> page;
+            std::list<UINT64>::iterator lru;
+        };
+
+        // Split up so threads mostly don't wait on each other, every shard has its own share of the budget.
+        struct Shard
+        {
+            std::mutex mutex;
+            std::list<UINT64> lru; // Most recently used first.
+            std::unordered_map<UINT64, Entry> pages;
+            size_t bytes = 0;
+        };
+
+        std::shared_ptr<const MeshTreeletPage> loadTreelet(UINT mesh, UINT treelet)
+        {
+            const MeshData& data = meshList[mesh];
+            const MeshTreelet& location = data.treelets[treelet];
+            const size_t nodeBytes = (size_t)location.nodeCount * sizeof(BVHNode);
+            const size_t vertexBytes = (size_t)location.triangleCount * 3 * sizeof(XMFLOAT3);
+            if (location.offset + nodeBytes + vertexBytes > data.pageFile->size)
+            {
+                throw std::runtime_error("Truncated mesh page file: " + data.pagePath);
+            }
+
+            auto page = std::make_shared<MeshTreeletPage>();
+            page->nodes.resize(location.nodeCount);
+            page->vertices.resize((size_t)location.triangleCount * 3);
+            const std::byte* source = data.pageFile->data + location.offset;
+            memcpy(page->nodes.data(), source, nodeBytes);
+            memcpy(page->vertices.data(), source + nodeBytes, vertexBytes);
+            bytesRead += nodeBytes + vertexBytes;
+            return page;
+        }
+
+        Shard shards[SHARD_COUNT];
+        std::atomic<size_t> bytes = 0;
+        std::atomic<size_t> peakBytes = 0;
+        std::atomic<UINT64> lookups = 0;
+        std::atomic<UINT64> hits = 0;
+        std::atomic<UINT64> faults = 0;
+        std::atomic<UINT64> evictions = 0;
+        std::atomic<UINT64> bytesRead = 0;
+        std::atomic<UINT64> queuedRays = 0;
+        std::atomic<UINT64> queues = 0;
+        std::atomic<UINT64> maxQueueLength = 0;
+    };
+
+    MeshPageCache meshPageCache;
+
+    // Named after this load so processes and scenes never share one, deleted with the last mesh using it.
+    std::string newPagePath()
+    {
+        static std::atomic<UINT> loads = 0;
+        const auto stamp = std::chrono::steady_clock::now().time_since_epoch().count();
+        return (std::filesystem::temp_directory_path() /
+                ("mesh." + std::to_string(stamp) + "." + std::to_string(loads++) + ".pages")).string();
+    }
+}
+
+void PageOutMesh(MeshData& mesh, SceneState& scene)
+{
+    const std::string path = newPagePath();
+
+    std::vector<BVHNode> top(1);
+    TreeletWriter writer(mesh, scene, path);
+    try
+    {
+        writer.cut(0, top, 0);
+        writer.finish();
+    }
+    catch (...)
+    {
+        std::error_code error;
+        std::filesystem::remove(path, error);
+        throw;
+    }
+
+    mesh.pagePath = path;
+    mesh.treelets = std::move(writer.treelets);
+    mesh.pageFile = std::make_shared<const MeshPageFile>(path, true);
+    const size_t wholeNodes = mesh.bvh.size();
+    mesh.bvh = std::move(top);
+
+    // LoadMesh just added the mesh, so its triangles are the last ones.
+    scene.meshVertices.resize(mesh.vertexOffset);
+    scene.meshVertices.shrink_to_fit();
+    scene.meshIndices.resize(mesh.indexOffset);
+    scene.meshIndices.shrink_to_fit();
+
+    printf("Paged out mesh: %zu treelets, %.1f MB in %s, %zu of %zu BVH nodes stay in memory\n", mesh.treelets.size(),
+        writer.bytes / 1048576.0, path.c_str(), mesh.bvh.size(), wholeNodes);
+}
+
+std::span<const UINT8> MeshPageData(const MeshData& mesh)
+{
+    if (!mesh.pageFile)
+        return {};
+    return { reinterpret_cast<const UINT8*>(mesh.pageFile->data), mesh.pageFile->size };
+}
+
+void StoreMeshPages(MeshData& mesh, std::span<const UINT8> pages)
+{
+    const std::string path = newPagePath();
+    {
+        std::ofstream file(path, std::ios::binary);
+        file.write(reinterpret_cast<const char*>(pages.data()), pages.size());
+        file.close();
+        if (!file)
+        {
+            std::error_code error;
+            std::filesystem::remove(path, error);
+            throw std::runtime_error("Cannot write mesh page file: " + path);
+        }
+    }
+    mesh.pagePath = path;
+    mesh.pageFile = std::make_shared<const MeshPageFile>(path, true);
+}
+
+std::shared_ptr<const MeshTreeletPage> GetMeshTreelet(UINT mesh, UINT treelet)
+{
+    return meshPageCache.get(mesh, treelet);
+}
+
+std::shared_ptr<const MeshTreeletPage> FindMeshTreelet(UINT mesh, UINT treelet)
+{
+    return meshPageCache.find(mesh, treelet);
+}
+
+void RecordMeshRayQueues(UINT64 queuedRays, UINT64 queues, UINT64 maxQueueLength)
+{
+    meshPageCache.recordQueues(queuedRays, queues, maxQueueLength);
+}
+
+void SetMeshPageBudget(size_t bytes)
+{
+    meshPageCache.budget = bytes;
+}
+
+void ClearMeshPageCache()
+{
+    meshPageCache.clear();
+}
+
+MeshPagingStats GetMeshPagingStats()
+{
+    return meshPageCache.stats();
+}
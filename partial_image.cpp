@@ -0,0 +1,187 @@
+#include "core.h"
+#include <fstream>
+
+// Renders split by samples instead of pixels. Every partial image holds the fixed point sums of
+// some sample ranges, so any number of them (rendered on any machines, in any order, possibly
+// merged along the way) add up to exactly the same image as rendering all samples at once.
+// Partial files are:
+//   UINT magic, version, width, height, frameIndex
+//   UINT64 sceneHash
+//   UINT rangeCount, then rangeCount pairs of UINT first sample and sample count
+//   INT64 sums, three per pixel
+
+namespace
+{
+    constexpr UINT PARTIAL_MAGIC = 0x49505452; // "RTPI"
+    constexpr UINT PARTIAL_VERSION = 1;
+
+    // FNV-1a of the serialized scene, which includes the camera. Sample count and seed are left
+    // out, those are checked separately, and so is the interactive renderer's history state.
+    UINT64 sceneHash(const ReferenceFrame& frame)
+    {
+        ReferenceFrame hashed;
+        hashed.camera = frame.camera;
+        hashed.camera.samplesPerPixel = 0;
+        hashed.camera.frameIndex = 0;
+        hashed.camera.previousLookfrom = hashed.camera.previousLookat = {};
+        hashed.camera.temporalReuse = 0;
+        hashed.transforms = frame.transforms;
+        hashed.motion = frame.motion;
+
+        UINT64 hash = 0xcbf29ce484222325ull;
+        for (UINT8 byte : SerializeScene(hashed))
+        {
+            hash = (hash ^ byte) * 0x100000001b3ull;
+        }
+        return hash;
+    }
+
+    template <typename T>
+    void writeValues(std::ofstream& file, const T* values, size_t count)
+    {
+        file.write(reinterpret_cast<const char*>(values), count * sizeof(T));
+    }
+
+    template <typename T>
+    void readValues(std::ifstream& file, T* values, size_t count)
+    {
+        file.read(reinterpret_cast<char*>(values), count * sizeof(T));
+        if (!file)
+        {
+            throw std::runtime_error("Truncated partial image");
+        }
+    }
+}
+
+PartialImage RenderPartialImage(const ReferenceFrame& frame, UINT width, UINT height, UINT firstSample, UINT sampleCount, ThreadPool* pool)
+{
+    PartialImage partial = { .width = width,
+                             .height = height,
+                             .frameIndex = frame.camera.frameIndex,
+                             .sceneHash = sceneHash(frame),
+                             .sampleRanges = { { firstSample, sampleCount } } };
+    RenderReferenceSamples(frame, width, height, firstSample, sampleCount, partial.sums, pool);
+    return partial;
+}
+
+void MergePartialImage(PartialImage& merged, const PartialImage& partial)
+{
+    if (merged.sums.empty())
+    {
+        merged = partial;
+        return;
+    }
+
+    if (merged.width != partial.width || merged.height != partial.height ||
+        merged.frameIndex != partial.frameIndex || merged.sceneHash != partial.sceneHash)
+    {
+        throw std::runtime_error("Partial images are of different renders");
+    }
+
+    // The same sample twice would get counted twice, and the result wouldn't be the full render anymore.
+    auto ranges = merged.sampleRanges;
+    ranges.insert(ranges.end(), partial.sampleRanges.begin(), partial.sampleRanges.end());
+    std::sort(ranges.begin(), ranges.end());
+    std::vector<std::pair<UINT, UINT>> mergedRanges;
+    for (auto range : ranges)
+    {
+        if (!mergedRanges.empty())
+        {
+            auto& last = mergedRanges.back();
+            if (range.first < last.first + last.second)
+            {
+                throw std::runtime_error("Partial images share samples " + std::to_string(range.first) + " and on");
+            }
+            if (range.first == last.first + last.second)
+            {
+                last.second += range.second;
+                continue;
+            }
+        }
+        mergedRanges.push_back(range);
+    }
+    merged.sampleRanges = std::move(mergedRanges);
+
+    for (size_t i = 0; i < merged.sums.size(); ++i)
+    {
+        merged.sums[i] += partial.sums[i];
+    }
+}
+
+UINT64 PartialImageSampleCount(const PartialImage& partial)
+{
+    UINT64 count = 0;
+    for (auto range : partial.sampleRanges)
+    {
+        count += range.second;
+    }
+    return count;
+}
+
+std::vector<DirectX::XMFLOAT3> ResolvePartialImage(const PartialImage& partial)
+{
+    const UINT64 samples = std::max<UINT64>(PartialImageSampleCount(partial), 1);
+    std::vector<DirectX::XMFLOAT3> image((size_t)partial.width * partial.height);
+    for (size_t i = 0; i < image.size(); ++i)
+    {
+        image[i] = { FromSampleFixedPoint(partial.sums[3 * i], samples),
+                     FromSampleFixedPoint(partial.sums[3 * i + 1], samples),
+                     FromSampleFixedPoint(partial.sums[3 * i + 2], samples) };
+    }
+    return image;
+}
+
+void WritePartialImage(const char* path, const PartialImage& partial)
+{
+    std::ofstream file(path, std::ios::binary);
+    const UINT header[] = { PARTIAL_MAGIC, PARTIAL_VERSION, partial.width, partial.height, partial.frameIndex };
+    writeValues(file, header, std::size(header));
+    writeValues(file, &partial.sceneHash, 1);
+
+    const UINT rangeCount = (UINT)partial.sampleRanges.size();
+    writeValues(file, &rangeCount, 1);
+    for (auto range : partial.sampleRanges)
+    {
+        const UINT values[] = { range.first, range.second };
+        writeValues(file, values, 2);
+    }
+    writeValues(file, partial.sums.data(), partial.sums.size());
+
+    if (!file)
+    {
+        throw std::runtime_error(std::string("Can't write ") + path);
+    }
+}
+
+PartialImage ReadPartialImage(const char* path)
+{
+    std::ifstream file(path, std::ios::binary);
+    if (!file)
+    {
+        throw std::runtime_error(std::string("Can't open ") + path);
+    }
+
+    UINT header[5];
+    readValues(file, header, std::size(header));
+    if (header[0] != PARTIAL_MAGIC || header[1] != PARTIAL_VERSION)
+    {
+        throw std::runtime_error(std::string(path) + " is not a partial image, or one from a different version");
+    }
+
+    PartialImage partial = { .width = header[2], .height = header[3], .frameIndex = header[4] };
+    readValues(file, &partial.sceneHash, 1);
+
+    UINT rangeCount;
+    readValues(file, &rangeCount, 1);
+    partial.sampleRanges.resize(rangeCount);
+    for (auto& range : partial.sampleRanges)
+    {
+        UINT values[2];
+        readValues(file, values, 2);
+        range = { values[0], values[1] };
+    }
+
+    partial.sums.resize((size_t)partial.width * partial.height * 3);
+    readValues(file, partial.sums.data(), partial.sums.size());
+    return partial;
+}
@@ -34,8 +34,13 @@ LRESULT WINAPI WndProc(HWND hwnd, UINT msg, WPARAM wparam, LPARAM lparam)
     return DefWindowProcW(hwnd, msg, wparam, lparam);
 }
 
-int main()
+int main(int argc, char** argv)
 {
+    if (int exitCode; RunCommandLine(argc, argv, exitCode))
+    {
+        return exitCode;
+    }
+
     // Alternatively, DPI_AWARENESS_CONTEXT_UNAWARE
     SetProcessDpiAwarenessContext(DPI_AWARENESS_CONTEXT_PER_MONITOR_AWARE_V2);
 
@@ -49,8 +54,6 @@ int main()
         /*width=*/CW_USEDEFAULT, /*height=*/CW_USEDEFAULT,
         nullptr, nullptr, nullptr, nullptr);
 
-    SetupNextScene();
-
     RAWINPUTDEVICE Rid[1];
     Rid[0].usUsagePage = 0x01;          // HID_USAGE_PAGE_GENERIC
     Rid[0].usUsage = 0x02;              // HID_USAGE_GENERIC_MOUSE
@@ -90,7 +93,11 @@ int main()
         while (PeekMessageW(&msg, nullptr, 0, 0, PM_REMOVE))
         {
             if (msg.message == WM_QUIT)
+            {
+                frameRing.WaitIdle();
+                sceneSwitcher.reset();
                 return 0;
+            }
             TranslateMessage(&msg);
             DispatchMessageW(&msg);
         }
@@ -120,31 +127,31 @@ void OnKeyDown(UINT8 key)
     }
     else if (key == 'W')
     {
-        cameraMomentum.x += eyeDirNormalized.m128_f32[0] * 0.1f;
-        cameraMomentum.y += eyeDirNormalized.m128_f32[1] * 0.1f;
-        cameraMomentum.z += eyeDirNormalized.m128_f32[2] * 0.1f;
+        cameraMomentum.x += XMVectorGetX(eyeDirNormalized) * 0.1f;
+        cameraMomentum.y += XMVectorGetY(eyeDirNormalized) * 0.1f;
+        cameraMomentum.z += XMVectorGetZ(eyeDirNormalized) * 0.1f;
     }
     else if (key == 'S')
     {
-        cameraMomentum.x -= eyeDirNormalized.m128_f32[0] * 0.1f;
-        cameraMomentum.y -= eyeDirNormalized.m128_f32[1] * 0.1f;
-        cameraMomentum.z -= eyeDirNormalized.m128_f32[2] * 0.1f;
+        cameraMomentum.x -= XMVectorGetX(eyeDirNormalized) * 0.1f;
+        cameraMomentum.y -= XMVectorGetY(eyeDirNormalized) * 0.1f;
+        cameraMomentum.z -= XMVectorGetZ(eyeDirNormalized) * 0.1f;
     }
     else if (key == 'A')
     {
         XMVECTOR up{0.0f, 1.0f, 0.0f, 0.0f};
         XMVECTOR cross = XMVector3Cross(eyeDirNormalized, up);
-        cameraMomentum.x += cross.m128_f32[0] * 0.1f;
-        cameraMomentum.y += cross.m128_f32[1] * 0.1f;
-        cameraMomentum.z += cross.m128_f32[2] * 0.1f;
+        cameraMomentum.x += XMVectorGetX(cross) * 0.1f;
+        cameraMomentum.y += XMVectorGetY(cross) * 0.1f;
+        cameraMomentum.z += XMVectorGetZ(cross) * 0.1f;
     }
     else if (key == 'D')
     {
         XMVECTOR up{0.0f, 1.0f, 0.0f, 0.0f};
         XMVECTOR cross = XMVector3Cross(eyeDirNormalized, up);
-        cameraMomentum.x -= cross.m128_f32[0] * 0.1f;
-        cameraMomentum.y -= cross.m128_f32[1] * 0.1f;
-        cameraMomentum.z -= cross.m128_f32[2] * 0.1f;
+        cameraMomentum.x -= XMVectorGetX(cross) * 0.1f;
+        cameraMomentum.y -= XMVectorGetY(cross) * 0.1f;
+        cameraMomentum.z -= XMVectorGetZ(cross) * 0.1f;
     }
     else if (key == 'Z')
     {
@@ -162,6 +169,19 @@ void OnKeyDown(UINT8 key)
     {
         cameraData.doStratify = !cameraData.doStratify;
     }
+    else if (key == 'P')
+    {
+        animationPlaying = !animationPlaying;
+    }
+    else if (key == 'T')
+    {
+        temporalReuseEnabled = !temporalReuseEnabled;
+    }
+    else if (key == 'I')
+    {
+        instanceRecordsEnabled = !instanceRecordsEnabled;
+        instanceRecordsToggled = true;
+    }
     else if (key == 'X')
     {
         cameraData.samplesPerPixel *= 2;
@@ -194,13 +214,13 @@ void OnMouseMove(int xPosDiff, int yPosDiff)
 
     auto prenormalized = XMVector4Normalize(XMVector4Transform(XMLoadFloat3(&eyeDir), rotateY * rotateX));
 
-    float verticalAngleRads = XMVector4AngleBetweenVectors(prenormalized, up).m128_f32[0];
+    float verticalAngleRads = XMVectorGetX(XMVector4AngleBetweenVectors(prenormalized, up));
 
     if (verticalAngleRads >= 0.17f && verticalAngleRads <= 2.96f)
     {
-        eyeDir.x = prenormalized.m128_f32[0];
-        eyeDir.y = prenormalized.m128_f32[1];
-        eyeDir.z = prenormalized.m128_f32[2];
+        eyeDir.x = XMVectorGetX(prenormalized);
+        eyeDir.y = XMVectorGetY(prenormalized);
+        eyeDir.z = XMVectorGetZ(prenormalized);
 
         cameraData.lookat.x = cameraData.lookfrom.x + eyeDir.x;
         cameraData.lookat.y = cameraData.lookfrom.y + eyeDir.y;
@@ -214,12 +234,14 @@ void Init(HWND hwnd)
     InitSurfaces(hwnd);
     InitSeedBuffer();
     InitCommand();
-    InitBuffers();
-    InitBottomLevel();
-    InitScene();
-    InitTopLevel();
     InitRootSignature();
     InitPipeline();
+
+    // There is nothing to render before the first scene, so that one is waited for.
+    sceneSwitcher = std::make_unique<SceneSwitcher<LoadedScene>>(LoadScene);
+    sceneSwitcher->Request(NextScene());
+    sceneSwitcher->WaitIdle();
+    ChangeScene();
 }
 
 void InitDevice()
@@ -241,13 +263,6 @@ void InitDevice()
     device->CreateFence(0, D3D12_FENCE_FLAG_NONE, IID_PPV_ARGS(&fence));
 }
 
-void Flush()
-{
-    static UINT64 value = 1;
-    cmdQueue->Signal(fence, value);
-    fence->SetEventOnCompletion(value++, nullptr);
-}
-
 void InitSurfaces(HWND hwnd)
 {
     DXGI_SWAP_CHAIN_DESC1 scDesc = {.Format = DXGI_FORMAT_R8G8B8A8_UNORM,
@@ -263,7 +278,7 @@ void InitSurfaces(HWND hwnd)
     factory->Release();
 
     D3D12_DESCRIPTOR_HEAP_DESC uavHeapDesc = {.Type = D3D12_DESCRIPTOR_HEAP_TYPE_CBV_SRV_UAV,
-                                              .NumDescriptors = 2,
+                                              .NumDescriptors = 6,
                                               .Flags = D3D12_DESCRIPTOR_HEAP_FLAG_SHADER_VISIBLE };
     device->CreateDescriptorHeap(&uavHeapDesc, IID_PPV_ARGS(&uavHeap));
 
@@ -280,7 +295,7 @@ void Resize(HWND hwnd)
     auto width = std::max<UINT>(rect.right - rect.left, 1);
     auto height = std::max<UINT>(rect.bottom - rect.top, 1);
 
-    Flush();
+    frameRing.WaitIdle();
 
     swapChain->ResizeBuffers(0, width, height, DXGI_FORMAT_UNKNOWN, 0);
 
@@ -306,6 +321,49 @@ void Resize(HWND hwnd)
     device->CreateUnorderedAccessView(
         renderTarget, nullptr, &uavDesc,
         uavHeap->GetCPUDescriptorHandleForHeapStart());
+
+    // Per pixel ray time, written by ray generation for the intersection shaders of moving objects.
+    if (rayTimeTexture) [[likely]]
+        rayTimeTexture->Release();
+
+    rtDesc.Format = DXGI_FORMAT_R32_FLOAT;
+    device->CreateCommittedResource(&DEFAULT_HEAP, D3D12_HEAP_FLAG_NONE, &rtDesc,
+            D3D12_RESOURCE_STATE_UNORDERED_ACCESS,
+            nullptr, IID_PPV_ARGS(&rayTimeTexture));
+
+    uavDesc.Format = DXGI_FORMAT_R32_FLOAT;
+    D3D12_CPU_DESCRIPTOR_HANDLE handle = uavHeap->GetCPUDescriptorHandleForHeapStart();
+    handle.ptr += 2 * device->GetDescriptorHandleIncrementSize(D3D12_DESCRIPTOR_HEAP_TYPE_CBV_SRV_UAV);
+
+    device->CreateUnorderedAccessView(
+        rayTimeTexture, nullptr, &uavDesc,
+        handle);
+
+    // First hits and radiance of the last two frames, for reusing them while only the camera moves.
+    rtDesc.DepthOrArraySize = 2;
+    rtDesc.Format = DXGI_FORMAT_R32G32B32A32_FLOAT;
+    uavDesc = {.Format = DXGI_FORMAT_R32G32B32A32_FLOAT,
+               .ViewDimension = D3D12_UAV_DIMENSION_TEXTURE2DARRAY,
+               .Texture2DArray = {.ArraySize = 2 } };
+
+    UINT descriptor = 3;
+    for (auto* texture : { &historyPositionTexture, &historyNormalTexture, &historyColorTexture })
+    {
+        if (*texture) [[likely]]
+            (*texture)->Release();
+
+        device->CreateCommittedResource(&DEFAULT_HEAP, D3D12_HEAP_FLAG_NONE, &rtDesc,
+                D3D12_RESOURCE_STATE_UNORDERED_ACCESS,
+                nullptr, IID_PPV_ARGS(texture));
+
+        handle = uavHeap->GetCPUDescriptorHandleForHeapStart();
+        handle.ptr += descriptor++ * device->GetDescriptorHandleIncrementSize(D3D12_DESCRIPTOR_HEAP_TYPE_CBV_SRV_UAV);
+
+        device->CreateUnorderedAccessView(
+            *texture, nullptr, &uavDesc,
+            handle);
+    }
+    historyValid = false;
 }
 
 void InitSeedBuffer()
@@ -343,68 +401,258 @@ void InitSeedBuffer()
 
 void InitCommand()
 {
-    device->CreateCommandAllocator(D3D12_COMMAND_LIST_TYPE_DIRECT,
-        IID_PPV_ARGS(&cmdAlloc));
+    // One allocator per frame in flight, the GPU may still be executing what the others hold.
+    for (auto& frame : frameRing.Frames())
+    {
+        device->CreateCommandAllocator(D3D12_COMMAND_LIST_TYPE_DIRECT,
+            IID_PPV_ARGS(&frame.cmdAlloc));
+    }
     device->CreateCommandList1(0, D3D12_COMMAND_LIST_TYPE_DIRECT,
         D3D12_COMMAND_LIST_FLAG_NONE,
         IID_PPV_ARGS(&cmdList));
+
+    // Only used by the scene loading thread.
+    D3D12_COMMAND_QUEUE_DESC setupQueueDesc = {.Type = D3D12_COMMAND_LIST_TYPE_DIRECT,};
+    device->CreateCommandQueue(&setupQueueDesc, IID_PPV_ARGS(&setupQueue));
+    device->CreateFence(0, D3D12_FENCE_FLAG_NONE, IID_PPV_ARGS(&setupFence));
+    device->CreateCommandAllocator(D3D12_COMMAND_LIST_TYPE_DIRECT,
+        IID_PPV_ARGS(&setupAlloc));
+    device->CreateCommandList1(0, D3D12_COMMAND_LIST_TYPE_DIRECT,
+        D3D12_COMMAND_LIST_FLAG_NONE,
+        IID_PPV_ARGS(&setupList));
 }
 
-ID3D12Resource* makeAndCopy(void* ptr, size_t size, void** mappedPtr) {
-    auto desc = BASIC_BUFFER_DESC;
-    desc.Width = size;
+namespace
+{
+    // Constant buffers need it, and everything else is fine with it too.
+    constexpr size_t SCENE_UPLOAD_ALIGNMENT = D3D12_CONSTANT_BUFFER_DATA_PLACEMENT_ALIGNMENT;
 
-    ID3D12Resource* res;
-    device->CreateCommittedResource(&UPLOAD_HEAP, D3D12_HEAP_FLAG_NONE,
-        &desc, D3D12_RESOURCE_STATE_COMMON,
-        nullptr, IID_PPV_ARGS(&res));
+    // Root SRVs can't be null, so empty tables still get a tiny dummy range.
+    constexpr UINT DUMMY_RANGE[3] = {};
 
-    void* mapped;
-    res->Map(0, nullptr, &mapped);
-    memcpy(mapped, ptr, size);
+    size_t uploadRangeBytes(size_t size)
+    {
+        return (std::max(size, sizeof(DUMMY_RANGE)) + SCENE_UPLOAD_ALIGNMENT - 1) & ~(SCENE_UPLOAD_ALIGNMENT - 1);
+    }
 
-    if (mappedPtr)
-        *mappedPtr = mapped;
-    else
-        res->Unmap(0, nullptr);
+    // Everything InitBuffers, InitScene and InitShaderTable upload for a scene, with the alignment padding.
+    size_t sceneUploadBytes(const SceneState& scene, const ShaderTableLayout& shaderTable)
+    {
+        size_t bytes = uploadRangeBytes(scene.objectList.size() * sizeof(ObjectData)) +
+            uploadRangeBytes(scene.lightsList.size() * sizeof(LightData)) +
+            uploadRangeBytes(scene.materialList.size() * sizeof(MaterialData)) +
+            2 * uploadRangeBytes(sizeof(D3D12_RAYTRACING_AABB)) +
+            uploadRangeBytes(scene.meshVertices.size() * sizeof(DirectX::XMFLOAT3)) +
+            uploadRangeBytes(scene.meshIndices.size() * sizeof(UINT)) +
+            uploadRangeBytes(scene.groupQuads.size() * sizeof(GroupQuad)) +
+            uploadRangeBytes(scene.groupQuads.size() * sizeof(D3D12_RAYTRACING_AABB)) +
+            uploadRangeBytes(scene.animatedInstances.size() * sizeof(D3D12_RAYTRACING_AABB)) +
+            uploadRangeBytes(shaderTable.size);
+        const size_t perFrame = uploadRangeBytes(scene.objectList.size() * sizeof(DirectX::XMFLOAT3)) +
+            uploadRangeBytes(scene.proceduralInstances.size() * sizeof(D3D12_RAYTRACING_INSTANCE_DESC)) +
+            uploadRangeBytes(sizeof(CameraData));
+        return bytes + FRAMES_IN_FLIGHT * perFrame;
+    }
+}
 
-    return res;
-};
+void BeginSceneUpload(const SceneState& scene, GpuScene& gpu)
+{
+    // Whatever the GPU read from the buffer is done by now, see LoadScene.
+    // One hit record per instance when they're enabled and the scene isn't too big for it, otherwise one
+    // per hit group. Hit records always have room for InstanceRecordData, the local root signature wants it.
+    gpu.instanceRecords = instanceRecordsEnabled && scene.proceduralInstances.size() <= MAX_INSTANCE_RECORDS;
+    gpu.shaderTableLayout = MakeShaderTableLayout(1, gpu.instanceRecords ? (UINT)scene.proceduralInstances.size() : NUM_HIT_GROUPS,
+        sizeof(InstanceRecordData));
+    const size_t size = sceneUploadBytes(scene, gpu.shaderTableLayout);
+    if (gpu.uploadBuffer == nullptr || gpu.uploadRanges.Capacity() < size)
+    {
+        if (gpu.uploadBuffer)
+            gpu.uploadBuffer->Release();
+
+        auto desc = BASIC_BUFFER_DESC;
+        desc.Width = size;
+        device->CreateCommittedResource(&UPLOAD_HEAP, D3D12_HEAP_FLAG_NONE,
+            &desc, D3D12_RESOURCE_STATE_COMMON,
+            nullptr, IID_PPV_ARGS(&gpu.uploadBuffer));
+        gpu.uploadBuffer->Map(0, nullptr, reinterpret_cast<void**>(&gpu.uploadData));
+        gpu.uploadRanges = LinearSuballocator(size);
+    }
+    gpu.uploadRanges.Reset();
+}
 
-void InitBuffers()
+D3D12_GPU_VIRTUAL_ADDRESS uploadToScene(GpuScene& gpu, const void* ptr, size_t size, void** mappedPtr)
 {
-    if (objectsView)
-        objectsView->Release();
+    size_t offset;
+    if (!gpu.uploadRanges.Allocate(std::max(size, sizeof(DUMMY_RANGE)), SCENE_UPLOAD_ALIGNMENT, offset))
+    {
+        throw std::runtime_error("Scene upload buffer is too small, sceneUploadBytes missed something");
+    }
 
-    objectsView = makeAndCopy(objectList.data(), objectList.size() * sizeof(ObjectData));
+    // A null ptr only reserves the range, the caller writes it through mappedPtr.
+    if (size == 0)
+        ptr = DUMMY_RANGE;
+    if (ptr)
+        memcpy(gpu.uploadData + offset, ptr, std::max(size, sizeof(DUMMY_RANGE)));
+    if (mappedPtr)
+        *mappedPtr = gpu.uploadData + offset;
+    return gpu.uploadBuffer->GetGPUVirtualAddress() + offset;
+}
 
-    if (lightsView)
-        lightsView->Release();
+void InitBuffers(const SceneState& scene, GpuScene& gpu)
+{
+    BeginSceneUpload(scene, gpu);
+    ArenaScope scratch(ScratchArena());
 
-    lightsView = makeAndCopy(lightsList.data(), lightsList.size() * sizeof(UINT));
+    gpu.objectsView = uploadToScene(gpu, scene.objectList.data(), scene.objectList.size() * sizeof(ObjectData));
+    gpu.lightsView = uploadToScene(gpu, scene.lightsList.data(), scene.lightsList.size() * sizeof(LightData));
+    gpu.materialsView = uploadToScene(gpu, scene.materialList.data(), scene.materialList.size() * sizeof(MaterialData));
 
     // All our procedural primitives will be using this AABB and we will use instance
     // transforms to resize/move them around.
+    const D3D12_RAYTRACING_AABB cube = { -1, -1, -1, 1, 1, 1 };
+    gpu.cubeAABB = uploadToScene(gpu, &cube, sizeof(cube));
+    const D3D12_RAYTRACING_AABB quad = { -1, -1, -0.00001f, 1, 1, 0.00001f };
+    gpu.quadAABB = uploadToScene(gpu, &quad, sizeof(quad));
+
+    gpu.meshVertexBuffer = uploadToScene(gpu, scene.meshVertices.data(), scene.meshVertices.size() * sizeof(DirectX::XMFLOAT3));
+    gpu.meshIndexBuffer = uploadToScene(gpu, scene.meshIndices.data(), scene.meshIndices.size() * sizeof(UINT));
+
+    // Each group quad gets its own thin AABB, all groups share one AABB buffer.
+    ArenaVector<D3D12_RAYTRACING_AABB> groupAABBs(ScratchArena());
+    groupAABBs.reserve(scene.groupQuads.size());
+    for (auto& quad : scene.groupQuads)
+    {
+        D3D12_RAYTRACING_AABB aabb = { FLT_MAX, FLT_MAX, FLT_MAX, -FLT_MAX, -FLT_MAX, -FLT_MAX };
+        for (float a : { 0.0f, 1.0f })
+        {
+            for (float b : { 0.0f, 1.0f })
+            {
+                DirectX::XMFLOAT3 corner = { quad.Q.x + a * quad.U.x + b * quad.V.x,
+                                             quad.Q.y + a * quad.U.y + b * quad.V.y,
+                                             quad.Q.z + a * quad.U.z + b * quad.V.z };
+                aabb = { std::min(aabb.MinX, corner.x - 0.00001f), std::min(aabb.MinY, corner.y - 0.00001f), std::min(aabb.MinZ, corner.z - 0.00001f),
+                         std::max(aabb.MaxX, corner.x + 0.00001f), std::max(aabb.MaxY, corner.y + 0.00001f), std::max(aabb.MaxZ, corner.z + 0.00001f) };
+            }
+        }
+        groupAABBs.push_back(aabb);
+    }
 
-    if (cubeAABB == nullptr)
+    gpu.groupQuadBuffer = uploadToScene(gpu, scene.groupQuads.data(), scene.groupQuads.size() * sizeof(GroupQuad));
+    gpu.groupAABBBuffer = uploadToScene(gpu, groupAABBs.data(), groupAABBs.size() * sizeof(D3D12_RAYTRACING_AABB));
+
+    // Motion is filled in by InitScene and then every animated frame, static objects just keep zero.
+    ArenaVector<DirectX::XMFLOAT3> objectMotion(scene.objectList.size(), { 0, 0, 0 }, ScratchArena());
+    for (auto& frame : gpu.frames)
     {
-        const D3D12_RAYTRACING_AABB aabbs = { -1, -1, -1, 1, 1, 1 };
-        cubeAABB = makeAndCopy((void*)&aabbs, sizeof(aabbs));
+        frame.objectMotionBuffer = uploadToScene(gpu, objectMotion.data(), objectMotion.size() * sizeof(DirectX::XMFLOAT3), (void**)&frame.objectMotionData);
     }
 
-    if (quadAABB == nullptr)
+    // Moving spheres can't share the unit cube AABB, their BLAS has to cover every place the ray time can
+    // move them to. That is at most the span of their keyframe translations, in any direction.
+    ArenaVector<D3D12_RAYTRACING_AABB> motionAABBs(ScratchArena());
+    for (UINT instance : scene.animatedInstances)
     {
-        const D3D12_RAYTRACING_AABB aabbs = { -1, -1, -0.00001f, 1, 1, 0.00001f };
-        quadAABB = makeAndCopy((void*)&aabbs, sizeof(aabbs));
+        const ProceduralInstance& moving = scene.proceduralInstances[instance];
+        if (moving.type != OBJECT_TYPE_MOVING_SPHERE)
+            continue;
+
+        DirectX::XMFLOAT3 spanMin = { FLT_MAX, FLT_MAX, FLT_MAX };
+        DirectX::XMFLOAT3 spanMax = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
+        for (auto& keyframe : moving.keyframes)
+        {
+            DirectX::XMFLOAT3 position;
+            DirectX::XMStoreFloat3(&position, keyframe.transform.r[3]);
+            spanMin = { std::min(spanMin.x, position.x), std::min(spanMin.y, position.y), std::min(spanMin.z, position.z) };
+            spanMax = { std::max(spanMax.x, position.x), std::max(spanMax.y, position.y), std::max(spanMax.z, position.z) };
+        }
+        const float span[3] = { spanMax.x - spanMin.x, spanMax.y - spanMin.y, spanMax.z - spanMin.z };
+
+        float extent[3] = {};
+        for (auto& keyframe : moving.keyframes)
+        {
+            DirectX::XMFLOAT4X4 worldToObject;
+            DirectX::XMStoreFloat4x4(&worldToObject, DirectX::XMMatrixInverse(nullptr, keyframe.transform));
+            for (int j = 0; j < 3; ++j)
+            {
+                float objectSpan = 0;
+                for (int i = 0; i < 3; ++i)
+                {
+                    objectSpan += span[i] * std::abs(worldToObject.m[i][j]);
+                }
+                extent[j] = std::max(extent[j], objectSpan);
+            }
+        }
+
+        motionAABBs.push_back({ -1 - extent[0], -1 - extent[1], -1 - extent[2], 1 + extent[0], 1 + extent[1], 1 + extent[2] });
     }
 
-    if (cameraConstantBuffer)
-        cameraConstantBuffer->Release();
+    gpu.motionAABBBuffer = uploadToScene(gpu, motionAABBs.data(), motionAABBs.size() * sizeof(D3D12_RAYTRACING_AABB));
+    gpu.motionAABBCount = (UINT)motionAABBs.size();
 
-    cameraConstantBuffer = makeAndCopy(&cameraData, sizeof(cameraData), &cameraMappedData);
+    for (auto& frame : gpu.frames)
+    {
+        frame.cameraConstantBuffer = uploadToScene(gpu, &scene.camera, sizeof(scene.camera), &frame.cameraMappedData);
+    }
 }
 
-ID3D12Resource* MakeAccelerationStructure(
+void BeginSetup()
+{
+    setupAlloc->Reset();
+    setupList->Reset(setupAlloc, nullptr);
+}
+
+void FinishSetup(GpuScene& gpu)
+{
+    setupList->Close();
+    setupQueue->ExecuteCommandLists(
+        1, reinterpret_cast<ID3D12CommandList**>(&setupList));
+
+    // Only blocks the loading thread, frames keep going on the other queue.
+    setupQueue->Signal(setupFence, ++setupFenceValue);
+    setupFence->SetEventOnCompletion(setupFenceValue, nullptr);
+    for (auto* scratch : gpu.setupScratch)
+        scratch->Release();
+    gpu.setupScratch.clear();
+}
+
+void ReleaseScene(GpuScene& gpu)
+{
+    // The upload buffer stays, the next scene loaded into gpu reuses it.
+    for (auto** as : { &gpu.cubeProceduralBlas, &gpu.quadProceduralBlas, &gpu.tlas, &gpu.tlasUpdateScratch })
+    {
+        if (*as)
+            (*as)->Release();
+        *as = nullptr;
+    }
+
+    for (auto* blases : { &gpu.meshBlases, &gpu.groupBlases, &gpu.motionBlases })
+    {
+        for (auto* blas : *blases)
+            blas->Release();
+        blases->clear();
+    }
+}
+
+void LoadScene(UINT scene, LoadedScene& back)
+{
+    // Runs on the scene switcher's thread. After a swap the back scene is the one frames were rendering,
+    // the last of them has to be done with it.
+    frameRing.GetQueue().WaitFor(back.gpu.lastUse);
+    ReleaseScene(back.gpu);
+
+    BuildScene(scene, back.host);
+
+    InitBuffers(back.host, back.gpu);
+    BeginSetup();
+    InitBottomLevel(back.host, back.gpu);
+    InitScene(back.host, back.gpu);
+    InitTopLevel(back.host, back.gpu);
+    InitShaderTable(back.host, back.gpu);
+    FinishSetup(back.gpu);
+    back.index = scene;
+}
+
+ID3D12Resource* MakeAccelerationStructure(GpuScene& gpu,
     const D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_INPUTS& inputs,
     UINT64* updateScratchSize)
 {
@@ -434,30 +682,25 @@ ID3D12Resource* MakeAccelerationStructure(
                                                                     .Inputs = inputs,
                                                                     .ScratchAccelerationStructureData = scratch->GetGPUVirtualAddress() };
 
-    cmdAlloc->Reset();
-    cmdList->Reset(cmdAlloc, nullptr);
-    cmdList->BuildRaytracingAccelerationStructure(&buildDesc, 0, nullptr);
-    cmdList->Close();
-    cmdQueue->ExecuteCommandLists(
-        1, reinterpret_cast<ID3D12CommandList**>(&cmdList));
-
-    Flush();
-    scratch->Release();
+    // Builds are only recorded here, all of them go to the GPU together in FinishSetup.
+    setupList->BuildRaytracingAccelerationStructure(&buildDesc, 0, nullptr);
+    gpu.setupScratch.push_back(scratch);
     return as;
 }
 
-ID3D12Resource* MakeBLAS(ID3D12Resource* vertexBuffer, UINT vertexFloats,
-    ID3D12Resource* indexBuffer, UINT indices)
+ID3D12Resource* MakeBLAS(GpuScene& gpu, D3D12_GPU_VIRTUAL_ADDRESS vertexBuffer, UINT vertexFloats,
+    D3D12_GPU_VIRTUAL_ADDRESS indexBuffer, UINT indices,
+    UINT firstVertex, UINT firstIndex)
 {
     D3D12_RAYTRACING_GEOMETRY_DESC geometryDesc = {.Type = D3D12_RAYTRACING_GEOMETRY_TYPE_TRIANGLES,
                                                    .Flags = D3D12_RAYTRACING_GEOMETRY_FLAG_OPAQUE,
                                                    .Triangles = {.Transform3x4 = 0,
-                                                                 .IndexFormat = indexBuffer ? DXGI_FORMAT_R16_UINT : DXGI_FORMAT_UNKNOWN,
+                                                                 .IndexFormat = indexBuffer ? DXGI_FORMAT_R32_UINT : DXGI_FORMAT_UNKNOWN,
                                                                  .VertexFormat = DXGI_FORMAT_R32G32B32_FLOAT,
                                                                  .IndexCount = indices,
                                                                  .VertexCount = vertexFloats / 3,
-                                                                 .IndexBuffer = indexBuffer ? indexBuffer->GetGPUVirtualAddress() : 0,
-                                                                 .VertexBuffer = {.StartAddress = vertexBuffer->GetGPUVirtualAddress(),
+                                                                 .IndexBuffer = indexBuffer ? indexBuffer + firstIndex * sizeof(UINT) : 0,
+                                                                 .VertexBuffer = {.StartAddress = vertexBuffer + firstVertex * sizeof(float) * 3,
                                                                                   .StrideInBytes = sizeof(float) * 3 } } };
 
     D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_INPUTS inputs = {.Type = D3D12_RAYTRACING_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL,
@@ -465,16 +708,16 @@ ID3D12Resource* MakeBLAS(ID3D12Resource* vertexBuffer, UINT vertexFloats,
                                                                    .NumDescs = 1,
                                                                    .DescsLayout = D3D12_ELEMENTS_LAYOUT_ARRAY,
                                                                    .pGeometryDescs = &geometryDesc };
-    return MakeAccelerationStructure(inputs);
+    return MakeAccelerationStructure(gpu, inputs);
 }
 
-ID3D12Resource* MakeProceduralBLAS(ID3D12Resource* aabbBuffer)
+ID3D12Resource* MakeProceduralBLAS(GpuScene& gpu, D3D12_GPU_VIRTUAL_ADDRESS aabbBuffer, UINT aabbCount, UINT firstAABB)
 {
     D3D12_RAYTRACING_GEOMETRY_DESC geometryDesc[] = {
                                     {.Type = D3D12_RAYTRACING_GEOMETRY_TYPE_PROCEDURAL_PRIMITIVE_AABBS,
                                     .Flags = D3D12_RAYTRACING_GEOMETRY_FLAG_OPAQUE,
-                                    .AABBs = {.AABBCount = 1,
-                                                .AABBs = {.StartAddress = aabbBuffer->GetGPUVirtualAddress(),
+                                    .AABBs = {.AABBCount = aabbCount,
+                                                .AABBs = {.StartAddress = aabbBuffer + firstAABB * sizeof(D3D12_RAYTRACING_AABB),
                                                         .StrideInBytes = sizeof(D3D12_RAYTRACING_AABB) } } },
     };
 
@@ -483,72 +726,118 @@ ID3D12Resource* MakeProceduralBLAS(ID3D12Resource* aabbBuffer)
                                                                    .NumDescs = 1,
                                                                    .DescsLayout = D3D12_ELEMENTS_LAYOUT_ARRAY,
                                                                    .pGeometryDescs = geometryDesc };
-    return MakeAccelerationStructure(inputs);
+    return MakeAccelerationStructure(gpu, inputs);
 }
 
-void InitBottomLevel()
+void InitBottomLevel(const SceneState& scene, GpuScene& gpu)
 {
-    if (cubeProceduralBlas)
-        cubeProceduralBlas->Release();
-    cubeProceduralBlas = MakeProceduralBLAS(cubeAABB);
+    // Whatever gpu had before was released by LoadScene.
+    gpu.cubeProceduralBlas = MakeProceduralBLAS(gpu, gpu.cubeAABB);
+    gpu.quadProceduralBlas = MakeProceduralBLAS(gpu, gpu.quadAABB);
 
-    if (quadProceduralBlas)
-        quadProceduralBlas->Release();
-    quadProceduralBlas = MakeProceduralBLAS(quadAABB);
+    // One BLAS per loaded mesh, every instance of the mesh shares it.
+    for (auto& mesh : scene.meshList)
+    {
+        gpu.meshBlases.push_back(MakeBLAS(gpu, gpu.meshVertexBuffer, mesh.vertexCount * 3,
+            gpu.meshIndexBuffer, mesh.indexCount,
+            mesh.vertexOffset, mesh.indexOffset));
+    }
+
+    // Same for quad groups, a single BLAS holds all quads of the group.
+    for (auto& group : scene.groupList)
+    {
+        gpu.groupBlases.push_back(MakeProceduralBLAS(gpu, gpu.groupAABBBuffer, group.quadCount, group.quadOffset));
+    }
+
+    // And one per moving sphere, as each one moves by a different amount.
+    for (UINT i = 0; i < gpu.motionAABBCount; ++i)
+    {
+        gpu.motionBlases.push_back(MakeProceduralBLAS(gpu, gpu.motionAABBBuffer, 1, i));
+    }
 }
 
-ID3D12Resource* MakeTLAS(ID3D12Resource* instances, UINT numInstances,
+void UploadPendingInstances(FrameResources& frame, GpuSceneFrame& copies)
+{
+    for (UINT id : frame.pendingInstances)
+    {
+        const ProceduralInstance& instance = proceduralInstances[id];
+        auto* ptr = reinterpret_cast<DirectX::XMFLOAT3X4*>(&copies.instanceData[id].Transform);
+        DirectX::XMStoreFloat3x4(ptr, instance.transform);
+        copies.objectMotionData[instance.instanceID] = instance.motion;
+    }
+    frame.pendingInstances.clear();
+}
+
+ID3D12Resource* MakeTLAS(GpuScene& gpu, D3D12_GPU_VIRTUAL_ADDRESS instances, UINT numInstances,
     UINT64* updateScratchSize)
 {
     D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_INPUTS inputs = {.Type = D3D12_RAYTRACING_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL,
                                                                    .Flags = D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_ALLOW_UPDATE,
                                                                    .NumDescs = numInstances,
                                                                    .DescsLayout = D3D12_ELEMENTS_LAYOUT_ARRAY,
-                                                                   .InstanceDescs = instances->GetGPUVirtualAddress() };
+                                                                   .InstanceDescs = instances };
 
-    return MakeAccelerationStructure(inputs, updateScratchSize);
+    // The BLAS builds recorded before this one have to be done first.
+    D3D12_RESOURCE_BARRIER barrier = {.Type = D3D12_RESOURCE_BARRIER_TYPE_UAV,
+                                      .UAV = {.pResource = nullptr} };
+    setupList->ResourceBarrier(1, &barrier);
+
+    return MakeAccelerationStructure(gpu, inputs, updateScratchSize);
 }
 
-void InitScene()
+void InitScene(const SceneState& scene, GpuScene& gpu)
 {
-    if (instances)
-        instances->Release();
-
-    auto instancesDesc = BASIC_BUFFER_DESC;
-    instancesDesc.Width = sizeof(D3D12_RAYTRACING_INSTANCE_DESC) * getNumInstances();
-    device->CreateCommittedResource(&UPLOAD_HEAP, D3D12_HEAP_FLAG_NONE,
-        &instancesDesc, D3D12_RESOURCE_STATE_COMMON,
-        nullptr, IID_PPV_ARGS(&instances));
-    instances->Map(0, nullptr, reinterpret_cast<void**>(&instanceData));
-
+    // Animated instances are already where they are at the scene's shutter time, see BuildScene.
+    ArenaScope scratch(ScratchArena());
+    ArenaVector<D3D12_RAYTRACING_INSTANCE_DESC> instanceDescs(scene.proceduralInstances.size(), ScratchArena());
     UINT id = 0;
-    for (auto& instance : proceduralInstances)
+    for (auto& instance : scene.proceduralInstances)
     {
         ID3D12Resource* accelerationStructure = nullptr;
         switch (instance.type)
         {
         case OBJECT_TYPE_SPHERE:
         case OBJECT_TYPE_VOLUMETRIC_CUBE:
-            accelerationStructure = cubeProceduralBlas;
+            accelerationStructure = gpu.cubeProceduralBlas;
             break;
         case OBJECT_TYPE_QUAD:
-            accelerationStructure = quadProceduralBlas;
+            accelerationStructure = gpu.quadProceduralBlas;
             break;
+        case OBJECT_TYPE_TRIANGLE_MESH:
+            accelerationStructure = gpu.meshBlases[instance.prototypeIndex];
+            break;
+        case OBJECT_TYPE_QUAD_GROUP:
+            accelerationStructure = gpu.groupBlases[instance.prototypeIndex];
+            break;
+        case OBJECT_TYPE_MOVING_SPHERE:
+            accelerationStructure = gpu.motionBlases[instance.prototypeIndex];
+            break;
+        default:
+            throw std::runtime_error("Instance of unknown object type " + std::to_string(instance.type));
         }
 
-        instanceData[id] = { .InstanceID = instance.instanceID,
-                             .InstanceMask = 1,
-                             .InstanceContributionToHitGroupIndex = instance.hitGroupIndex,
-                             .AccelerationStructure = accelerationStructure->GetGPUVirtualAddress() };
+        instanceDescs[id] = { .InstanceID = instance.instanceID,
+                              .InstanceMask = 1,
+                              .InstanceContributionToHitGroupIndex = gpu.instanceRecords ? id : instance.hitGroupIndex,
+                              .AccelerationStructure = accelerationStructure->GetGPUVirtualAddress() };
 
-        auto* ptr = reinterpret_cast<DirectX::XMFLOAT3X4*>(&instanceData[id].Transform);
+        auto* ptr = reinterpret_cast<DirectX::XMFLOAT3X4*>(&instanceDescs[id].Transform);
         DirectX::XMStoreFloat3x4(ptr, instance.transform);
         ++id;
     }
 
-    instances->Unmap(0, nullptr);
+    // Every frame in flight gets its own copy of the instances and their motion. They stay mapped,
+    // so moved instances can be patched in place by UpdateScene.
+    for (auto& frame : gpu.frames)
+    {
+        frame.instances = uploadToScene(gpu, instanceDescs.data(), instanceDescs.size() * sizeof(D3D12_RAYTRACING_INSTANCE_DESC),
+            reinterpret_cast<void**>(&frame.instanceData));
 
-    UpdateTransforms();
+        for (UINT instance : scene.animatedInstances)
+        {
+            frame.objectMotionData[scene.proceduralInstances[instance].instanceID] = scene.proceduralInstances[instance].motion;
+        }
+    }
 }
 
 void UpdateTransforms()
@@ -602,24 +891,31 @@ void UpdateTransforms()
             cameraData.samplesPerPixel *= 2;
         }
     }
-    printf("elapsedMilliseconds: %d at aa: %d\n", (UINT)elapsedMilliseconds, cameraData.samplesPerPixel);
+    printf("elapsedMilliseconds: %d at aa: %d, bounces d/s/t/v: %u/%u/%u/%u\n", (UINT)elapsedMilliseconds, cameraData.samplesPerPixel,
+        cameraData.maxBounces[BOUNCE_TYPE_DIFFUSE], cameraData.maxBounces[BOUNCE_TYPE_SPECULAR],
+        cameraData.maxBounces[BOUNCE_TYPE_TRANSMISSION], cameraData.maxBounces[BOUNCE_TYPE_VOLUME]);
 
     cameraData.frameIndex++;
     cameraData.numLights = (UINT)lightsList.size();
 
-    memcpy(cameraMappedData, &cameraData, sizeof(cameraData));
-}
+    // The previous frame's first hits and radiance only hold up if nothing but the camera moved.
+    if (!dirtyInstances.empty())
+        historyValid = false;
+    cameraData.temporalReuse = temporalReuseEnabled && historyValid;
 
-void InitTopLevel()
-{
-    if (tlas)
-        tlas->Release();
+    memcpy(gpuScene.frames[frameRing.CurrentIndex()].cameraMappedData, &cameraData, sizeof(cameraData));
 
-    if (tlasUpdateScratch)
-        tlasUpdateScratch->Release();
+    // The next frame reprojects into this one.
+    cameraData.previousLookfrom = cameraData.lookfrom;
+    cameraData.previousLookat = cameraData.lookat;
+    historyValid = true;
+}
 
+void InitTopLevel(const SceneState& scene, GpuScene& gpu)
+{
+    // Built from the first frame's copy of the instances, they all start out the same.
     UINT64 updateScratchSize;
-    tlas = MakeTLAS(instances, getNumInstances(), &updateScratchSize);
+    gpu.tlas = MakeTLAS(gpu, gpu.frames[0].instances, (UINT)scene.proceduralInstances.size(), &updateScratchSize);
 
     auto desc = BASIC_BUFFER_DESC;
     // WARP bug workaround: use 8 if the required size was reported as less
@@ -627,13 +923,13 @@ void InitTopLevel()
     desc.Flags = D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS;
     device->CreateCommittedResource(&DEFAULT_HEAP, D3D12_HEAP_FLAG_NONE, &desc,
         D3D12_RESOURCE_STATE_COMMON, nullptr,
-        IID_PPV_ARGS(&tlasUpdateScratch));
+        IID_PPV_ARGS(&gpu.tlasUpdateScratch));
 }
 
 void InitRootSignature()
 {
     D3D12_DESCRIPTOR_RANGE uavRange = {.RangeType = D3D12_DESCRIPTOR_RANGE_TYPE_UAV,
-                                       .NumDescriptors = 2 };
+                                       .NumDescriptors = 6 };
 
     D3D12_ROOT_PARAMETER params[] = {
                                         {.ParameterType = D3D12_ROOT_PARAMETER_TYPE_DESCRIPTOR_TABLE,
@@ -648,6 +944,21 @@ void InitRootSignature()
                                         {.ParameterType = D3D12_ROOT_PARAMETER_TYPE_SRV,
                                          .Descriptor = {.ShaderRegister = 2,
                                                         .RegisterSpace = 0} },
+                                        {.ParameterType = D3D12_ROOT_PARAMETER_TYPE_SRV,
+                                         .Descriptor = {.ShaderRegister = 3,
+                                                        .RegisterSpace = 0} },
+                                        {.ParameterType = D3D12_ROOT_PARAMETER_TYPE_SRV,
+                                         .Descriptor = {.ShaderRegister = 4,
+                                                        .RegisterSpace = 0} },
+                                        {.ParameterType = D3D12_ROOT_PARAMETER_TYPE_SRV,
+                                         .Descriptor = {.ShaderRegister = 5,
+                                                        .RegisterSpace = 0} },
+                                        {.ParameterType = D3D12_ROOT_PARAMETER_TYPE_SRV,
+                                         .Descriptor = {.ShaderRegister = 6,
+                                                        .RegisterSpace = 0} },
+                                        {.ParameterType = D3D12_ROOT_PARAMETER_TYPE_SRV,
+                                         .Descriptor = {.ShaderRegister = 7,
+                                                        .RegisterSpace = 0} },
                                         {.ParameterType = D3D12_ROOT_PARAMETER_TYPE_CBV,
                                          .Descriptor = {.ShaderRegister = 0,
                                                         .RegisterSpace = 0} }
@@ -663,6 +974,53 @@ void InitRootSignature()
         blob->GetBufferSize(),
         IID_PPV_ARGS(&rootSignature));
     blob->Release();
+
+    // Hit records carry InstanceRecordData inline, as root constants.
+    D3D12_ROOT_PARAMETER hitParam = {.ParameterType = D3D12_ROOT_PARAMETER_TYPE_32BIT_CONSTANTS,
+                                     .Constants = {.ShaderRegister = 1,
+                                                   .RegisterSpace = 0,
+                                                   .Num32BitValues = sizeof(InstanceRecordData) / 4} };
+
+    D3D12_ROOT_SIGNATURE_DESC hitDesc = {.NumParameters = 1,
+                                         .pParameters = &hitParam,
+                                         .Flags = D3D12_ROOT_SIGNATURE_FLAG_LOCAL_ROOT_SIGNATURE };
+
+    D3D12SerializeRootSignature(&hitDesc, D3D_ROOT_SIGNATURE_VERSION_1_0, &blob,
+        nullptr);
+    device->CreateRootSignature(0, blob->GetBufferPointer(),
+        blob->GetBufferSize(),
+        IID_PPV_ARGS(&hitRootSignature));
+    blob->Release();
+}
+
+namespace
+{
+    // Indexed by hit group index, see objectTypeToHitGroupIndex.
+    const wchar_t* HIT_GROUP_NAMES[NUM_HIT_GROUPS] = {
+        L"HitGroupProceduralLambertianSphere",
+        L"HitGroupProceduralMetalSphere",
+        L"HitGroupProceduralDielectricSphere",
+        L"HitGroupProceduralDiffuseLightSphere",
+        L"HitGroupProceduralSmokeSphere",
+        L"HitGroupProceduralLambertianQuad",
+        L"HitGroupProceduralMetalQuad",
+        L"HitGroupProceduralDielectricQuad",
+        L"HitGroupProceduralDiffuseLightQuad",
+        L"HitGroupProceduralSmokeCube",
+        L"HitGroupProceduralGlassCube",
+        L"HitGroupTriangleLambertian",
+        L"HitGroupTriangleMetal",
+        L"HitGroupTriangleDielectric",
+        L"HitGroupTriangleDiffuseLight",
+        L"HitGroupProceduralLambertianQuadGroup",
+        L"HitGroupProceduralMetalQuadGroup",
+        L"HitGroupProceduralDielectricQuadGroup",
+        L"HitGroupProceduralDiffuseLightQuadGroup",
+        L"HitGroupProceduralLambertianMovingSphere",
+        L"HitGroupProceduralMetalMovingSphere",
+        L"HitGroupProceduralDielectricMovingSphere",
+        L"HitGroupProceduralDiffuseLightMovingSphere"
+    };
 }
 
 void InitPipeline()
@@ -725,11 +1083,71 @@ void InitPipeline()
                                                                   .ClosestHitShaderImport = L"ClosestHitProceduralDielectric",
                                                                   .IntersectionShaderImport = L"IntersectionProceduralGlassCube" };
 
-    D3D12_RAYTRACING_SHADER_CONFIG shaderCfg = {.MaxPayloadSizeInBytes = 56,
+    D3D12_HIT_GROUP_DESC hitGroupTriangleLambertian = {           .HitGroupExport = L"HitGroupTriangleLambertian",
+                                                                  .Type = D3D12_HIT_GROUP_TYPE_TRIANGLES,
+                                                                  .ClosestHitShaderImport = L"ClosestHitTriangleLambertian" };
+
+    D3D12_HIT_GROUP_DESC hitGroupTriangleMetal = {                .HitGroupExport = L"HitGroupTriangleMetal",
+                                                                  .Type = D3D12_HIT_GROUP_TYPE_TRIANGLES,
+                                                                  .ClosestHitShaderImport = L"ClosestHitTriangleMetal" };
+
+    D3D12_HIT_GROUP_DESC hitGroupTriangleDielectric = {           .HitGroupExport = L"HitGroupTriangleDielectric",
+                                                                  .Type = D3D12_HIT_GROUP_TYPE_TRIANGLES,
+                                                                  .ClosestHitShaderImport = L"ClosestHitTriangleDielectric" };
+
+    D3D12_HIT_GROUP_DESC hitGroupTriangleDiffuseLight = {         .HitGroupExport = L"HitGroupTriangleDiffuseLight",
+                                                                  .Type = D3D12_HIT_GROUP_TYPE_TRIANGLES,
+                                                                  .ClosestHitShaderImport = L"ClosestHitTriangleDiffuseLight" };
+
+    D3D12_HIT_GROUP_DESC hitGroupProceduralLambertianQuadGroup = { .HitGroupExport = L"HitGroupProceduralLambertianQuadGroup",
+                                                                  .Type = D3D12_HIT_GROUP_TYPE_PROCEDURAL_PRIMITIVE,
+                                                                  .ClosestHitShaderImport = L"ClosestHitProceduralLambertian",
+                                                                  .IntersectionShaderImport = L"IntersectionProceduralQuadGroup" };
+
+    D3D12_HIT_GROUP_DESC hitGroupProceduralMetalQuadGroup = {     .HitGroupExport = L"HitGroupProceduralMetalQuadGroup",
+                                                                  .Type = D3D12_HIT_GROUP_TYPE_PROCEDURAL_PRIMITIVE,
+                                                                  .ClosestHitShaderImport = L"ClosestHitProceduralMetal",
+                                                                  .IntersectionShaderImport = L"IntersectionProceduralQuadGroup" };
+
+    D3D12_HIT_GROUP_DESC hitGroupProceduralDielectricQuadGroup = { .HitGroupExport = L"HitGroupProceduralDielectricQuadGroup",
+                                                                  .Type = D3D12_HIT_GROUP_TYPE_PROCEDURAL_PRIMITIVE,
+                                                                  .ClosestHitShaderImport = L"ClosestHitProceduralDielectric",
+                                                                  .IntersectionShaderImport = L"IntersectionProceduralQuadGroup" };
+
+    D3D12_HIT_GROUP_DESC hitGroupProceduralDiffuseLightQuadGroup = { .HitGroupExport = L"HitGroupProceduralDiffuseLightQuadGroup",
+                                                                  .Type = D3D12_HIT_GROUP_TYPE_PROCEDURAL_PRIMITIVE,
+                                                                  .ClosestHitShaderImport = L"ClosestHitProceduralDiffuseLight",
+                                                                  .IntersectionShaderImport = L"IntersectionProceduralQuadGroup" };
+
+    D3D12_HIT_GROUP_DESC hitGroupProceduralLambertianMovingSphere = { .HitGroupExport = L"HitGroupProceduralLambertianMovingSphere",
+                                                                  .Type = D3D12_HIT_GROUP_TYPE_PROCEDURAL_PRIMITIVE,
+                                                                  .ClosestHitShaderImport = L"ClosestHitProceduralLambertian",
+                                                                  .IntersectionShaderImport = L"IntersectionProceduralMovingSphere" };
+
+    D3D12_HIT_GROUP_DESC hitGroupProceduralMetalMovingSphere = {  .HitGroupExport = L"HitGroupProceduralMetalMovingSphere",
+                                                                  .Type = D3D12_HIT_GROUP_TYPE_PROCEDURAL_PRIMITIVE,
+                                                                  .ClosestHitShaderImport = L"ClosestHitProceduralMetal",
+                                                                  .IntersectionShaderImport = L"IntersectionProceduralMovingSphere" };
+
+    D3D12_HIT_GROUP_DESC hitGroupProceduralDielectricMovingSphere = { .HitGroupExport = L"HitGroupProceduralDielectricMovingSphere",
+                                                                  .Type = D3D12_HIT_GROUP_TYPE_PROCEDURAL_PRIMITIVE,
+                                                                  .ClosestHitShaderImport = L"ClosestHitProceduralDielectric",
+                                                                  .IntersectionShaderImport = L"IntersectionProceduralMovingSphere" };
+
+    D3D12_HIT_GROUP_DESC hitGroupProceduralDiffuseLightMovingSphere = { .HitGroupExport = L"HitGroupProceduralDiffuseLightMovingSphere",
+                                                                  .Type = D3D12_HIT_GROUP_TYPE_PROCEDURAL_PRIMITIVE,
+                                                                  .ClosestHitShaderImport = L"ClosestHitProceduralDiffuseLight",
+                                                                  .IntersectionShaderImport = L"IntersectionProceduralMovingSphere" };
+
+    D3D12_RAYTRACING_SHADER_CONFIG shaderCfg = {.MaxPayloadSizeInBytes = 72,
                                                 .MaxAttributeSizeInBytes = 16};
 
     D3D12_GLOBAL_ROOT_SIGNATURE globalSig = { rootSignature };
 
+    D3D12_LOCAL_ROOT_SIGNATURE hitSig = { hitRootSignature };
+    D3D12_SUBOBJECT_TO_EXPORTS_ASSOCIATION hitSigAssociation = {.NumExports = NUM_HIT_GROUPS,
+                                                                .pExports = HIT_GROUP_NAMES };
+
     D3D12_RAYTRACING_PIPELINE_CONFIG pipelineCfg = { .MaxTraceRecursionDepth = 1 };
     D3D12_STATE_SUBOBJECT subobjects[] = {
                                             {.Type = D3D12_STATE_SUBOBJECT_TYPE_DXIL_LIBRARY, .pDesc = &lib},
@@ -744,80 +1162,164 @@ void InitPipeline()
                                             {.Type = D3D12_STATE_SUBOBJECT_TYPE_HIT_GROUP, .pDesc = &hitGroupProceduralDiffuseLightQuad},
                                             {.Type = D3D12_STATE_SUBOBJECT_TYPE_HIT_GROUP, .pDesc = &hitGroupProceduralSmokeCube},
                                             {.Type = D3D12_STATE_SUBOBJECT_TYPE_HIT_GROUP, .pDesc = &hitGroupProceduralGlassCube},
+                                            {.Type = D3D12_STATE_SUBOBJECT_TYPE_HIT_GROUP, .pDesc = &hitGroupTriangleLambertian},
+                                            {.Type = D3D12_STATE_SUBOBJECT_TYPE_HIT_GROUP, .pDesc = &hitGroupTriangleMetal},
+                                            {.Type = D3D12_STATE_SUBOBJECT_TYPE_HIT_GROUP, .pDesc = &hitGroupTriangleDielectric},
+                                            {.Type = D3D12_STATE_SUBOBJECT_TYPE_HIT_GROUP, .pDesc = &hitGroupTriangleDiffuseLight},
+                                            {.Type = D3D12_STATE_SUBOBJECT_TYPE_HIT_GROUP, .pDesc = &hitGroupProceduralLambertianQuadGroup},
+                                            {.Type = D3D12_STATE_SUBOBJECT_TYPE_HIT_GROUP, .pDesc = &hitGroupProceduralMetalQuadGroup},
+                                            {.Type = D3D12_STATE_SUBOBJECT_TYPE_HIT_GROUP, .pDesc = &hitGroupProceduralDielectricQuadGroup},
+                                            {.Type = D3D12_STATE_SUBOBJECT_TYPE_HIT_GROUP, .pDesc = &hitGroupProceduralDiffuseLightQuadGroup},
+                                            {.Type = D3D12_STATE_SUBOBJECT_TYPE_HIT_GROUP, .pDesc = &hitGroupProceduralLambertianMovingSphere},
+                                            {.Type = D3D12_STATE_SUBOBJECT_TYPE_HIT_GROUP, .pDesc = &hitGroupProceduralMetalMovingSphere},
+                                            {.Type = D3D12_STATE_SUBOBJECT_TYPE_HIT_GROUP, .pDesc = &hitGroupProceduralDielectricMovingSphere},
+                                            {.Type = D3D12_STATE_SUBOBJECT_TYPE_HIT_GROUP, .pDesc = &hitGroupProceduralDiffuseLightMovingSphere},
                                             {.Type = D3D12_STATE_SUBOBJECT_TYPE_RAYTRACING_SHADER_CONFIG, .pDesc = &shaderCfg},
                                             {.Type = D3D12_STATE_SUBOBJECT_TYPE_GLOBAL_ROOT_SIGNATURE, .pDesc = &globalSig},
-                                            {.Type = D3D12_STATE_SUBOBJECT_TYPE_RAYTRACING_PIPELINE_CONFIG, .pDesc = &pipelineCfg}
+                                            {.Type = D3D12_STATE_SUBOBJECT_TYPE_RAYTRACING_PIPELINE_CONFIG, .pDesc = &pipelineCfg},
+                                            {.Type = D3D12_STATE_SUBOBJECT_TYPE_LOCAL_ROOT_SIGNATURE, .pDesc = &hitSig},
+                                            {.Type = D3D12_STATE_SUBOBJECT_TYPE_SUBOBJECT_TO_EXPORTS_ASSOCIATION, .pDesc = &hitSigAssociation}
                                          };
+    // Points into subobjects, at the local root signature right before it.
+    hitSigAssociation.pSubobjectToAssociate = &subobjects[std::size(subobjects) - 2];
 
     D3D12_STATE_OBJECT_DESC desc = {.Type = D3D12_STATE_OBJECT_TYPE_RAYTRACING_PIPELINE,
                                     .NumSubobjects = (UINT)std::size(subobjects),
                                     .pSubobjects = subobjects };
     device->CreateStateObject(&desc, IID_PPV_ARGS(&pso));
 
-    auto idDesc = BASIC_BUFFER_DESC;
-    idDesc.Width = 13 * D3D12_RAYTRACING_SHADER_TABLE_BYTE_ALIGNMENT;
-    device->CreateCommittedResource(&UPLOAD_HEAP, D3D12_HEAP_FLAG_NONE, &idDesc,
-        D3D12_RESOURCE_STATE_COMMON, nullptr,
-        IID_PPV_ARGS(&shaderIDs));
-
+    // Scenes build their own shader tables, see InitShaderTable, they only need the identifiers.
     ID3D12StateObjectProperties* props;
     pso->QueryInterface(&props);
 
-    UINT8* data;
-    auto writeId = [&](const wchar_t* name) {
-        void* id = props->GetShaderIdentifier(name);
-        memcpy(data, id, D3D12_SHADER_IDENTIFIER_SIZE_IN_BYTES);
-        data = data + D3D12_RAYTRACING_SHADER_TABLE_BYTE_ALIGNMENT;
-    };
-
-    shaderIDs->Map(0, nullptr, (void**)&data);
-    writeId(L"RayGeneration");
-    writeId(L"Miss");
-    writeId(L"HitGroupProceduralLambertianSphere");
-    writeId(L"HitGroupProceduralMetalSphere");
-    writeId(L"HitGroupProceduralDielectricSphere");
-    writeId(L"HitGroupProceduralDiffuseLightSphere");
-    writeId(L"HitGroupProceduralSmokeSphere");
-    writeId(L"HitGroupProceduralLambertianQuad");
-    writeId(L"HitGroupProceduralMetalQuad");
-    writeId(L"HitGroupProceduralDielectricQuad");
-    writeId(L"HitGroupProceduralDiffuseLightQuad");
-    writeId(L"HitGroupProceduralSmokeCube");
-    writeId(L"HitGroupProceduralGlassCube");
-
-    shaderIDs->Unmap(0, nullptr);
+    memcpy(shaderIdentifiers.rayGeneration, props->GetShaderIdentifier(L"RayGeneration"), SHADER_IDENTIFIER_BYTES);
+    memcpy(shaderIdentifiers.miss, props->GetShaderIdentifier(L"Miss"), SHADER_IDENTIFIER_BYTES);
+    for (UINT i = 0; i < NUM_HIT_GROUPS; ++i)
+    {
+        memcpy(shaderIdentifiers.hitGroups[i], props->GetShaderIdentifier(HIT_GROUP_NAMES[i]), SHADER_IDENTIFIER_BYTES);
+    }
 
     props->Release();
 }
 
+void InitShaderTable(const SceneState& scene, GpuScene& gpu)
+{
+    // Runs on the loader thread with the rest of the scene, so a new table costs the frames nothing.
+    static_assert(SHADER_IDENTIFIER_BYTES == D3D12_SHADER_IDENTIFIER_SIZE_IN_BYTES);
+    static_assert(SHADER_RECORD_ALIGNMENT == D3D12_RAYTRACING_SHADER_RECORD_BYTE_ALIGNMENT);
+    static_assert(SHADER_TABLE_ALIGNMENT == D3D12_RAYTRACING_SHADER_TABLE_BYTE_ALIGNMENT);
+
+    const ShaderTableLayout& layout = gpu.shaderTableLayout;
+    void* mapped;
+    gpu.shaderTable = uploadToScene(gpu, nullptr, layout.size, &mapped);
+    ShaderTableWriter table(static_cast<std::byte*>(mapped), layout);
+
+    table.RayGeneration(shaderIdentifiers.rayGeneration);
+    table.Miss(0, shaderIdentifiers.miss);
+
+    if (!gpu.instanceRecords)
+    {
+        for (UINT i = 0; i < NUM_HIT_GROUPS; ++i)
+        {
+            table.HitGroup(i, shaderIdentifiers.hitGroups[i]);
+        }
+        return;
+    }
+
+    // Records don't depend on each other, so big scenes write them in chunks on a pool of the loader's own.
+    constexpr UINT RECORDS_PER_CHUNK = 4096;
+    static ThreadPool pool;
+    const UINT chunks = (layout.hitGroups.count + RECORDS_PER_CHUNK - 1) / RECORDS_PER_CHUNK;
+    pool.ParallelFor(chunks, [&](UINT chunk) {
+        const UINT end = std::min(layout.hitGroups.count, (chunk + 1) * RECORDS_PER_CHUNK);
+        for (UINT id = chunk * RECORDS_PER_CHUNK; id < end; ++id)
+        {
+            const ProceduralInstance& instance = scene.proceduralInstances[id];
+            InstanceRecordData record = {.object = scene.objectList[instance.instanceID],
+                                         .inlined = 1 };
+            record.material = scene.materialList[record.object.materialIndex];
+            table.HitGroup(id, shaderIdentifiers.hitGroups[instance.hitGroupIndex], &record, sizeof(record));
+        }
+    });
+}
+
 void ChangeScene()
 {
     if (sceneChangeRequested)
     {
-        SetupNextScene();
+        // Loaded on the scene switcher's thread, the current scene keeps rendering until it's ready.
+        sceneSwitcher->Request(NextScene());
+        sceneChangeRequested = false;
+    }
+    else if (instanceRecordsToggled && !sceneSwitcher->Loading())
+    {
+        // Instance descs and shader table both change with it, so the scene is loaded over again. A load
+        // already going may have missed the toggle, this waits for it to be swapped in first.
+        sceneSwitcher->Request(currentScene);
+        instanceRecordsToggled = false;
+    }
 
-        InitBuffers();
-        InitBottomLevel();
-        InitScene();
-        InitTopLevel();
+    const bool swapped = sceneSwitcher->TrySwap([](LoadedScene& back) {
+        SwapSceneState(back.host);
+        std::swap(gpuScene, back.gpu);
+        std::swap(currentScene, back.index);
+        // Frames in flight still render the old scene, the next load into it waits for them.
+        back.gpu.lastUse = frameRing.GetQueue().Signal();
+    });
+    if (!swapped)
+        return;
 
-        sceneChangeRequested = false;
+    // Moves the frames had pending were about the old scene, the new one starts out the same in every copy.
+    for (auto& frame : frameRing.Frames())
+    {
+        frame.pendingInstances.clear();
     }
+    UpdateSceneBVH(true);
+
+    // Whatever the history holds is from the previous scene.
+    historyValid = false;
 }
 
-void UpdateScene()
+void UpdateScene(FrameResources& frame, GpuSceneFrame& copies)
 {
+    if (animationPlaying && !animatedInstances.empty())
+    {
+        // Frames are presented with vsync, so just step the shutter by a 60 Hz frame.
+        cameraData.shutterOpen += 1.0f / 60.0f;
+        cameraData.shutterClose += 1.0f / 60.0f;
+        AnimateInstances(cameraData.shutterOpen, cameraData.shutterClose);
+    }
+
     UpdateTransforms();
 
+    // The other frames' copies may still be read by the GPU, they catch up once their slot comes around.
+    for (auto& slot : frameRing.Frames())
+    {
+        slot.pendingInstances.insert(slot.pendingInstances.end(), dirtyInstances.begin(), dirtyInstances.end());
+    }
+    UploadPendingInstances(frame, copies);
+
+    // Most frames only the camera moves and the TLAS is still valid as is. Topology changes
+    // go through ChangeScene, which swaps in a whole new scene, so here we only handle moved instances.
+    if (dirtyInstances.empty())
+        return;
+
+    UpdateSceneBVH(false);
+
+    ClearDirtyInstances();
+
+    // DXR has no partial TLAS refit, but an update still only refits instead of rebuilding.
+
+    ID3D12Resource* tlas = gpuScene.tlas;
     D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_DESC desc = {.DestAccelerationStructureData = tlas->GetGPUVirtualAddress(),
                                                                .Inputs = {
                                                                    .Type = D3D12_RAYTRACING_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL,
                                                                    .Flags = D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_PERFORM_UPDATE,
                                                                    .NumDescs = getNumInstances(),
                                                                    .DescsLayout = D3D12_ELEMENTS_LAYOUT_ARRAY,
-                                                                   .InstanceDescs = instances->GetGPUVirtualAddress()},
+                                                                   .InstanceDescs = copies.instances},
                                                                .SourceAccelerationStructureData = tlas->GetGPUVirtualAddress(),
-                                                               .ScratchAccelerationStructureData = tlasUpdateScratch->GetGPUVirtualAddress()};
+                                                               .ScratchAccelerationStructureData = gpuScene.tlasUpdateScratch->GetGPUVirtualAddress()};
     cmdList->BuildRaytracingAccelerationStructure(&desc, 0, nullptr);
 
     D3D12_RESOURCE_BARRIER barrier = {.Type = D3D12_RESOURCE_BARRIER_TYPE_UAV,
@@ -829,10 +1331,16 @@ void Render()
 {
     ChangeScene();
 
-    cmdAlloc->Reset();
-    cmdList->Reset(cmdAlloc, nullptr);
+    // Only waits if the GPU is still on the frame that used this slot last.
+    FrameResources& frame = frameRing.BeginFrame();
+    GpuSceneFrame& copies = gpuScene.frames[frameRing.CurrentIndex()];
+    // Host side temporaries of the frame, all released at once when it's recorded.
+    ArenaScope frameScratch(ScratchArena());
+
+    frame.cmdAlloc->Reset();
+    cmdList->Reset(frame.cmdAlloc, nullptr);
 
-    UpdateScene();
+    UpdateScene(frame, copies);
 
     cmdList->SetPipelineState1(pso);
     cmdList->SetComputeRootSignature(rootSignature);
@@ -840,23 +1348,30 @@ void Render()
     cmdList->SetDescriptorHeaps(1, &uavHeap);
 
     auto uavTable = uavHeap->GetGPUDescriptorHandleForHeapStart();
-    cmdList->SetComputeRootDescriptorTable(0, uavTable); // u0
-    cmdList->SetComputeRootShaderResourceView(1, tlas->GetGPUVirtualAddress()); // t0
-    cmdList->SetComputeRootShaderResourceView(2, objectsView->GetGPUVirtualAddress()); // t1
-    cmdList->SetComputeRootShaderResourceView(3, lightsView->GetGPUVirtualAddress()); // t2
-    cmdList->SetComputeRootConstantBufferView(4, cameraConstantBuffer->GetGPUVirtualAddress()); // b0
+    cmdList->SetComputeRootDescriptorTable(0, uavTable); // u0-u5
+    cmdList->SetComputeRootShaderResourceView(1, gpuScene.tlas->GetGPUVirtualAddress()); // t0
+    cmdList->SetComputeRootShaderResourceView(2, gpuScene.objectsView); // t1
+    cmdList->SetComputeRootShaderResourceView(3, gpuScene.lightsView); // t2
+    cmdList->SetComputeRootShaderResourceView(4, gpuScene.meshVertexBuffer); // t3
+    cmdList->SetComputeRootShaderResourceView(5, gpuScene.meshIndexBuffer); // t4
+    cmdList->SetComputeRootShaderResourceView(6, gpuScene.groupQuadBuffer); // t5
+    cmdList->SetComputeRootShaderResourceView(7, gpuScene.materialsView); // t6
+    cmdList->SetComputeRootShaderResourceView(8, copies.objectMotionBuffer); // t7
+    cmdList->SetComputeRootConstantBufferView(9, copies.cameraConstantBuffer); // b0
 
     auto rtDesc = renderTarget->GetDesc();
+    const ShaderTableLayout& tableLayout = gpuScene.shaderTableLayout;
     D3D12_DISPATCH_RAYS_DESC dispatchDesc = {.RayGenerationShaderRecord = {
-                                                 .StartAddress = shaderIDs->GetGPUVirtualAddress(),
-                                                 .SizeInBytes = D3D12_SHADER_IDENTIFIER_SIZE_IN_BYTES},
+                                                 .StartAddress = gpuScene.shaderTable + tableLayout.rayGeneration.offset,
+                                                 .SizeInBytes = tableLayout.rayGeneration.size},
                                              .MissShaderTable = {
-                                                 .StartAddress = shaderIDs->GetGPUVirtualAddress() + D3D12_RAYTRACING_SHADER_TABLE_BYTE_ALIGNMENT,
-                                                 .SizeInBytes = D3D12_SHADER_IDENTIFIER_SIZE_IN_BYTES},
+                                                 .StartAddress = gpuScene.shaderTable + tableLayout.miss.offset,
+                                                 .SizeInBytes = tableLayout.miss.size,
+                                                 .StrideInBytes = tableLayout.miss.stride},
                                              .HitGroupTable = {
-                                                 .StartAddress = shaderIDs->GetGPUVirtualAddress() + 2 * D3D12_RAYTRACING_SHADER_TABLE_BYTE_ALIGNMENT,
-                                                 .SizeInBytes = D3D12_SHADER_IDENTIFIER_SIZE_IN_BYTES * 22,
-                                                 .StrideInBytes = D3D12_RAYTRACING_SHADER_TABLE_BYTE_ALIGNMENT},
+                                                 .StartAddress = gpuScene.shaderTable + tableLayout.hitGroups.offset,
+                                                 .SizeInBytes = tableLayout.hitGroups.size,
+                                                 .StrideInBytes = tableLayout.hitGroups.stride},
                                              .Width = static_cast<UINT>(rtDesc.Width),
                                              .Height = rtDesc.Height,
                                              .Depth = 1 };
@@ -894,6 +1409,6 @@ void Render()
     cmdQueue->ExecuteCommandLists(
         1, reinterpret_cast<ID3D12CommandList**>(&cmdList));
 
-    Flush();
     swapChain->Present(1, 0);
+    frameRing.EndFrame();
 }
\ No newline at end of file
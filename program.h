@@ -2,19 +2,15 @@
 
 #define NOMINMAX
 #define WIN32_LEAN_AND_MEAN
-#include <algorithm>
-#include <vector>
-#include <map>
-#include <stdexcept>
-#include <cmath>
-#include <numbers>
-#include <chrono>
-#include <DirectXMath.h>
+#include "core.h"
 #include <Windows.h>
 #include <windowsx.h>
 #include <d3d12.h>
 #include <dxgi1_4.h>
 #include "shaders.fxh"
+#include "frame_ring.h"
+#include "scene_switcher.h"
+#include "shader_table.h"
 
 #pragma comment(lib, "user32")
 #pragma comment(lib, "d3d12")
@@ -32,121 +28,195 @@ constexpr D3D12_RESOURCE_DESC BASIC_BUFFER_DESC = {
     .SampleDesc = NO_AA,
     .Layout = D3D12_TEXTURE_LAYOUT_ROW_MAJOR };
 
-enum OBJECT_TYPE {
-    OBJECT_TYPE_SPHERE = 0,
-    OBJECT_TYPE_QUAD = 1,
-    OBJECT_TYPE_VOLUMETRIC_CUBE = 2,
-    OBJECT_TYPE_COUNT
-};
+static_assert(sizeof(D3D12_RAYTRACING_INSTANCE_DESC) == INSTANCE_DESC_BYTES);
 
-struct ProceduralInstance
-{
-    DirectX::XMMATRIX transform;
-    UINT instanceID;
-    UINT hitGroupIndex;
-    OBJECT_TYPE type;
-};
+inline IDXGIFactory4* factory = nullptr;
+inline ID3D12Device5* device = nullptr;
+inline ID3D12CommandQueue* cmdQueue = nullptr;
+inline ID3D12Fence* fence = nullptr;
+inline IDXGISwapChain3* swapChain = nullptr;
+inline ID3D12DescriptorHeap* uavHeap = nullptr;
+inline ID3D12Resource* renderTarget = nullptr;
+inline ID3D12GraphicsCommandList4* cmdList = nullptr;
 
-enum MATERIAL_TYPE {
-    MATERIAL_TYPE_LAMBERTIAN = 0,
-    MATERIAL_TYPE_METAL = 1,
-    MATERIAL_TYPE_DIELECTRIC = 2,
-    MATERIAL_TYPE_DIFFUSE_LIGHT = 3,
-    MATERIAL_TYPE_SMOKE = 4,
-    MATERIAL_TYPE_COUNT
-};
+// Scenes are loaded on the SceneSwitcher's worker thread, which records its acceleration structure
+// builds on a list of its own and submits them to a queue of its own, so frames keep going meanwhile.
+inline ID3D12CommandQueue* setupQueue = nullptr;
+inline ID3D12Fence* setupFence = nullptr;
+inline UINT64 setupFenceValue = 0;
+inline ID3D12CommandAllocator* setupAlloc = nullptr;
+inline ID3D12GraphicsCommandList4* setupList = nullptr;
 
-#pragma pack(4)
-struct MaterialData
+inline ID3D12Resource* seedBuffer = nullptr;
+inline ID3D12Resource* rayTimeTexture = nullptr;
+
+// Per pixel first hit position, normal and radiance history (with its sample count in w). Each is an
+// array of two slices, a frame reads the one the previous frame wrote and writes the other.
+inline ID3D12Resource* historyPositionTexture = nullptr;
+inline ID3D12Resource* historyNormalTexture = nullptr;
+inline ID3D12Resource* historyColorTexture = nullptr;
+
+inline ID3D12RootSignature* rootSignature = nullptr;
+inline ID3D12RootSignature* hitRootSignature = nullptr; // Local, InstanceRecordData of the hit records.
+
+inline ID3D12StateObject* pso = nullptr;
+
+// Hit groups in the order of their hit group index, see objectTypeToHitGroupIndex.
+constexpr UINT NUM_HIT_GROUPS = 23;
+
+// Shader identifiers of the pipeline, copied out once by InitPipeline. Scenes build their shader tables
+// from them on the loader thread.
+struct ShaderIdentifiers
 {
-    DirectX::XMFLOAT3 albedo;
-    float fuzz;
-    float refractionIndex;
-    float density;
-    MATERIAL_TYPE type;
+    std::byte rayGeneration[SHADER_IDENTIFIER_BYTES];
+    std::byte miss[SHADER_IDENTIFIER_BYTES];
+    std::byte hitGroups[NUM_HIT_GROUPS][SHADER_IDENTIFIER_BYTES];
 };
 
-struct ObjectData
+inline ShaderIdentifiers shaderIdentifiers = {};
+
+// Local root arguments of every hit record, root constants at b1 (InstanceRecord in the shaders). With
+// one record per instance they hold a copy of the instance's object and material, so hit shaders don't
+// go through the object and material tables. With one record per hit group inlined is 0 and the rest
+// unused. The object comes first so the material starts on a constant buffer register, like HLSL wants.
+struct InstanceRecordData
 {
+    ObjectData object;
+    UINT inlined;
     MaterialData material;
-    OBJECT_TYPE type;
+};
 
-    // Quad specific.
-    DirectX::XMFLOAT3 Q;
-    DirectX::XMFLOAT3 U;
-    DirectX::XMFLOAT3 V;
-    DirectX::XMFLOAT3 normal;
+static_assert(offsetof(InstanceRecordData, inlined) == 12 && offsetof(InstanceRecordData, material) == 16);
+static_assert(sizeof(InstanceRecordData) % 4 == 0);
 
-    // Sphere specific.
-    DirectX::XMFLOAT3 center;
-    float             radius;
-};
+// Scenes with more instances than this keep one record per hit group, the table would get too big.
+constexpr size_t MAX_INSTANCE_RECORDS = 1 << 16;
 
-struct CameraData
+// Everything the CPU writes for a frame while the GPU may still be reading it for an earlier one.
+struct FrameResources
 {
-    DirectX::XMFLOAT3 lookfrom;
-    float padding1;
-    DirectX::XMFLOAT3 lookat;
-    float padding2;
-    DirectX::XMFLOAT3 backgroundColor;
-    float vfov;
-    float focusDist;
-    float defocusAngle;
-    UINT frameIndex;
-    UINT samplesPerPixel;
-    UINT doStratify;
-    UINT numLights;
+    ID3D12CommandAllocator* cmdAlloc;
+    // Instances moved since this frame's copies of the scene's instances were last written.
+    std::vector<UINT> pendingInstances;
 };
 
-inline CameraData cameraData;
-inline IDXGIFactory4* factory = nullptr;
-inline ID3D12Device5* device = nullptr;
-inline ID3D12CommandQueue* cmdQueue = nullptr;
-inline ID3D12Fence* fence = nullptr;
-inline IDXGISwapChain3* swapChain = nullptr;
-inline ID3D12DescriptorHeap* uavHeap = nullptr;
-inline ID3D12Resource* renderTarget = nullptr;
-inline ID3D12CommandAllocator* cmdAlloc = nullptr;
-inline ID3D12GraphicsCommandList4* cmdList = nullptr;
-inline ID3D12Resource* objectsView = nullptr;
-inline ID3D12Resource* lightsView = nullptr;
+struct D3D12FrameQueue
+{
+    UINT64 Signal()
+    {
+        cmdQueue->Signal(fence, nextValue);
+        return nextValue++;
+    }
+
+    UINT64 CompletedValue() const
+    {
+        return fence->GetCompletedValue();
+    }
+
+    void WaitFor(UINT64 value)
+    {
+        if (fence->GetCompletedValue() < value)
+            fence->SetEventOnCompletion(value, nullptr);
+    }
+
+    UINT64 nextValue = 1;
+};
 
-inline ID3D12Resource* cameraConstantBuffer = nullptr;
-inline void* cameraMappedData = nullptr;
+// The swap chain has two buffers, a third frame in flight would only add latency.
+constexpr size_t FRAMES_IN_FLIGHT = 2;
 
-inline ID3D12Resource* cubeAABB = nullptr;
-inline ID3D12Resource* quadAABB = nullptr;
-inline ID3D12Resource* cubeProceduralBlas = nullptr;
-inline ID3D12Resource* quadProceduralBlas = nullptr;
+inline FrameRing<D3D12FrameQueue, FrameResources, FRAMES_IN_FLIGHT> frameRing;
 
-inline ID3D12Resource* seedBuffer = nullptr;
+// A scene's copy of what the CPU writes every frame, one per frame in flight. All of it stays mapped.
+struct GpuSceneFrame
+{
+    D3D12_GPU_VIRTUAL_ADDRESS cameraConstantBuffer;
+    void* cameraMappedData;
+    // Instance descs and per object motion over the shutter (zero for everything that isn't animated).
+    D3D12_GPU_VIRTUAL_ADDRESS instances;
+    D3D12_RAYTRACING_INSTANCE_DESC* instanceData;
+    D3D12_GPU_VIRTUAL_ADDRESS objectMotionBuffer;
+    DirectX::XMFLOAT3* objectMotionData;
+};
 
-inline ID3D12Resource* instances = nullptr;
-inline D3D12_RAYTRACING_INSTANCE_DESC* instanceData = nullptr;
+// GPU side of a scene. gpuScene is the one being rendered, the next one gets loaded into another
+// in the background, see ChangeScene.
+struct GpuScene
+{
+    // One upload buffer holds everything the CPU writes for the scene, from the object table to the per
+    // frame camera constants, suballocated front to back by uploadToScene. Every load starts it over,
+    // and only a scene bigger than every one before gets a new buffer. It stays mapped. It is no ring:
+    // per frame data have a fixed range per frame in flight, patched in place.
+    ID3D12Resource* uploadBuffer;
+    std::byte* uploadData;
+    LinearSuballocator uploadRanges;
+
+    D3D12_GPU_VIRTUAL_ADDRESS objectsView;
+    D3D12_GPU_VIRTUAL_ADDRESS lightsView;
+    D3D12_GPU_VIRTUAL_ADDRESS materialsView;
+
+    D3D12_GPU_VIRTUAL_ADDRESS cubeAABB;
+    D3D12_GPU_VIRTUAL_ADDRESS quadAABB;
+    ID3D12Resource* cubeProceduralBlas;
+    ID3D12Resource* quadProceduralBlas;
+
+    D3D12_GPU_VIRTUAL_ADDRESS meshVertexBuffer;
+    D3D12_GPU_VIRTUAL_ADDRESS meshIndexBuffer;
+    std::vector<ID3D12Resource*> meshBlases;
+
+    D3D12_GPU_VIRTUAL_ADDRESS groupQuadBuffer;
+    D3D12_GPU_VIRTUAL_ADDRESS groupAABBBuffer;
+    std::vector<ID3D12Resource*> groupBlases;
+
+    D3D12_GPU_VIRTUAL_ADDRESS motionAABBBuffer;
+    UINT motionAABBCount;
+    std::vector<ID3D12Resource*> motionBlases;
+
+    ID3D12Resource* tlas;
+    ID3D12Resource* tlasUpdateScratch;
+
+    // Lives in the upload buffer like the rest, built along with the scene by InitShaderTable. With
+    // instanceRecords every instance has a hit record of its own, otherwise they share their hit group's.
+    D3D12_GPU_VIRTUAL_ADDRESS shaderTable;
+    bool instanceRecords;
+    ShaderTableLayout shaderTableLayout;
+
+    // Scratch buffers of the acceleration structures recorded since BeginSetup, freed by FinishSetup.
+    std::vector<ID3D12Resource*> setupScratch;
+
+    std::array<GpuSceneFrame, FRAMES_IN_FLIGHT> frames;
+
+    // Fence value of the last frame that may render the scene, nothing is released before the GPU gets there.
+    UINT64 lastUse;
+};
 
-inline ID3D12Resource* tlas = nullptr;
-inline ID3D12Resource* tlasUpdateScratch = nullptr;
+inline GpuScene gpuScene = {};
 
-inline ID3D12RootSignature* rootSignature = nullptr;
+// What the scene switcher loads, both sides of a scene.
+struct LoadedScene
+{
+    UINT index = 0;
+    SceneState host;
+    GpuScene gpu = {};
+};
 
-inline ID3D12StateObject* pso = nullptr;
-inline ID3D12Resource* shaderIDs = nullptr;
+inline std::unique_ptr<SceneSwitcher<LoadedScene>> sceneSwitcher;
 
 inline bool sceneChangeRequested = false;
+inline UINT currentScene = 0;
 
-inline bool autoAdaptSamplesCount = false;
-inline UINT savedAALevel = 0;
+// Read by the loader thread, so toggling it reloads the current scene, see ChangeScene.
+inline std::atomic<bool> instanceRecordsEnabled = true;
+inline bool instanceRecordsToggled = false;
 
-inline DirectX::XMFLOAT3 cameraMomentum;
+inline bool animationPlaying = false;
 
-inline std::vector<ProceduralInstance> proceduralInstances;
-inline std::vector<ObjectData> objectList;
-inline std::vector<UINT> lightsList;
+inline bool temporalReuseEnabled = true;
+inline bool historyValid = false; // Cleared by anything that changes more than the camera.
 
-inline UINT getNumInstances()
-{
-    return (UINT)proceduralInstances.size();
-}
+inline UINT savedAALevel = 0;
+
+inline DirectX::XMFLOAT3 cameraMomentum;
 
 void UpdateTransforms();
 void Resize(HWND);
@@ -156,24 +226,30 @@ void InitDevice();
 void InitSurfaces(HWND);
 void InitCommand();
 void InitSeedBuffer();
-void InitBuffers();
-void InitBottomLevel();
-void InitScene();
-void InitTopLevel();
+void InitBuffers(const SceneState& scene, GpuScene& gpu);
+void InitBottomLevel(const SceneState& scene, GpuScene& gpu);
+void InitScene(const SceneState& scene, GpuScene& gpu);
+void InitTopLevel(const SceneState& scene, GpuScene& gpu);
 void InitRootSignature();
 void InitPipeline();
+void InitShaderTable(const SceneState& scene, GpuScene& gpu);
+void BeginSetup();
+void FinishSetup(GpuScene& gpu);
+void LoadScene(UINT scene, LoadedScene& back);
+void ReleaseScene(GpuScene& gpu);
 void OnKeyDown(UINT8);
 void OnMouseMove(int xPos, int yPos);
 void ChangeScene();
-void SetupNextScene();
 
-ID3D12Resource* makeAndCopy(void* ptr, size_t size, void** mappedPtr = nullptr);
+void BeginSceneUpload(const SceneState& scene, GpuScene& gpu);
+D3D12_GPU_VIRTUAL_ADDRESS uploadToScene(GpuScene& gpu, const void* ptr, size_t size, void** mappedPtr = nullptr);
 
-ID3D12Resource* MakeAccelerationStructure(
+ID3D12Resource* MakeAccelerationStructure(GpuScene& gpu,
     const D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_INPUTS& inputs,
     UINT64* updateScratchSize = nullptr);
-ID3D12Resource* MakeBLAS(ID3D12Resource* vertexBuffer, UINT vertexFloats,
-    ID3D12Resource* indexBuffer = nullptr, UINT indices = 0);
-ID3D12Resource* MakeProceduralBLAS(ID3D12Resource* aabbBuffer);
-ID3D12Resource* MakeTLAS(ID3D12Resource* instances, UINT numInstances,
-    UINT64* updateScratchSize);
\ No newline at end of file
+ID3D12Resource* MakeBLAS(GpuScene& gpu, D3D12_GPU_VIRTUAL_ADDRESS vertexBuffer, UINT vertexFloats,
+    D3D12_GPU_VIRTUAL_ADDRESS indexBuffer = 0, UINT indices = 0,
+    UINT firstVertex = 0, UINT firstIndex = 0);
+ID3D12Resource* MakeProceduralBLAS(GpuScene& gpu, D3D12_GPU_VIRTUAL_ADDRESS aabbBuffer, UINT aabbCount = 1, UINT firstAABB = 0);
+ID3D12Resource* MakeTLAS(GpuScene& gpu, D3D12_GPU_VIRTUAL_ADDRESS instances, UINT numInstances,
+    UINT64* updateScratchSize);
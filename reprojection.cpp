@@ -0,0 +1,66 @@
+#include "core.h"
+
+// Temporal reuse for frames where only the camera moved. Every pixel keeps the position and normal
+// of its first hit and its accumulated radiance; the next frame projects its own first hit into the
+// previous camera and continues from that history if it still shows the same surface. This is the
+// same math as the history functions in shaders_helpers.hlsli, kept here so it can be checked on the CPU.
+
+using namespace DirectX;
+
+namespace
+{
+    // Same basis as the ray generation shader.
+    void cameraBasis(XMFLOAT3 lookfrom, XMFLOAT3 lookat, XMVECTOR& u, XMVECTOR& v, XMVECTOR& w)
+    {
+        w = XMVector3Normalize(XMLoadFloat3(&lookfrom) - XMLoadFloat3(&lookat));
+        u = XMVector3Normalize(XMVector3Cross(XMVectorSet(0, 1, 0, 0), w));
+        v = XMVector3Cross(w, u);
+    }
+}
+
+bool ReprojectToPixel(XMFLOAT3 lookfrom, XMFLOAT3 lookat, float vfov, UINT width, UINT height, XMFLOAT3 position, XMINT2& pixel)
+{
+    XMVECTOR u, v, w;
+    cameraBasis(lookfrom, lookat, u, v, w);
+
+    const XMVECTOR offset = XMLoadFloat3(&position) - XMLoadFloat3(&lookfrom);
+    const float depth = -XMVectorGetX(XMVector3Dot(offset, w));
+    if (depth <= 0)
+        return false;
+
+    // Viewport at distance 1, pixel centers are at integer coordinates like in ray generation.
+    const float viewportHeight = 2 * std::tan(XMConvertToRadians(vfov) / 2);
+    const float viewportWidth = viewportHeight * ((float)width / height);
+    const float x = (-XMVectorGetX(XMVector3Dot(offset, u)) / depth / viewportWidth + 0.5f) * width - 0.5f;
+    const float y = (-XMVectorGetX(XMVector3Dot(offset, v)) / depth / viewportHeight + 0.5f) * height - 0.5f;
+
+    pixel = { (int)std::floor(x + 0.5f), (int)std::floor(y + 0.5f) };
+    return pixel.x >= 0 && pixel.y >= 0 && pixel.x < (int)width && pixel.y < (int)height;
+}
+
+bool IsHistoryValid(XMFLOAT3 position, XMFLOAT3 normal, XMFLOAT3 historyPosition, XMFLOAT3 historyNormal, XMFLOAT3 lookfrom)
+{
+    // Zero normals mark first hits whose shading depends on the view (misses, smoke, metal, glass).
+    const XMVECTOR n = XMLoadFloat3(&normal);
+    const XMVECTOR historyN = XMLoadFloat3(&historyNormal);
+    if (XMVector3Equal(n, XMVectorZero()) || XMVector3Equal(historyN, XMVectorZero()))
+        return false;
+
+    // Disocclusion: the history pixel has to show the same surface, so a point close to ours (relative
+    // to the distance, a pixel covers more further away) facing about the same way.
+    const float distance = XMVectorGetX(XMVector3Length(XMLoadFloat3(&position) - XMLoadFloat3(&lookfrom)));
+    const float mismatch = XMVectorGetX(XMVector3Length(XMLoadFloat3(&position) - XMLoadFloat3(&historyPosition)));
+    return mismatch <= HISTORY_POSITION_TOLERANCE * distance &&
+           XMVectorGetX(XMVector3Dot(n, historyN)) >= HISTORY_NORMAL_TOLERANCE;
+}
+
+XMFLOAT4 AccumulateHistory(XMFLOAT4 history, XMFLOAT3 color, UINT samples)
+{
+    // Running average over at most HISTORY_MAX_SAMPLES, so old samples fade out instead of sticking around forever.
+    const float historySamples = std::min(history.w, (float)(HISTORY_MAX_SAMPLES - std::min(samples, HISTORY_MAX_SAMPLES)));
+    const float total = historySamples + samples;
+    return { (history.x * historySamples + color.x * samples) / total,
+             (history.y * historySamples + color.y * samples) / total,
+             (history.z * historySamples + color.z * samples) / total,
+             total };
+}
@@ -0,0 +1,161 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <utility>
+
+// Loads scenes on a worker thread while the current one keeps rendering. Of the two scenes, the
+// caller owns the front one it renders, the switcher the back one the worker loads into. Once a
+// load is done, TrySwap hands the back scene to the caller between two frames and the caller trades
+// it for the front one. The switcher doesn't know anything about scenes, its loader does:
+//   void(unsigned index, Scene& back)   load scene index into back, runs on the worker thread
+// After a swap the back scene is what the caller rendered until then, so the loader has to wait for
+// whatever still uses it (frames in flight) before releasing anything.
+template <typename Scene>
+class SceneSwitcher
+{
+public:
+    using Loader = std::function<void(unsigned index, Scene& back)>;
+
+    explicit SceneSwitcher(Loader loader) : loader(std::move(loader)), worker([this]() { run(); }) {}
+
+    ~SceneSwitcher()
+    {
+        {
+            std::lock_guard lock(mutex);
+            stopping = true;
+        }
+        wake.notify_one();
+        worker.join();
+    }
+
+    SceneSwitcher(const SceneSwitcher&) = delete;
+    SceneSwitcher& operator=(const SceneSwitcher&) = delete;
+
+    // The latest request wins, one that comes while a scene is loading replaces anything not started
+    // yet, and the scene being loaded gets thrown away instead of swapped in.
+    void Request(unsigned index)
+    {
+        {
+            std::lock_guard lock(mutex);
+            pending = index;
+        }
+        wake.notify_one();
+    }
+
+    // Call between frames. If a loaded scene is ready, calls swap(back) and returns true. The worker
+    // stays off the back scene until swap returns, that's where the caller trades it for the front one.
+    // A load that failed throws here, on the caller's thread.
+    template <typename Swap>
+    bool TrySwap(Swap&& swap)
+    {
+        std::lock_guard lock(mutex);
+        if (error)
+        {
+            std::rethrow_exception(std::exchange(error, nullptr));
+        }
+        if (!ready)
+            return false;
+
+        swap(back);
+        ready = false;
+        ++swaps;
+        return true;
+    }
+
+    // Blocks until everything requested so far is loaded (or failed), for when there is nothing to
+    // render meanwhile, like the very first scene.
+    void WaitIdle()
+    {
+        std::unique_lock lock(mutex);
+        idle.wait(lock, [this]() { return !pending && !loading; });
+    }
+
+    // A scene was requested and isn't swapped in yet.
+    bool Loading() const
+    {
+        std::lock_guard lock(mutex);
+        return pending || loading || ready;
+    }
+
+    uint64_t Swaps() const
+    {
+        std::lock_guard lock(mutex);
+        return swaps;
+    }
+
+    // Loads thrown away because another scene was requested before they got swapped in.
+    uint64_t Superseded() const
+    {
+        std::lock_guard lock(mutex);
+        return superseded;
+    }
+
+private:
+    void run()
+    {
+        std::unique_lock lock(mutex);
+        while (true)
+        {
+            wake.wait(lock, [this]() { return stopping || pending; });
+            if (stopping)
+                return;
+
+            const unsigned index = *pending;
+            pending.reset();
+            if (ready)
+            {
+                ready = false;
+                ++superseded;
+            }
+            loading = true;
+            lock.unlock();
+
+            std::exception_ptr failure;
+            try
+            {
+                loader(index, back);
+            }
+            catch (...)
+            {
+                failure = std::current_exception();
+            }
+
+            lock.lock();
+            loading = false;
+            if (failure)
+            {
+                error = failure;
+            }
+            else if (pending)
+            {
+                ++superseded;
+            }
+            else
+            {
+                ready = true;
+            }
+            idle.notify_all();
+        }
+    }
+
+    Loader loader;
+    Scene back = {};
+    mutable std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable idle;
+    std::optional<unsigned> pending;
+    bool loading = false;
+    bool ready = false;
+    bool stopping = false;
+    std::exception_ptr error;
+    uint64_t swaps = 0;
+    uint64_t superseded = 0;
+    // Last, so it starts once everything above is there.
+    std::thread worker;
+};
@@ -1,4 +1,8 @@
-#include "program.h"
+#include "core.h"
+#include <filesystem>
+#include <optional>
+#include <unordered_map>
+#include <string_view>
 
 float random_float() {
     // Returns a random real in [0,1).
@@ -31,7 +35,19 @@ UINT objectTypeToHitGroupIndex(OBJECT_TYPE objectType, MATERIAL_TYPE materialTyp
         { { OBJECT_TYPE_QUAD, MATERIAL_TYPE_DIELECTRIC }, 7 },
         { { OBJECT_TYPE_QUAD, MATERIAL_TYPE_DIFFUSE_LIGHT }, 8 },
         { { OBJECT_TYPE_VOLUMETRIC_CUBE, MATERIAL_TYPE_SMOKE }, 9 },
-        { { OBJECT_TYPE_VOLUMETRIC_CUBE, MATERIAL_TYPE_DIELECTRIC }, 10 }
+        { { OBJECT_TYPE_VOLUMETRIC_CUBE, MATERIAL_TYPE_DIELECTRIC }, 10 },
+        { { OBJECT_TYPE_TRIANGLE_MESH, MATERIAL_TYPE_LAMBERTIAN }, 11 },
+        { { OBJECT_TYPE_TRIANGLE_MESH, MATERIAL_TYPE_METAL }, 12 },
+        { { OBJECT_TYPE_TRIANGLE_MESH, MATERIAL_TYPE_DIELECTRIC }, 13 },
+        { { OBJECT_TYPE_TRIANGLE_MESH, MATERIAL_TYPE_DIFFUSE_LIGHT }, 14 },
+        { { OBJECT_TYPE_QUAD_GROUP, MATERIAL_TYPE_LAMBERTIAN }, 15 },
+        { { OBJECT_TYPE_QUAD_GROUP, MATERIAL_TYPE_METAL }, 16 },
+        { { OBJECT_TYPE_QUAD_GROUP, MATERIAL_TYPE_DIELECTRIC }, 17 },
+        { { OBJECT_TYPE_QUAD_GROUP, MATERIAL_TYPE_DIFFUSE_LIGHT }, 18 },
+        { { OBJECT_TYPE_MOVING_SPHERE, MATERIAL_TYPE_LAMBERTIAN }, 19 },
+        { { OBJECT_TYPE_MOVING_SPHERE, MATERIAL_TYPE_METAL }, 20 },
+        { { OBJECT_TYPE_MOVING_SPHERE, MATERIAL_TYPE_DIELECTRIC }, 21 },
+        { { OBJECT_TYPE_MOVING_SPHERE, MATERIAL_TYPE_DIFFUSE_LIGHT }, 22 }
     };
 
     if (hitGroupIndices.find({ objectType, materialType }) == hitGroupIndices.end())
@@ -42,25 +58,206 @@ UINT objectTypeToHitGroupIndex(OBJECT_TYPE objectType, MATERIAL_TYPE materialTyp
     return hitGroupIndices.at({ objectType, materialType });
 }
 
-void addProceduralObject(DirectX::XMMATRIX transform, ObjectData& obj, bool isPDFLightSource)
+// Materials are interned by their exact bytes, MaterialData is packed so there is no padding to worry about.
+struct MaterialDataHash
 {
-    UINT instanceIDCounter = (UINT)proceduralInstances.size();
-    proceduralInstances.push_back({ .transform = transform, .instanceID = instanceIDCounter, .hitGroupIndex = objectTypeToHitGroupIndex(obj.type, obj.material.type), .type = obj.type });
+    size_t operator()(const MaterialData& mat) const
+    {
+        return std::hash<std::string_view>()(std::string_view(reinterpret_cast<const char*>(&mat), sizeof(mat)));
+    }
+};
 
-    if (isPDFLightSource)
+struct MaterialDataEqual
+{
+    bool operator()(const MaterialData& a, const MaterialData& b) const
+    {
+        return memcmp(&a, &b, sizeof(MaterialData)) == 0;
+    }
+};
+
+// Scene the functions below add to, set by BuildScene for the time it runs.
+static SceneState* building = nullptr;
+
+// On the arena of the scene being built, only there while BuildScene runs.
+using MaterialRegistry = std::unordered_map<MaterialData, UINT16, MaterialDataHash, MaterialDataEqual,
+    ArenaAllocator<std::pair<const MaterialData, UINT16>>>;
+static std::optional<MaterialRegistry> materialRegistry;
+
+UINT16 addMaterial(const MaterialData& mat)
+{
+    // Scenes pass the same material to lots of objects (like 1000 spheres in the final scene),
+    // so each distinct material is stored once and objects just reference it.
+    auto it = materialRegistry->find(mat);
+    if (it != materialRegistry->end())
+    {
+        return it->second;
+    }
+
+    if (mat.textureType != TEXTURE_TYPE_NONE && mat.type != MATERIAL_TYPE_LAMBERTIAN)
+    {
+        throw std::runtime_error("Only Lambertian materials can be textured");
+    }
+
+    if (building->materialList.size() > UINT16_MAX)
+    {
+        throw std::runtime_error("Too many distinct materials for 16-bit material IDs");
+    }
+
+    UINT16 id = (UINT16)building->materialList.size();
+    building->materialList.push_back(mat);
+    materialRegistry->emplace(mat, id);
+    return id;
+}
+
+void addProceduralObject(DirectX::XMMATRIX transform, ObjectData& obj, MaterialData& mat, UINT prototypeIndex = 0)
+{
+    UINT instanceIDCounter = (UINT)building->proceduralInstances.size();
+    OBJECT_TYPE type = (OBJECT_TYPE)obj.type;
+    building->proceduralInstances.push_back({ .transform = transform, .instanceID = instanceIDCounter, .hitGroupIndex = objectTypeToHitGroupIndex(type, mat.type), .type = type, .prototypeIndex = prototypeIndex });
+
+    obj.materialIndex = addMaterial(mat);
+    building->objectList.push_back(obj);
+}
+
+void MoveInstance(UINT instance, DirectX::XMMATRIX transform)
+{
+    // Nothing is rebuilt here, the TLAS and scene BVH pick up all moved instances on the next update.
+    ProceduralInstance& moved = proceduralInstances[instance];
+    moved.transform = transform;
+    if (!moved.dirty)
+    {
+        moved.dirty = true;
+        dirtyInstances.push_back(instance);
+    }
+}
+
+void ClearDirtyInstances()
+{
+    for (UINT instance : dirtyInstances)
+    {
+        proceduralInstances[instance].dirty = false;
+    }
+    dirtyInstances.clear();
+}
+
+DirectX::XMMATRIX InstanceTransformAt(const ProceduralInstance& instance, float time)
+{
+    using namespace DirectX;
+
+    const auto& keyframes = instance.keyframes;
+    if (keyframes.empty())
     {
-        lightsList.push_back((UINT)objectList.size());
+        return instance.transform;
     }
 
-    objectList.push_back(obj);
+    // Clamp outside of the animation, otherwise lerp between the two keyframes around the given time.
+    // Lerping matrices works fine for what we animate (mostly translations), no need for decomposing them.
+    auto next = std::upper_bound(keyframes.begin(), keyframes.end(), time,
+        [](float t, const InstanceKeyframe& keyframe) { return t < keyframe.time; });
+    if (next == keyframes.begin())
+    {
+        return keyframes.front().transform;
+    }
+    if (next == keyframes.end())
+    {
+        return keyframes.back().transform;
+    }
+
+    auto previous = next - 1;
+    float s = (time - previous->time) / (next->time - previous->time);
+    XMMATRIX result;
+    for (int row = 0; row < 4; ++row)
+    {
+        result.r[row] = XMVectorLerp(previous->transform.r[row], next->transform.r[row], s);
+    }
+    return result;
+}
+
+void AnimateInstances(float shutterOpen, float shutterClose)
+{
+    using namespace DirectX;
+
+    // Instances sit where they are when the shutter opens, rays then move them along by their
+    // sampled time times the motion. Only the translation is blurred this way.
+    for (UINT instance : animatedInstances)
+    {
+        ProceduralInstance& animated = proceduralInstances[instance];
+        XMMATRIX open = InstanceTransformAt(animated, shutterOpen);
+        XMMATRIX close = InstanceTransformAt(animated, shutterClose);
+        XMStoreFloat3(&animated.motion, close.r[3] - open.r[3]);
+        MoveInstance(instance, open);
+    }
+}
+
+MaterialData imageTextureMaterial(UINT texture)
+{
+    return { .albedo = building->textureList[texture].average, .type = MATERIAL_TYPE_LAMBERTIAN, .textureType = TEXTURE_TYPE_IMAGE, .textureIndex = texture };
+}
+
+// Lights that can't send anything toward p (surface normal n, zero in volumes) are left out of light
+// sampling, when picking one and in its PDF alike. Only bounds tests, same as in shaders_helpers.hlsli.
+bool LightMayReach(const LightData& light, DirectX::XMFLOAT3 p, DirectX::XMFLOAT3 n)
+{
+    // Entirely below the tangent plane, no scatter direction gets there.
+    const DirectX::XMFLOAT3 toCenter = { light.boundsCenter.x - p.x, light.boundsCenter.y - p.y, light.boundsCenter.z - p.z };
+    if (toCenter.x * n.x + toCenter.y * n.y + toCenter.z * n.z < -light.boundsRadius)
+        return false;
+
+    // The normal cone of a quad has no spread, it only reaches one side of its plane. Emitters light
+    // their front, box faces are only seen from outside the box. Spheres face every way.
+    const DirectX::XMFLOAT3 fromQ = { p.x - light.Q.x, p.y - light.Q.y, p.z - light.Q.z };
+    const float side = fromQ.x * light.normal.x + fromQ.y * light.normal.y + fromQ.z * light.normal.z;
+    if ((light.flags & LIGHT_FLAG_ONE_SIDED) && side >= 0)
+        return false;
+    if ((light.flags & LIGHT_FLAG_BOX_FACE) && side <= 0)
+        return false;
+    return true;
+}
+
+void addLight(const LightData& light)
+{
+    building->lightsList.push_back(light);
 }
 
 void addSphere(DirectX::XMFLOAT3 position, float r, MaterialData& mat, bool isPDFLightSource = false)
 {
     // We always assume that inside the AABB, sphere is centered in 0,0,0 and has a radius of 1.
     // We will use position and R to scale/move it properly
-    ObjectData objectData = { .material = mat, .type = OBJECT_TYPE_SPHERE, .center = position, .radius = r};
-    addProceduralObject(DirectX::XMMatrixScaling(r, r, r) * DirectX::XMMatrixTranslation(position.x, position.y, position.z), objectData, isPDFLightSource);
+    ObjectData objectData = { .type = OBJECT_TYPE_SPHERE };
+    addProceduralObject(DirectX::XMMatrixScaling(r, r, r) * DirectX::XMMatrixTranslation(position.x, position.y, position.z), objectData, mat);
+
+    if (isPDFLightSource)
+    {
+        addLight({ .Q = position, .type = OBJECT_TYPE_SPHERE, .radius = r, .boundsCenter = position, .boundsRadius = r });
+    }
+}
+
+void addMovingSphere(std::span<const std::pair<float, DirectX::XMFLOAT3>> centers, float r, MaterialData& mat)
+{
+    // Same unit sphere as addSphere, with its center keyframed. Moving spheres get their own BLAS with
+    // an AABB covering the whole motion, see InitBuffers, and the intersection shader moves them by the ray time.
+    if (mat.type == MATERIAL_TYPE_SMOKE)
+    {
+        throw std::runtime_error("Moving smoke spheres are not supported");
+    }
+
+    UINT motionIndex = 0;
+    for (UINT instance : building->animatedInstances)
+    {
+        motionIndex += (building->proceduralInstances[instance].type == OBJECT_TYPE_MOVING_SPHERE) ? 1 : 0;
+    }
+
+    ObjectData objectData = { .type = OBJECT_TYPE_MOVING_SPHERE };
+    ArenaVector<InstanceKeyframe> keyframes(*building->arena);
+    keyframes.reserve(centers.size());
+    for (auto& [time, center] : centers)
+    {
+        keyframes.push_back({ time, DirectX::XMMatrixScaling(r, r, r) * DirectX::XMMatrixTranslation(center.x, center.y, center.z) });
+    }
+    addProceduralObject(keyframes.front().transform, objectData, mat, motionIndex);
+
+    building->animatedInstances.push_back((UINT)building->proceduralInstances.size() - 1);
+    building->proceduralInstances.back().keyframes = std::move(keyframes);
 }
 
 void addQuad(DirectX::XMFLOAT3 position, DirectX::XMFLOAT3 u, DirectX::XMFLOAT3 v, MaterialData& mat, bool isPDFLightSource = false)
@@ -98,8 +295,55 @@ void addQuad(DirectX::XMFLOAT3 position, DirectX::XMFLOAT3 u, DirectX::XMFLOAT3
     transform.r[2] = DirectX::XMVectorSetW(zBasis, 0.0f);        // z basis
     transform.r[3] = DirectX::XMVectorSetW(translation, 1.0f);   // translation
 
-    ObjectData objectData = { .material = mat, .type = OBJECT_TYPE_QUAD, .Q = position, .U = u, .V = v };
-    addProceduralObject(transform, objectData, isPDFLightSource);
+    ObjectData objectData = { .type = OBJECT_TYPE_QUAD };
+    addProceduralObject(transform, objectData, mat);
+
+    if (isPDFLightSource)
+    {
+        // Quads face against U x V, see above, so an emitting one only lights the side U x V points away from.
+        DirectX::XMFLOAT3 center, normal;
+        DirectX::XMStoreFloat3(&center, pos + 0.5f * (uvec + vvec));
+        DirectX::XMStoreFloat3(&normal, zBasis);
+        const float diagonal = std::max(DirectX::XMVectorGetX(DirectX::XMVector3Length(uvec + vvec)),
+                                        DirectX::XMVectorGetX(DirectX::XMVector3Length(uvec - vvec)));
+        addLight({ .Q = position, .type = OBJECT_TYPE_QUAD, .U = u, .V = v,
+                   .flags = mat.type == MATERIAL_TYPE_DIFFUSE_LIGHT ? (UINT)LIGHT_FLAG_ONE_SIDED : 0u,
+                   .boundsCenter = center, .boundsRadius = diagonal / 2,
+                   .normal = normal,
+                   .area = DirectX::XMVectorGetX(DirectX::XMVector3Length(DirectX::XMVector3Cross(uvec, vvec))) });
+    }
+}
+
+// Index of the unit box group in the group list, created on first use in every scene.
+static UINT unitBoxGroup = UINT_MAX;
+
+UINT addQuadGroup(const std::vector<GroupQuad>& quads)
+{
+    building->groupList.push_back({ .quadOffset = (UINT)building->groupQuads.size(), .quadCount = (UINT)quads.size() });
+    building->groupQuads.insert(building->groupQuads.end(), quads.begin(), quads.end());
+    return (UINT)building->groupList.size() - 1;
+}
+
+void addQuadGroupInstance(UINT group, DirectX::XMMATRIX transform, MaterialData& mat)
+{
+    ObjectData objectData = { .type = OBJECT_TYPE_QUAD_GROUP, .geometryOffset = building->groupList[group].quadOffset };
+    addProceduralObject(transform, objectData, mat, group);
+}
+
+DirectX::XMMATRIX volumetricCubeTransform(DirectX::XMFLOAT3 a, DirectX::XMFLOAT3 b, float rotateX, float rotateY, float rotateZ)
+{
+    using namespace DirectX;
+
+    return XMMatrixTranslation(
+        a.x < b.x ? 1.0f : -1.0f, 
+        a.y < b.y ? 1.0f : -1.0f,  
+        a.z < b.z ? 1.0f : -1.0f) *  
+        XMMatrixRotationRollPitchYaw(
+            XMConvertToRadians(rotateX),
+            XMConvertToRadians(rotateY),
+            XMConvertToRadians(rotateZ)) *
+        XMMatrixScaling(std::abs(b.x - a.x) / 2, std::abs(b.y - a.y) / 2, std::abs(b.z - a.z) / 2) *
+        XMMatrixTranslation(a.x, a.y, a.z);
 }
 
 void addBox(DirectX::XMFLOAT3 a, DirectX::XMFLOAT3 b, MaterialData& mat, float rotateX = 0, float rotateY = 0,float rotateZ = 0, bool isPDFLightSource = false)
@@ -113,22 +357,48 @@ void addBox(DirectX::XMFLOAT3 a, DirectX::XMFLOAT3 b, MaterialData& mat, float r
         // But it turned out it's not that complicated to support also other cases.
         // Book rotates around A, not origin. We will do the same, let's reposition A point into (0,0,0) in object-space and do
         // necessary transforms.
-        ObjectData objectData = { .material = mat, .type = OBJECT_TYPE_VOLUMETRIC_CUBE };
-        addProceduralObject(XMMatrixTranslation(
-            a.x < b.x ? 1.0f : -1.0f, 
-            a.y < b.y ? 1.0f : -1.0f,  
-            a.z < b.z ? 1.0f : -1.0f) *  
+        if (isPDFLightSource)
+        {
+            throw std::runtime_error("Volumetric boxes can't be sampled as lights");
+        }
+
+        ObjectData objectData = { .type = OBJECT_TYPE_VOLUMETRIC_CUBE };
+        addProceduralObject(volumetricCubeTransform(a, b, rotateX, rotateY, rotateZ), objectData, mat, NO_DENSITY_GRID);
+        return;
+    }
+
+    // For other cases, box is made of quads. Unless it's a light we sample directly (light sampling only
+    // knows about single quads and spheres), all boxes instance the same unit box prototype, so each one
+    // costs a single TLAS instance and ObjectData instead of six.
+    if (!isPDFLightSource)
+    {
+        if (unitBoxGroup == UINT_MAX)
+        {
+            // Same faces as below, just for the (0,0,0)-(1,1,1) box.
+            unitBoxGroup = addQuadGroup({
+                { .Q = { 0, 0, 1 }, .U = {  1, 0, 0 }, .V = { 0, 1, 0 } }, // front
+                { .Q = { 1, 0, 1 }, .U = {  0, 0,-1 }, .V = { 0, 1, 0 } }, // right
+                { .Q = { 1, 0, 0 }, .U = { -1, 0, 0 }, .V = { 0, 1, 0 } }, // back
+                { .Q = { 0, 0, 0 }, .U = {  0, 0, 1 }, .V = { 0, 1, 0 } }, // left
+                { .Q = { 0, 1, 1 }, .U = {  1, 0, 0 }, .V = { 0, 0,-1 } }, // top
+                { .Q = { 0, 0, 0 }, .U = {  1, 0, 0 }, .V = { 0, 0, 1 } }  // bottom
+            });
+        }
+
+        // Scale the unit box to size, put its min corner where it belongs relative to A and rotate around A.
+        XMFLOAT3 boxMin = { std::min(a.x, b.x), std::min(a.y, b.y), std::min(a.z, b.z) };
+        addQuadGroupInstance(unitBoxGroup,
+            XMMatrixScaling(std::abs(b.x - a.x), std::abs(b.y - a.y), std::abs(b.z - a.z)) *
+            XMMatrixTranslation(boxMin.x - a.x, boxMin.y - a.y, boxMin.z - a.z) *
             XMMatrixRotationRollPitchYaw(
                 XMConvertToRadians(rotateX),
                 XMConvertToRadians(rotateY),
                 XMConvertToRadians(rotateZ)) *
-            XMMatrixScaling(std::abs(b.x - a.x) / 2, std::abs(b.y - a.y) / 2, std::abs(b.z - a.z) / 2) *
-            XMMatrixTranslation(a.x, a.y, a.z), 
-            objectData, isPDFLightSource);
+            XMMatrixTranslation(a.x, a.y, a.z),
+            mat);
         return;
     }
 
-    // For other cases, just create an empty box from quads.
     XMVECTOR vA = XMLoadFloat3(&a);
     XMVECTOR vB = XMLoadFloat3(&b);
 
@@ -173,11 +443,47 @@ void addBox(DirectX::XMFLOAT3 a, DirectX::XMFLOAT3 b, MaterialData& mat, float r
     addQuad(rotatePoint({min.x, min.y, min.z}), rotateVec(     dz), rotateVec(     dy), mat, isPDFLightSource); // left
     addQuad(rotatePoint({min.x, max.y, max.z}), rotateVec(     dx), rotateVec(minusdz), mat, isPDFLightSource); // top
     addQuad(rotatePoint({min.x, min.y, min.z}), rotateVec(     dx), rotateVec(     dz), mat, isPDFLightSource); // bottom
+
+    // U x V points out of the box on every face.
+    for (size_t face = building->lightsList.size() - 6; face < building->lightsList.size(); ++face)
+    {
+        building->lightsList[face].flags |= LIGHT_FLAG_BOX_FACE;
+    }
+}
+
+void addMesh(UINT meshIndex, DirectX::XMFLOAT3 position, float size, MaterialData& mat, float rotateX = 0, float rotateY = 0, float rotateZ = 0)
+{
+    using namespace DirectX;
+
+    // Meshes come in whatever units they were modeled in, so we fit them instead. The mesh is scaled
+    // so that its largest dimension equals size and placed with the center of its bottom at position.
+    // Every call adds just another instance of the same BLAS, mesh data itself is never duplicated.
+    const MeshData& mesh = building->meshList[meshIndex];
+    XMFLOAT3 extent = { mesh.bounds.max.x - mesh.bounds.min.x, mesh.bounds.max.y - mesh.bounds.min.y, mesh.bounds.max.z - mesh.bounds.min.z };
+    float scale = size / std::max({ extent.x, extent.y, extent.z, FLT_MIN });
+
+    if (mat.type == MATERIAL_TYPE_SMOKE)
+    {
+        throw std::runtime_error("Triangle meshes can't be used as volumes");
+    }
+
+    ObjectData objectData = { .type = OBJECT_TYPE_TRIANGLE_MESH, .geometryOffset = mesh.indexOffset, .vertexOffset = mesh.vertexOffset };
+    addProceduralObject(XMMatrixTranslation(
+        -(mesh.bounds.min.x + mesh.bounds.max.x) / 2,
+        -mesh.bounds.min.y,
+        -(mesh.bounds.min.z + mesh.bounds.max.z) / 2) *
+        XMMatrixScaling(scale, scale, scale) *
+        XMMatrixRotationRollPitchYaw(
+            XMConvertToRadians(rotateX),
+            XMConvertToRadians(rotateY),
+            XMConvertToRadians(rotateZ)) *
+        XMMatrixTranslation(position.x, position.y, position.z),
+        objectData, mat, meshIndex);
 }
 
 void setupSceneBasic(float defocusAngle)
 {
-    cameraData = { .lookfrom = { 0, 0, -0.5 },
+    building->camera = { .lookfrom = { 0, 0, -0.5 },
         .lookat = { 0, 0, 1 },
         .backgroundColor = { 0.4f, 0.6f, 0.8f }, 
         .vfov = 90.0f,
@@ -205,7 +511,7 @@ void setupSceneBasic(float defocusAngle)
 
 void setupSceneBasicClose(float defocusAngle)
 {
-    cameraData = { 
+    building->camera = { 
         .lookfrom = { -2, 2, -1 },
         .lookat = { 0, 0, 1 },
         .backgroundColor = { 0.4f, 0.6f, 0.8f }, 
@@ -234,7 +540,7 @@ void setupSceneBasicClose(float defocusAngle)
 
 void setupSceneFinal(float defocusAngle, bool isNight)
 {
-    cameraData = { 
+    building->camera = { 
         .lookfrom = { 13, 2, -3 },
         .lookat = { 0, 0, 0 },
         .backgroundColor = (isNight) ? DirectX::XMFLOAT3{ 0, 0, 0 } : DirectX::XMFLOAT3{ 0.4f, 0.6f, 0.8f },
@@ -289,9 +595,73 @@ void setupSceneFinal(float defocusAngle, bool isNight)
     }
 }
 
+void setupSceneBouncingSpheres()
+{
+    // Book 2 opener: the final scene of book 1 with the diffuse spheres bouncing. Each bounce takes
+    // a second and the shutter stays open for half of it, so they get blurred from the ground up.
+    building->camera = {
+        .lookfrom = { 13, 2, -3 },
+        .lookat = { 0, 0, 0 },
+        .backgroundColor = { 0.7f, 0.8f, 1.0f },
+        .vfov = 20.0f,
+        .focusDist = 10.0f,
+        .defocusAngle = 0.6f,
+        .samplesPerPixel = 16,
+        .doStratify = false,
+        .shutterOpen = 0.0f,
+        .shutterClose = 0.5f
+    };
+
+    MaterialData materialGround = { .albedo = { 0.5f, 0.5f, 0.5f},                               .type = MATERIAL_TYPE_LAMBERTIAN };
+    addSphere({ 0, -1000, 0 }, 1000, materialGround);
+
+    MaterialData material1 =   { .albedo = { 1.0f, 1.0f, 1.0f}, .refractionIndex = 1.5f,      .type = MATERIAL_TYPE_DIELECTRIC };
+    addSphere({ 0, 1, 0 }, 1.0, material1);
+
+    MaterialData material2 =   { .albedo = { 0.4f, 0.2f, 0.1f},                               .type = MATERIAL_TYPE_LAMBERTIAN };
+    addSphere({ -4, 1, 0 }, 1.0, material2);
+
+    MaterialData material3 =   { .albedo = { 0.7f, 0.6f, 0.5f}, .fuzz = 0.0f,                 .type = MATERIAL_TYPE_METAL };
+    addSphere({ 4, 1, 0 }, 1.0, material3);
+
+    for (int a = -11; a < 11; a++) {
+        for (int b = -11; b < 11; b++) {
+            auto choose_mat = random_float();
+            DirectX::XMFLOAT3 center(a + 0.9f*random_float(), 0.2f, b + 0.9f*random_float());
+            DirectX::XMFLOAT3 result(center.x - 4, center.y - 0.2f, center.z);
+            float distance = std::sqrt(result.x * result.x + result.y * result.y + result.z * result.z);
+
+            if (distance > 0.9) {
+                if (choose_mat < 0.8) {
+                    // diffuse, bouncing for 4 seconds
+                    DirectX::XMFLOAT3 vec1 = random_vector();
+                    DirectX::XMFLOAT3 vec2 = random_vector();
+                    MaterialData sphere_material = { .albedo = {vec1.x * vec2.x, vec1.y * vec2.y, vec1.z * vec2.z}, .type = MATERIAL_TYPE_LAMBERTIAN };
+                    DirectX::XMFLOAT3 top(center.x, center.y + random_float(0, 0.5f), center.z);
+                    std::pair<float, DirectX::XMFLOAT3> centers[9];
+                    for (int bounce = 0; bounce < 4; bounce++) {
+                        centers[2 * bounce] = { bounce + 0.0f, center };
+                        centers[2 * bounce + 1] = { bounce + 0.5f, top };
+                    }
+                    centers[8] = { 4.0f, center };
+                    addMovingSphere(centers, 0.2f, sphere_material);
+                } else if (choose_mat < 0.95) {
+                    // metal
+                    MaterialData sphere_material = { .albedo = random_vector(0.5, 1), .fuzz = random_float(0, 0.5), .type = MATERIAL_TYPE_METAL };
+                    addSphere(center, 0.2f, sphere_material);
+                } else {
+                    // glass
+                    MaterialData sphere_material =   { .albedo = { 1.0f, 1.0f, 1.0f}, .refractionIndex = 1.5f, .type = MATERIAL_TYPE_DIELECTRIC };
+                    addSphere(center, 0.2f, sphere_material);
+                }
+            }
+        }
+    }
+}
+
 void setupSceneQuads(float defocusAngle)
 {
-    cameraData = { 
+    building->camera = { 
         .lookfrom = { 0, 0, -9 }, 
         .lookat = { 0, 0, 0 }, 
         .backgroundColor = { 0, 0, 0 }, 
@@ -318,7 +688,7 @@ void setupSceneQuads(float defocusAngle)
 void setupSceneCornellBox(float defocusAngle)
 {
     // Make everything 10x smaller than in article so its easier to navigate...
-    cameraData = { 
+    building->camera = { 
         .lookfrom = { 27.8f, 27.8f, 80.0f }, 
         .lookat = { 27.8f, 27.8f, 0 }, 
         .backgroundColor = { 0, 0, 0 }, 
@@ -348,7 +718,7 @@ void setupSceneCornellBox(float defocusAngle)
 void setupSceneCornellBoxGlass(float defocusAngle)
 {
     // Make everything 10x smaller than in article so its easier to navigate...
-    cameraData = { 
+    building->camera = { 
         .lookfrom = { 27.8f, 27.8f, 80.0f }, 
         .lookat = { 27.8f, 27.8f, 0 }, 
         .backgroundColor = { 0, 0, 0 }, 
@@ -379,7 +749,7 @@ void setupSceneCornellBoxGlass(float defocusAngle)
 
 void setupSceneCornellBoxSmoke(float defocusAngle)
 {
-    cameraData = {
+    building->camera = {
         .lookfrom = { 278, 278, 800 },
         .lookat = { 278, 278, 0 },
         .backgroundColor = { 0, 0, 0 },
@@ -409,10 +779,118 @@ void setupSceneCornellBoxSmoke(float defocusAngle)
     addBox({  265,   0, -295 }, {  430, 330, -460}, blackSmoke, 0, -18, 0);
 }
 
+void addGridVolume(DirectX::XMFLOAT3 a, DirectX::XMFLOAT3 b, DensityGrid grid, MaterialData& mat, float rotateY = 0)
+{
+    // Same box as addBox makes for smoke, with the grid stretched over it. The GPU path only knows
+    // constant density smoke and renders it at the mean density (material density) of the grid.
+    if (mat.type != MATERIAL_TYPE_SMOKE)
+    {
+        throw std::runtime_error("Density grids only work with smoke");
+    }
+
+    UINT gridIndex = (UINT)building->gridList.size();
+    building->gridList.push_back(std::move(grid));
+
+    ObjectData objectData = { .type = OBJECT_TYPE_VOLUMETRIC_CUBE };
+    addProceduralObject(volumetricCubeTransform(a, b, 0, rotateY, 0), objectData, mat, gridIndex);
+}
+
+DensityGrid MakeCloudGrid(UINT resolution, UINT blobs, UINT seed)
+{
+    // A few soft blobs with fine noise on top, the rest of the volume stays empty.
+    DensityGrid grid = { .resolution = { resolution, resolution, resolution } };
+    grid.density.assign((size_t)resolution * resolution * resolution, 0.0f);
+
+    for (UINT blob = 0; blob < blobs; ++blob)
+    {
+        const float radius = (0.08f + 0.14f * RandomFloat(seed)) * resolution;
+        const float center[3] = { (0.25f + 0.5f * RandomFloat(seed)) * resolution,
+                                  (0.2f + 0.45f * RandomFloat(seed)) * resolution,
+                                  (0.25f + 0.5f * RandomFloat(seed)) * resolution };
+        for (UINT z = 0; z < resolution; ++z)
+        {
+            for (UINT y = 0; y < resolution; ++y)
+            {
+                for (UINT x = 0; x < resolution; ++x)
+                {
+                    const float dx = x + 0.5f - center[0], dy = y + 0.5f - center[1], dz = z + 0.5f - center[2];
+                    const float falloff = 1 - (dx * dx + dy * dy + dz * dz) / (radius * radius);
+                    if (falloff > 0)
+                    {
+                        grid.density[x + (size_t)resolution * (y + (size_t)resolution * z)] += falloff * (0.6f + 0.4f * RandomFloat(seed));
+                    }
+                }
+            }
+        }
+    }
+
+    BuildMajorantGrid(grid);
+    return grid;
+}
+
+void setupSceneCornellBoxCloud(float defocusAngle)
+{
+    building->camera = { 
+        .lookfrom = { 278, 278, 800 }, 
+        .lookat = { 278, 278, 0 }, 
+        .backgroundColor = { 0, 0, 0 }, 
+        .vfov = 40, 
+        .focusDist = 10.0f, 
+        .defocusAngle = defocusAngle, 
+        .samplesPerPixel = 16,
+        .doStratify = false
+    };
+
+    MaterialData red   = { .albedo = { .65f, .05f, .05f}, .type = MATERIAL_TYPE_LAMBERTIAN };
+    MaterialData white = { .albedo = { .73f, .73f, .73f}, .type = MATERIAL_TYPE_LAMBERTIAN };
+    MaterialData green = { .albedo = { .12f, .45f, .15f}, .type = MATERIAL_TYPE_LAMBERTIAN };
+    MaterialData light = { .albedo = {   7,   7,   7}, .type = MATERIAL_TYPE_DIFFUSE_LIGHT };
+
+    MaterialData cloud = { .albedo = { 1, 1, 1}, .density = 0.01f, .type = MATERIAL_TYPE_SMOKE };
+
+    addQuad({ 555,   0,    0 }, {    0, 555, 0 }, { 0,   0, -555 }, green);
+    addQuad({   0,   0,    0 }, {    0, 555, 0 }, { 0,   0, -555 },   red);
+    addQuad({ 113, 554, -127 }, {  330,   0, 0 }, { 0,   0, -305 }, light, true);
+    addQuad({   0,   0,    0 }, {  555,   0, 0 }, { 0,   0, -555 }, white);
+    addQuad({ 555, 555, -555 }, { -555,   0, 0 }, { 0,   0,  555 }, white);
+    addQuad({   0,   0, -555 }, {  555,   0, 0 }, { 0, 555,    0 }, white);
+
+    // Put any density grid you like next to the executable.
+    if (std::filesystem::exists("volume.vgrid"))
+    {
+        addGridVolume({ 60, 0, -60 }, { 495, 435, -495 }, LoadDensityGrid("volume.vgrid"), cloud, 15);
+        return;
+    }
+
+    printf("No volume.vgrid found, cloud scene will use a generated grid.\n");
+    addGridVolume({ 60, 0, -60 }, { 495, 435, -495 }, MakeCloudGrid(96, 6, 7), cloud, 15);
+}
+
+void setupScenePerlinSpheres()
+{
+    building->camera = { 
+        .lookfrom = { 13, 2, -3 },
+        .lookat = { 0, 0, 0 },
+        .backgroundColor = { 0.4f, 0.6f, 0.8f },
+        .vfov = 20.0f,
+        .focusDist = 10.0f,
+        .defocusAngle = 0,
+        .samplesPerPixel = 16,
+        .doStratify = false
+    };
+
+    MaterialData light = { .albedo = {   15,   15,   10}, .type = MATERIAL_TYPE_DIFFUSE_LIGHT };
+    addSphere({ 0, 50, 1 }, 10, light, true);
+
+    MaterialData marble = { .albedo = { 1, 1, 1}, .type = MATERIAL_TYPE_LAMBERTIAN, .textureType = TEXTURE_TYPE_NOISE, .textureScale = 4 };
+    addSphere({ 0, -1000, 0 }, 1000, marble);
+    addSphere({ 0, 2, 0 }, 2, marble);
+}
+
 void setupSceneCornellBoxMetal(float defocusAngle)
 {
     // Make everything 10x smaller than in article so its easier to navigate...
-    cameraData = { 
+    building->camera = { 
         .lookfrom = { 27.8f, 27.8f, 80.0f }, 
         .lookat = { 27.8f, 27.8f, 0 }, 
         .backgroundColor = { 0, 0, 0 }, 
@@ -444,7 +922,7 @@ void setupSceneCornellBoxMetal(float defocusAngle)
 void setupSceneCornellBoxGlassSphere(float defocusAngle, bool isGlassSphereALight)
 {
     // Make everything 10x smaller than in article so its easier to navigate...
-    cameraData = { 
+    building->camera = { 
         .lookfrom = { 27.8f, 27.8f, 80.0f }, 
         .lookat = { 27.8f, 27.8f, 0 }, 
         .backgroundColor = { 0, 0, 0 }, 
@@ -460,7 +938,7 @@ void setupSceneCornellBoxGlassSphere(float defocusAngle, bool isGlassSphereALigh
     MaterialData green = { .albedo = { .12f, .45f, .15f}, .type = MATERIAL_TYPE_LAMBERTIAN };
     MaterialData light = { .albedo = {   15,   15,   15}, .type = MATERIAL_TYPE_DIFFUSE_LIGHT };
 
-    MaterialData glass = { .albedo = { 1, 1, 1}, .fuzz = 0.0f, .refractionIndex = 1.5f, .type = MATERIAL_TYPE_DIELECTRIC };
+    MaterialData glass = { .albedo = { 1, 1, 1}, .fuzz = 0.0f, .refractionIndex = 1.5f, .type = MATERIAL_TYPE_DIELECTRIC, .abbeNumber = 30 }; // Flint like dispersion.
 
     addQuad({ 55.5f,   .0f,    .0f }, {    .0f, 55.5f, .0f }, { .0f,   .0f, -55.5f }, green);
     addQuad({   .0f,   .0f,    .0f }, {    .0f, 55.5f, .0f }, { .0f,   .0f, -55.5f },   red);
@@ -477,7 +955,7 @@ void setupSceneCornellBoxGlassSphere(float defocusAngle, bool isGlassSphereALigh
 void setupSceneCornellBoxMetalBoxGlassSphere()
 {
     // Make everything 10x smaller than in article so its easier to navigate...
-    cameraData = { 
+    building->camera = { 
         .lookfrom = { 27.8f, 27.8f, 80.0f }, 
         .lookat = { 27.8f, 27.8f, 0 }, 
         .backgroundColor = { 0, 0, 0 }, 
@@ -493,7 +971,7 @@ void setupSceneCornellBoxMetalBoxGlassSphere()
     MaterialData green = { .albedo = { .12f, .45f, .15f}, .type = MATERIAL_TYPE_LAMBERTIAN };
     MaterialData light = { .albedo = {   15,   15,   15}, .type = MATERIAL_TYPE_DIFFUSE_LIGHT };
     MaterialData aluminum = { .albedo = { 0.8f, 0.85f, 0.88f}, .fuzz = 0.0f, .type = MATERIAL_TYPE_METAL };
-    MaterialData glass = { .albedo = { 1, 1, 1}, .fuzz = 0.0f, .refractionIndex = 1.5f, .type = MATERIAL_TYPE_DIELECTRIC };
+    MaterialData glass = { .albedo = { 1, 1, 1}, .fuzz = 0.0f, .refractionIndex = 1.5f, .type = MATERIAL_TYPE_DIELECTRIC, .abbeNumber = 30 }; // Flint like dispersion.
 
     addQuad({ 55.5f,   .0f,    .0f }, {    .0f, 55.5f, .0f }, { .0f,   .0f, -55.5f }, green);
     addQuad({   .0f,   .0f,    .0f }, {    .0f, 55.5f, .0f }, { .0f,   .0f, -55.5f },   red);
@@ -509,7 +987,7 @@ void setupSceneCornellBoxMetalBoxGlassSphere()
 
 void setupSceneFinal2(float defocusAngle)
 {
-    cameraData = {
+    building->camera = {
         .lookfrom = { 478, 278, 600 },
         .lookat = { 278, 278, 0 },
         .backgroundColor = { 0, 0, 0 },
@@ -517,7 +995,9 @@ void setupSceneFinal2(float defocusAngle)
         .focusDist = 10.0f,
         .defocusAngle = defocusAngle,
         .samplesPerPixel = 16,
-        .doStratify = false
+        .doStratify = false,
+        .shutterOpen = 0.0f,
+        .shutterClose = 1.0f
     };
 
     MaterialData ground   = { .albedo = { 0.48f, 0.83f, 0.53f}, .type = MATERIAL_TYPE_LAMBERTIAN };
@@ -540,9 +1020,9 @@ void setupSceneFinal2(float defocusAngle)
     MaterialData light = { .albedo = {   7,   7,   7}, .type = MATERIAL_TYPE_DIFFUSE_LIGHT };
     addQuad({ 123, 554, -147 }, { 300, 0, 0 }, { 0,   0, -265 }, light, true);
 
-    // No motion blur for this one.
     MaterialData sphereMaterial1 = { .albedo = { .7f, .3f, .1f}, .type = MATERIAL_TYPE_LAMBERTIAN };
-    addSphere({ 400, 400, -200 }, 50, sphereMaterial1);
+    const std::pair<float, DirectX::XMFLOAT3> centers[] = { { 0.0f, { 400, 400, -200 } }, { 1.0f, { 430, 400, -200 } } };
+    addMovingSphere(centers, 50, sphereMaterial1);
 
     MaterialData sphereMaterial2 =   { .albedo = { 1.0f, 1.0f, 1.0f}, .refractionIndex = 1.5f, .type = MATERIAL_TYPE_DIELECTRIC };
     addSphere({ 260, 150, -45 }, 50, sphereMaterial2);
@@ -559,12 +1039,16 @@ void setupSceneFinal2(float defocusAngle)
     MaterialData sphereMaterial5 = { .albedo = { 1, 1, 1}, .density = 0.0002f, .type = MATERIAL_TYPE_SMOKE };
     addSphere({ 0, 0, 0 }, 4999, sphereMaterial5);
 
-    // No world texturing for this one.
+    // Put any PPM world map you like next to the executable, the GPU only shows its average color.
     MaterialData sphereMaterial6 = { .albedo = { 0.05f, 0.1f, 0.225f}, .type = MATERIAL_TYPE_LAMBERTIAN };
+    if (std::filesystem::exists("earthmap.ppm"))
+    {
+        sphereMaterial6 = imageTextureMaterial(LoadTexture("earthmap.ppm", building->textureList));
+    }
     addSphere({ 400, 200, -400 }, 100, sphereMaterial6);
 
-    // No noise texturing for this one.
-    addSphere({ 220, 280, -300 }, 80, sphereMaterial3);
+    MaterialData sphereMaterial8 = { .albedo = { 1, 1, 1}, .type = MATERIAL_TYPE_LAMBERTIAN, .textureType = TEXTURE_TYPE_NOISE, .textureScale = 0.2f };
+    addSphere({ 220, 280, -300 }, 80, sphereMaterial8);
 
     MaterialData sphereMaterial7 = { .albedo = { .73f, .73f, .73f}, .type = MATERIAL_TYPE_LAMBERTIAN };
     int ns = 1000;
@@ -574,16 +1058,125 @@ void setupSceneFinal2(float defocusAngle)
     }
 }
 
-void SetupNextScene()
+void setupSceneCornellBoxMesh(float defocusAngle)
+{
+    building->camera = { 
+        .lookfrom = { 27.8f, 27.8f, 80.0f }, 
+        .lookat = { 27.8f, 27.8f, 0 }, 
+        .backgroundColor = { 0, 0, 0 }, 
+        .vfov = 40, 
+        .focusDist = 10.0f, 
+        .defocusAngle = defocusAngle, 
+        .samplesPerPixel = 16,
+        .doStratify = false
+    };
+
+    MaterialData red   = { .albedo = { .65f, .05f, .05f}, .type = MATERIAL_TYPE_LAMBERTIAN };
+    MaterialData white = { .albedo = { .73f, .73f, .73f}, .type = MATERIAL_TYPE_LAMBERTIAN };
+    MaterialData green = { .albedo = { .12f, .45f, .15f}, .type = MATERIAL_TYPE_LAMBERTIAN };
+    MaterialData light = { .albedo = {   15,   15,   15}, .type = MATERIAL_TYPE_DIFFUSE_LIGHT };
+    MaterialData metal = { .albedo = { .8f, .85f, .88f}, .fuzz = 0.05f, .type = MATERIAL_TYPE_METAL };
+    MaterialData glass = { .albedo = { 1.0f, 1.0f, 1.0f}, .refractionIndex = 1.5f, .type = MATERIAL_TYPE_DIELECTRIC };
+
+    addQuad({ 55.5f,   .0f,    .0f }, {    .0f, 55.5f, .0f }, { .0f,   .0f, -55.5f }, green);
+    addQuad({   .0f,   .0f,    .0f }, {    .0f, 55.5f, .0f }, { .0f,   .0f, -55.5f },   red);
+    addQuad({ 34.3f, 55.4f, -33.2f }, { -13.0f,   .0f, .0f }, { .0f,   .0f,  10.5f }, light, true);
+    addQuad({   .0f,   .0f,    .0f }, {  55.5f,   .0f, .0f }, { .0f,   .0f, -55.5f }, white);
+    addQuad({ 55.5f, 55.5f, -55.5f }, { -55.5f,   .0f, .0f }, { .0f,   .0f,  55.5f }, white);
+    addQuad({   .0f,   .0f, -55.5f }, {  55.5f,   .0f, .0f }, { .0f, 55.5f,    .0f }, white);
+
+    // Put any .obj or .ply you like next to the executable.
+    const char* meshPath = std::filesystem::exists("mesh.obj") ? "mesh.obj" : "mesh.ply";
+    if (!std::filesystem::exists(meshPath))
+    {
+        printf("No mesh.obj/mesh.ply found, mesh scene will only have the boxes.\n");
+        addBox({  13.0f,   .0f,  -6.5f }, {  29.5f, 16.5f, -23.0f}, white, 0,  15, 0);
+        addBox({  26.5f,   .0f, -29.5f }, {  43.0f, 33.0f, -46.0f}, white, 0, -18, 0);
+        return;
+    }
+
+    UINT mesh = LoadMesh(meshPath, *building);
+    addMesh(mesh, { 16.0f, .0f, -18.0f }, 18.0f, white, 0,  20, 0);
+    addMesh(mesh, { 38.0f, .0f, -36.0f }, 24.0f, metal, 0, -25, 0);
+    addMesh(mesh, { 40.0f, .0f, -12.0f }, 10.0f, glass, 0,  60, 0);
+}
+
+UINT NextScene()
 {
     static UINT scene = 3;
-    scene = (scene + 1) % 16;
+    scene = (scene + 1) % SCENE_COUNT;
+    return scene;
+}
+
+void SetupNextScene()
+{
+    SetupScene(NextScene());
+}
+
+void SetupScene(UINT scene)
+{
+    // The scene replaced here ends up in spare, which is released when the next one is built into it.
+    static SceneState spare;
+    BuildScene(scene, spare);
+    SwapSceneState(spare);
+}
+
+void SwapSceneState(SceneState& scene)
+{
+    std::swap(proceduralInstances, scene.proceduralInstances);
+    std::swap(dirtyInstances, scene.dirtyInstances);
+    std::swap(animatedInstances, scene.animatedInstances);
+    std::swap(objectList, scene.objectList);
+    std::swap(lightsList, scene.lightsList);
+    std::swap(materialList, scene.materialList);
+    std::swap(meshList, scene.meshList);
+    std::swap(meshVertices, scene.meshVertices);
+    std::swap(meshIndices, scene.meshIndices);
+    std::swap(groupList, scene.groupList);
+    std::swap(groupQuads, scene.groupQuads);
+    std::swap(gridList, scene.gridList);
+    std::swap(textureList, scene.textureList);
+    std::swap(cameraData, scene.camera);
+    std::swap(autoAdaptSamplesCount, scene.autoAdaptSamplesCount);
+    std::swap(sceneSpatialIndex, scene.spatialIndex);
+    std::swap(sceneArena, scene.arena);
+
+    // Cached tiles and treelets are keyed by texture and mesh index, they belong to the old ones.
+    ClearTextureCache();
+    ClearMeshPageCache();
+}
+
+void BuildScene(UINT scene, SceneState& into)
+{
+    // The builders share the registry and the unit box, so one scene at a time. Whatever is rendering
+    // the current scene meanwhile doesn't care, nothing here touches it.
+    static std::mutex buildMutex;
+    std::lock_guard lock(buildMutex);
+    building = &into;
 
     // Reset.
-    proceduralInstances.clear();
-    objectList.clear();
-    lightsList.clear();
-    autoAdaptSamplesCount = false;
+    into.proceduralInstances.clear();
+    into.dirtyInstances.clear();
+    into.animatedInstances.clear();
+    into.objectList.clear();
+    into.lightsList.clear();
+    into.materialList.clear();
+    into.meshList.clear();
+    into.meshVertices.clear();
+    into.meshIndices.clear();
+    into.groupList.clear();
+    into.groupQuads.clear();
+    into.gridList.clear();
+    ClearTextures(into.textureList);
+    into.camera = {};
+    unitBoxGroup = UINT_MAX;
+    into.autoAdaptSamplesCount = false;
+    into.spatialIndex = SPATIAL_INDEX_AUTO;
+
+    // Everything on the arena has to be gone before the reset: keyframes went with the instances above.
+    materialRegistry.reset();
+    into.arena->Reset();
+    materialRegistry.emplace(0, MaterialDataHash(), MaterialDataEqual(), ArenaAllocator<std::pair<const MaterialData, UINT16>>(*into.arena));
 
     switch (scene)
     {
@@ -603,5 +1196,23 @@ void SetupNextScene()
     case 13: setupSceneCornellBoxGlassSphere(0.0f, true); break;
     case 14: setupSceneCornellBoxMetalBoxGlassSphere(); break;
     case 15: setupSceneFinal2(0.0f); break;
+    case 16: setupSceneCornellBoxMesh(0.0f); break;
+    case 17: setupSceneBouncingSpheres(); break;
+    case 18: setupSceneCornellBoxCloud(0.0f); break;
+    case 19: setupScenePerlinSpheres(); break;
+    }
+    building = nullptr;
+    // Its nodes are on into's arena, which can go away before the next build, SceneStates other than
+    // the globals' do.
+    materialRegistry.reset();
+
+    // Like AnimateInstances, so the scene is ready to render as soon as it's swapped in.
+    for (UINT instance : into.animatedInstances)
+    {
+        ProceduralInstance& animated = into.proceduralInstances[instance];
+        DirectX::XMMATRIX open = InstanceTransformAt(animated, into.camera.shutterOpen);
+        DirectX::XMMATRIX close = InstanceTransformAt(animated, into.camera.shutterClose);
+        DirectX::XMStoreFloat3(&animated.motion, close.r[3] - open.r[3]);
+        animated.transform = open;
     }
 }
\ No newline at end of file
@@ -0,0 +1,118 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+
+// Layout of a DXR shader table: the ray generation record, then the miss table, then the hit group
+// table, each starting on SHADER_TABLE_ALIGNMENT. A record is a shader identifier followed by the
+// local root arguments of its shader, records of a table all have the same stride, rounded up to
+// SHADER_RECORD_ALIGNMENT. The constants are D3D12's, repeated here so none of this needs d3d12.h.
+constexpr uint64_t SHADER_IDENTIFIER_BYTES = 32;   // D3D12_SHADER_IDENTIFIER_SIZE_IN_BYTES
+constexpr uint64_t SHADER_RECORD_ALIGNMENT = 32;   // D3D12_RAYTRACING_SHADER_RECORD_BYTE_ALIGNMENT
+constexpr uint64_t SHADER_TABLE_ALIGNMENT = 64;    // D3D12_RAYTRACING_SHADER_TABLE_BYTE_ALIGNMENT
+constexpr uint64_t MAX_SHADER_RECORD_STRIDE = 4096; // D3D12_RAYTRACING_MAX_SHADER_RECORD_STRIDE
+
+struct ShaderTableRange
+{
+    uint64_t offset; // From the start of the table buffer.
+    uint64_t size;
+    uint64_t stride;
+    uint32_t count;
+};
+
+struct ShaderTableLayout
+{
+    ShaderTableRange rayGeneration;
+    ShaderTableRange miss;
+    ShaderTableRange hitGroups;
+    uint64_t localBytes; // Local root arguments of a hit record, the other records have none.
+    uint64_t size;
+};
+
+constexpr uint64_t AlignShaderTable(uint64_t value, uint64_t alignment)
+{
+    return (value + alignment - 1) / alignment * alignment;
+}
+
+constexpr uint64_t ShaderRecordStride(uint64_t localBytes)
+{
+    return AlignShaderTable(SHADER_IDENTIFIER_BYTES + localBytes, SHADER_RECORD_ALIGNMENT);
+}
+
+// One ray generation record, missCount miss records and hitCount hit records of localBytes each.
+// Throws if a hit record doesn't fit in the stride DXR allows.
+constexpr ShaderTableLayout MakeShaderTableLayout(uint32_t missCount, uint32_t hitCount, uint64_t localBytes = 0)
+{
+    const uint64_t hitStride = ShaderRecordStride(localBytes);
+    if (hitStride > MAX_SHADER_RECORD_STRIDE)
+    {
+        throw std::invalid_argument("Shader record local arguments don't fit in the maximum record stride");
+    }
+
+    ShaderTableLayout layout = {};
+    layout.localBytes = localBytes;
+    const uint64_t plainStride = ShaderRecordStride(0);
+    layout.rayGeneration = { 0, plainStride, plainStride, 1 };
+    layout.miss = { AlignShaderTable(layout.rayGeneration.offset + layout.rayGeneration.size, SHADER_TABLE_ALIGNMENT),
+        missCount * plainStride, plainStride, missCount };
+    layout.hitGroups = { AlignShaderTable(layout.miss.offset + layout.miss.size, SHADER_TABLE_ALIGNMENT),
+        hitCount * hitStride, hitStride, hitCount };
+    layout.size = layout.hitGroups.offset + layout.hitGroups.size;
+    return layout;
+}
+
+// The rules above, checked where anyone changing them will see it.
+static_assert(ShaderRecordStride(0) == 32);
+static_assert(ShaderRecordStride(1) == 64);
+static_assert(ShaderRecordStride(60) == 96);
+static_assert(MakeShaderTableLayout(1, 23).miss.offset == 64);
+static_assert(MakeShaderTableLayout(1, 23).hitGroups.offset == 128);
+static_assert(MakeShaderTableLayout(1, 23).size == 128 + 23 * 32);
+static_assert(MakeShaderTableLayout(2, 3, 60).hitGroups.offset == 128);
+static_assert(MakeShaderTableLayout(3, 3, 60).hitGroups.offset == 192);
+static_assert(MakeShaderTableLayout(1, 3, 60).hitGroups.stride == 96);
+static_assert(MakeShaderTableLayout(1, 0).size == 128);
+
+// Writes records into a table laid out by layout, which table points to the start of. Records can be
+// written in any order and from several threads at once, as long as no two write the same record.
+class ShaderTableWriter
+{
+public:
+    ShaderTableWriter(std::byte* table, const ShaderTableLayout& layout) : table(table), layout(layout) {}
+
+    void RayGeneration(const void* identifier)
+    {
+        write(layout.rayGeneration, 0, identifier, nullptr, 0);
+    }
+
+    void Miss(uint32_t index, const void* identifier)
+    {
+        write(layout.miss, index, identifier, nullptr, 0);
+    }
+
+    // localData may be shorter than the layout's local arguments, the rest of the record is zeroed.
+    void HitGroup(uint32_t index, const void* identifier, const void* localData = nullptr, size_t localBytes = 0)
+    {
+        write(layout.hitGroups, index, identifier, localData, localBytes);
+    }
+
+private:
+    void write(const ShaderTableRange& range, uint32_t index, const void* identifier, const void* localData, size_t localBytes)
+    {
+        if (index >= range.count || SHADER_IDENTIFIER_BYTES + localBytes > range.stride)
+        {
+            throw std::out_of_range("Shader record outside of the table layout");
+        }
+
+        std::byte* record = table + range.offset + index * range.stride;
+        memcpy(record, identifier, SHADER_IDENTIFIER_BYTES);
+        if (localBytes)
+            memcpy(record + SHADER_IDENTIFIER_BYTES, localData, localBytes);
+        memset(record + SHADER_IDENTIFIER_BYTES + localBytes, 0, range.stride - SHADER_IDENTIFIER_BYTES - localBytes);
+    }
+
+    std::byte* table;
+    ShaderTableLayout layout;
+};
@@ -52,6 +52,11 @@ void RayGeneration()
     const uint numSamplesX = (g_camera.doStratify) ? sqrtSpp : g_camera.samplesPerPixel;
     const uint numSamplesY = (g_camera.doStratify) ? sqrtSpp : 1;
     
+    // First hit of the first sample, for reprojecting next frame.
+    float3 primaryPosition = 0;
+    float3 primaryNormal = 0;
+    bool primaryRecorded = false;
+
     float3 accumulatedColor = 0;
     for (uint sampleY = 0; sampleY < numSamplesY; ++sampleY)
     {
@@ -76,6 +81,9 @@ void RayGeneration()
             }
         
             const float3 rayDirection = pixelSample - rayOrigin;
+
+            // All bounces of the path happen at the same time, somewhere while the shutter is open.
+            g_rayTime[idx] = (g_camera.shutterClose > g_camera.shutterOpen) ? RandomFloat(randomSeed) : 0;
         
             Payload payload;
         
@@ -87,10 +95,10 @@ void RayGeneration()
         
             float3 gatheredAttenuation = float3(1, 1, 1);
             float3 lastColor;
-            uint remainingReflections = 256;
+            uint4 bounces = 0; // Per BOUNCE_TYPE.
             while (true)
             {
-                if (remainingReflections == 0 || length(gatheredAttenuation) < 0.0001)
+                if (length(gatheredAttenuation) < 0.0001)
                 {
                     lastColor = float3(0, 0, 0);
                     break;
@@ -107,6 +115,13 @@ void RayGeneration()
             
                 randomSeed = payload.seed;
 
+                if (!primaryRecorded)
+                {
+                    primaryPosition = payload.p;
+                    primaryNormal = payload.normal;
+                    primaryRecorded = true;
+                }
+
                 if (payload.missed)
                 {
                     // Missed or fully absorbed or emits light.
@@ -150,14 +165,32 @@ void RayGeneration()
                 }
                 
                 gatheredAttenuation *= payload.color * pdfRatio;
-                --remainingReflections;
+
+                // Past its limit the path ends without light, like one that left the scene into black.
+                if (++bounces[payload.bounceType] > g_camera.maxBounces[payload.bounceType])
+                {
+                    lastColor = float3(0, 0, 0);
+                    break;
+                }
             }
 
             accumulatedColor += gatheredAttenuation * lastColor;
         }
     }
 
-    uav[idx] = float4(sqrt(accumulatedColor / (numSamplesX * numSamplesY)), 1);
+    // New samples refine whatever history survived the camera motion.
+    const uint samples = numSamplesX * numSamplesY;
+    const uint currentSlice = g_camera.frameIndex & 1;
+    float4 history = 0;
+    if (g_camera.temporalReuse)
+        history = ReprojectHistory(primaryPosition, primaryNormal, idx, size, 1 - currentSlice);
+    const float4 color = AccumulateHistory(history, accumulatedColor / samples, samples);
+
+    g_historyPosition[uint3(idx, currentSlice)] = float4(primaryPosition, 1);
+    g_historyNormal[uint3(idx, currentSlice)] = float4(primaryNormal, 0);
+    g_historyColor[uint3(idx, currentSlice)] = color;
+
+    uav[idx] = float4(sqrt(color.rgb), 1);
 }
 
 [shader("intersection")]
@@ -172,6 +205,18 @@ void IntersectionProceduralSphere()
     }
 }
 
+[shader("intersection")]
+void IntersectionProceduralMovingSphere()
+{
+    float enterT;
+    float exitT; // unused here
+    ProceduralPrimitiveAttributes attr;
+    if (IntersectionProceduralSphere(MotionObjectRayOrigin(), ObjectRayDirection(), false, enterT, exitT, attr))
+    {
+        ReportHit(enterT, 0, attr);
+    }
+}
+
 [shader("intersection")]
 void IntersectionProceduralQuad()
 {
@@ -192,7 +237,7 @@ void IntersectionProceduralSmokeSphere()
     if (IntersectionProceduralSphere(ObjectRayOrigin(), ObjectRayDirection(), true, enterT, exitT, attr))
     {
         float distanceInsideBoundary = exitT - enterT;
-        float negInvDensity = -1 / g_objects[NonUniformResourceIndex(InstanceID())].material.density;
+        float negInvDensity = -1 / InstanceMaterial().density;
         uint seed = SetupSeed(FrameSetupSeed(), randomSeedBuffer[0]);
         float hitDistance = negInvDensity * log(RandomFloat(seed));
         
@@ -226,7 +271,7 @@ void IntersectionProceduralSmokeCube()
     if (IntersectionProceduralCube(ObjectRayOrigin(), ObjectRayDirection(), true, enterT, exitT, attr))
     {
         float distanceInsideBoundary = exitT - enterT;
-        float negInvDensity = -1 / g_objects[NonUniformResourceIndex(InstanceID())].material.density;
+        float negInvDensity = -1 / InstanceMaterial().density;
         uint seed = SetupSeed(FrameSetupSeed(), randomSeedBuffer[0]);
         float hitDistance = negInvDensity * log(RandomFloat(seed));
         
@@ -237,46 +282,56 @@ void IntersectionProceduralSmokeCube()
     }
 }
 
-[shader("closesthit")]
-void ClosestHitProceduralLambertian(
-                            inout Payload payload,
-                            ProceduralPrimitiveAttributes attrib)
+[shader("intersection")]
+void IntersectionProceduralQuadGroup()
+{
+    float enterT;
+    ProceduralPrimitiveAttributes attr;
+    const GroupQuad quad = g_groupQuads[InstanceObject().geometryOffset + PrimitiveIndex()];
+    if (IntersectionProceduralGroupQuad(ObjectRayOrigin(), ObjectRayDirection(), quad, enterT, attr))
+    {
+        ReportHit(enterT, 0, attr);
+    }
+}
+
+void ShadeLambertian(inout Payload payload, ProceduralPrimitiveAttributes attrib)
 {
     float3 normal = attrib.normal;
-    payload.color = g_objects[NonUniformResourceIndex(InstanceID())].material.albedo.xyz;
     payload.p = WorldRayOrigin() + RayTCurrent() * WorldRayDirection();
+    payload.color = MaterialAlbedo(InstanceMaterial(), payload.p);
+    payload.normal = normal;
+    payload.bounceType = BOUNCE_TYPE_DIFFUSE;
     payload.missed = false;
     
-    payload.scatterDirection = MixedCosineHittablePDFGenerate(normal, payload.p, payload.scatterDirection, payload.seed);
-    payload.pdfValue = MixedCosineHittablePDFValue(normal, payload.p, payload.scatterDirection);
+    const uint reachableLights = ReachableLights(payload.p, normal);
+    payload.scatterDirection = MixedCosineHittablePDFGenerate(normal, payload.p, payload.scatterDirection, reachableLights, payload.seed);
+    payload.pdfValue = MixedCosineHittablePDFValue(normal, payload.p, payload.scatterDirection, reachableLights);
     
     payload.pdfScatter = CosinePDFValue(normal, payload.scatterDirection);
     payload.skipPdf = false;
 }
 
-[shader("closesthit")]
-void ClosestHitProceduralMetal(
-                            inout Payload payload,
-                            ProceduralPrimitiveAttributes attrib)
+void ShadeMetal(inout Payload payload, ProceduralPrimitiveAttributes attrib)
 {
-    payload.color = g_objects[NonUniformResourceIndex(InstanceID())].material.albedo.xyz;
+    const MaterialData material = InstanceMaterial();
+    payload.color = material.albedo.xyz;
     payload.p = WorldRayOrigin() + RayTCurrent() * WorldRayDirection();
     payload.scatterDirection = normalize(reflect(WorldRayDirection(), attrib.normal));
-    payload.scatterDirection += g_objects[NonUniformResourceIndex(InstanceID())].material.fuzz * RandomUnitVector(payload.seed);
+    payload.scatterDirection += material.fuzz * RandomUnitVector(payload.seed);
+    payload.normal = 0; // Reflections move with the camera.
+    payload.bounceType = BOUNCE_TYPE_SPECULAR;
     payload.missed = false;
     
     payload.skipPdf = true;
 }
 
-[shader("closesthit")]
-void ClosestHitProceduralDielectric(
-                            inout Payload payload,
-                            ProceduralPrimitiveAttributes attrib)
+void ShadeDielectric(inout Payload payload, ProceduralPrimitiveAttributes attrib)
 {
-    payload.color = g_objects[NonUniformResourceIndex(InstanceID())].material.albedo.xyz;
+    const MaterialData material = InstanceMaterial();
+    payload.color = material.albedo.xyz;
     payload.p = WorldRayOrigin() + RayTCurrent() * WorldRayDirection();
     
-    const float refractionIndex = g_objects[NonUniformResourceIndex(InstanceID())].material.refractionIndex;
+    const float refractionIndex = material.refractionIndex;
     const float ri = attrib.front_face ? (1.0 / refractionIndex) : refractionIndex;
         
     const float3 unitDirection = normalize(WorldRayDirection());
@@ -295,47 +350,125 @@ void ClosestHitProceduralDielectric(
     }
 
     payload.scatterDirection = direction;
+    payload.normal = 0; // Reflections and refractions move with the camera.
+    payload.bounceType = BOUNCE_TYPE_TRANSMISSION;
     payload.missed = false;
     
     payload.skipPdf = true;
 }
 
-[shader("closesthit")]
-void ClosestHitProceduralDiffuseLight(
-                            inout Payload payload,
-                            ProceduralPrimitiveAttributes attrib)
+void ShadeDiffuseLight(inout Payload payload, ProceduralPrimitiveAttributes attrib)
 {
     if (attrib.front_face)
     {
-        payload.color = g_objects[NonUniformResourceIndex(InstanceID())].material.albedo.xyz;
+        payload.color = InstanceMaterial().albedo.xyz;
     }
     else
     {
         payload.color = float3(0, 0, 0);
     }
     
+    payload.p = WorldRayOrigin() + RayTCurrent() * WorldRayDirection();
+    payload.normal = attrib.normal;
     payload.missed = true;
 }
 
-[shader("closesthit")]
-void ClosestHitProceduralSmoke(
-                            inout Payload payload,
-                            ProceduralPrimitiveAttributes attrib)
+void ShadeSmoke(inout Payload payload, ProceduralPrimitiveAttributes attrib)
 {
-    payload.color = g_objects[NonUniformResourceIndex(InstanceID())].material.albedo.xyz;
+    payload.color = InstanceMaterial().albedo.xyz;
     payload.p = WorldRayOrigin() + RayTCurrent() * WorldRayDirection();
+    payload.normal = 0; // Scatters at a random depth every sample.
+    payload.bounceType = BOUNCE_TYPE_VOLUME;
     payload.missed = false;
     
-    payload.scatterDirection = MixedSphereHittablePDFGenerate(payload.p, payload.scatterDirection, payload.seed);
-    payload.pdfValue = MixedSphereHittablePDFValue(payload.p, payload.scatterDirection);
+    const uint reachableLights = ReachableLights(payload.p, float3(0, 0, 0));
+    payload.scatterDirection = MixedSphereHittablePDFGenerate(payload.p, payload.scatterDirection, reachableLights, payload.seed);
+    payload.pdfValue = MixedSphereHittablePDFValue(payload.p, payload.scatterDirection, reachableLights);
     
     payload.pdfScatter = SpherePDFValue();
     payload.skipPdf = false;
 }
 
+// Material shading is shared between procedural and triangle geometry, the only difference
+// is where the hit attributes come from.
+
+[shader("closesthit")]
+void ClosestHitProceduralLambertian(
+                            inout Payload payload,
+                            ProceduralPrimitiveAttributes attrib)
+{
+    ShadeLambertian(payload, attrib);
+}
+
+[shader("closesthit")]
+void ClosestHitProceduralMetal(
+                            inout Payload payload,
+                            ProceduralPrimitiveAttributes attrib)
+{
+    ShadeMetal(payload, attrib);
+}
+
+[shader("closesthit")]
+void ClosestHitProceduralDielectric(
+                            inout Payload payload,
+                            ProceduralPrimitiveAttributes attrib)
+{
+    ShadeDielectric(payload, attrib);
+}
+
+[shader("closesthit")]
+void ClosestHitProceduralDiffuseLight(
+                            inout Payload payload,
+                            ProceduralPrimitiveAttributes attrib)
+{
+    ShadeDiffuseLight(payload, attrib);
+}
+
+[shader("closesthit")]
+void ClosestHitProceduralSmoke(
+                            inout Payload payload,
+                            ProceduralPrimitiveAttributes attrib)
+{
+    ShadeSmoke(payload, attrib);
+}
+
+[shader("closesthit")]
+void ClosestHitTriangleLambertian(
+                            inout Payload payload,
+                            BuiltInTriangleIntersectionAttributes attrib)
+{
+    ShadeLambertian(payload, TriangleMeshAttributes());
+}
+
+[shader("closesthit")]
+void ClosestHitTriangleMetal(
+                            inout Payload payload,
+                            BuiltInTriangleIntersectionAttributes attrib)
+{
+    ShadeMetal(payload, TriangleMeshAttributes());
+}
+
+[shader("closesthit")]
+void ClosestHitTriangleDielectric(
+                            inout Payload payload,
+                            BuiltInTriangleIntersectionAttributes attrib)
+{
+    ShadeDielectric(payload, TriangleMeshAttributes());
+}
+
+[shader("closesthit")]
+void ClosestHitTriangleDiffuseLight(
+                            inout Payload payload,
+                            BuiltInTriangleIntersectionAttributes attrib)
+{
+    ShadeDiffuseLight(payload, TriangleMeshAttributes());
+}
+
 [shader("miss")]
 void Miss(inout Payload payload)
 {
     payload.color = g_camera.backgroundColor;
+    payload.p = WorldRayOrigin() + RayTCurrent() * WorldRayDirection();
+    payload.normal = 0;
     payload.missed = true;
 }
\ No newline at end of file
@@ -3,6 +3,8 @@ struct Payload
     float3 color;
     float3 p;
     float3 scatterDirection;
+    float3 normal; // Zero if what the ray hit looks different from elsewhere, see IsHistoryValid.
+    uint bounceType; // BOUNCE_TYPE of the scatter.
     float pdfScatter;
     float pdfValue;
     uint seed;
@@ -25,10 +27,35 @@ enum MATERIAL_TYPE {
     MATERIAL_TYPE_COUNT
 };
 
+// Every type has its own limit of bounces per path, same as in program.h.
+enum BOUNCE_TYPE {
+    BOUNCE_TYPE_DIFFUSE = 0,
+    BOUNCE_TYPE_SPECULAR = 1,
+    BOUNCE_TYPE_TRANSMISSION = 2,
+    BOUNCE_TYPE_VOLUME = 3,
+    BOUNCE_TYPE_COUNT
+};
+
+// Where Lambertian color comes from, same as in program.h. Image textures only exist on the CPU
+// renderer, here they show their average color, which is the material albedo.
+enum TEXTURE_TYPE {
+    TEXTURE_TYPE_NONE = 0,
+    TEXTURE_TYPE_IMAGE = 1,
+    TEXTURE_TYPE_NOISE = 2,
+};
+
+enum LIGHT_FLAG {
+    LIGHT_FLAG_ONE_SIDED = 1,
+    LIGHT_FLAG_BOX_FACE = 2,
+};
+
 enum OBJECT_TYPE {
     OBJECT_TYPE_SPHERE = 0,
     OBJECT_TYPE_QUAD = 1,
     OBJECT_TYPE_VOLUMETRIC_CUBE = 2,
+    OBJECT_TYPE_TRIANGLE_MESH = 3,
+    OBJECT_TYPE_QUAD_GROUP = 4,
+    OBJECT_TYPE_MOVING_SPHERE = 5,
     OBJECT_TYPE_COUNT
 };
 
@@ -40,22 +67,57 @@ struct MaterialData
     float refractionIndex;
     float density;
     MATERIAL_TYPE type;
+    TEXTURE_TYPE textureType;
+    uint textureIndex;
+    float textureScale;
+    float abbeNumber; // Only the CPU reference renderer disperses light.
 };
 
+// Per instance data, material and light geometry live in their own tables.
 struct ObjectData
 {
+    uint materialIndexAndType; // Low 16 bits are the material index, high 16 bits the OBJECT_TYPE.
+
+    // Triangle mesh: offset into the shared mesh index buffer. Quad group: offset into the group quad buffer.
+    uint geometryOffset;
+    // Triangle mesh only, offset into the shared mesh vertex buffer.
+    uint vertexOffset;
+};
+
+// Local root arguments of the hit records, InstanceRecordData in program.h. With a record per instance
+// they hold the instance's object and material, inlined is 0 when records are per hit group instead.
+struct InstanceRecord
+{
+    // ObjectData, spelled out so the material starts on the next constant buffer register.
+    uint materialIndexAndType;
+    uint geometryOffset;
+    uint vertexOffset;
+    uint inlined;
     MaterialData material;
+};
+
+// Geometry of the lights we sample directly, quads and spheres only.
+struct LightData
+{
+    float3 Q; // Quad corner or sphere center.
     OBJECT_TYPE type;
+    float3 U;
+    float radius; // Sphere only.
+    float3 V;
+    uint flags;   // LIGHT_FLAG.
+    // Precomputed when the light is added, see LightMayReach.
+    float3 boundsCenter;
+    float boundsRadius;
+    float3 normal; // Quad only, unit length along U x V.
+    float area;    // Quad only.
+};
 
-    // Quad specific.
+// Quad of a quad group, in the group's object space.
+struct GroupQuad
+{
     float3 Q;
     float3 U;
     float3 V;
-    float3 normal;
-    
-    // Sphere specific.
-    float3 center;
-    float  radius;
 };
 
 struct CameraData
@@ -70,14 +132,65 @@ struct CameraData
     uint samplesPerPixel;
     uint doStratify;
     uint numLights;
+    float shutterOpen;
+    float shutterClose;
+    float3 previousLookfrom;
+    uint temporalReuse;
+    float3 previousLookat;
+    float padding3;
+    uint4 maxBounces; // Indexed by BOUNCE_TYPE.
+    uint spectral;    // CPU reference renderer only.
 };
 
 RaytracingAccelerationStructure g_scene : register(t0);
 StructuredBuffer<ObjectData> g_objects : register(t1);
-StructuredBuffer<uint> g_lights : register(t2);
+StructuredBuffer<LightData> g_lights : register(t2);
+StructuredBuffer<float3> g_meshVertices : register(t3);
+StructuredBuffer<uint> g_meshIndices : register(t4);
+StructuredBuffer<GroupQuad> g_groupQuads : register(t5);
+StructuredBuffer<MaterialData> g_materials : register(t6);
+StructuredBuffer<float3> g_objectMotion : register(t7);
 ConstantBuffer<CameraData> g_camera : register(b0);
+ConstantBuffer<InstanceRecord> l_instance : register(b1); // Hit groups only, from their shader record.
 RWTexture2D<float4> uav : register(u0);
 RWStructuredBuffer<uint> randomSeedBuffer : register(u1);
+RWTexture2D<float> g_rayTime : register(u2);
+// Two slices each, frames alternate between reading one and writing the other.
+RWTexture2DArray<float4> g_historyPosition : register(u3);
+RWTexture2DArray<float4> g_historyNormal : register(u4);
+RWTexture2DArray<float4> g_historyColor : register(u5); // Sample count in w.
+
+// Same limits as in program.h.
+static const float HISTORY_POSITION_TOLERANCE = 0.01;
+static const float HISTORY_NORMAL_TOLERANCE = 0.9;
+static const uint HISTORY_MAX_SAMPLES = 256;
+
+MaterialData InstanceMaterial()
+{
+    if (l_instance.inlined)
+        return l_instance.material;
+    return g_materials[g_objects[NonUniformResourceIndex(InstanceID())].materialIndexAndType & 0xFFFF];
+}
+
+ObjectData InstanceObject()
+{
+    if (l_instance.inlined)
+    {
+        const ObjectData object = { l_instance.materialIndexAndType, l_instance.geometryOffset, l_instance.vertexOffset };
+        return object;
+    }
+    return g_objects[NonUniformResourceIndex(InstanceID())];
+}
+
+float3 MotionObjectRayOrigin()
+{
+    // Intersection shaders can't see the payload, so the ray time comes from the texture the ray generation
+    // shader writes it to. Moving the ray back by the instance motion is the same as moving the instance forward.
+    // Only translation is blurred, a keyframed rotation shows as it is at shutter open.
+    const float time = g_rayTime[DispatchRaysIndex().xy];
+    const float3 motion = mul(g_objectMotion[NonUniformResourceIndex(InstanceID())], (float3x3) WorldToObject4x3());
+    return ObjectRayOrigin() - time * motion;
+}
 
 float PI()
 {
@@ -137,6 +250,63 @@ float3 RandomUnitVector(inout uint seed)
     }
 }
 
+// Same Perlin noise as textures.cpp, with the tables hashed on the fly instead of looked up.
+uint PerlinHash(uint x)
+{
+    x ^= x >> 16;
+    x *= 0x7feb352d;
+    x ^= x >> 15;
+    x *= 0x846ca68b;
+    x ^= x >> 16;
+    return x;
+}
+
+float3 PerlinVector(uint i)
+{
+    const uint h = PerlinHash(i + 1024);
+    return normalize(float3(h & 1023, (h >> 10) & 1023, (h >> 20) & 1023) / 1023.0 * 2 - 1);
+}
+
+float PerlinNoise(float3 p)
+{
+    const float3 f = p - floor(p);
+    const int3 i = int3(floor(p));
+    const float3 s = f * f * (3 - 2 * f);
+
+    float accum = 0;
+    for (int corner = 0; corner < 8; ++corner)
+    {
+        const int3 d = int3(corner >> 2, (corner >> 1) & 1, corner & 1);
+        const uint3 wrapped = uint3((i + d) & 255);
+        const float3 c = PerlinVector((PerlinHash(wrapped.x * 3) ^ PerlinHash(wrapped.y * 3 + 1) ^ PerlinHash(wrapped.z * 3 + 2)) & 255);
+        const float3 weights = d * s + (1 - d) * (1 - s);
+        accum += weights.x * weights.y * weights.z * dot(c, f - d);
+    }
+    return accum;
+}
+
+float Turbulence(float3 p, uint depth = 7)
+{
+    float accum = 0;
+    float weight = 1;
+    for (uint i = 0; i < depth; ++i)
+    {
+        accum += weight * PerlinNoise(p);
+        weight *= 0.5;
+        p *= 2;
+    }
+    return abs(accum);
+}
+
+float3 MaterialAlbedo(MaterialData material, float3 p)
+{
+    if (material.textureType == TEXTURE_TYPE_NOISE)
+    {
+        return 0.5 * (1 + sin(material.textureScale * p.z + 10 * Turbulence(p)));
+    }
+    return material.albedo;
+}
+
 float SpherePDFValue()
 {
     return 1 / (4 * PI());
@@ -186,91 +356,159 @@ float3 RandomToSphere(inout uint seed, float radius, float distanceSquared)
     return float3(x, y, z);
 }
 
-float HittablePDFValue(float3 hittablePdfOrigin, float3 scatterDirection)
+// Lights that can't send anything toward p (surface normal n, zero in volumes) are left out of light
+// sampling in the scenes that cull, see ReachableLights, when picking one and in its PDF alike, so the
+// two still agree. Only bounds tests, the exact ones are left for the lights that pass. Same as
+// LightMayReach on the CPU.
+bool LightMayReach(LightData light, float3 p, float3 n)
 {
-    float accumulatedPDFValue = 0.0f;
+    // Entirely below the tangent plane, no scatter direction gets there.
+    if (dot(light.boundsCenter - p, n) < -light.boundsRadius)
+        return false;
+    // The normal cone of a quad has no spread, it only reaches one side of its plane. Emitters light
+    // their front, box faces are only seen from outside the box. Spheres face every way.
+    const float side = dot(p - light.Q, light.normal);
+    if ((light.flags & LIGHT_FLAG_ONE_SIDED) && side >= 0)
+        return false;
+    if ((light.flags & LIGHT_FLAG_BOX_FACE) && side <= 0)
+        return false;
+    return true;
+}
+
+// Same limits as in core.h.
+static const uint MIN_CULLED_LIGHTS = 4;
+static const uint MAX_CULLED_LIGHTS = 32;
+// Every light of the scene, whichever bits that would take.
+static const uint ALL_LIGHTS = 0xFFFFFFFF;
+
+// Bit per light that may reach p, the one pass of bounds tests a bounce makes. Scenes with too few or
+// too many lights to cull skip the pass and get ALL_LIGHTS, which is what all 32 bits mean anyway.
+uint ReachableLights(float3 p, float3 n)
+{
+    if (g_camera.numLights == 0)
+        return 0;
+    if (g_camera.numLights < MIN_CULLED_LIGHTS || g_camera.numLights > MAX_CULLED_LIGHTS)
+        return ALL_LIGHTS;
+
+    uint reachable = 0;
     for (uint light = 0; light < g_camera.numLights; light++)
     {
-        uint object = g_lights[light];
-        float hittablePDFValue = 0.0f;
+        if (LightMayReach(g_lights[light], p, n))
+            reachable |= 1u << light;
+    }
+    return reachable;
+}
+
+uint ReachableLightCount(uint reachableLights)
+{
+    return (reachableLights == ALL_LIGHTS) ? g_camera.numLights : countbits(reachableLights);
+}
+
+float LightPDFValue(LightData lightData, float3 hittablePdfOrigin, float3 scatterDirection)
+{
+    float hittablePDFValue = 0.0f;
+    
+    // Manual intersection code. I don't see a reason to use the whole acceleration stuff here
+    // because we just check one specific geometry which is just a bunch of vector operations.
+    if (lightData.type == OBJECT_TYPE_QUAD)
+    {
+        float3 lightQuadQ = lightData.Q;
+        float3 lightQuadU = lightData.U;
+        float3 lightQuadV = lightData.V;
+
+        float3 lightQuadNormal = lightData.normal;
+        float  lightQuadArea = lightData.area;
+        float3 lightQuadW = lightQuadNormal / lightQuadArea;
+        float  lightQuadD = dot(lightQuadNormal, lightQuadQ);
+
+        float  lightQuadDenom = dot(lightQuadNormal, scatterDirection);
         
-        // Manual intersection code. I don't see a reason to use the whole acceleration stuff here
-        // because we just check one specific geometry which is just a bunch of vector operations.
-        if (g_objects[object].type == OBJECT_TYPE_QUAD)
+        if (abs(lightQuadDenom) > 1e-8)
         {
-            float3 lightQuadQ = g_objects[object].Q;
-            float3 lightQuadU = g_objects[object].U;
-            float3 lightQuadV = g_objects[object].V;
-    
-            float3 lightQuadNormal = cross(lightQuadU, lightQuadV);
-            float3 lightQuadW = lightQuadNormal / dot(lightQuadNormal, lightQuadNormal);
-            float  lightQuadArea = length(lightQuadNormal);
-            lightQuadNormal = normalize(lightQuadNormal);
-            float  lightQuadD = dot(lightQuadNormal, lightQuadQ);
+            float  lightQuadT = (lightQuadD - dot(lightQuadNormal, hittablePdfOrigin)) / lightQuadDenom;
 
-            float  lightQuadDenom = dot(lightQuadNormal, scatterDirection);
+            float3 intersection = hittablePdfOrigin + lightQuadT * scatterDirection;
+            float3 planarHitptVector = intersection - lightQuadQ;
+            float alpha = dot(lightQuadW, cross(planarHitptVector, lightQuadV));
+            float beta = dot(lightQuadW, cross(lightQuadU, planarHitptVector));
             
-            if (abs(lightQuadDenom) > 1e-8)
+            // Only ahead of the origin, a light behind it can't be where the direction came from.
+            if (lightQuadT > 0 && 0.0f <= alpha && alpha <= 1.0f && 0.0f <= beta && beta <= 1.0f)
             {
-                float  lightQuadT = (lightQuadD - dot(lightQuadNormal, hittablePdfOrigin)) / lightQuadDenom;
-
-                float3 intersection = hittablePdfOrigin + lightQuadT * scatterDirection;
-                float3 planarHitptVector = intersection - lightQuadQ;
-                float alpha = dot(lightQuadW, cross(planarHitptVector, lightQuadV));
-                float beta = dot(lightQuadW, cross(lightQuadU, planarHitptVector));
-                
-                if (0.0f <= alpha && alpha <= 1.0f && 0.0f <= beta && beta <= 1.0f)
-                {
-                    float distanceSquared = lightQuadT * lightQuadT * dot(scatterDirection, scatterDirection);
-                    float cosine = abs(dot(scatterDirection, lightQuadNormal) / length(scatterDirection));
-
-                    hittablePDFValue = distanceSquared / (cosine * lightQuadArea);
-                }
+                float distanceSquared = lightQuadT * lightQuadT * dot(scatterDirection, scatterDirection);
+                float cosine = abs(dot(scatterDirection, lightQuadNormal) / length(scatterDirection));
+
+                hittablePDFValue = distanceSquared / (cosine * lightQuadArea);
             }
         }
-        else if (g_objects[object].type == OBJECT_TYPE_SPHERE)
-        {
-            float3 lightSphereCenter = g_objects[object].center;
-            float  lightSphereRadius = g_objects[object].radius;
+    }
+    else if (lightData.type == OBJECT_TYPE_SPHERE)
+    {
+        float3 lightSphereCenter = lightData.Q;
+        float  lightSphereRadius = lightData.radius;
 
-            float3 oc = lightSphereCenter - hittablePdfOrigin;
-            float  a = dot(scatterDirection, scatterDirection);
-            float  h = dot(scatterDirection, oc);
-            float  distSquared = dot(oc, oc);
-            float  c = distSquared - lightSphereRadius * lightSphereRadius;
+        float3 oc = lightSphereCenter - hittablePdfOrigin;
+        float  a = dot(scatterDirection, scatterDirection);
+        float  h = dot(scatterDirection, oc);
+        float  distSquared = dot(oc, oc);
+        float  c = distSquared - lightSphereRadius * lightSphereRadius;
 
-            float  discriminant = h * h - a * c;
-            if (discriminant >= 0)
-            {
-                float cosThetaMax = sqrt(1 - lightSphereRadius * lightSphereRadius / distSquared);
-                float solidAngle = 2 * PI() * (1 - cosThetaMax);
+        float  discriminant = h * h - a * c;
+        if (discriminant >= 0 && h + sqrt(discriminant) > 0)
+        {
+            float cosThetaMax = sqrt(1 - lightSphereRadius * lightSphereRadius / distSquared);
+            float solidAngle = 2 * PI() * (1 - cosThetaMax);
 
-                hittablePDFValue = 1 / solidAngle;
-            }
+            hittablePDFValue = 1 / solidAngle;
         }
-    
-        accumulatedPDFValue += hittablePDFValue;
     }
 
-    return (g_camera.numLights > 0) ? accumulatedPDFValue / (float) g_camera.numLights : 0;
+    return hittablePDFValue;
 }
 
-float3 HittablePDFGenerate(float3 hittablePdfOrigin, inout uint seed)
+float HittablePDFValue(float3 hittablePdfOrigin, float3 scatterDirection, uint reachableLights)
 {
-    uint light = RandomInt(seed, 0, g_camera.numLights - 1);
-    uint object = g_lights[light];
+    float accumulatedPDFValue = 0.0f;
+    if (reachableLights == ALL_LIGHTS)
+    {
+        for (uint light = 0; light < g_camera.numLights; light++)
+            accumulatedPDFValue += LightPDFValue(g_lights[light], hittablePdfOrigin, scatterDirection);
+    }
+    else
+    {
+        for (uint lights = reachableLights; lights != 0; lights &= lights - 1)
+            accumulatedPDFValue += LightPDFValue(g_lights[firstbitlow(lights)], hittablePdfOrigin, scatterDirection);
+    }
+
+    return (reachableLights != 0) ? accumulatedPDFValue / (float) ReachableLightCount(reachableLights) : 0;
+}
+
+float3 HittablePDFGenerate(float3 hittablePdfOrigin, uint reachableLights, inout uint seed)
+{
+    // The pick-th of the lights that may reach the origin.
+    uint pick = RandomInt(seed, 0, ReachableLightCount(reachableLights) - 1);
+    if (reachableLights != ALL_LIGHTS)
+    {
+        uint lights = reachableLights;
+        for (; pick > 0; pick--)
+        {
+            lights &= lights - 1;
+        }
+        pick = firstbitlow(lights);
+    }
+    const LightData lightData = g_lights[pick];
     
-    if (g_objects[object].type == OBJECT_TYPE_QUAD)
+    if (lightData.type == OBJECT_TYPE_QUAD)
     {
-        float3 lightQuadQ = g_objects[object].Q;
-        float3 lightQuadU = g_objects[object].U;
-        float3 lightQuadV = g_objects[object].V;
+        float3 lightQuadQ = lightData.Q;
+        float3 lightQuadU = lightData.U;
+        float3 lightQuadV = lightData.V;
         return lightQuadQ + (RandomFloat(seed) * lightQuadU) + (RandomFloat(seed) * lightQuadV) - hittablePdfOrigin;
     }
-    else if (g_objects[object].type == OBJECT_TYPE_SPHERE)
+    else if (lightData.type == OBJECT_TYPE_SPHERE)
     {
-        float3 lightSphereCenter = g_objects[object].center;
-        float  lightSphereRadius = g_objects[object].radius;
+        float3 lightSphereCenter = lightData.Q;
+        float  lightSphereRadius = lightData.radius;
         
         float3 oc = lightSphereCenter - hittablePdfOrigin;
         float  distSquared = dot(oc, oc);
@@ -296,17 +534,20 @@ float3 CosinePDFGenerate(float3 normal, inout uint seed)
     return TransformONB(RandomCosineDirection(seed), onbAxes);
 }
 
-float MixedCosineHittablePDFValue(float3 normal, float3 hittablePdfOrigin, float3 scatterDirection)
+// With no light in reach, the cosine (or sphere) half takes over all of the sampling.
+float MixedCosineHittablePDFValue(float3 normal, float3 hittablePdfOrigin, float3 scatterDirection, uint reachableLights)
 {
-    return 0.5f * HittablePDFValue(hittablePdfOrigin, scatterDirection) +
+    if (reachableLights == 0)
+        return CosinePDFValue(normal, scatterDirection);
+    return 0.5f * HittablePDFValue(hittablePdfOrigin, scatterDirection, reachableLights) +
            0.5f * CosinePDFValue(normal, scatterDirection);
 }
 
-float3 MixedCosineHittablePDFGenerate(float3 normal, float3 hittablePdfOrigin, float3 scatterDirection, inout uint seed)
+float3 MixedCosineHittablePDFGenerate(float3 normal, float3 hittablePdfOrigin, float3 scatterDirection, uint reachableLights, inout uint seed)
 {
-    if (RandomFloat(seed) < 0.5f)
+    if (reachableLights != 0 && RandomFloat(seed) < 0.5f)
     {
-        return HittablePDFGenerate(hittablePdfOrigin, seed);
+        return HittablePDFGenerate(hittablePdfOrigin, reachableLights, seed);
     }
     else
     {
@@ -314,17 +555,19 @@ float3 MixedCosineHittablePDFGenerate(float3 normal, float3 hittablePdfOrigin, f
     }
 }
 
-float MixedSphereHittablePDFValue(float3 hittablePdfOrigin, float3 scatterDirection)
+float MixedSphereHittablePDFValue(float3 hittablePdfOrigin, float3 scatterDirection, uint reachableLights)
 {
-    return 0.5f * HittablePDFValue(hittablePdfOrigin, scatterDirection) +
+    if (reachableLights == 0)
+        return SpherePDFValue();
+    return 0.5f * HittablePDFValue(hittablePdfOrigin, scatterDirection, reachableLights) +
            0.5f * SpherePDFValue();
 }
 
-float3 MixedSphereHittablePDFGenerate(float3 hittablePdfOrigin, float3 scatterDirection, inout uint seed)
+float3 MixedSphereHittablePDFGenerate(float3 hittablePdfOrigin, float3 scatterDirection, uint reachableLights, inout uint seed)
 {
-    if (RandomFloat(seed) < 0.5f)
+    if (reachableLights != 0 && RandomFloat(seed) < 0.5f)
     {
-        return HittablePDFGenerate(hittablePdfOrigin, seed);
+        return HittablePDFGenerate(hittablePdfOrigin, reachableLights, seed);
     }
     else
     {
@@ -528,4 +771,109 @@ bool IntersectionProceduralQuad(float3 rayOrigin, float3 rayDirection, out float
     attr.front_face = front_face;
     rayT = t;
     return true;
-}
\ No newline at end of file
+}
+ProceduralPrimitiveAttributes TriangleMeshAttributes()
+{
+    // Triangle hits only give us barycentrics, so fetch the triangle and compute its flat normal here.
+    const ObjectData object = InstanceObject();
+    const uint firstIndex = object.geometryOffset + 3 * PrimitiveIndex();
+    const float3 a = g_meshVertices[object.vertexOffset + g_meshIndices[firstIndex + 0]];
+    const float3 b = g_meshVertices[object.vertexOffset + g_meshIndices[firstIndex + 1]];
+    const float3 c = g_meshVertices[object.vertexOffset + g_meshIndices[firstIndex + 2]];
+
+    // Normals need the inverse transpose, otherwise non-uniform scaling would skew them.
+    float3 normal = normalize(mul((float3x3) WorldToObject4x3(), cross(b - a, c - a)));
+    bool front_face = dot(WorldRayDirection(), normal) < 0;
+
+    ProceduralPrimitiveAttributes attr;
+    attr.normal = front_face ? normal : -normal;
+    attr.front_face = front_face;
+    return attr;
+}
+
+bool IntersectionProceduralGroupQuad(float3 rayOrigin, float3 rayDirection, GroupQuad quad, out float rayT, out ProceduralPrimitiveAttributes attr)
+{
+    // Unlike single quads, group quads aren't baked into the instance transform, so do a proper
+    // ray/parallelogram test in object space, the same way as the book does it.
+    float3 n = cross(quad.U, quad.V);
+    float denom = dot(n, rayDirection);
+    if (abs(denom) < 1e-8)
+        return false;
+
+    float t = dot(n, quad.Q - rayOrigin) / denom;
+    if (t < RayTMin() || t > RayTCurrent())
+        return false;
+
+    float3 w = n / dot(n, n);
+    float3 planarHitptVector = rayOrigin + t * rayDirection - quad.Q;
+    float alpha = dot(w, cross(planarHitptVector, quad.V));
+    float beta = dot(w, cross(quad.U, planarHitptVector));
+    if (alpha < 0 || alpha > 1 || beta < 0 || beta > 1)
+        return false;
+
+    // Single quads face against U x V, keep it the same here.
+    float3 normal = -n;
+    bool front_face = dot(rayDirection, normal) < 0;
+    normal = normalize(mul((float3x3) WorldToObject4x3(), normal));
+
+    attr.normal = front_face ? normal : -normal;
+    attr.front_face = front_face;
+    rayT = t;
+    return true;
+}
+
+// History functions mirror reprojection.cpp, where they are explained.
+bool ReprojectToPixel(float3 lookfrom, float3 lookat, float vfov, float2 size, float3 position, out int2 pixel)
+{
+    const float3 w = normalize(lookfrom - lookat);
+    const float3 u = normalize(cross(float3(0, 1, 0), w));
+    const float3 v = cross(w, u);
+
+    pixel = int2(-1, -1);
+    const float3 offset = position - lookfrom;
+    const float depth = -dot(offset, w);
+    if (depth <= 0)
+        return false;
+
+    const float viewportHeight = 2 * tan(DegreesToRadians(vfov) / 2);
+    const float viewportWidth = viewportHeight * (size.x / size.y);
+    const float x = (-dot(offset, u) / depth / viewportWidth + 0.5) * size.x - 0.5;
+    const float y = (-dot(offset, v) / depth / viewportHeight + 0.5) * size.y - 0.5;
+
+    pixel = int2(floor(x + 0.5), floor(y + 0.5));
+    return all(pixel >= 0) && all(pixel < int2(size));
+}
+
+bool IsHistoryValid(float3 position, float3 normal, float3 historyPosition, float3 historyNormal, float3 lookfrom)
+{
+    if (all(normal == 0) || all(historyNormal == 0))
+        return false;
+
+    return length(position - historyPosition) <= HISTORY_POSITION_TOLERANCE * length(position - lookfrom) &&
+           dot(normal, historyNormal) >= HISTORY_NORMAL_TOLERANCE;
+}
+
+float4 AccumulateHistory(float4 history, float3 color, uint samples)
+{
+    const float historySamples = min(history.w, float(HISTORY_MAX_SAMPLES - min(samples, HISTORY_MAX_SAMPLES)));
+    const float total = historySamples + samples;
+    return float4((history.rgb * historySamples + color * samples) / total, total);
+}
+
+// Radiance history of the surface at position as the previous frame saw it, zero samples if it didn't.
+float4 ReprojectHistory(float3 position, float3 normal, uint2 idx, float2 size, uint previousSlice)
+{
+    // With a still camera every pixel sees what it saw before, whatever it hit.
+    if (all(g_camera.previousLookfrom == g_camera.lookfrom) && all(g_camera.previousLookat == g_camera.lookat))
+        return g_historyColor[uint3(idx, previousSlice)];
+
+    int2 pixel;
+    if (!ReprojectToPixel(g_camera.previousLookfrom, g_camera.previousLookat, g_camera.vfov, size, position, pixel))
+        return 0;
+
+    const uint3 historyIdx = uint3(pixel, previousSlice);
+    if (!IsHistoryValid(position, normal, g_historyPosition[historyIdx].xyz, g_historyNormal[historyIdx].xyz, g_camera.lookfrom))
+        return 0;
+
+    return g_historyColor[historyIdx];
+}
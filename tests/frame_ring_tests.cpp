@@ -0,0 +1,92 @@
+#include "test.h"
+#include "frame_ring.h"
+
+namespace
+{
+    struct TrackedFrame
+    {
+        uint64_t lastSignal; // Of the last frame that used the slot.
+    };
+
+    struct PacingResult
+    {
+        double millisecondsPerFrame;
+        uint64_t stalls;
+    };
+
+    // Runs frameCount frames of fixed CPU and GPU time through a ring, checking on the way that no
+    // slot is handed out while the GPU may still use it.
+    template <size_t FrameCount>
+    PacingResult runFrames(double cpuMilliseconds, double gpuMilliseconds, UINT frameCount)
+    {
+        FrameRing<SimulatedFrameQueue, TrackedFrame, FrameCount> ring;
+        SimulatedFrameQueue& queue = ring.GetQueue();
+        for (UINT i = 0; i < frameCount; ++i)
+        {
+            TrackedFrame& frame = ring.BeginFrame();
+            CHECK(queue.CompletedValue() >= frame.lastSignal);
+            CHECK(&frame == &ring.Frames()[i % FrameCount]);
+
+            queue.now += cpuMilliseconds;
+            queue.Submit(gpuMilliseconds);
+            ring.EndFrame();
+            frame.lastSignal = queue.signalTimes.size();
+        }
+        CHECK(ring.FramesSubmitted() == frameCount);
+        ring.WaitIdle();
+        CHECK(queue.CompletedValue() == queue.signalTimes.size());
+        return { queue.now / frameCount, ring.Stalls() };
+    }
+}
+
+TEST(frame_ring, never_hands_out_a_busy_frame)
+{
+    for (auto [cpu, gpu] : { std::pair{ 6.0, 10.0 }, std::pair{ 10.0, 6.0 }, std::pair{ 8.0, 8.0 }, std::pair{ 1.0, 30.0 } })
+    {
+        runFrames<1>(cpu, gpu, 200);
+        runFrames<2>(cpu, gpu, 200);
+        runFrames<3>(cpu, gpu, 200);
+    }
+}
+
+TEST(frame_ring, one_in_flight_waits_for_every_frame)
+{
+    // Waiting after every frame, so CPU and GPU time add up.
+    const PacingResult result = runFrames<1>(6, 10, 100);
+    CHECK(result.stalls == 99);
+    CHECK(std::abs(result.millisecondsPerFrame - 16) < 0.2);
+}
+
+TEST(frame_ring, two_in_flight_overlap_cpu_and_gpu)
+{
+    // GPU bound: frames come at the GPU's pace, the CPU waits for slots now and then.
+    const PacingResult gpuBound = runFrames<2>(6, 10, 100);
+    CHECK(std::abs(gpuBound.millisecondsPerFrame - 10) < 0.2);
+
+    // CPU bound: the GPU is always done with a slot before it comes around again.
+    const PacingResult cpuBound = runFrames<2>(10, 6, 100);
+    CHECK(cpuBound.stalls == 0);
+    CHECK(std::abs(cpuBound.millisecondsPerFrame - 10) < 0.2);
+}
+
+TEST(frame_ring, wait_idle_frees_every_slot)
+{
+    FrameRing<SimulatedFrameQueue, TrackedFrame, 3> ring;
+    SimulatedFrameQueue& queue = ring.GetQueue();
+    for (UINT i = 0; i < 3; ++i)
+    {
+        ring.BeginFrame();
+        queue.Submit(50);
+        ring.EndFrame();
+    }
+    ring.WaitIdle();
+    CHECK(queue.now == 150);
+
+    // Nothing pending anymore, so the next round doesn't wait.
+    for (UINT i = 0; i < 3; ++i)
+    {
+        ring.BeginFrame();
+        ring.EndFrame();
+    }
+    CHECK(ring.Stalls() == 0);
+}
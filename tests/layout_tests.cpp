@@ -0,0 +1,166 @@
+#include "test.h"
+#include <fstream>
+#include <map>
+#include <sstream>
+
+// The shaders read the scene buffers with the structs in shaders_helpers.hlsli, so the C++ ones in core.h
+// have to match them member by member. These lay out the HLSL structs the way the shader compiler does
+// and compare every member against offsetof.
+
+namespace
+{
+    struct Member
+    {
+        UINT offset;
+        UINT size;
+    };
+
+    struct Layout
+    {
+        std::map<std::string, Member> members;
+        UINT size = 0;
+    };
+
+    UINT hlslTypeSize(const std::string& type)
+    {
+        // Enums are uints, every one of them is a type of ours ending in _TYPE.
+        static const std::map<std::string, UINT> sizes = {
+            { "float", 4 }, { "float2", 8 }, { "float3", 12 }, { "float4", 16 },
+            { "uint", 4 }, { "uint2", 8 }, { "uint3", 12 }, { "uint4", 16 },
+            { "int", 4 }, { "bool", 4 },
+        };
+        auto it = sizes.find(type);
+        if (it != sizes.end())
+        {
+            return it->second;
+        }
+        if (type.size() > 5 && type.ends_with("_TYPE"))
+        {
+            return 4;
+        }
+        throw std::runtime_error("Unknown HLSL type " + type);
+    }
+
+    // Structured buffers pack members tightly at 4 bytes, constant buffers also keep a vector from
+    // straddling a 16 byte register.
+    Layout hlslLayout(const std::string& structName, bool constantBuffer)
+    {
+        std::ifstream file(SHADERS_HELPERS_PATH);
+        if (!file)
+        {
+            throw std::runtime_error("Can't open " SHADERS_HELPERS_PATH);
+        }
+
+        Layout layout;
+        std::string line;
+        bool inside = false;
+        while (std::getline(file, line))
+        {
+            line = line.substr(0, line.find("//"));
+            std::istringstream words(line);
+            std::string type, name;
+            if (!(words >> type))
+            {
+                continue;
+            }
+            if (!inside)
+            {
+                inside = type == "struct" && words >> name && name == structName;
+                continue;
+            }
+            if (type == "{")
+            {
+                continue;
+            }
+            if (type.starts_with("}"))
+            {
+                return layout;
+            }
+            if (!(words >> name) || !name.ends_with(";"))
+            {
+                throw std::runtime_error("Can't parse " + structName + " member: " + line);
+            }
+            name.pop_back();
+
+            UINT size = hlslTypeSize(type);
+            if (constantBuffer && layout.size / 16 != (layout.size + size - 1) / 16)
+            {
+                layout.size = (layout.size + 15) & ~15u;
+            }
+            layout.members[name] = { layout.size, size };
+            layout.size += size;
+        }
+        throw std::runtime_error("No struct " + structName + " in " SHADERS_HELPERS_PATH);
+    }
+
+    void checkLayout(const Layout& hlsl, const std::map<std::string, Member>& cpp)
+    {
+        CHECK(hlsl.members.size() == cpp.size());
+        for (const auto& [name, member] : cpp)
+        {
+            auto it = hlsl.members.find(name);
+            CHECK(it != hlsl.members.end());
+            CHECK(it->second.offset == member.offset);
+            CHECK(it->second.size == member.size);
+        }
+    }
+}
+
+#define CPP_MEMBER(Struct, member) { #member, { (UINT)offsetof(Struct, member), (UINT)sizeof(Struct::member) } }
+
+TEST(layout, material_data)
+{
+    Layout hlsl = hlslLayout("MaterialData", false);
+    checkLayout(hlsl, {
+        CPP_MEMBER(MaterialData, albedo), CPP_MEMBER(MaterialData, fuzz), CPP_MEMBER(MaterialData, refractionIndex),
+        CPP_MEMBER(MaterialData, density), CPP_MEMBER(MaterialData, type), CPP_MEMBER(MaterialData, textureType),
+        CPP_MEMBER(MaterialData, textureIndex), CPP_MEMBER(MaterialData, textureScale), CPP_MEMBER(MaterialData, abbeNumber),
+    });
+    CHECK(hlsl.size == sizeof(MaterialData));
+}
+
+TEST(layout, object_data)
+{
+    Layout hlsl = hlslLayout("ObjectData", false);
+    // The shaders read the 16 bit material index and type as one uint, material index in the low half.
+    static_assert(offsetof(ObjectData, materialIndex) == 0 && offsetof(ObjectData, type) == 2);
+    checkLayout(hlsl, {
+        { "materialIndexAndType", { 0, 4 } },
+        CPP_MEMBER(ObjectData, geometryOffset), CPP_MEMBER(ObjectData, vertexOffset),
+    });
+    CHECK(hlsl.size == sizeof(ObjectData));
+}
+
+TEST(layout, light_data)
+{
+    Layout hlsl = hlslLayout("LightData", false);
+    checkLayout(hlsl, {
+        CPP_MEMBER(LightData, Q), CPP_MEMBER(LightData, type), CPP_MEMBER(LightData, U), CPP_MEMBER(LightData, radius),
+        CPP_MEMBER(LightData, V), CPP_MEMBER(LightData, flags), CPP_MEMBER(LightData, boundsCenter),
+        CPP_MEMBER(LightData, boundsRadius), CPP_MEMBER(LightData, normal), CPP_MEMBER(LightData, area),
+    });
+    CHECK(hlsl.size == sizeof(LightData));
+}
+
+TEST(layout, group_quad)
+{
+    Layout hlsl = hlslLayout("GroupQuad", false);
+    checkLayout(hlsl, { CPP_MEMBER(GroupQuad, Q), CPP_MEMBER(GroupQuad, U), CPP_MEMBER(GroupQuad, V) });
+    CHECK(hlsl.size == sizeof(GroupQuad));
+}
+
+TEST(layout, camera_data)
+{
+    // A constant buffer, the C++ side spells out the padding the shader compiler inserts, except padding3
+    // which the HLSL struct names too.
+    Layout hlsl = hlslLayout("CameraData", true);
+    checkLayout(hlsl, {
+        CPP_MEMBER(CameraData, lookfrom), CPP_MEMBER(CameraData, lookat), CPP_MEMBER(CameraData, backgroundColor),
+        CPP_MEMBER(CameraData, vfov), CPP_MEMBER(CameraData, focusDist), CPP_MEMBER(CameraData, defocusAngle),
+        CPP_MEMBER(CameraData, frameIndex), CPP_MEMBER(CameraData, samplesPerPixel), CPP_MEMBER(CameraData, doStratify),
+        CPP_MEMBER(CameraData, numLights), CPP_MEMBER(CameraData, shutterOpen), CPP_MEMBER(CameraData, shutterClose),
+        CPP_MEMBER(CameraData, previousLookfrom), CPP_MEMBER(CameraData, temporalReuse), CPP_MEMBER(CameraData, previousLookat),
+        CPP_MEMBER(CameraData, padding3), CPP_MEMBER(CameraData, maxBounces), CPP_MEMBER(CameraData, spectral),
+    });
+    CHECK(hlsl.size == sizeof(CameraData));
+}
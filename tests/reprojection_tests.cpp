@@ -0,0 +1,108 @@
+#include "test.h"
+
+using namespace DirectX;
+
+namespace
+{
+    constexpr UINT WIDTH = 320;
+    constexpr UINT HEIGHT = 180;
+    constexpr XMFLOAT3 LOOKFROM = { 0, 0, 0 };
+    constexpr XMFLOAT3 LOOKAT = { 0, 0, -1 };
+    constexpr float VFOV = 40;
+}
+
+TEST(reprojection, still_camera_keeps_first_hits_in_their_pixel)
+{
+    // Every first hit of the Cornell box has to land back in its own pixel, or right next to it when
+    // the jitter put it on the edge.
+    SetupScene(8);
+    MotionBVH bvh;
+    BuildMotionBVH(bvh);
+    ReferenceFrame referenceFrame;
+    CaptureReferenceFrame(referenceFrame, bvh);
+    const CameraData& camera = referenceFrame.camera;
+
+    std::vector<XMFLOAT3> positions, normals;
+    TraceReferenceFirstHits(referenceFrame, WIDTH, HEIGHT, positions, normals);
+    UINT hits = 0;
+    for (UINT i = 0; i < WIDTH * HEIGHT; ++i)
+    {
+        if (normals[i].x == 0 && normals[i].y == 0 && normals[i].z == 0)
+            continue;
+        ++hits;
+        XMINT2 pixel;
+        CHECK(ReprojectToPixel(camera.lookfrom, camera.lookat, camera.vfov, WIDTH, HEIGHT, positions[i], pixel));
+        CHECK(std::abs(pixel.x - (int)(i % WIDTH)) <= 1 && std::abs(pixel.y - (int)(i / WIDTH)) <= 1);
+    }
+    CHECK(hits > WIDTH * HEIGHT / 2);
+}
+
+TEST(reprojection, projects_into_the_view_only)
+{
+    XMINT2 center, left, right;
+    CHECK(ReprojectToPixel(LOOKFROM, LOOKAT, VFOV, WIDTH, HEIGHT, { 0, 0, -10 }, center));
+    CHECK(std::abs(center.x - (int)WIDTH / 2) <= 1 && std::abs(center.y - (int)HEIGHT / 2) <= 1);
+
+    // Mirrored points land on mirrored pixels.
+    CHECK(ReprojectToPixel(LOOKFROM, LOOKAT, VFOV, WIDTH, HEIGHT, { -1, 0, -10 }, left));
+    CHECK(ReprojectToPixel(LOOKFROM, LOOKAT, VFOV, WIDTH, HEIGHT, { 1, 0, -10 }, right));
+    CHECK(left.x != right.x && left.y == right.y);
+    CHECK(std::abs(left.x + right.x - 2 * center.x) <= 1);
+
+    XMINT2 pixel;
+    CHECK(!ReprojectToPixel(LOOKFROM, LOOKAT, VFOV, WIDTH, HEIGHT, { 0, 0, 10 }, pixel));   // Behind the camera.
+    CHECK(!ReprojectToPixel(LOOKFROM, LOOKAT, VFOV, WIDTH, HEIGHT, { 0, 0, 0 }, pixel));    // On it.
+    CHECK(!ReprojectToPixel(LOOKFROM, LOOKAT, VFOV, WIDTH, HEIGHT, { 100, 0, -10 }, pixel)); // Off to the side.
+    CHECK(!ReprojectToPixel(LOOKFROM, LOOKAT, VFOV, WIDTH, HEIGHT, { 0, 100, -10 }, pixel));
+}
+
+TEST(reprojection, strafing_camera_shifts_the_pixel)
+{
+    // Moving camera and target sideways together moves what's in front the other way on screen.
+    XMINT2 before, after;
+    CHECK(ReprojectToPixel(LOOKFROM, LOOKAT, VFOV, WIDTH, HEIGHT, { 0, 0, -10 }, before));
+    CHECK(ReprojectToPixel({ 1, 0, 0 }, { 1, 0, -1 }, VFOV, WIDTH, HEIGHT, { 0, 0, -10 }, after));
+    XMINT2 moved;
+    CHECK(ReprojectToPixel(LOOKFROM, LOOKAT, VFOV, WIDTH, HEIGHT, { -1, 0, -10 }, moved));
+    CHECK(after.x == moved.x && after.y == before.y);
+}
+
+TEST(reprojection, history_needs_the_same_surface)
+{
+    const XMFLOAT3 position = { 0, 0, -10 };
+    const XMFLOAT3 normal = { 0, 0, 1 };
+    CHECK(IsHistoryValid(position, normal, position, normal, LOOKFROM));
+
+    // Within the position tolerance, which grows with the distance.
+    const float slack = HISTORY_POSITION_TOLERANCE * 10 * 0.5f;
+    CHECK(IsHistoryValid(position, normal, { slack, 0, -10 }, normal, LOOKFROM));
+    CHECK(!IsHistoryValid(position, normal, { 4 * slack, 0, -10 }, normal, LOOKFROM));
+    CHECK(IsHistoryValid({ 0, 0, -40 }, normal, { 4 * slack, 0, -40 }, normal, LOOKFROM));
+
+    // Surfaces facing elsewhere, and view dependent first hits on either side.
+    CHECK(!IsHistoryValid(position, normal, position, { 0, 1, 0 }, LOOKFROM));
+    CHECK(!IsHistoryValid(position, normal, position, { 0, 0, -1 }, LOOKFROM));
+    CHECK(!IsHistoryValid(position, { 0, 0, 0 }, position, normal, LOOKFROM));
+    CHECK(!IsHistoryValid(position, normal, position, { 0, 0, 0 }, LOOKFROM));
+}
+
+TEST(reprojection, history_is_a_capped_running_average)
+{
+    XMFLOAT4 history = AccumulateHistory({ 0, 0, 0, 0 }, { 1, 2, 3 }, 4);
+    CHECK(history.x == 1 && history.y == 2 && history.z == 3 && history.w == 4);
+
+    history = AccumulateHistory(history, { 3, 2, 1 }, 4);
+    CHECK(history.x == 2 && history.y == 2 && history.z == 2 && history.w == 8);
+
+    // Past the cap the oldest samples make room for new ones.
+    for (UINT i = 0; i < 200; ++i)
+    {
+        history = AccumulateHistory(history, { 0, 0, 0 }, 4);
+    }
+    CHECK(history.w == HISTORY_MAX_SAMPLES);
+    CHECK(history.x > 0 && history.x < 2);
+    const float before = history.x;
+    history = AccumulateHistory(history, { 10, 10, 10 }, 4);
+    CHECK(history.w == HISTORY_MAX_SAMPLES);
+    CHECK(std::abs(history.x - (before * (HISTORY_MAX_SAMPLES - 4) + 10 * 4) / HISTORY_MAX_SAMPLES) < 1e-5f);
+}
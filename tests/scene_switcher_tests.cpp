@@ -0,0 +1,143 @@
+#include "test.h"
+#include "scene_switcher.h"
+
+namespace
+{
+    struct FakeScene
+    {
+        int index = -1;
+    };
+
+    // Holds loads until opened, so a test can make requests while one is in progress.
+    class Gate
+    {
+    public:
+        void wait()
+        {
+            std::unique_lock lock(mutex);
+            ++waiting;
+            changed.notify_all();
+            changed.wait(lock, [this]() { return open; });
+        }
+
+        void waitForLoads(UINT count)
+        {
+            std::unique_lock lock(mutex);
+            changed.wait(lock, [&]() { return waiting >= count; });
+        }
+
+        void release()
+        {
+            std::lock_guard lock(mutex);
+            open = true;
+            changed.notify_all();
+        }
+
+    private:
+        std::mutex mutex;
+        std::condition_variable changed;
+        UINT waiting = 0;
+        bool open = false;
+    };
+}
+
+TEST(scene_switcher, swaps_in_a_loaded_scene)
+{
+    SceneSwitcher<FakeScene> switcher([](unsigned index, FakeScene& back) { back.index = (int)index; });
+    FakeScene front;
+    CHECK(!switcher.Loading());
+    CHECK(!switcher.TrySwap([&](FakeScene& back) { std::swap(front, back); }));
+
+    switcher.Request(3);
+    switcher.WaitIdle();
+    CHECK(switcher.Loading()); // Loaded, but not swapped in yet.
+    CHECK(switcher.TrySwap([&](FakeScene& back) { std::swap(front, back); }));
+    CHECK(front.index == 3);
+    CHECK(!switcher.Loading());
+    CHECK(!switcher.TrySwap([&](FakeScene& back) { std::swap(front, back); }));
+
+    // The back scene is the old front one now, the next load goes there.
+    switcher.Request(5);
+    switcher.WaitIdle();
+    CHECK(switcher.TrySwap([&](FakeScene& back) {
+        CHECK(back.index == 5);
+        std::swap(front, back);
+    }));
+    CHECK(front.index == 5 && switcher.Swaps() == 2 && switcher.Superseded() == 0);
+}
+
+TEST(scene_switcher, latest_request_wins)
+{
+    Gate gate;
+    std::vector<unsigned> loads;
+    SceneSwitcher<FakeScene> switcher([&](unsigned index, FakeScene& back) {
+        loads.push_back(index);
+        if (index == 1)
+            gate.wait();
+        back.index = (int)index;
+    });
+
+    // 1 is loading while 2 and 3 come in, so 2 never starts and 1 gets thrown away.
+    switcher.Request(1);
+    gate.waitForLoads(1);
+    switcher.Request(2);
+    switcher.Request(3);
+    gate.release();
+    switcher.WaitIdle();
+
+    FakeScene front;
+    CHECK(switcher.TrySwap([&](FakeScene& back) { std::swap(front, back); }));
+    CHECK(front.index == 3);
+    CHECK((loads == std::vector<unsigned>{ 1, 3 }));
+    CHECK(switcher.Superseded() == 1 && switcher.Swaps() == 1);
+
+    // A scene loaded but not swapped in yet is superseded by the next request too.
+    switcher.Request(4);
+    switcher.WaitIdle();
+    switcher.Request(5);
+    switcher.WaitIdle();
+    CHECK(switcher.TrySwap([&](FakeScene& back) { std::swap(front, back); }));
+    CHECK(front.index == 5 && switcher.Superseded() == 2);
+}
+
+TEST(scene_switcher, load_errors_reach_the_caller)
+{
+    SceneSwitcher<FakeScene> switcher([](unsigned index, FakeScene& back) {
+        if (index == 0)
+            throw std::runtime_error("Broken scene");
+        back.index = (int)index;
+    });
+
+    switcher.Request(0);
+    switcher.WaitIdle();
+    bool thrown = false;
+    try
+    {
+        switcher.TrySwap([](FakeScene&) {});
+    }
+    catch (const std::runtime_error&)
+    {
+        thrown = true;
+    }
+    CHECK(thrown);
+
+    // Only once, and the switcher keeps going.
+    CHECK(!switcher.TrySwap([](FakeScene&) {}));
+    switcher.Request(2);
+    switcher.WaitIdle();
+    FakeScene front;
+    CHECK(switcher.TrySwap([&](FakeScene& back) { std::swap(front, back); }));
+    CHECK(front.index == 2);
+}
+
+TEST(scene_switcher, builds_real_scenes)
+{
+    // Host scenes like the frontend loads them, the front scene being the globals.
+    SceneSwitcher<SceneState> switcher([](unsigned scene, SceneState& back) { BuildScene(scene, back); });
+    switcher.Request(15);
+    switcher.Request(18);
+    switcher.WaitIdle();
+    CHECK(switcher.TrySwap([](SceneState& back) { SwapSceneState(back); }));
+    CHECK(getNumInstances() == 7);
+    CHECK(!switcher.Loading());
+}
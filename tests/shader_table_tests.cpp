@@ -0,0 +1,167 @@
+#include "test.h"
+#include "shader_table.h"
+#include <array>
+
+namespace
+{
+    // Fake identifiers, one byte pattern each, so a record can be traced back to what it was written with.
+    std::array<std::byte, SHADER_IDENTIFIER_BYTES> identifier(UINT id)
+    {
+        std::array<std::byte, SHADER_IDENTIFIER_BYTES> bytes;
+        bytes.fill(std::byte(id + 1));
+        return bytes;
+    }
+
+    template <typename Func>
+    bool throws(Func&& func)
+    {
+        try
+        {
+            func();
+        }
+        catch (const std::logic_error&)
+        {
+            return true;
+        }
+        return false;
+    }
+}
+
+TEST(shader_table, layout_follows_alignment_and_stride_rules)
+{
+    for (UINT missCount : { 0u, 1u, 2u, 3u, 7u })
+    {
+        for (UINT hitCount : { 0u, 1u, 23u, 1000u })
+        {
+            for (uint64_t localBytes : std::initializer_list<uint64_t>{ 0, 1, 4, 31, 32, 60, 100, MAX_SHADER_RECORD_STRIDE - SHADER_IDENTIFIER_BYTES })
+            {
+                const ShaderTableLayout layout = MakeShaderTableLayout(missCount, hitCount, localBytes);
+                for (const ShaderTableRange* range : { &layout.rayGeneration, &layout.miss, &layout.hitGroups })
+                {
+                    CHECK(range->offset % SHADER_TABLE_ALIGNMENT == 0);
+                    CHECK(range->stride % SHADER_RECORD_ALIGNMENT == 0);
+                    CHECK(range->stride >= SHADER_IDENTIFIER_BYTES && range->stride <= MAX_SHADER_RECORD_STRIDE);
+                    CHECK(range->size == range->count * range->stride);
+                }
+
+                // Tables come in order and don't overlap, hit records fit identifier and local arguments.
+                CHECK(layout.rayGeneration.offset == 0 && layout.rayGeneration.count == 1);
+                CHECK(layout.miss.offset >= layout.rayGeneration.offset + layout.rayGeneration.size);
+                CHECK(layout.hitGroups.offset >= layout.miss.offset + layout.miss.size);
+                CHECK(layout.hitGroups.offset - (layout.miss.offset + layout.miss.size) < SHADER_TABLE_ALIGNMENT);
+                CHECK(layout.miss.count == missCount && layout.hitGroups.count == hitCount);
+                CHECK(layout.hitGroups.stride >= SHADER_IDENTIFIER_BYTES + localBytes);
+                CHECK(layout.hitGroups.stride - (SHADER_IDENTIFIER_BYTES + localBytes) < SHADER_RECORD_ALIGNMENT);
+                CHECK(layout.size == layout.hitGroups.offset + layout.hitGroups.size);
+            }
+        }
+    }
+
+    // Local arguments that don't fit the largest record DXR allows.
+    CHECK(throws([]() { MakeShaderTableLayout(1, 1, MAX_SHADER_RECORD_STRIDE - SHADER_IDENTIFIER_BYTES + 1); }));
+}
+
+TEST(shader_table, writer_fills_and_pads_records)
+{
+    struct Local
+    {
+        UINT object;
+        float values[7];
+    };
+    constexpr UINT HIT_COUNT = 37;
+    const ShaderTableLayout layout = MakeShaderTableLayout(2, HIT_COUNT, sizeof(Local));
+    std::vector<std::byte> table(layout.size, std::byte{ 0xCD });
+    ShaderTableWriter writer(table.data(), layout);
+
+    writer.RayGeneration(identifier(100).data());
+    writer.Miss(0, identifier(101).data());
+    writer.Miss(1, identifier(102).data());
+    // Half of them with shorter local data than the layout's, the rest of the record is zeroed.
+    for (UINT i = 0; i < HIT_COUNT; ++i)
+    {
+        const Local local = { i, { 1, 2, 3, 4, 5, 6, (float)i } };
+        writer.HitGroup(i, identifier(i).data(), &local, (i % 2) ? sizeof(local) : sizeof(UINT));
+    }
+
+    auto isZero = [](const std::byte* begin, const std::byte* end) {
+        return std::all_of(begin, end, [](std::byte b) { return b == std::byte{ 0 }; });
+    };
+    const std::byte* rayGeneration = table.data() + layout.rayGeneration.offset;
+    CHECK(memcmp(rayGeneration, identifier(100).data(), SHADER_IDENTIFIER_BYTES) == 0);
+    CHECK(isZero(rayGeneration + SHADER_IDENTIFIER_BYTES, rayGeneration + layout.rayGeneration.stride));
+    CHECK(memcmp(table.data() + layout.miss.offset + layout.miss.stride, identifier(102).data(), SHADER_IDENTIFIER_BYTES) == 0);
+
+    for (UINT i = 0; i < HIT_COUNT; ++i)
+    {
+        const std::byte* record = table.data() + layout.hitGroups.offset + i * layout.hitGroups.stride;
+        CHECK(memcmp(record, identifier(i).data(), SHADER_IDENTIFIER_BYTES) == 0);
+        Local written;
+        memcpy(&written, record + SHADER_IDENTIFIER_BYTES, sizeof(written));
+        CHECK(written.object == i);
+        CHECK((i % 2) ? written.values[6] == (float)i : written.values[6] == 0);
+        CHECK(isZero(record + SHADER_IDENTIFIER_BYTES + sizeof(Local), record + layout.hitGroups.stride));
+    }
+}
+
+TEST(shader_table, writer_rejects_records_outside_the_layout)
+{
+    const ShaderTableLayout layout = MakeShaderTableLayout(1, 4, 8);
+    std::vector<std::byte> table(layout.size);
+    ShaderTableWriter writer(table.data(), layout);
+    const auto id = identifier(0);
+    const std::byte local[16] = {};
+
+    CHECK(throws([&]() { writer.HitGroup(4, id.data()); }));
+    CHECK(throws([&]() { writer.Miss(1, id.data()); }));
+    // Local data longer than the record has room for.
+    CHECK(throws([&]() { writer.HitGroup(0, id.data(), local, layout.hitGroups.stride - SHADER_IDENTIFIER_BYTES + 1); }));
+    CHECK(!throws([&]() { writer.Miss(0, id.data()); }));
+}
+
+TEST(shader_table, records_of_real_scenes_hold_their_instance)
+{
+    // Per instance records like InitShaderTable writes them, object and material inlined, from
+    // several threads at once.
+    struct InstanceRecord
+    {
+        ObjectData object;
+        UINT inlined;
+        MaterialData material;
+    };
+    constexpr UINT HIT_GROUPS = 23;
+    constexpr UINT RECORDS_PER_CHUNK = 256;
+
+    SceneState scene;
+    ThreadPool pool(4);
+    for (UINT index : { 0u, 4u, 15u })
+    {
+        BuildScene(index, scene);
+        const UINT count = (UINT)scene.proceduralInstances.size();
+        const ShaderTableLayout layout = MakeShaderTableLayout(1, count, sizeof(InstanceRecord));
+        std::vector<std::byte> table(layout.size, std::byte{ 0xCD });
+        ShaderTableWriter writer(table.data(), layout);
+
+        pool.ParallelFor((count + RECORDS_PER_CHUNK - 1) / RECORDS_PER_CHUNK, [&](UINT chunk) {
+            for (UINT id = chunk * RECORDS_PER_CHUNK; id < std::min(count, (chunk + 1) * RECORDS_PER_CHUNK); ++id)
+            {
+                const ProceduralInstance& instance = scene.proceduralInstances[id];
+                InstanceRecord record = { .object = scene.objectList[instance.instanceID], .inlined = 1 };
+                record.material = scene.materialList[record.object.materialIndex];
+                writer.HitGroup(id, identifier(instance.hitGroupIndex).data(), &record, sizeof(record));
+            }
+        });
+
+        for (UINT id = 0; id < count; ++id)
+        {
+            const std::byte* record = table.data() + layout.hitGroups.offset + id * layout.hitGroups.stride;
+            const ProceduralInstance& instance = scene.proceduralInstances[id];
+            CHECK(instance.hitGroupIndex < HIT_GROUPS);
+            CHECK(memcmp(record, identifier(instance.hitGroupIndex).data(), SHADER_IDENTIFIER_BYTES) == 0);
+            InstanceRecord written;
+            memcpy(&written, record + SHADER_IDENTIFIER_BYTES, sizeof(written));
+            CHECK(written.inlined == 1);
+            CHECK(memcmp(&written.object, &scene.objectList[instance.instanceID], sizeof(ObjectData)) == 0);
+            CHECK(memcmp(&written.material, &scene.materialList[written.object.materialIndex], sizeof(MaterialData)) == 0);
+        }
+    }
+}
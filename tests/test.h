@@ -0,0 +1,36 @@
+#pragma once
+
+#include "core.h"
+
+// Just enough of a test framework for raytracer_tests. TEST(suite, name) registers a test, a CHECK
+// that fails throws, and the executable runs the suites named on its command line (all of them
+// without any). CTest runs every suite on its own, see CMakeLists.txt.
+
+struct TestCase
+{
+    const char* suite;
+    const char* name;
+    void (*func)();
+};
+
+std::vector<TestCase>& TestRegistry();
+
+struct TestRegistrar
+{
+    TestRegistrar(const char* suite, const char* name, void (*func)())
+    {
+        TestRegistry().push_back({ suite, name, func });
+    }
+};
+
+#define TEST(suite, name)                                                                      \
+    static void test_##suite##_##name();                                                       \
+    static const TestRegistrar registrar_##suite##_##name(#suite, #name, &test_##suite##_##name); \
+    static void test_##suite##_##name()
+
+#define CHECK(condition)                                                                                        \
+    do                                                                                                          \
+    {                                                                                                           \
+        if (!(condition))                                                                                       \
+            throw std::runtime_error(std::string(__FILE__) + ":" + std::to_string(__LINE__) + ": " #condition); \
+    } while (0)
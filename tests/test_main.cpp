@@ -0,0 +1,38 @@
+#include "test.h"
+
+std::vector<TestCase>& TestRegistry()
+{
+    static std::vector<TestCase> registry;
+    return registry;
+}
+
+int main(int argc, char** argv)
+{
+    UINT passed = 0;
+    UINT failed = 0;
+    for (const TestCase& test : TestRegistry())
+    {
+        bool selected = argc < 2;
+        for (int i = 1; i < argc; ++i)
+        {
+            selected |= strcmp(argv[i], test.suite) == 0;
+        }
+        if (!selected)
+            continue;
+
+        try
+        {
+            test.func();
+            printf("[ ok ] %s.%s\n", test.suite, test.name);
+            ++passed;
+        }
+        catch (const std::exception& e)
+        {
+            printf("[FAIL] %s.%s: %s\n", test.suite, test.name, e.what());
+            ++failed;
+        }
+    }
+
+    printf("%u passed, %u failed\n", passed, failed);
+    return (failed > 0 || passed == 0) ? 1 : 0;
+}
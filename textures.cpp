@@ -0,0 +1,517 @@
+#include "core.h"
+#include <fstream>
+#include <list>
+#include <memory>
+#include <bit>
+#include <filesystem>
+#include <unordered_map>
+
+// Textures for Lambertian materials on the CPU renderer.
+//
+// Perlin noise is the book's, except that the gradient and permutation tables come from an integer
+// hash instead of a random generator, so the shaders can compute the same noise without any tables.
+//
+// Image textures are never loaded whole. Loading streams through the PPM once, a couple of rows at
+// a time, for the average color and to write all the smaller mip levels to a file of their own.
+// Every level is cut into TEXTURE_TILE_SIZE^2 tiles and the renderer only ever looks at tiles,
+// through a cache with a memory budget that throws out the least recently used tiles once it's
+// full. A tile is read straight from its rows in the PPM (level 0) or the mip file. So scenes can
+// have way more texture data than RAM, as long as what the rays actually look at at the mip level
+// they need fits in the budget.
+
+using namespace DirectX;
+
+namespace
+{
+    constexpr UINT PERLIN_POINT_COUNT = 256;
+
+    UINT perlinHash(UINT x)
+    {
+        x ^= x >> 16;
+        x *= 0x7feb352d;
+        x ^= x >> 15;
+        x *= 0x846ca68b;
+        x ^= x >> 16;
+        return x;
+    }
+
+    struct PerlinTables
+    {
+        PerlinTables()
+        {
+            for (UINT i = 0; i < PERLIN_POINT_COUNT; ++i)
+            {
+                for (UINT axis = 0; axis < 3; ++axis)
+                {
+                    permutations[axis][i] = perlinHash(i * 3 + axis) % PERLIN_POINT_COUNT;
+                }
+
+                // 10 bits per component, never exactly zero so it always normalizes.
+                const UINT h = perlinHash(i + 1024);
+                XMStoreFloat3(&vectors[i], XMVector3Normalize(XMVectorSet(
+                    (h & 1023) / 1023.0f * 2 - 1, ((h >> 10) & 1023) / 1023.0f * 2 - 1, ((h >> 20) & 1023) / 1023.0f * 2 - 1, 0)));
+            }
+        }
+
+        XMFLOAT3 vectors[PERLIN_POINT_COUNT];
+        UINT permutations[3][PERLIN_POINT_COUNT];
+    };
+
+    const PerlinTables perlin;
+
+    float perlinNoise(XMFLOAT3 p)
+    {
+        const float u = p.x - std::floor(p.x);
+        const float v = p.y - std::floor(p.y);
+        const float w = p.z - std::floor(p.z);
+        const int i = (int)std::floor(p.x);
+        const int j = (int)std::floor(p.y);
+        const int k = (int)std::floor(p.z);
+
+        // Hermite smoothing of the trilinear weights.
+        const float uu = u * u * (3 - 2 * u);
+        const float vv = v * v * (3 - 2 * v);
+        const float ww = w * w * (3 - 2 * w);
+
+        float accum = 0;
+        for (int di = 0; di < 2; ++di)
+        {
+            for (int dj = 0; dj < 2; ++dj)
+            {
+                for (int dk = 0; dk < 2; ++dk)
+                {
+                    const XMFLOAT3& c = perlin.vectors[perlin.permutations[0][(i + di) & 255] ^
+                                                       perlin.permutations[1][(j + dj) & 255] ^
+                                                       perlin.permutations[2][(k + dk) & 255]];
+                    const float weight = c.x * (u - di) + c.y * (v - dj) + c.z * (w - dk);
+                    accum += (di * uu + (1 - di) * (1 - uu)) * (dj * vv + (1 - dj) * (1 - vv)) * (dk * ww + (1 - dk) * (1 - ww)) * weight;
+                }
+            }
+        }
+        return accum;
+    }
+
+    // Texels are kept as 8 bit sRGB like in the file, and decoded to linear when sampled.
+    struct Tile
+    {
+        UINT width;
+        UINT height;
+        std::vector<UINT32> texels;
+
+        size_t bytes() const { return sizeof(Tile) + texels.size() * sizeof(UINT32); }
+    };
+
+    UINT32 packTexel(UINT r, UINT g, UINT b)
+    {
+        return r | (g << 8) | (b << 16);
+    }
+
+    struct SrgbTable
+    {
+        SrgbTable()
+        {
+            for (UINT i = 0; i < 256; ++i)
+            {
+                linear[i] = std::pow(i / 255.0f, 2.2f);
+            }
+        }
+
+        float linear[256];
+    };
+
+    const SrgbTable srgb;
+
+    UINT levelSize(UINT size, UINT level)
+    {
+        return std::max(size >> level, 1u);
+    }
+
+    // The mip file has levels 1 and up, one after another, rows of 8 bit RGB like the PPM.
+    UINT64 mipLevelOffset(const TextureData& texture, UINT level)
+    {
+        UINT64 offset = 0;
+        for (UINT i = 1; i < level; ++i)
+        {
+            offset += (UINT64)levelSize(texture.width, i) * levelSize(texture.height, i) * 3;
+        }
+        return offset;
+    }
+
+    // Builds the mip levels from rows coming in one at a time, top to bottom. Every level keeps just
+    // the one row waiting for its pair, so memory stays at a few rows however big the texture is.
+    class MipWriter
+    {
+    public:
+        MipWriter(const TextureData& texture) : texture(texture), file(texture.mipPath, std::ios::binary), pending(texture.mipLevels), rows(texture.mipLevels)
+        {
+            if (!file)
+            {
+                throw std::runtime_error("Cannot write texture mip file: " + texture.mipPath);
+            }
+        }
+
+        // Row of the given level, 8 bit RGB.
+        void addRow(UINT level, const std::vector<UINT8>& row)
+        {
+            if (level > 0)
+            {
+                file.seekp(mipLevelOffset(texture, level) + (UINT64)rows[level] * row.size());
+                file.write(reinterpret_cast<const char*>(row.data()), row.size());
+            }
+            ++rows[level];
+
+            const UINT next = level + 1;
+            if (next >= texture.mipLevels)
+                return;
+
+            // Box filter over 2x2 texels. An odd last row or column is dropped, a single one is doubled.
+            if (levelSize(texture.height, level) > 1 && pending[next].empty())
+            {
+                pending[next] = row;
+                return;
+            }
+            const std::vector<UINT8>& above = pending[next].empty() ? row : pending[next];
+            const UINT width = levelSize(texture.width, level);
+            std::vector<UINT8> filtered((size_t)levelSize(texture.width, next) * 3);
+            for (UINT x = 0; x < filtered.size() / 3; ++x)
+            {
+                const UINT left = 2 * x, right = std::min(2 * x + 1, width - 1);
+                for (UINT channel = 0; channel < 3; ++channel)
+                {
+                    const UINT sum = above[3 * left + channel] + above[3 * right + channel] + row[3 * left + channel] + row[3 * right + channel];
+                    filtered[3 * x + channel] = (UINT8)((sum + 2) / 4);
+                }
+            }
+            pending[next].clear();
+            addRow(next, filtered);
+        }
+
+        void finish()
+        {
+            file.close();
+            if (!file)
+            {
+                throw std::runtime_error("Cannot write texture mip file: " + texture.mipPath);
+            }
+        }
+
+    private:
+        const TextureData& texture;
+        std::ofstream file;
+        std::vector<std::vector<UINT8>> pending;
+        std::vector<UINT> rows;
+    };
+
+    class TextureCache
+    {
+    public:
+        // Texture 20 bits, level 6 bits, tile coordinates 19 bits each.
+        static UINT64 tileKey(UINT texture, UINT level, UINT tileX, UINT tileY)
+        {
+            return ((UINT64)texture << 44) | ((UINT64)level << 38) | ((UINT64)tileY << 19) | tileX;
+        }
+
+        std::shared_ptr<const Tile> get(UINT texture, UINT level, UINT tileX, UINT tileY)
+        {
+            const UINT64 key = tileKey(texture, level, tileX, tileY);
+            Shard& shard = shards[(key * 0x9E3779B97F4A7C15ull) >> 60];
+            ++lookups;
+            {
+                std::lock_guard lock(shard.mutex);
+                auto it = shard.tiles.find(key);
+                if (it != shard.tiles.end())
+                {
+                    shard.lru.splice(shard.lru.begin(), shard.lru, it->second.lru);
+                    ++hits;
+                    return it->second.tile;
+                }
+            }
+
+            // Reading the file goes without the lock.
+            ++misses;
+            std::shared_ptr<const Tile> tile = loadTile(texture, level, tileX, tileY);
+
+            std::lock_guard lock(shard.mutex);
+            auto [it, inserted] = shard.tiles.try_emplace(key);
+            if (!inserted)
+            {
+                // Some other thread got here first.
+                return it->second.tile;
+            }
+            shard.lru.push_front(key);
+            it->second = { tile, shard.lru.begin() };
+            shard.bytes += tile->bytes();
+            size_t total = bytes += tile->bytes();
+
+            // The tile we just added stays, even if it's over the budget all on its own.
+            const size_t shardBudget = budget / SHARD_COUNT;
+            while (shard.bytes > shardBudget && shard.lru.size() > 1)
+            {
+                auto evicted = shard.tiles.find(shard.lru.back());
+                const size_t evictedBytes = evicted->second.tile->bytes();
+                shard.bytes -= evictedBytes;
+                total = bytes -= evictedBytes;
+                shard.tiles.erase(evicted);
+                shard.lru.pop_back();
+                ++evictions;
+            }
+
+            size_t peak = peakBytes;
+            while (total > peak && !peakBytes.compare_exchange_weak(peak, total))
+            {
+            }
+            return tile;
+        }
+
+        void clear()
+        {
+            for (Shard& shard : shards)
+            {
+                std::lock_guard lock(shard.mutex);
+                shard.tiles.clear();
+                shard.lru.clear();
+                shard.bytes = 0;
+            }
+            bytes = peakBytes = 0;
+            lookups = hits = misses = evictions = 0;
+        }
+
+        TextureCacheStats stats() const
+        {
+            return { lookups, hits, misses, evictions, bytes, peakBytes, budget };
+        }
+
+        std::atomic<size_t> budget = TEXTURE_CACHE_DEFAULT_BUDGET;
+
+    private:
+        static constexpr UINT SHARD_COUNT = 16;
+
+        struct Entry
+        {
+            std::shared_ptr<const Tile> tile;
+            std::list<UINT64>::iterator lru;
+        };
+
+        // Split up so threads mostly don't wait on each other, every shard has its own share of the budget.
+        struct Shard
+        {
+            std::mutex mutex;
+            std::list<UINT64> lru; // Most recently used first.
+            std::unordered_map<UINT64, Entry> tiles;
+            size_t bytes = 0;
+        };
+
+        std::shared_ptr<const Tile> loadTile(UINT texture, UINT level, UINT tileX, UINT tileY)
+        {
+            const TextureData& data = textureList[texture];
+            const UINT levelWidth = levelSize(data.width, level);
+            const UINT levelHeight = levelSize(data.height, level);
+            const UINT x0 = tileX * TEXTURE_TILE_SIZE;
+            const UINT y0 = tileY * TEXTURE_TILE_SIZE;
+
+            auto tile = std::make_shared<Tile>();
+            tile->width = std::min(TEXTURE_TILE_SIZE, levelWidth - x0);
+            tile->height = std::min(TEXTURE_TILE_SIZE, levelHeight - y0);
+            tile->texels.resize((size_t)tile->width * tile->height);
+
+            const std::string& path = (level == 0) ? data.path : data.mipPath;
+            const UINT64 offset = (level == 0) ? data.dataOffset : mipLevelOffset(data, level);
+            std::ifstream file(path, std::ios::binary);
+            std::vector<UINT8> row(tile->width * 3);
+            for (UINT y = 0; y < tile->height; ++y)
+            {
+                file.seekg(offset + ((UINT64)(y0 + y) * levelWidth + x0) * 3);
+                file.read(reinterpret_cast<char*>(row.data()), row.size());
+                if (!file)
+                {
+                    throw std::runtime_error("Cannot read texture file: " + path);
+                }
+                for (UINT x = 0; x < tile->width; ++x)
+                {
+                    tile->texels[y * tile->width + x] = packTexel(row[3 * x], row[3 * x + 1], row[3 * x + 2]);
+                }
+            }
+            return tile;
+        }
+
+        Shard shards[SHARD_COUNT];
+        std::atomic<size_t> bytes = 0;
+        std::atomic<size_t> peakBytes = 0;
+        std::atomic<UINT64> lookups = 0;
+        std::atomic<UINT64> hits = 0;
+        std::atomic<UINT64> misses = 0;
+        std::atomic<UINT64> evictions = 0;
+    };
+
+    TextureCache textureCache;
+
+    // Binary PPM header, skipping comments. Leaves the file at the first texel.
+    UINT readHeaderValue(std::ifstream& file, const std::string& path)
+    {
+        while (true)
+        {
+            file >> std::ws;
+            if (file.peek() != '#')
+                break;
+            std::string comment;
+            std::getline(file, comment);
+        }
+
+        UINT value;
+        if (!(file >> value))
+        {
+            throw std::runtime_error("Bad texture file header: " + path);
+        }
+        return value;
+    }
+}
+
+UINT LoadTexture(const std::string& path, std::vector<TextureData>& textures)
+{
+    for (UINT i = 0; i < textures.size(); ++i)
+    {
+        if (textures[i].path == path)
+            return i;
+    }
+
+    std::ifstream file(path, std::ios::binary);
+    if (!file)
+    {
+        throw std::runtime_error("Cannot open texture file: " + path);
+    }
+
+    char magic[2] = {};
+    file.read(magic, 2);
+    if (magic[0] != 'P' || magic[1] != '6')
+    {
+        throw std::runtime_error("Only binary PPM textures are supported: " + path);
+    }
+    TextureData texture = { .path = path };
+    texture.width = readHeaderValue(file, path);
+    texture.height = readHeaderValue(file, path);
+    if (readHeaderValue(file, path) != 255 || texture.width == 0 || texture.height == 0)
+    {
+        throw std::runtime_error("Only 8 bit PPM textures are supported: " + path);
+    }
+    file.get(); // Single whitespace before the texels.
+    texture.dataOffset = (UINT64)file.tellg();
+    texture.mipLevels = (UINT)std::bit_width(std::max(texture.width, texture.height));
+
+    // Mip levels go to a temporary file, named after the texture and this load so processes and
+    // scenes never share one. ClearTextures deletes them.
+    static std::atomic<UINT> loads = 0;
+    const auto stamp = std::chrono::steady_clock::now().time_since_epoch().count();
+    texture.mipPath = (std::filesystem::temp_directory_path() /
+                       (std::filesystem::path(path).stem().string() + "." + std::to_string(stamp) + "." + std::to_string(loads++) + ".mips")).string();
+
+    // One pass over the file for the average color, which is what the GPU path gets to show, and the mip levels.
+    MipWriter mips(texture);
+    std::vector<UINT8> row((size_t)texture.width * 3);
+    double sum[3] = {};
+    for (UINT y = 0; y < texture.height; ++y)
+    {
+        file.read(reinterpret_cast<char*>(row.data()), row.size());
+        if (!file)
+        {
+            throw std::runtime_error("Truncated texture file: " + path);
+        }
+        for (size_t i = 0; i < row.size(); ++i)
+        {
+            sum[i % 3] += srgb.linear[row[i]];
+        }
+        mips.addRow(0, row);
+    }
+    mips.finish();
+    const double texels = (double)texture.width * texture.height;
+    texture.average = { (float)(sum[0] / texels), (float)(sum[1] / texels), (float)(sum[2] / texels) };
+
+    textures.push_back(std::move(texture));
+    return (UINT)textures.size() - 1;
+}
+
+XMFLOAT3 SampleTexture(UINT texture, float u, float v, float footprint)
+{
+    // Footprint is the size of what we're shading in uv units, the level is where a texel is about that size.
+    const TextureData& data = textureList[texture];
+    const float texelsCovered = footprint * std::max(data.width, data.height);
+    const UINT level = (UINT)std::clamp((int)std::floor(std::log2(std::max(texelsCovered, 1.0f)) + 0.5f), 0, (int)data.mipLevels - 1);
+    const UINT width = levelSize(data.width, level);
+    const UINT height = levelSize(data.height, level);
+
+    // Bilinear, wrapping around. v goes up, rows go down.
+    const float x = (u - std::floor(u)) * width - 0.5f;
+    const float y = (1 - (v - std::floor(v))) * height - 0.5f;
+    const float x0 = std::floor(x), y0 = std::floor(y);
+    const float fx = x - x0, fy = y - y0;
+
+    UINT64 lastKey = UINT64_MAX;
+    std::shared_ptr<const Tile> tile;
+    float color[3] = {};
+    for (UINT corner = 0; corner < 4; ++corner)
+    {
+        const UINT tx = (UINT)(((int)x0 + (int)(corner & 1) + (int)width) % (int)width);
+        const UINT ty = (UINT)(((int)y0 + (int)(corner >> 1) + (int)height) % (int)height);
+        const UINT64 key = TextureCache::tileKey(texture, level, tx / TEXTURE_TILE_SIZE, ty / TEXTURE_TILE_SIZE);
+        if (key != lastKey)
+        {
+            tile = textureCache.get(texture, level, tx / TEXTURE_TILE_SIZE, ty / TEXTURE_TILE_SIZE);
+            lastKey = key;
+        }
+
+        const UINT32 texel = tile->texels[(ty % TEXTURE_TILE_SIZE) * tile->width + tx % TEXTURE_TILE_SIZE];
+        const float weight = ((corner & 1) ? fx : 1 - fx) * ((corner >> 1) ? fy : 1 - fy);
+        for (UINT channel = 0; channel < 3; ++channel)
+        {
+            color[channel] += weight * srgb.linear[(texel >> (8 * channel)) & 255];
+        }
+    }
+    return { color[0], color[1], color[2] };
+}
+
+float Turbulence(XMFLOAT3 p, UINT depth)
+{
+    float accum = 0;
+    float weight = 1;
+    for (UINT i = 0; i < depth; ++i)
+    {
+        accum += weight * perlinNoise(p);
+        weight *= 0.5f;
+        p = { p.x * 2, p.y * 2, p.z * 2 };
+    }
+    return std::abs(accum);
+}
+
+XMFLOAT3 NoiseTextureColor(XMFLOAT3 p, float scale)
+{
+    // Marble from the book, stripes along z bent by turbulence.
+    const float value = 0.5f * (1 + std::sin(scale * p.z + 10 * Turbulence(p)));
+    return { value, value, value };
+}
+
+void SetTextureCacheBudget(size_t bytes)
+{
+    textureCache.budget = bytes;
+}
+
+void ClearTextureCache()
+{
+    textureCache.clear();
+}
+
+void ClearTextures(std::vector<TextureData>& textures)
+{
+    // Tiles are keyed by texture index, so they have to go too if these are the textures in use.
+    if (&textures == &textureList)
+        textureCache.clear();
+    for (const TextureData& texture : textures)
+    {
+        std::error_code error;
+        std::filesystem::remove(texture.mipPath, error);
+    }
+    textures.clear();
+}
+
+TextureCacheStats GetTextureCacheStats()
+{
+    return textureCache.stats();
+}
@@ -0,0 +1,428 @@
+#include "core.h"
+#include <memory>
+
+#ifdef _WIN32
+#define NOMINMAX
+#define WIN32_LEAN_AND_MEAN
+#include <Windows.h>
+#elif defined(__linux__)
+#include <cctype>
+#include <filesystem>
+#include <fstream>
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+// NUMA: on machines with several memory nodes, a pool can spread its threads over the nodes and pin
+// each to the CPUs of its node. ParallelForNodes then keeps every node on a share of the work of its
+// own, and RunOnEachNode lets callers place a copy of what that work reads in each node's memory,
+// which is where pages end up when a thread of the node is the first to touch them. The renderer
+// does both with reference frames, see ReplicateReferenceFrame.
+
+namespace
+{
+    // Pool the current thread works for, if any. Pools can't wait on themselves from their own threads.
+    thread_local const ThreadPool* workerOf = nullptr;
+
+    // Counts down helpers that reference the caller's locals, which has to wait for all of them to
+    // be done, even the ones that start when there's nothing left.
+    class Completion
+    {
+    public:
+        explicit Completion(UINT count) : remaining(count) {}
+
+        void finishOne()
+        {
+            std::lock_guard lock(mutex);
+            if (--remaining == 0)
+            {
+                done.notify_all();
+            }
+        }
+
+        void wait()
+        {
+            std::unique_lock lock(mutex);
+            done.wait(lock, [&]() { return remaining == 0; });
+        }
+
+    private:
+        std::mutex mutex;
+        std::condition_variable done;
+        UINT remaining;
+    };
+
+#ifdef __linux__
+    // "0-3,8-11" style lists of /sys.
+    std::vector<UINT> parseCpuList(const std::string& list)
+    {
+        std::vector<UINT> cpus;
+        size_t pos = 0;
+        while (pos < list.size())
+        {
+            size_t end = list.find(',', pos);
+            if (end == std::string::npos)
+                end = list.size();
+            const std::string range = list.substr(pos, end - pos);
+            if (!range.empty() && isdigit((unsigned char)range[0]))
+            {
+                const UINT first = (UINT)strtoul(range.c_str(), nullptr, 10);
+                const size_t dash = range.find('-');
+                const UINT last = dash == std::string::npos ? first : (UINT)strtoul(range.c_str() + dash + 1, nullptr, 10);
+                for (UINT cpu = first; cpu <= last; ++cpu)
+                {
+                    cpus.push_back(cpu);
+                }
+            }
+            pos = end + 1;
+        }
+        return cpus;
+    }
+#endif
+
+    // Pinning is only a hint, a thread that can't be pinned just runs wherever it's scheduled.
+    void pinCurrentThread(const std::vector<UINT>& cpus)
+    {
+        if (cpus.empty())
+            return;
+#ifdef _WIN32
+        // A node never spans processor groups, so its first CPU's group is the group of all of them.
+        GROUP_AFFINITY affinity = {};
+        affinity.Group = (WORD)(cpus[0] / 64);
+        for (UINT cpu : cpus)
+        {
+            if (cpu / 64 == affinity.Group)
+                affinity.Mask |= (KAFFINITY)1 << (cpu % 64);
+        }
+        SetThreadGroupAffinity(GetCurrentThread(), &affinity, nullptr);
+#elif defined(__linux__)
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (UINT cpu : cpus)
+        {
+            if (cpu < CPU_SETSIZE)
+                CPU_SET(cpu, &set);
+        }
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#endif
+    }
+}
+
+std::vector<std::vector<UINT>> NumaNodeCpus()
+{
+    std::vector<std::vector<UINT>> nodes;
+#ifdef _WIN32
+    ULONG highestNode = 0;
+    if (GetNumaHighestNodeNumber(&highestNode))
+    {
+        for (ULONG node = 0; node <= highestNode; ++node)
+        {
+            GROUP_AFFINITY affinity = {};
+            if (!GetNumaNodeProcessorMaskEx((USHORT)node, &affinity))
+                continue;
+            std::vector<UINT> cpus;
+            for (UINT bit = 0; bit < 64; ++bit)
+            {
+                if (affinity.Mask & ((KAFFINITY)1 << bit))
+                    cpus.push_back(affinity.Group * 64 + bit);
+            }
+            if (!cpus.empty())
+                nodes.push_back(std::move(cpus));
+        }
+    }
+#elif defined(__linux__)
+    // Nodes as /sys lists them, cut down to the CPUs the process is allowed on. Nodes without any
+    // (memory only ones, or ones taskset keeps us off) are left out.
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    const bool haveAllowed = sched_getaffinity(0, sizeof(allowed), &allowed) == 0;
+
+    std::map<UINT, std::vector<UINT>> found;
+    std::error_code error;
+    for (const auto& entry : std::filesystem::directory_iterator("/sys/devices/system/node", error))
+    {
+        const std::string name = entry.path().filename().string();
+        if (name.size() <= 4 || name.compare(0, 4, "node") != 0 || !isdigit((unsigned char)name[4]))
+            continue;
+        std::ifstream file(entry.path() / "cpulist");
+        std::string list;
+        if (!std::getline(file, list))
+            continue;
+
+        std::vector<UINT> cpus;
+        for (UINT cpu : parseCpuList(list))
+        {
+            if (!haveAllowed || (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed)))
+                cpus.push_back(cpu);
+        }
+        if (!cpus.empty())
+            found[(UINT)strtoul(name.c_str() + 4, nullptr, 10)] = std::move(cpus);
+    }
+    for (auto& [node, cpus] : found)
+    {
+        nodes.push_back(std::move(cpus));
+    }
+#endif
+
+    if (nodes.empty())
+    {
+        std::vector<UINT> cpus(std::max(std::thread::hardware_concurrency(), 1u));
+        for (UINT i = 0; i < cpus.size(); ++i)
+        {
+            cpus[i] = i;
+        }
+        nodes.push_back(std::move(cpus));
+    }
+    return nodes;
+}
+
+ThreadPool::ThreadPool(UINT threadCount)
+{
+    if (threadCount == 0)
+    {
+        threadCount = std::max(std::thread::hardware_concurrency(), 1u);
+    }
+
+    start(threadCount, { {} }, false);
+}
+
+ThreadPool::ThreadPool(UINT threadCount, const std::vector<std::vector<UINT>>& nodeCpus)
+{
+    if (nodeCpus.empty())
+    {
+        throw std::invalid_argument("Thread pool needs at least one node");
+    }
+
+    size_t cpuCount = 0;
+    for (const auto& cpus : nodeCpus)
+    {
+        cpuCount += cpus.size();
+    }
+    if (threadCount == 0)
+    {
+        threadCount = std::max((UINT)cpuCount, 1u);
+    }
+
+    start(threadCount, nodeCpus, true);
+}
+
+void ThreadPool::start(UINT threadCount, const std::vector<std::vector<UINT>>& nodeCpus, bool pinned)
+{
+    // Threads go to the nodes in proportion to their CPUs (evenly if none are listed). Nodes that get
+    // none are dropped, nothing could run what's submitted to them.
+    size_t cpuCount = 0;
+    for (const auto& cpus : nodeCpus)
+    {
+        cpuCount += std::max<size_t>(cpus.size(), 1);
+    }
+
+    std::vector<std::pair<const std::vector<UINT>*, UINT>> nodes; // CPUs and thread count of every node kept.
+    size_t cpusBefore = 0;
+    for (const auto& cpus : nodeCpus)
+    {
+        const UINT first = (UINT)((UINT64)threadCount * cpusBefore / cpuCount);
+        cpusBefore += std::max<size_t>(cpus.size(), 1);
+        const UINT last = (UINT)((UINT64)threadCount * cpusBefore / cpuCount);
+        if (first != last)
+        {
+            nodes.push_back({ &cpus, last - first });
+            nodeThreadCounts.push_back(last - first);
+            if (pinned)
+                pinnedCpus.push_back(cpus);
+        }
+    }
+
+    // Queues first, workers look at theirs as soon as they start.
+    nodeTasks.resize(nodes.size());
+    threads.reserve(threadCount);
+    for (UINT node = 0; node < nodes.size(); ++node)
+    {
+        for (UINT i = 0; i < nodes[node].second; ++i)
+        {
+            threads.emplace_back([this, node, cpus = *nodes[node].first, pinned]() {
+                if (pinned)
+                {
+                    pinCurrentThread(cpus);
+                }
+                WorkerLoop(node);
+            });
+        }
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard lock(mutex);
+        stopping = true;
+    }
+    taskAvailable.notify_all();
+
+    for (auto& thread : threads)
+    {
+        thread.join();
+    }
+}
+
+void ThreadPool::Submit(std::function<void()> task)
+{
+    {
+        std::lock_guard lock(mutex);
+        tasks.push_back(std::move(task));
+    }
+    taskAvailable.notify_one();
+}
+
+void ThreadPool::SubmitToNode(UINT node, std::function<void()> task)
+{
+    {
+        std::lock_guard lock(mutex);
+        nodeTasks.at(node).push_back(std::move(task));
+    }
+    // The one woken up could belong to another node and go right back to sleep.
+    taskAvailable.notify_all();
+}
+
+void ThreadPool::checkNotWorker() const
+{
+    // Waiting there could mean waiting on helpers queued behind the waiting task itself.
+    if (workerOf == this)
+    {
+        throw std::logic_error("Thread pool can't wait for its own work on one of its threads");
+    }
+}
+
+UINT ThreadPool::callerNode() const
+{
+    UINT cpu = UINT_MAX;
+#ifdef _WIN32
+    PROCESSOR_NUMBER number;
+    GetCurrentProcessorNumberEx(&number);
+    cpu = number.Group * 64 + number.Number;
+#elif defined(__linux__)
+    const int current = sched_getcpu();
+    if (current >= 0)
+        cpu = (UINT)current;
+#endif
+    for (UINT node = 0; node < pinnedCpus.size(); ++node)
+    {
+        if (std::find(pinnedCpus[node].begin(), pinnedCpus[node].end(), cpu) != pinnedCpus[node].end())
+            return node;
+    }
+    return 0;
+}
+
+void ThreadPool::ParallelFor(UINT count, const std::function<void(UINT)>& func)
+{
+    checkNotWorker();
+
+    // Every participant pulls indices until they run out, so uneven items (like rows with more
+    // bounces) balance out by themselves. The caller helps too instead of just waiting.
+    std::atomic<UINT> next = 0;
+    auto work = [&]() {
+        for (UINT i = next++; i < count; i = next++)
+        {
+            func(i);
+        }
+    };
+
+    const UINT helpers = std::min(count, ThreadCount());
+    Completion completion(helpers);
+    for (UINT i = 0; i < helpers; ++i)
+    {
+        Submit([&]() {
+            work();
+            completion.finishOne();
+        });
+    }
+
+    work();
+    completion.wait();
+}
+
+void ThreadPool::ParallelForNodes(UINT count, const std::function<void(UINT, UINT)>& func)
+{
+    checkNotWorker();
+
+    // Shares follow the nodes' thread counts. A thread done with its own node's share goes on with
+    // the next node's, and so on around, so uneven shares still balance out in the end.
+    const UINT nodes = NodeCount();
+    std::unique_ptr<std::atomic<UINT>[]> next(new std::atomic<UINT>[nodes]);
+    std::vector<UINT> ends(nodes);
+    UINT threadsBefore = 0;
+    for (UINT node = 0; node < nodes; ++node)
+    {
+        next[node] = (UINT)((UINT64)count * threadsBefore / ThreadCount());
+        threadsBefore += nodeThreadCounts[node];
+        ends[node] = (UINT)((UINT64)count * threadsBefore / ThreadCount());
+    }
+
+    auto work = [&](UINT node) {
+        for (UINT k = 0; k < nodes; ++k)
+        {
+            const UINT share = (node + k) % nodes;
+            for (UINT i = next[share]++; i < ends[share]; i = next[share]++)
+            {
+                func(i, node);
+            }
+        }
+    };
+
+    UINT helpers = 0;
+    for (UINT node = 0; node < nodes; ++node)
+    {
+        helpers += std::min(count, nodeThreadCounts[node]);
+    }
+    Completion completion(helpers);
+    for (UINT node = 0; node < nodes; ++node)
+    {
+        for (UINT i = std::min(count, nodeThreadCounts[node]); i > 0; --i)
+        {
+            SubmitToNode(node, [&, node]() {
+                work(node);
+                completion.finishOne();
+            });
+        }
+    }
+
+    // Like in ParallelFor, the caller helps too, starting with the share of the node it runs on.
+    work(callerNode());
+    completion.wait();
+}
+
+void ThreadPool::RunOnEachNode(const std::function<void(UINT)>& func)
+{
+    checkNotWorker();
+
+    Completion completion(NodeCount());
+    for (UINT node = 0; node < NodeCount(); ++node)
+    {
+        SubmitToNode(node, [&, node]() {
+            func(node);
+            completion.finishOne();
+        });
+    }
+    completion.wait();
+}
+
+void ThreadPool::WorkerLoop(UINT node)
+{
+    workerOf = this;
+    while (true)
+    {
+        std::function<void()> task;
+        {
+            std::unique_lock lock(mutex);
+            auto& ownTasks = nodeTasks[node];
+            taskAvailable.wait(lock, [&]() { return stopping || !ownTasks.empty() || !tasks.empty(); });
+            auto& queue = !ownTasks.empty() ? ownTasks : tasks;
+            if (queue.empty())
+            {
+                return;
+            }
+            task = std::move(queue.front());
+            queue.pop_front();
+        }
+        task();
+    }
+}
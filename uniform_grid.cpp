@@ -0,0 +1,162 @@
+#include "core.h"
+
+// Uniform grid over the instances, the CPU renderer's alternative to the motion BVH for dense fields
+// of similar sized instances, like the small spheres of the book 1 final scene. A BVH gets little out
+// of its hierarchy there, while grid cells about as big as a typical instance hold just an instance
+// or two and a ray walks only the cells along its way (see ReferenceScene).
+//
+// Instances much bigger than typical (the ground, the glass ball around everything) would land in a
+// lot of cells, so they stay out of the grid and every ray tests them. So do media: their intersection
+// draws random numbers, and a ray testing one in several cells would get several chances to scatter.
+
+namespace
+{
+    // Cell edge relative to the median instance extent.
+    constexpr float GRID_CELL_SIZE = 2.0f;
+    // Instances this many times the median extent and bigger aren't binned.
+    constexpr float GRID_LARGE_INSTANCE = 8.0f;
+    constexpr UINT GRID_MAX_CELLS = 1u << 22;
+
+    // What ChooseSpatialIndex wants to see before it prefers the grid.
+    constexpr UINT GRID_MIN_INSTANCES = 256;
+    constexpr UINT GRID_MAX_UNBINNED = 16;
+    constexpr float GRID_MAX_AVERAGE_CELL_INSTANCES = 4.0f;
+
+    float axisValue(const DirectX::XMFLOAT3& v, int axis)
+    {
+        return (&v.x)[axis];
+    }
+
+    float extent(const AABB& bounds)
+    {
+        return std::max({ bounds.max.x - bounds.min.x, bounds.max.y - bounds.min.y, bounds.max.z - bounds.min.z });
+    }
+
+    // Cells overlapped by bounds, inclusive.
+    void cellRange(const UniformGrid& grid, const AABB& bounds, UINT (&first)[3], UINT (&last)[3])
+    {
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            const float origin = axisValue(grid.bounds.min, axis);
+            const float size = axisValue(grid.cellSize, axis);
+            const int maxCell = (int)grid.resolution[axis] - 1;
+            first[axis] = (UINT)std::clamp((int)((axisValue(bounds.min, axis) - origin) / size), 0, maxCell);
+            last[axis] = (UINT)std::clamp((int)((axisValue(bounds.max, axis) - origin) / size), 0, maxCell);
+        }
+    }
+}
+
+void BuildUniformGrid(UniformGrid& grid, const MotionBVH& bvh)
+{
+    const UINT instanceCount = (UINT)bvh.instanceBounds[0].size();
+    // Cleared rather than replaced, the lists keep their capacity from the last capture.
+    grid.bounds = {};
+    grid.resolution[0] = grid.resolution[1] = grid.resolution[2] = 0;
+    grid.cellSize = {};
+    grid.cellStart.clear();
+    grid.cellInstances.clear();
+    grid.unbinned.clear();
+    grid.binnedInstances = grid.occupiedCells = grid.maxCellInstances = 0;
+
+    ArenaScope scratch(ScratchArena());
+    ArenaVector<AABB> sweptBounds(instanceCount, ScratchArena());
+    ArenaVector<UINT> candidates(ScratchArena());
+    candidates.reserve(instanceCount);
+    for (UINT i = 0; i < instanceCount; ++i)
+    {
+        const AABB& open = bvh.instanceBounds[0][i];
+        const AABB& close = bvh.instanceBounds[1][i];
+        sweptBounds[i] = { { std::min(open.min.x, close.min.x), std::min(open.min.y, close.min.y), std::min(open.min.z, close.min.z) },
+                           { std::max(open.max.x, close.max.x), std::max(open.max.y, close.max.y), std::max(open.max.z, close.max.z) } };
+        if (materialList[objectList[i].materialIndex].type == MATERIAL_TYPE_SMOKE)
+            grid.unbinned.push_back(i);
+        else
+            candidates.push_back(i);
+    }
+    if (candidates.empty())
+        return;
+
+    ArenaVector<float> extents(candidates.size(), ScratchArena());
+    for (size_t i = 0; i < candidates.size(); ++i)
+    {
+        extents[i] = extent(sweptBounds[candidates[i]]);
+    }
+    std::nth_element(extents.begin(), extents.begin() + extents.size() / 2, extents.end());
+    const float medianExtent = extents[extents.size() / 2];
+
+    ArenaVector<UINT> binned(ScratchArena());
+    binned.reserve(candidates.size());
+    grid.bounds = { { FLT_MAX, FLT_MAX, FLT_MAX }, { -FLT_MAX, -FLT_MAX, -FLT_MAX } };
+    for (UINT i : candidates)
+    {
+        const AABB& bounds = sweptBounds[i];
+        if (extent(bounds) >= GRID_LARGE_INSTANCE * medianExtent && medianExtent > 0)
+        {
+            grid.unbinned.push_back(i);
+            continue;
+        }
+        binned.push_back(i);
+        grid.bounds.min = { std::min(grid.bounds.min.x, bounds.min.x), std::min(grid.bounds.min.y, bounds.min.y), std::min(grid.bounds.min.z, bounds.min.z) };
+        grid.bounds.max = { std::max(grid.bounds.max.x, bounds.max.x), std::max(grid.bounds.max.y, bounds.max.y), std::max(grid.bounds.max.z, bounds.max.z) };
+    }
+
+    // Cells about twice a typical instance, unless that makes too many of them. Flat axes get a single cell.
+    float size[3];
+    double volume = 1;
+    for (int axis = 0; axis < 3; ++axis)
+    {
+        size[axis] = std::max(axisValue(grid.bounds.max, axis) - axisValue(grid.bounds.min, axis), 1e-4f);
+        volume *= size[axis];
+    }
+    const float cellEdge = std::max(GRID_CELL_SIZE * medianExtent, (float)std::cbrt(volume / GRID_MAX_CELLS));
+    float cellSize[3];
+    for (int axis = 0; axis < 3; ++axis)
+    {
+        grid.resolution[axis] = std::clamp((UINT)std::ceil(size[axis] / cellEdge), 1u, GRID_MAX_CELLS);
+        cellSize[axis] = size[axis] / grid.resolution[axis];
+    }
+    grid.cellSize = { cellSize[0], cellSize[1], cellSize[2] };
+    const UINT cellCount = grid.resolution[0] * grid.resolution[1] * grid.resolution[2];
+
+    // Counting sort of (cell, instance) pairs into per cell lists.
+    grid.cellStart.assign(cellCount + 1, 0);
+    for (UINT i : binned)
+    {
+        UINT first[3], last[3];
+        cellRange(grid, sweptBounds[i], first, last);
+        for (UINT z = first[2]; z <= last[2]; ++z)
+            for (UINT y = first[1]; y <= last[1]; ++y)
+                for (UINT x = first[0]; x <= last[0]; ++x)
+                    ++grid.cellStart[(z * grid.resolution[1] + y) * grid.resolution[0] + x + 1];
+    }
+    for (UINT cell = 0; cell < cellCount; ++cell)
+    {
+        const UINT count = grid.cellStart[cell + 1];
+        grid.occupiedCells += count > 0;
+        grid.maxCellInstances = std::max(grid.maxCellInstances, count);
+        grid.cellStart[cell + 1] += grid.cellStart[cell];
+    }
+
+    grid.cellInstances.resize(grid.cellStart[cellCount]);
+    ArenaVector<UINT> next(grid.cellStart.begin(), grid.cellStart.end() - 1, ScratchArena());
+    for (UINT i : binned)
+    {
+        UINT first[3], last[3];
+        cellRange(grid, sweptBounds[i], first, last);
+        for (UINT z = first[2]; z <= last[2]; ++z)
+            for (UINT y = first[1]; y <= last[1]; ++y)
+                for (UINT x = first[0]; x <= last[0]; ++x)
+                    grid.cellInstances[next[(z * grid.resolution[1] + y) * grid.resolution[0] + x]++] = i;
+    }
+    grid.binnedInstances = (UINT)binned.size();
+}
+
+SPATIAL_INDEX ChooseSpatialIndex(const UniformGrid& grid)
+{
+    // The grid wins with lots of instances spread evenly over it. Every unbinned instance costs every
+    // ray, and crowded cells mean either clustered instances or overlapping ones, both better left to the BVH.
+    if (grid.binnedInstances < GRID_MIN_INSTANCES || grid.unbinned.size() > GRID_MAX_UNBINNED || grid.occupiedCells == 0)
+        return SPATIAL_INDEX_BVH;
+    const float averageCellInstances = (float)grid.cellInstances.size() / grid.occupiedCells;
+    return averageCellInstances <= GRID_MAX_AVERAGE_CELL_INSTANCES ? SPATIAL_INDEX_GRID : SPATIAL_INDEX_BVH;
+}
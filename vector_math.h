@@ -0,0 +1,741 @@
+#pragma once
+
+// The part of DirectXMath the scene, BVH and CPU renderer code uses, for building without it. Names and
+// conventions are the same: row vectors, matrices are four rows r[0..3], M1 * M2 applies M1 first and
+// XMFLOAT3 loads with w = 0. core.h picks it instead of DirectXMath off Windows or with RT_PORTABLE_MATH.
+//
+// SSE2 on x86, NEON on 64 bit ARM and plain floats anywhere else (or with RT_MATH_SCALAR).
+
+#include <cmath>
+#include <cstdint>
+
+#if defined(RT_MATH_SCALAR)
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define RT_MATH_SSE
+#include <emmintrin.h>
+#elif (defined(__ARM_NEON) && defined(__aarch64__)) || defined(_M_ARM64)
+#define RT_MATH_NEON
+#include <arm_neon.h>
+#endif
+
+namespace rtmath
+{
+
+constexpr float XM_PI = 3.141592654f;
+constexpr float XM_2PI = 6.283185307f;
+
+constexpr float XMConvertToRadians(float degrees) { return degrees * (XM_PI / 180.0f); }
+
+#if defined(RT_MATH_SSE)
+constexpr const char* XM_IMPLEMENTATION = "SSE2";
+#elif defined(RT_MATH_NEON)
+constexpr const char* XM_IMPLEMENTATION = "NEON";
+#else
+constexpr const char* XM_IMPLEMENTATION = "scalar";
+#endif
+
+struct XMFLOAT3
+{
+    float x;
+    float y;
+    float z;
+
+    XMFLOAT3() = default;
+    constexpr XMFLOAT3(float _x, float _y, float _z) : x(_x), y(_y), z(_z) {}
+    explicit XMFLOAT3(const float* array) : x(array[0]), y(array[1]), z(array[2]) {}
+};
+
+struct XMFLOAT4
+{
+    float x;
+    float y;
+    float z;
+    float w;
+
+    XMFLOAT4() = default;
+    constexpr XMFLOAT4(float _x, float _y, float _z, float _w) : x(_x), y(_y), z(_z), w(_w) {}
+    explicit XMFLOAT4(const float* array) : x(array[0]), y(array[1]), z(array[2]), w(array[3]) {}
+};
+
+struct XMINT2
+{
+    int32_t x;
+    int32_t y;
+
+    XMINT2() = default;
+    constexpr XMINT2(int32_t _x, int32_t _y) : x(_x), y(_y) {}
+};
+
+// Transposed, rows are the columns of the XMMATRIX. Same layout as D3D12 instance transforms.
+struct XMFLOAT3X4
+{
+    float m[3][4];
+};
+
+struct XMFLOAT4X3
+{
+    float m[4][3];
+};
+
+struct XMFLOAT4X4
+{
+    float m[4][4];
+};
+
+struct XMVECTOR
+{
+#if defined(RT_MATH_SSE)
+    __m128 v;
+#elif defined(RT_MATH_NEON)
+    float32x4_t v;
+#else
+    float v[4];
+#endif
+};
+
+struct XMMATRIX
+{
+    XMVECTOR r[4];
+
+    XMMATRIX() = default;
+    XMMATRIX(XMVECTOR r0, XMVECTOR r1, XMVECTOR r2, XMVECTOR r3) : r{ r0, r1, r2, r3 } {}
+};
+
+using FXMVECTOR = const XMVECTOR;
+using GXMVECTOR = const XMVECTOR;
+using HXMVECTOR = const XMVECTOR;
+using CXMVECTOR = const XMVECTOR&;
+using FXMMATRIX = const XMMATRIX&;
+using CXMMATRIX = const XMMATRIX&;
+
+// Lane wise basics, everything else is built from these.
+
+inline XMVECTOR XMVectorSet(float x, float y, float z, float w)
+{
+#if defined(RT_MATH_SSE)
+    return { _mm_setr_ps(x, y, z, w) };
+#elif defined(RT_MATH_NEON)
+    const float lanes[4] = { x, y, z, w };
+    return { vld1q_f32(lanes) };
+#else
+    return { { x, y, z, w } };
+#endif
+}
+
+inline XMVECTOR XMVectorReplicate(float value)
+{
+#if defined(RT_MATH_SSE)
+    return { _mm_set1_ps(value) };
+#elif defined(RT_MATH_NEON)
+    return { vdupq_n_f32(value) };
+#else
+    return { { value, value, value, value } };
+#endif
+}
+
+inline XMVECTOR XMVectorZero()
+{
+    return XMVectorReplicate(0.0f);
+}
+
+inline float XMVectorGetX(FXMVECTOR V)
+{
+#if defined(RT_MATH_SSE)
+    return _mm_cvtss_f32(V.v);
+#elif defined(RT_MATH_NEON)
+    return vgetq_lane_f32(V.v, 0);
+#else
+    return V.v[0];
+#endif
+}
+
+inline float XMVectorGetY(FXMVECTOR V)
+{
+#if defined(RT_MATH_SSE)
+    return _mm_cvtss_f32(_mm_shuffle_ps(V.v, V.v, _MM_SHUFFLE(1, 1, 1, 1)));
+#elif defined(RT_MATH_NEON)
+    return vgetq_lane_f32(V.v, 1);
+#else
+    return V.v[1];
+#endif
+}
+
+inline float XMVectorGetZ(FXMVECTOR V)
+{
+#if defined(RT_MATH_SSE)
+    return _mm_cvtss_f32(_mm_shuffle_ps(V.v, V.v, _MM_SHUFFLE(2, 2, 2, 2)));
+#elif defined(RT_MATH_NEON)
+    return vgetq_lane_f32(V.v, 2);
+#else
+    return V.v[2];
+#endif
+}
+
+inline float XMVectorGetW(FXMVECTOR V)
+{
+#if defined(RT_MATH_SSE)
+    return _mm_cvtss_f32(_mm_shuffle_ps(V.v, V.v, _MM_SHUFFLE(3, 3, 3, 3)));
+#elif defined(RT_MATH_NEON)
+    return vgetq_lane_f32(V.v, 3);
+#else
+    return V.v[3];
+#endif
+}
+
+inline XMVECTOR XMVectorSplatX(FXMVECTOR V)
+{
+#if defined(RT_MATH_SSE)
+    return { _mm_shuffle_ps(V.v, V.v, _MM_SHUFFLE(0, 0, 0, 0)) };
+#elif defined(RT_MATH_NEON)
+    return { vdupq_laneq_f32(V.v, 0) };
+#else
+    return XMVectorReplicate(V.v[0]);
+#endif
+}
+
+inline XMVECTOR XMVectorSplatY(FXMVECTOR V)
+{
+#if defined(RT_MATH_SSE)
+    return { _mm_shuffle_ps(V.v, V.v, _MM_SHUFFLE(1, 1, 1, 1)) };
+#elif defined(RT_MATH_NEON)
+    return { vdupq_laneq_f32(V.v, 1) };
+#else
+    return XMVectorReplicate(V.v[1]);
+#endif
+}
+
+inline XMVECTOR XMVectorSplatZ(FXMVECTOR V)
+{
+#if defined(RT_MATH_SSE)
+    return { _mm_shuffle_ps(V.v, V.v, _MM_SHUFFLE(2, 2, 2, 2)) };
+#elif defined(RT_MATH_NEON)
+    return { vdupq_laneq_f32(V.v, 2) };
+#else
+    return XMVectorReplicate(V.v[2]);
+#endif
+}
+
+inline XMVECTOR XMVectorSplatW(FXMVECTOR V)
+{
+#if defined(RT_MATH_SSE)
+    return { _mm_shuffle_ps(V.v, V.v, _MM_SHUFFLE(3, 3, 3, 3)) };
+#elif defined(RT_MATH_NEON)
+    return { vdupq_laneq_f32(V.v, 3) };
+#else
+    return XMVectorReplicate(V.v[3]);
+#endif
+}
+
+inline XMVECTOR XMVectorSetW(FXMVECTOR V, float w)
+{
+#if defined(RT_MATH_SSE)
+    // (z, w, ...) from the high half of V and the new w, then (x, y) from V in front of it.
+    __m128 zw = _mm_unpacklo_ps(_mm_movehl_ps(V.v, V.v), _mm_set_ss(w));
+    return { _mm_shuffle_ps(V.v, zw, _MM_SHUFFLE(1, 0, 1, 0)) };
+#elif defined(RT_MATH_NEON)
+    return { vsetq_lane_f32(w, V.v, 3) };
+#else
+    return { { V.v[0], V.v[1], V.v[2], w } };
+#endif
+}
+
+inline XMVECTOR XMVectorAdd(FXMVECTOR V1, FXMVECTOR V2)
+{
+#if defined(RT_MATH_SSE)
+    return { _mm_add_ps(V1.v, V2.v) };
+#elif defined(RT_MATH_NEON)
+    return { vaddq_f32(V1.v, V2.v) };
+#else
+    return { { V1.v[0] + V2.v[0], V1.v[1] + V2.v[1], V1.v[2] + V2.v[2], V1.v[3] + V2.v[3] } };
+#endif
+}
+
+inline XMVECTOR XMVectorSubtract(FXMVECTOR V1, FXMVECTOR V2)
+{
+#if defined(RT_MATH_SSE)
+    return { _mm_sub_ps(V1.v, V2.v) };
+#elif defined(RT_MATH_NEON)
+    return { vsubq_f32(V1.v, V2.v) };
+#else
+    return { { V1.v[0] - V2.v[0], V1.v[1] - V2.v[1], V1.v[2] - V2.v[2], V1.v[3] - V2.v[3] } };
+#endif
+}
+
+inline XMVECTOR XMVectorMultiply(FXMVECTOR V1, FXMVECTOR V2)
+{
+#if defined(RT_MATH_SSE)
+    return { _mm_mul_ps(V1.v, V2.v) };
+#elif defined(RT_MATH_NEON)
+    return { vmulq_f32(V1.v, V2.v) };
+#else
+    return { { V1.v[0] * V2.v[0], V1.v[1] * V2.v[1], V1.v[2] * V2.v[2], V1.v[3] * V2.v[3] } };
+#endif
+}
+
+inline XMVECTOR XMVectorDivide(FXMVECTOR V1, FXMVECTOR V2)
+{
+#if defined(RT_MATH_SSE)
+    return { _mm_div_ps(V1.v, V2.v) };
+#elif defined(RT_MATH_NEON)
+    return { vdivq_f32(V1.v, V2.v) };
+#else
+    return { { V1.v[0] / V2.v[0], V1.v[1] / V2.v[1], V1.v[2] / V2.v[2], V1.v[3] / V2.v[3] } };
+#endif
+}
+
+// V1 * V2 + V3.
+inline XMVECTOR XMVectorMultiplyAdd(FXMVECTOR V1, FXMVECTOR V2, FXMVECTOR V3)
+{
+#if defined(RT_MATH_NEON)
+    return { vmlaq_f32(V3.v, V1.v, V2.v) };
+#else
+    return XMVectorAdd(XMVectorMultiply(V1, V2), V3);
+#endif
+}
+
+inline XMVECTOR XMVectorMin(FXMVECTOR V1, FXMVECTOR V2)
+{
+#if defined(RT_MATH_SSE)
+    return { _mm_min_ps(V1.v, V2.v) };
+#elif defined(RT_MATH_NEON)
+    return { vminq_f32(V1.v, V2.v) };
+#else
+    return { { std::fmin(V1.v[0], V2.v[0]), std::fmin(V1.v[1], V2.v[1]), std::fmin(V1.v[2], V2.v[2]), std::fmin(V1.v[3], V2.v[3]) } };
+#endif
+}
+
+inline XMVECTOR XMVectorMax(FXMVECTOR V1, FXMVECTOR V2)
+{
+#if defined(RT_MATH_SSE)
+    return { _mm_max_ps(V1.v, V2.v) };
+#elif defined(RT_MATH_NEON)
+    return { vmaxq_f32(V1.v, V2.v) };
+#else
+    return { { std::fmax(V1.v[0], V2.v[0]), std::fmax(V1.v[1], V2.v[1]), std::fmax(V1.v[2], V2.v[2]), std::fmax(V1.v[3], V2.v[3]) } };
+#endif
+}
+
+inline XMVECTOR XMVectorSqrt(FXMVECTOR V)
+{
+#if defined(RT_MATH_SSE)
+    return { _mm_sqrt_ps(V.v) };
+#elif defined(RT_MATH_NEON)
+    return { vsqrtq_f32(V.v) };
+#else
+    return { { std::sqrt(V.v[0]), std::sqrt(V.v[1]), std::sqrt(V.v[2]), std::sqrt(V.v[3]) } };
+#endif
+}
+
+inline XMVECTOR XMVectorScale(FXMVECTOR V, float scale)
+{
+    return XMVectorMultiply(V, XMVectorReplicate(scale));
+}
+
+inline XMVECTOR XMVectorNegate(FXMVECTOR V)
+{
+    return XMVectorSubtract(XMVectorZero(), V);
+}
+
+inline XMVECTOR XMVectorReciprocal(FXMVECTOR V)
+{
+    return XMVectorDivide(XMVectorReplicate(1.0f), V);
+}
+
+inline XMVECTOR XMVectorLerp(FXMVECTOR V0, FXMVECTOR V1, float t)
+{
+    return XMVectorMultiplyAdd(XMVectorSubtract(V1, V0), XMVectorReplicate(t), V0);
+}
+
+// Sine and cosine of every lane, with the same minimax polynomials as DirectXMath (about 1e-7 off in
+// [-pi, pi], the range reduction loses a bit more on larger angles).
+inline void XMVectorSinCos(XMVECTOR* sine, XMVECTOR* cosine, FXMVECTOR V)
+{
+#if defined(RT_MATH_SSE)
+    // Wrap to [-pi, pi], then fold into [-pi/2, pi/2], where the sine stays the same and the cosine flips.
+    __m128 quotient = _mm_cvtepi32_ps(_mm_cvtps_epi32(_mm_mul_ps(V.v, _mm_set1_ps(1.0f / XM_2PI))));
+    __m128 x = _mm_sub_ps(V.v, _mm_mul_ps(quotient, _mm_set1_ps(XM_2PI)));
+    __m128 signBit = _mm_and_ps(x, _mm_set1_ps(-0.0f));
+    __m128 pi = _mm_or_ps(_mm_set1_ps(XM_PI), signBit); // pi with the sign of x.
+    __m128 folded = _mm_cmpgt_ps(_mm_andnot_ps(_mm_set1_ps(-0.0f), x), _mm_set1_ps(XM_PI / 2));
+    x = _mm_or_ps(_mm_and_ps(folded, _mm_sub_ps(pi, x)), _mm_andnot_ps(folded, x));
+    __m128 cosineSign = _mm_or_ps(_mm_and_ps(folded, _mm_set1_ps(-1.0f)), _mm_andnot_ps(folded, _mm_set1_ps(1.0f)));
+    __m128 x2 = _mm_mul_ps(x, x);
+
+    __m128 s = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(-2.3889859e-08f), x2), _mm_set1_ps(2.7525562e-06f));
+    s = _mm_add_ps(_mm_mul_ps(s, x2), _mm_set1_ps(-0.00019840874f));
+    s = _mm_add_ps(_mm_mul_ps(s, x2), _mm_set1_ps(0.0083333310f));
+    s = _mm_add_ps(_mm_mul_ps(s, x2), _mm_set1_ps(-0.16666667f));
+    s = _mm_add_ps(_mm_mul_ps(s, x2), _mm_set1_ps(1.0f));
+    sine->v = _mm_mul_ps(s, x);
+
+    __m128 c = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(-2.6051615e-07f), x2), _mm_set1_ps(2.4760495e-05f));
+    c = _mm_add_ps(_mm_mul_ps(c, x2), _mm_set1_ps(-0.0013888378f));
+    c = _mm_add_ps(_mm_mul_ps(c, x2), _mm_set1_ps(0.041666638f));
+    c = _mm_add_ps(_mm_mul_ps(c, x2), _mm_set1_ps(-0.5f));
+    c = _mm_add_ps(_mm_mul_ps(c, x2), _mm_set1_ps(1.0f));
+    cosine->v = _mm_mul_ps(c, cosineSign);
+#else
+    float lanes[4] = { XMVectorGetX(V), XMVectorGetY(V), XMVectorGetZ(V), XMVectorGetW(V) };
+    float sines[4], cosines[4];
+    for (int i = 0; i < 4; ++i)
+    {
+        float x = lanes[i] - XM_2PI * std::nearbyint(lanes[i] * (1.0f / XM_2PI));
+        float cosineSign = 1.0f;
+        if (std::fabs(x) > XM_PI / 2)
+        {
+            x = std::copysign(XM_PI, x) - x;
+            cosineSign = -1.0f;
+        }
+        float x2 = x * x;
+        sines[i] = (((((-2.3889859e-08f * x2 + 2.7525562e-06f) * x2 - 0.00019840874f) * x2 + 0.0083333310f) * x2 - 0.16666667f) * x2 + 1.0f) * x;
+        cosines[i] = (((((-2.6051615e-07f * x2 + 2.4760495e-05f) * x2 - 0.0013888378f) * x2 + 0.041666638f) * x2 - 0.5f) * x2 + 1.0f) * cosineSign;
+    }
+    *sine = XMVectorSet(sines[0], sines[1], sines[2], sines[3]);
+    *cosine = XMVectorSet(cosines[0], cosines[1], cosines[2], cosines[3]);
+#endif
+}
+
+// Dot products, replicated into all four lanes.
+
+inline XMVECTOR XMVector3Dot(FXMVECTOR V1, FXMVECTOR V2)
+{
+#if defined(RT_MATH_SSE)
+    __m128 product = _mm_mul_ps(V1.v, V2.v);
+    __m128 sum = _mm_add_ss(product, _mm_shuffle_ps(product, product, _MM_SHUFFLE(1, 1, 1, 1)));
+    sum = _mm_add_ss(sum, _mm_shuffle_ps(product, product, _MM_SHUFFLE(2, 2, 2, 2)));
+    return { _mm_shuffle_ps(sum, sum, _MM_SHUFFLE(0, 0, 0, 0)) };
+#elif defined(RT_MATH_NEON)
+    float32x4_t product = vmulq_f32(V1.v, V2.v);
+    return XMVectorReplicate(vgetq_lane_f32(product, 0) + vgetq_lane_f32(product, 1) + vgetq_lane_f32(product, 2));
+#else
+    return XMVectorReplicate(V1.v[0] * V2.v[0] + V1.v[1] * V2.v[1] + V1.v[2] * V2.v[2]);
+#endif
+}
+
+inline XMVECTOR XMVector4Dot(FXMVECTOR V1, FXMVECTOR V2)
+{
+#if defined(RT_MATH_SSE)
+    __m128 product = _mm_mul_ps(V1.v, V2.v);
+    __m128 sum = _mm_add_ps(product, _mm_shuffle_ps(product, product, _MM_SHUFFLE(2, 3, 0, 1)));
+    return { _mm_add_ps(sum, _mm_shuffle_ps(sum, sum, _MM_SHUFFLE(1, 0, 3, 2))) };
+#elif defined(RT_MATH_NEON)
+    return XMVectorReplicate(vaddvq_f32(vmulq_f32(V1.v, V2.v)));
+#else
+    return XMVectorReplicate(V1.v[0] * V2.v[0] + V1.v[1] * V2.v[1] + V1.v[2] * V2.v[2] + V1.v[3] * V2.v[3]);
+#endif
+}
+
+inline XMVECTOR XMVector3Cross(FXMVECTOR V1, FXMVECTOR V2)
+{
+#if defined(RT_MATH_SSE)
+    // (V1 * V2.yzx - V1.yzx * V2).yzx, w ends up 0.
+    __m128 v1yzx = _mm_shuffle_ps(V1.v, V1.v, _MM_SHUFFLE(3, 0, 2, 1));
+    __m128 v2yzx = _mm_shuffle_ps(V2.v, V2.v, _MM_SHUFFLE(3, 0, 2, 1));
+    __m128 zxy = _mm_sub_ps(_mm_mul_ps(V1.v, v2yzx), _mm_mul_ps(v1yzx, V2.v));
+    return { _mm_shuffle_ps(zxy, zxy, _MM_SHUFFLE(3, 0, 2, 1)) };
+#else
+    float x1 = XMVectorGetX(V1), y1 = XMVectorGetY(V1), z1 = XMVectorGetZ(V1);
+    float x2 = XMVectorGetX(V2), y2 = XMVectorGetY(V2), z2 = XMVectorGetZ(V2);
+    return XMVectorSet(y1 * z2 - z1 * y2, z1 * x2 - x1 * z2, x1 * y2 - y1 * x2, 0.0f);
+#endif
+}
+
+inline XMVECTOR XMVector3LengthSq(FXMVECTOR V)
+{
+    return XMVector3Dot(V, V);
+}
+
+inline XMVECTOR XMVector3Length(FXMVECTOR V)
+{
+    return XMVectorSqrt(XMVector3Dot(V, V));
+}
+
+inline XMVECTOR XMVector4Length(FXMVECTOR V)
+{
+    return XMVectorSqrt(XMVector4Dot(V, V));
+}
+
+// Zero stays zero, like in DirectXMath.
+inline XMVECTOR XMVector3Normalize(FXMVECTOR V)
+{
+    XMVECTOR length = XMVector3Length(V);
+    return XMVectorGetX(length) > 0.0f ? XMVectorDivide(V, length) : XMVectorZero();
+}
+
+inline XMVECTOR XMVector4Normalize(FXMVECTOR V)
+{
+    XMVECTOR length = XMVector4Length(V);
+    return XMVectorGetX(length) > 0.0f ? XMVectorDivide(V, length) : XMVectorZero();
+}
+
+inline XMVECTOR XMVector4AngleBetweenVectors(FXMVECTOR V1, FXMVECTOR V2)
+{
+    float cosAngle = XMVectorGetX(XMVector4Dot(V1, V2)) / (XMVectorGetX(XMVector4Length(V1)) * XMVectorGetX(XMVector4Length(V2)));
+    return XMVectorReplicate(std::acos(std::fmin(std::fmax(cosAngle, -1.0f), 1.0f)));
+}
+
+inline bool XMVector3Equal(FXMVECTOR V1, FXMVECTOR V2)
+{
+#if defined(RT_MATH_SSE)
+    return (_mm_movemask_ps(_mm_cmpeq_ps(V1.v, V2.v)) & 7) == 7;
+#else
+    return XMVectorGetX(V1) == XMVectorGetX(V2) && XMVectorGetY(V1) == XMVectorGetY(V2) && XMVectorGetZ(V1) == XMVectorGetZ(V2);
+#endif
+}
+
+// Loads and stores.
+
+inline XMVECTOR XMLoadFloat3(const XMFLOAT3* source)
+{
+    return XMVectorSet(source->x, source->y, source->z, 0.0f);
+}
+
+inline XMVECTOR XMLoadFloat4(const XMFLOAT4* source)
+{
+    return XMVectorSet(source->x, source->y, source->z, source->w);
+}
+
+inline void XMStoreFloat3(XMFLOAT3* destination, FXMVECTOR V)
+{
+    destination->x = XMVectorGetX(V);
+    destination->y = XMVectorGetY(V);
+    destination->z = XMVectorGetZ(V);
+}
+
+inline void XMStoreFloat4(XMFLOAT4* destination, FXMVECTOR V)
+{
+#if defined(RT_MATH_SSE)
+    _mm_storeu_ps(&destination->x, V.v);
+#elif defined(RT_MATH_NEON)
+    vst1q_f32(&destination->x, V.v);
+#else
+    *destination = XMFLOAT4(V.v);
+#endif
+}
+
+// Matrices.
+
+inline XMMATRIX XMMatrixSet(float m00, float m01, float m02, float m03,
+                            float m10, float m11, float m12, float m13,
+                            float m20, float m21, float m22, float m23,
+                            float m30, float m31, float m32, float m33)
+{
+    return { XMVectorSet(m00, m01, m02, m03), XMVectorSet(m10, m11, m12, m13),
+             XMVectorSet(m20, m21, m22, m23), XMVectorSet(m30, m31, m32, m33) };
+}
+
+inline XMMATRIX XMMatrixIdentity()
+{
+    return XMMatrixSet(1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1);
+}
+
+inline XMMATRIX XMMatrixTranslation(float x, float y, float z)
+{
+    return XMMatrixSet(1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0, x, y, z, 1);
+}
+
+inline XMMATRIX XMMatrixScaling(float x, float y, float z)
+{
+    return XMMatrixSet(x, 0, 0, 0, 0, y, 0, 0, 0, 0, z, 0, 0, 0, 0, 1);
+}
+
+// Roll around z first, then pitch around x, then yaw around y.
+inline XMMATRIX XMMatrixRotationRollPitchYaw(float pitch, float yaw, float roll)
+{
+    XMVECTOR sines, cosines;
+    XMVectorSinCos(&sines, &cosines, XMVectorSet(pitch, yaw, roll, 0.0f));
+    float cp = XMVectorGetX(cosines), sp = XMVectorGetX(sines);
+    float cy = XMVectorGetY(cosines), sy = XMVectorGetY(sines);
+    float cr = XMVectorGetZ(cosines), sr = XMVectorGetZ(sines);
+    return XMMatrixSet(cr * cy + sr * sp * sy, sr * cp, sr * sp * cy - cr * sy, 0,
+                       cr * sp * sy - sr * cy, cr * cp, sr * sy + cr * sp * cy, 0,
+                       cp * sy, -sp, cp * cy, 0,
+                       0, 0, 0, 1);
+}
+
+inline XMMATRIX XMMatrixRotationAxis(FXMVECTOR axis, float angle)
+{
+    XMVECTOR n = XMVector3Normalize(axis);
+    float x = XMVectorGetX(n), y = XMVectorGetY(n), z = XMVectorGetZ(n);
+    XMVECTOR sines, cosines;
+    XMVectorSinCos(&sines, &cosines, XMVectorReplicate(angle));
+    float c = XMVectorGetX(cosines), s = XMVectorGetX(sines), t = 1.0f - c;
+    return XMMatrixSet(t * x * x + c, t * x * y + s * z, t * x * z - s * y, 0,
+                       t * x * y - s * z, t * y * y + c, t * y * z + s * x, 0,
+                       t * x * z + s * y, t * y * z - s * x, t * z * z + c, 0,
+                       0, 0, 0, 1);
+}
+
+inline XMMATRIX XMMatrixTranspose(FXMMATRIX M)
+{
+#if defined(RT_MATH_SSE)
+    __m128 r0 = M.r[0].v, r1 = M.r[1].v, r2 = M.r[2].v, r3 = M.r[3].v;
+    _MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+    return { { r0 }, { r1 }, { r2 }, { r3 } };
+#else
+    float m[4][4];
+    for (int i = 0; i < 4; ++i)
+    {
+        m[0][i] = XMVectorGetX(M.r[i]);
+        m[1][i] = XMVectorGetY(M.r[i]);
+        m[2][i] = XMVectorGetZ(M.r[i]);
+        m[3][i] = XMVectorGetW(M.r[i]);
+    }
+    return XMMatrixSet(m[0][0], m[0][1], m[0][2], m[0][3], m[1][0], m[1][1], m[1][2], m[1][3],
+                       m[2][0], m[2][1], m[2][2], m[2][3], m[3][0], m[3][1], m[3][2], m[3][3]);
+#endif
+}
+
+// Row vector times matrix, every row is a combination of the rows of M2.
+inline XMVECTOR XMVector4Transform(FXMVECTOR V, FXMMATRIX M)
+{
+    XMVECTOR result = XMVectorMultiply(XMVectorSplatX(V), M.r[0]);
+    result = XMVectorMultiplyAdd(XMVectorSplatY(V), M.r[1], result);
+    result = XMVectorMultiplyAdd(XMVectorSplatZ(V), M.r[2], result);
+    return XMVectorMultiplyAdd(XMVectorSplatW(V), M.r[3], result);
+}
+
+// Point with w = 1, the result keeps whatever w the matrix gives it.
+inline XMVECTOR XMVector3Transform(FXMVECTOR V, FXMMATRIX M)
+{
+    XMVECTOR result = XMVectorMultiplyAdd(XMVectorSplatX(V), M.r[0], M.r[3]);
+    result = XMVectorMultiplyAdd(XMVectorSplatY(V), M.r[1], result);
+    return XMVectorMultiplyAdd(XMVectorSplatZ(V), M.r[2], result);
+}
+
+// Point with w = 1, divided by the resulting w.
+inline XMVECTOR XMVector3TransformCoord(FXMVECTOR V, FXMMATRIX M)
+{
+    XMVECTOR result = XMVector3Transform(V, M);
+    return XMVectorDivide(result, XMVectorSplatW(result));
+}
+
+// Direction, w = 0 so the translation doesn't apply.
+inline XMVECTOR XMVector3TransformNormal(FXMVECTOR V, FXMMATRIX M)
+{
+    XMVECTOR result = XMVectorMultiply(XMVectorSplatX(V), M.r[0]);
+    result = XMVectorMultiplyAdd(XMVectorSplatY(V), M.r[1], result);
+    return XMVectorMultiplyAdd(XMVectorSplatZ(V), M.r[2], result);
+}
+
+inline XMMATRIX XMMatrixMultiply(FXMMATRIX M1, CXMMATRIX M2)
+{
+    return { XMVector4Transform(M1.r[0], M2), XMVector4Transform(M1.r[1], M2),
+             XMVector4Transform(M1.r[2], M2), XMVector4Transform(M1.r[3], M2) };
+}
+
+// General inverse by cofactors. Singular matrices give infinities, like in DirectXMath.
+inline XMMATRIX XMMatrixInverse(XMVECTOR* determinant, FXMMATRIX M)
+{
+    float m[16];
+    for (int i = 0; i < 4; ++i)
+    {
+        m[i * 4 + 0] = XMVectorGetX(M.r[i]);
+        m[i * 4 + 1] = XMVectorGetY(M.r[i]);
+        m[i * 4 + 2] = XMVectorGetZ(M.r[i]);
+        m[i * 4 + 3] = XMVectorGetW(M.r[i]);
+    }
+
+    // 2x2 minors of the top two and bottom two rows.
+    float s0 = m[0] * m[5] - m[4] * m[1];
+    float s1 = m[0] * m[6] - m[4] * m[2];
+    float s2 = m[0] * m[7] - m[4] * m[3];
+    float s3 = m[1] * m[6] - m[5] * m[2];
+    float s4 = m[1] * m[7] - m[5] * m[3];
+    float s5 = m[2] * m[7] - m[6] * m[3];
+    float c5 = m[10] * m[15] - m[14] * m[11];
+    float c4 = m[9] * m[15] - m[13] * m[11];
+    float c3 = m[9] * m[14] - m[13] * m[10];
+    float c2 = m[8] * m[15] - m[12] * m[11];
+    float c1 = m[8] * m[14] - m[12] * m[10];
+    float c0 = m[8] * m[13] - m[12] * m[9];
+
+    float det = s0 * c5 - s1 * c4 + s2 * c3 + s3 * c2 - s4 * c1 + s5 * c0;
+    if (determinant)
+    {
+        *determinant = XMVectorReplicate(det);
+    }
+    float inv = 1.0f / det;
+
+    return XMMatrixSet(
+        (m[5] * c5 - m[6] * c4 + m[7] * c3) * inv,
+        (-m[1] * c5 + m[2] * c4 - m[3] * c3) * inv,
+        (m[13] * s5 - m[14] * s4 + m[15] * s3) * inv,
+        (-m[9] * s5 + m[10] * s4 - m[11] * s3) * inv,
+
+        (-m[4] * c5 + m[6] * c2 - m[7] * c1) * inv,
+        (m[0] * c5 - m[2] * c2 + m[3] * c1) * inv,
+        (-m[12] * s5 + m[14] * s2 - m[15] * s1) * inv,
+        (m[8] * s5 - m[10] * s2 + m[11] * s1) * inv,
+
+        (m[4] * c4 - m[5] * c2 + m[7] * c0) * inv,
+        (-m[0] * c4 + m[1] * c2 - m[3] * c0) * inv,
+        (m[12] * s4 - m[13] * s2 + m[15] * s0) * inv,
+        (-m[8] * s4 + m[9] * s2 - m[11] * s0) * inv,
+
+        (-m[4] * c3 + m[5] * c1 - m[6] * c0) * inv,
+        (m[0] * c3 - m[1] * c1 + m[2] * c0) * inv,
+        (-m[12] * s3 + m[13] * s1 - m[14] * s0) * inv,
+        (m[8] * s3 - m[9] * s1 + m[10] * s0) * inv);
+}
+
+inline XMMATRIX XMLoadFloat4x3(const XMFLOAT4X3* source)
+{
+    const float(&m)[4][3] = source->m;
+    return XMMatrixSet(m[0][0], m[0][1], m[0][2], 0,
+                       m[1][0], m[1][1], m[1][2], 0,
+                       m[2][0], m[2][1], m[2][2], 0,
+                       m[3][0], m[3][1], m[3][2], 1);
+}
+
+inline void XMStoreFloat4x3(XMFLOAT4X3* destination, FXMMATRIX M)
+{
+    for (int i = 0; i < 4; ++i)
+    {
+        destination->m[i][0] = XMVectorGetX(M.r[i]);
+        destination->m[i][1] = XMVectorGetY(M.r[i]);
+        destination->m[i][2] = XMVectorGetZ(M.r[i]);
+    }
+}
+
+inline void XMStoreFloat3x4(XMFLOAT3X4* destination, FXMMATRIX M)
+{
+    XMMATRIX transposed = XMMatrixTranspose(M);
+    for (int i = 0; i < 3; ++i)
+    {
+        XMStoreFloat4(reinterpret_cast<XMFLOAT4*>(destination->m[i]), transposed.r[i]);
+    }
+}
+
+inline void XMStoreFloat4x4(XMFLOAT4X4* destination, FXMMATRIX M)
+{
+    for (int i = 0; i < 4; ++i)
+    {
+        XMStoreFloat4(reinterpret_cast<XMFLOAT4*>(destination->m[i]), M.r[i]);
+    }
+}
+
+// Operators, same set as DirectXMath.
+
+inline XMVECTOR operator+(FXMVECTOR V) { return V; }
+inline XMVECTOR operator-(FXMVECTOR V) { return XMVectorNegate(V); }
+
+inline XMVECTOR operator+(FXMVECTOR V1, FXMVECTOR V2) { return XMVectorAdd(V1, V2); }
+inline XMVECTOR operator-(FXMVECTOR V1, FXMVECTOR V2) { return XMVectorSubtract(V1, V2); }
+inline XMVECTOR operator*(FXMVECTOR V1, FXMVECTOR V2) { return XMVectorMultiply(V1, V2); }
+inline XMVECTOR operator/(FXMVECTOR V1, FXMVECTOR V2) { return XMVectorDivide(V1, V2); }
+inline XMVECTOR operator*(FXMVECTOR V, float s) { return XMVectorScale(V, s); }
+inline XMVECTOR operator*(float s, FXMVECTOR V) { return XMVectorScale(V, s); }
+inline XMVECTOR operator/(FXMVECTOR V, float s) { return XMVectorDivide(V, XMVectorReplicate(s)); }
+
+inline XMVECTOR& operator+=(XMVECTOR& V1, FXMVECTOR V2) { return V1 = XMVectorAdd(V1, V2); }
+inline XMVECTOR& operator-=(XMVECTOR& V1, FXMVECTOR V2) { return V1 = XMVectorSubtract(V1, V2); }
+inline XMVECTOR& operator*=(XMVECTOR& V1, FXMVECTOR V2) { return V1 = XMVectorMultiply(V1, V2); }
+inline XMVECTOR& operator/=(XMVECTOR& V1, FXMVECTOR V2) { return V1 = XMVectorDivide(V1, V2); }
+inline XMVECTOR& operator*=(XMVECTOR& V, float s) { return V = XMVectorScale(V, s); }
+inline XMVECTOR& operator/=(XMVECTOR& V, float s) { return V = V / s; }
+
+inline XMMATRIX operator*(FXMMATRIX M1, CXMMATRIX M2) { return XMMatrixMultiply(M1, M2); }
+inline XMMATRIX& operator*=(XMMATRIX& M1, CXMMATRIX M2) { return M1 = XMMatrixMultiply(M1, M2); }
+
+} // namespace rtmath
@@ -0,0 +1,364 @@
+#include "core.h"
+#include <fstream>
+
+// Smoke with a density that varies over a voxel grid. Free flight distances are sampled with delta
+// tracking: tentative collisions come from an exponential step against a majorant (a density at
+// least as high as the real one), and are real collisions with probability density / majorant.
+// Instead of one majorant for the whole volume we keep one per block of voxels and walk those
+// blocks with a 3D-DDA, so empty blocks are skipped without a single step and sparse ones take big
+// steps. Transmittance is estimated with ratio tracking over the same blocks.
+// The fixed step ray march at the end is only here to compare against in the benchmarks.
+// Grid files are:
+//   UINT magic, version, resolution x, y, z, encoding
+//   encoding 0: one float per voxel
+//   encoding 1: runs of UINT zero voxel count, UINT nonzero voxel count, then the nonzero floats,
+//               until all voxels are covered
+
+using namespace DirectX;
+
+namespace
+{
+    constexpr UINT GRID_MAGIC = 0x47565452; // "RTVG"
+    constexpr UINT GRID_VERSION = 1;
+    constexpr UINT GRID_ENCODING_RAW = 0;
+    constexpr UINT GRID_ENCODING_ZERO_RUNS = 1;
+
+    template <typename T>
+    void readValues(std::ifstream& file, const std::string& path, T* values, size_t count)
+    {
+        file.read(reinterpret_cast<char*>(values), count * sizeof(T));
+        if (!file)
+        {
+            throw std::runtime_error("Truncated density grid file: " + path);
+        }
+    }
+
+    template <typename T>
+    void writeValues(std::ofstream& file, const T* values, size_t count)
+    {
+        file.write(reinterpret_cast<const char*>(values), count * sizeof(T));
+    }
+
+    size_t voxelIndex(const DensityGrid& grid, UINT x, UINT y, UINT z)
+    {
+        return x + (size_t)grid.resolution[0] * (y + (size_t)grid.resolution[1] * z);
+    }
+
+    // Walks the majorant cells the ray passes between tEnter and tExit, calling
+    // visit(cell, t0, t1, majorant) for every one until it returns true.
+    // The object space cube [-1, 1]^3 is [0, resolution] in voxel space, t is the same in all of them.
+    template <typename Visit>
+    bool forEachMajorantCell(const DensityGrid& grid, FXMVECTOR origin, FXMVECTOR direction, float tEnter, float tExit,
+        VolumeTrackingStats* stats, Visit visit)
+    {
+        if (tEnter >= tExit)
+            return false;
+
+        XMFLOAT3 o, d;
+        XMStoreFloat3(&o, origin);
+        XMStoreFloat3(&d, direction);
+        const float rayOrigin[3] = { o.x, o.y, o.z };
+        const float rayDirection[3] = { d.x, d.y, d.z };
+
+        int cell[3], step[3], end[3];
+        float tNext[3], tDelta[3];
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            // In majorant cell units.
+            const float scale = 0.5f * grid.resolution[axis] / grid.majorantBlock;
+            const float position = (rayOrigin[axis] + tEnter * rayDirection[axis] + 1) * scale;
+            const float direction = rayDirection[axis] * scale;
+            const int cells = (int)grid.majorantResolution[axis];
+            cell[axis] = std::clamp((int)std::floor(position), 0, cells - 1);
+
+            if (direction > 0)
+            {
+                step[axis] = 1;
+                end[axis] = cells;
+                tNext[axis] = tEnter + (cell[axis] + 1 - position) / direction;
+                tDelta[axis] = 1 / direction;
+            }
+            else if (direction < 0)
+            {
+                step[axis] = -1;
+                end[axis] = -1;
+                tNext[axis] = tEnter + (cell[axis] - position) / direction;
+                tDelta[axis] = -1 / direction;
+            }
+            else
+            {
+                step[axis] = 0;
+                end[axis] = -1;
+                tNext[axis] = FLT_MAX;
+                tDelta[axis] = FLT_MAX;
+            }
+        }
+
+        float t = tEnter;
+        while (t < tExit)
+        {
+            const int axis = (tNext[0] < tNext[1]) ? (tNext[0] < tNext[2] ? 0 : 2) : (tNext[1] < tNext[2] ? 1 : 2);
+            const float tCellExit = std::min(tNext[axis], tExit);
+            const float majorant = grid.majorants[cell[0] + grid.majorantResolution[0] * (cell[1] + grid.majorantResolution[1] * cell[2])];
+            if (stats)
+                ++stats->majorantCells;
+
+            if (majorant > 0 && visit(cell, t, tCellExit, majorant))
+                return true;
+
+            t = tCellExit;
+            cell[axis] += step[axis];
+            if (cell[axis] == end[axis])
+                break;
+            tNext[axis] += tDelta[axis];
+        }
+        return false;
+    }
+
+    // Nearest voxel. Inside a majorant cell it's kept to that cell, so rounding at the cell faces
+    // can never pick a voxel the majorant doesn't bound.
+    float lookupDensity(const DensityGrid& grid, FXMVECTOR origin, FXMVECTOR direction, float t, const int* cell,
+        VolumeTrackingStats* stats)
+    {
+        XMFLOAT3 p;
+        XMStoreFloat3(&p, origin + t * direction);
+        const float position[3] = { p.x, p.y, p.z };
+
+        UINT voxel[3];
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            const int first = cell ? cell[axis] * (int)grid.majorantBlock : 0;
+            const int last = (cell ? std::min(first + (int)grid.majorantBlock, (int)grid.resolution[axis]) : (int)grid.resolution[axis]) - 1;
+            voxel[axis] = (UINT)std::clamp((int)std::floor((position[axis] + 1) * 0.5f * grid.resolution[axis]), first, last);
+        }
+        if (stats)
+            ++stats->densityLookups;
+        return grid.density[voxelIndex(grid, voxel[0], voxel[1], voxel[2])];
+    }
+
+    float voxelStepToT(const DensityGrid& grid, FXMVECTOR direction, float step)
+    {
+        XMFLOAT3 d;
+        XMStoreFloat3(&d, direction);
+        const float voxelLength = std::sqrt(std::pow(0.5f * grid.resolution[0] * d.x, 2.0f) +
+                                            std::pow(0.5f * grid.resolution[1] * d.y, 2.0f) +
+                                            std::pow(0.5f * grid.resolution[2] * d.z, 2.0f));
+        return step / voxelLength;
+    }
+}
+
+DensityGrid LoadDensityGrid(const std::string& path)
+{
+    std::ifstream file(path, std::ios::binary);
+    if (!file)
+    {
+        throw std::runtime_error("Cannot open density grid file: " + path);
+    }
+
+    UINT header[6];
+    readValues(file, path, header, std::size(header));
+    if (header[0] != GRID_MAGIC || header[1] != GRID_VERSION)
+    {
+        throw std::runtime_error("Not a density grid file, or one from a different version: " + path);
+    }
+
+    DensityGrid grid = { .resolution = { header[2], header[3], header[4] } };
+    const size_t voxelCount = (size_t)header[2] * header[3] * header[4];
+    if (voxelCount == 0)
+    {
+        throw std::runtime_error("Empty density grid: " + path);
+    }
+    grid.density.resize(voxelCount);
+
+    if (header[5] == GRID_ENCODING_RAW)
+    {
+        readValues(file, path, grid.density.data(), voxelCount);
+    }
+    else if (header[5] == GRID_ENCODING_ZERO_RUNS)
+    {
+        size_t voxel = 0;
+        while (voxel < voxelCount)
+        {
+            UINT run[2];
+            readValues(file, path, run, 2);
+            if (run[0] + (size_t)run[1] == 0 || run[0] + (size_t)run[1] > voxelCount - voxel)
+            {
+                throw std::runtime_error("Bad density grid run: " + path);
+            }
+            voxel += run[0]; // Already zero.
+            readValues(file, path, grid.density.data() + voxel, run[1]);
+            voxel += run[1];
+        }
+    }
+    else
+    {
+        throw std::runtime_error("Unknown density grid encoding " + std::to_string(header[5]) + ": " + path);
+    }
+
+    for (float& density : grid.density)
+    {
+        density = std::max(density, 0.0f);
+    }
+    BuildMajorantGrid(grid);
+    return grid;
+}
+
+void WriteDensityGrid(const std::string& path, const DensityGrid& grid, bool compressed)
+{
+    std::ofstream file(path, std::ios::binary);
+    const UINT header[] = { GRID_MAGIC, GRID_VERSION, grid.resolution[0], grid.resolution[1], grid.resolution[2],
+                            compressed ? GRID_ENCODING_ZERO_RUNS : GRID_ENCODING_RAW };
+    writeValues(file, header, std::size(header));
+
+    if (!compressed)
+    {
+        writeValues(file, grid.density.data(), grid.density.size());
+    }
+    else
+    {
+        size_t voxel = 0;
+        while (voxel < grid.density.size())
+        {
+            size_t first = voxel;
+            while (voxel < grid.density.size() && grid.density[voxel] == 0)
+                ++voxel;
+            size_t nonzero = voxel;
+            while (voxel < grid.density.size() && grid.density[voxel] != 0)
+                ++voxel;
+            const UINT run[] = { (UINT)(nonzero - first), (UINT)(voxel - nonzero) };
+            writeValues(file, run, 2);
+            writeValues(file, grid.density.data() + nonzero, voxel - nonzero);
+        }
+    }
+
+    if (!file)
+    {
+        throw std::runtime_error("Cannot write density grid file: " + path);
+    }
+}
+
+void BuildMajorantGrid(DensityGrid& grid, UINT block)
+{
+    grid.majorantBlock = block;
+    for (int axis = 0; axis < 3; ++axis)
+    {
+        grid.majorantResolution[axis] = (grid.resolution[axis] + block - 1) / block;
+    }
+    grid.majorants.assign((size_t)grid.majorantResolution[0] * grid.majorantResolution[1] * grid.majorantResolution[2], 0.0f);
+
+    double sum = 0;
+    for (UINT z = 0; z < grid.resolution[2]; ++z)
+    {
+        for (UINT y = 0; y < grid.resolution[1]; ++y)
+        {
+            for (UINT x = 0; x < grid.resolution[0]; ++x)
+            {
+                const float density = grid.density[voxelIndex(grid, x, y, z)];
+                float& majorant = grid.majorants[x / block + grid.majorantResolution[0] *
+                                                 (y / block + grid.majorantResolution[1] * (z / block))];
+                majorant = std::max(majorant, density);
+                sum += density;
+            }
+        }
+    }
+
+    // The material density is the mean of the whole volume, so voxels end up scaled by 1 / mean.
+    grid.meanDensity = (float)(sum / grid.density.size());
+}
+
+bool SampleGridScattering(const DensityGrid& grid, float density, FXMVECTOR origin, FXMVECTOR direction,
+    float tEnter, float tExit, UINT& seed, float& t, VolumeTrackingStats* stats)
+{
+    if (grid.meanDensity <= 0)
+        return false;
+    const float scale = density / grid.meanDensity;
+
+    return forEachMajorantCell(grid, origin, direction, tEnter, tExit, stats,
+        [&](const int* cell, float t0, float t1, float majorant)
+        {
+            // Exponential steps are memoryless, so starting over at every cell face is fine.
+            majorant *= scale;
+            float tentative = t0;
+            while (true)
+            {
+                tentative -= std::log(RandomFloat(seed)) / majorant;
+                if (tentative >= t1)
+                    return false;
+                if (RandomFloat(seed) * majorant < scale * lookupDensity(grid, origin, direction, tentative, cell, stats))
+                {
+                    t = tentative;
+                    return true;
+                }
+            }
+        });
+}
+
+float EstimateGridTransmittance(const DensityGrid& grid, float density, FXMVECTOR origin, FXMVECTOR direction,
+    float tEnter, float tExit, UINT& seed, VolumeTrackingStats* stats)
+{
+    if (grid.meanDensity <= 0)
+        return 1;
+    const float scale = density / grid.meanDensity;
+
+    float transmittance = 1;
+    forEachMajorantCell(grid, origin, direction, tEnter, tExit, stats,
+        [&](const int* cell, float t0, float t1, float majorant)
+        {
+            majorant *= scale;
+            float tentative = t0;
+            while (true)
+            {
+                tentative -= std::log(RandomFloat(seed)) / majorant;
+                if (tentative >= t1)
+                    return false;
+                transmittance *= 1 - scale * lookupDensity(grid, origin, direction, tentative, cell, stats) / majorant;
+            }
+        });
+    return transmittance;
+}
+
+bool MarchGridScattering(const DensityGrid& grid, float density, FXMVECTOR origin, FXMVECTOR direction,
+    float tEnter, float tExit, float step, UINT& seed, float& t, VolumeTrackingStats* stats)
+{
+    if (grid.meanDensity <= 0)
+        return false;
+    const float scale = density / grid.meanDensity;
+    const float tStep = voxelStepToT(grid, direction, step);
+
+    // Steps through the whole volume until the optical depth passes an exponentially distributed
+    // target, taking the density in the middle of each step for all of it.
+    float target = -std::log(RandomFloat(seed));
+    for (float t0 = tEnter; t0 < tExit; t0 += tStep)
+    {
+        const float t1 = std::min(t0 + tStep, tExit);
+        if (stats)
+            ++stats->majorantCells;
+        const float extinction = scale * lookupDensity(grid, origin, direction, 0.5f * (t0 + t1), nullptr, stats);
+        if (extinction * (t1 - t0) >= target)
+        {
+            t = t0 + target / extinction;
+            return true;
+        }
+        target -= extinction * (t1 - t0);
+    }
+    return false;
+}
+
+float MarchGridTransmittance(const DensityGrid& grid, float density, FXMVECTOR origin, FXMVECTOR direction,
+    float tEnter, float tExit, float step, VolumeTrackingStats* stats)
+{
+    if (grid.meanDensity <= 0)
+        return 1;
+    const float scale = density / grid.meanDensity;
+    const float tStep = voxelStepToT(grid, direction, step);
+
+    float opticalDepth = 0;
+    for (float t0 = tEnter; t0 < tExit; t0 += tStep)
+    {
+        const float t1 = std::min(t0 + tStep, tExit);
+        if (stats)
+            ++stats->majorantCells;
+        opticalDepth += scale * lookupDensity(grid, origin, direction, 0.5f * (t0 + t1), nullptr, stats) * (t1 - t0);
+    }
+    return std::exp(-opticalDepth);
+}